@@ -7,6 +7,7 @@
  * Reference: https://github.com/cisco/mercury
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,6 +28,9 @@
 #include <net/ethernet.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <sys/syscall.h>
 
 #include "include/signal_handling.h"
 #include "include/sniffer.h"
@@ -34,6 +38,12 @@
 #include "include/json_file_io.h"
 #include "include/utils.h"
 #include "include/bloom_filter.h"
+#include "include/af_packet_v3.h"
+#include "include/pcap_replay.h"
+#include "include/cpu_affinity.h"
+#include "include/block_queue.h"
+#include "include/af_xdp.h"
+#include "include/ascii_dump.h"
 
 /* 
  * Signal Handling
@@ -47,6 +57,20 @@
 extern int sig_close_flag; /*Defined in signal_handling.c */
 static int sig_close_workers = 0;
 
+/* Set once all capture threads have exited, pipeline workers drain
+ * their queues and exit after it */
+static int pipeline_stop = 0;
+
+/* How long an idle pipeline thread naps when it is not busy polling */
+#define PIPELINE_NAP_US 50
+
+/* How often an idle processing thread ends its timed out flows */
+#define IDLE_CHECK_MS 100
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
 static double time_elapsed(struct timespec *ts){
     double time_s;
     time_s = ts->tv_sec + (ts->tv_nsec / 1000000000.0);
@@ -71,58 +95,26 @@ struct ring_limits {
     uint64_t af_target_blocks;
     uint64_t af_min_blocks;
     uint32_t af_blocktimeout;
+    uint32_t af_tune_min_tov;     /* Auto tuning: shortest block timeout, in ms */
+    uint32_t af_tune_max_tov;     /* Auto tuning: longest block timeout, also the initial one */
+    uint32_t af_tune_block_pkts;  /* Auto tuning: packets a block is sized for */
+    uint32_t af_tune_ring_ms;     /* Auto tuning: traffic a ring holds, in ms */
     uint32_t af_fanout_type;
-};
-
-/* struct stats_tracking tracks stats for each thread and stores 
- * those stats. It is one of the first to get started.
- * This thread also stores the pointer to bloom filter
- * data structure which is used for analysis.*/
-struct stats_tracking {
-    struct thread_storage *tstor;
-    BloomFilter *bf;
-	struct log_file *pkt_log;
-	struct log_file *dup_pkt_log;
-    int num_threads;
-	int mode;
-    int c_port;
-    uint64_t received_packets;
-    uint64_t received_bytes;
-    uint64_t socket_packets;
-    uint64_t socket_drops;
-    uint64_t socket_freezes;
-    int verbosity;
-    int *t_start_p;  /* Clean start predicate */
-    pthread_cond_t *t_start_c; /* Clean start condition */
-    pthread_mutex_t *t_start_m; /* Clean start mutex */
-    pthread_mutex_t *log_access;
-    pthread_mutex_t *bf_access;
-};
-
-/* Stores details about the thread */
-struct thread_storage {
-    int tnum;      /* Thread Number */
-    pthread_t tid; /*Thread ID */
-    pthread_attr_t thread_attributes;
-    int sockfd;   /* Socket owned by this thread */
-    const char *if_name; /* Name of interface to bind the socket to */
-    char *output_file_name; /* Name of output file */
-    uint8_t *mapped_buffer; /* The pointer to the mmap()'d region */
-    struct tpacket_block_desc **block_header; /* The pointer to each block in mmap()'d region */
-    struct tpacket_req3 ring_params; /* The ring allocation params to setsockopt() */
-    struct stats_tracking *statst;  /* A pointer to struct with stats counters */
-    double *block_streak_hist; /* Block streak histogram */
-    pthread_mutex_t bstreak_m; /* Block streak mutex */
-    int *t_start_p;  /* Clean start predicate */
-    pthread_cond_t *t_start_c; /* Clean start condition */
-    pthread_mutex_t *t_start_m;   /* Clean start mutex */
-    /* The below two lines are probably rebundant */
-    pthread_mutex_t *log_access;
-    pthread_mutex_t *bf_access;
+    int af_fanout_bpf_fd;      /* Steering program for PACKET_FANOUT_EBPF, -1 if unused */
+    int af_fanout_flow_affine; /* All packets of a flow go to the same thread */
 };
 
 #define RING_LIMITS_DEFAULT_FRAC 0.01
 
+/* Ring memory for a fraction of physical memory */
+static uint64_t ring_memory(float frac){
+    if(frac < 0.0 || frac > 1.0){
+        /* sanity check */
+        frac = RING_LIMITS_DEFAULT_FRAC;
+    }
+    return (uint64_t) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) * frac;
+}
+
 void ring_limits_init(struct ring_limits *rl, float frac){
 
     if(frac < 0.0 || frac > 1.0){
@@ -131,7 +123,7 @@ void ring_limits_init(struct ring_limits *rl, float frac){
     }
 
     /* This is the only parameter you should need to change */
-    rl->af_desired_memory = (uint64_t) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) * frac;
+    rl->af_desired_memory = ring_memory(frac);
     //rl->af_desired_memory = 128 * (uint64_t) (1 << 30); /* 8 GiB */
     fprintf(stderr, "mem: %" PRIu64 "\tfrac: %f\n", rl->af_desired_memory, frac);
 
@@ -149,10 +141,130 @@ void ring_limits_init(struct ring_limits *rl, float frac){
     rl->af_target_blocks   = 64;
     rl->af_min_blocks      = 8;
     rl->af_blocktimeout    = 100;   /* milliseconds before a block is returned partially full */
-	rl->af_fanout_type	   = PACKET_FANOUT_FLAG_ROLLOVER;
+    rl->af_tune_min_tov    = 1;
+    rl->af_tune_max_tov    = 10;
+    rl->af_tune_block_pkts = 1024;  /* bounds the work of a block */
+    rl->af_tune_ring_ms    = 2000;
+	rl->af_fanout_type	   = PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_ROLLOVER;
+    rl->af_fanout_bpf_fd   = -1;
+    rl->af_fanout_flow_affine = 0; /* rollover moves flows between threads */
     sniffer_debug("Initalized ring\n");
 }
 
+/* Fanout modes selectable from the command line. Modes that are flow
+ * affine send every packet of a flow to the same socket, which lets
+ * threads keep per-flow state without sharing it. */
+struct fanout_mode {
+    const char *name;
+    uint32_t type;
+    int flow_affine;
+};
+
+static const struct fanout_mode fanout_modes[] = {
+    { "hash",     PACKET_FANOUT_HASH,     1 },  /* hash of the flow (rxhash) */
+    { "cpu",      PACKET_FANOUT_CPU,      1 },  /* CPU which received the packet, follows RSS */
+    { "qm",       PACKET_FANOUT_QM,       1 },  /* NIC receive queue, follows RSS */
+    { "lb",       PACKET_FANOUT_LB,       0 },  /* round robin */
+    { "rnd",      PACKET_FANOUT_RND,      0 },
+    { "rollover", PACKET_FANOUT_ROLLOVER, 0 },
+    { "ebpf",     PACKET_FANOUT_EBPF,     1 },  /* program is expected to steer by flow */
+    { "vlan",     PACKET_FANOUT_CBPF,     1 },  /* outermost VLAN id, see vlan_fanout_prog */
+};
+
+/* Steering program of the vlan fanout mode, the kernel takes the socket
+ * as the result modulo the group size. Returns the VLAN id the kernel
+ * stripped or, if there is none, that of a tag still in the frame.
+ * Untagged frames all go to the first socket. The packet data starts at
+ * the network header here, the frame is read relative to SKF_LL_OFF */
+static struct sock_filter vlan_fanout_insns[] = {
+    { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT },
+    { BPF_JMP | BPF_JEQ | BPF_K, 3, 0, 0 },                 /* no stripped tag */
+    { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_VLAN_TAG },
+    { BPF_ALU | BPF_AND | BPF_K, 0, 0, 0x0fff },
+    { BPF_RET | BPF_A, 0, 0, 0 },
+    { BPF_LD | BPF_H | BPF_ABS, 0, 0, SKF_LL_OFF + 12 },    /* ethertype */
+    { BPF_JMP | BPF_JEQ | BPF_K, 3, 0, ETH_P_8021Q },
+    { BPF_JMP | BPF_JEQ | BPF_K, 2, 0, ETH_P_8021AD },
+    { BPF_JMP | BPF_JEQ | BPF_K, 1, 0, ETH_P_QINQ1 },
+    { BPF_RET | BPF_K, 0, 0, 0 },
+    { BPF_LD | BPF_H | BPF_ABS, 0, 0, SKF_LL_OFF + 14 },    /* tag control information */
+    { BPF_ALU | BPF_AND | BPF_K, 0, 0, 0x0fff },
+    { BPF_RET | BPF_A, 0, 0, 0 },
+};
+
+static struct sock_fprog vlan_fanout_prog = {
+    sizeof(vlan_fanout_insns) / sizeof(vlan_fanout_insns[0]), vlan_fanout_insns
+};
+
+/* Loads a pinned eBPF program (e.g. /sys/fs/bpf/steer) and returns its fd */
+static int fanout_bpf_obj_get(const char *path){
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.pathname = (uint64_t)(unsigned long)path;
+    int fd = syscall(__NR_bpf, BPF_OBJ_GET, &attr, sizeof(attr));
+    if(fd < 0){
+        fprintf(stderr, "%s: could not get pinned eBPF program %s\n", strerror(errno), path);
+    }
+    return fd;
+}
+
+/* Parses a fanout spec of the form mode[:bpf_path][,rollover][,defrag],
+ * for example "hash,defrag" or "ebpf:/sys/fs/bpf/steer,rollover" */
+int fanout_config_parse(const char *spec, struct ring_limits *rl){
+    char buffer[512];
+    strncpy(buffer, spec, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+
+    char *saveptr;
+    char *token = strtok_r(buffer, ",", &saveptr);
+    if(token == NULL){
+        return -1;
+    }
+
+    char *bpf_path = strchr(token, ':');
+    if(bpf_path != NULL){
+        *bpf_path++ = '\0';
+    }
+
+    const struct fanout_mode *mode = NULL;
+    for(unsigned int i = 0; i < sizeof(fanout_modes) / sizeof(fanout_modes[0]); i++){
+        if(strcmp(token, fanout_modes[i].name) == 0){
+            mode = &fanout_modes[i];
+            break;
+        }
+    }
+    if(mode == NULL){
+        fprintf(stderr, "error: unknown fanout mode %s\n", token);
+        return -1;
+    }
+    if((mode->type == PACKET_FANOUT_EBPF) != (bpf_path != NULL)){
+        fprintf(stderr, "error: fanout mode ebpf needs a pinned program, ebpf:<path>\n");
+        return -1;
+    }
+
+    rl->af_fanout_type = mode->type;
+    rl->af_fanout_flow_affine = mode->flow_affine;
+    while((token = strtok_r(NULL, ",", &saveptr)) != NULL){
+        if(strcmp(token, "rollover") == 0){
+            rl->af_fanout_type |= PACKET_FANOUT_FLAG_ROLLOVER;
+            rl->af_fanout_flow_affine = 0;
+        } else if(strcmp(token, "defrag") == 0){
+            rl->af_fanout_type |= PACKET_FANOUT_FLAG_DEFRAG;
+        } else {
+            fprintf(stderr, "error: unknown fanout flag %s\n", token);
+            return -1;
+        }
+    }
+
+    if(bpf_path != NULL){
+        rl->af_fanout_bpf_fd = fanout_bpf_obj_get(bpf_path);
+        if(rl->af_fanout_bpf_fd < 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
 void af_packet_stats(int sockfd, struct stats_tracking *statst){
     sniffer_debug("Finding packet stats\n");
     int err;
@@ -177,6 +289,210 @@ void af_packet_stats(int sockfd, struct stats_tracking *statst){
 
 }
 
+/* Adds the socket counters of a capture thread to statst and to the
+ * thread's own socket_packets, including those of sockets it retired
+ * since the last call. ring_lock keeps the socket and ring_params from
+ * being swapped meanwhile. Returns the thread's block count */
+static uint32_t capture_socket_stats(struct thread_storage *ts, struct stats_tracking *statst){
+    pthread_mutex_lock(&(ts->ring_lock));
+    uint64_t packets_before = statst->socket_packets;
+    af_packet_stats(ts->sockfd, statst);
+    statst->socket_packets += ts->retired_stats.tp_packets;
+    statst->socket_drops += ts->retired_stats.tp_drops;
+    statst->socket_freezes += ts->retired_stats.tp_freeze_q_cnt;
+    memset(&(ts->retired_stats), 0, sizeof(ts->retired_stats));
+    ts->socket_packets += statst->socket_packets - packets_before;
+    uint32_t block_count = ts->ring_params.tp_block_nr;
+    pthread_mutex_unlock(&(ts->ring_lock));
+    return block_count;
+}
+
+#define RING_TUNE_MIN_PPS 100      /* Rates below this are tuned for as this */
+#define RING_TUNE_RATE_CHANGE 4.0  /* Re-tune when the rate changes more than this many times */
+#define RING_TUNE_PKT_OVERHEAD 96  /* tpacket3_hdr, sockaddr_ll and alignment of a packet */
+#define RING_TUNE_DEFAULT_SIZE 512 /* Packet size assumed before any packet was seen */
+
+/* Works out the ring of a thread that sees pps packets per second of
+ * avg_size bytes, using at most budget bytes. Blocks hold at most
+ * af_tune_block_pkts packets, or what arrives within the longest block
+ * timeout when that is fewer, so the work per block stays bounded. The
+ * timeout is the time a block takes to fill, within the tuning limits,
+ * and there are enough blocks for af_tune_ring_ms of traffic */
+static void ring_request_tune(const struct ring_limits *rl, double pps, double avg_size,
+        uint64_t budget, struct tpacket_req3 *req){
+    if(pps < RING_TUNE_MIN_PPS){
+        pps = RING_TUNE_MIN_PPS;
+    }
+    double slot = avg_size + RING_TUNE_PKT_OVERHEAD;
+
+    double block_pkts = rl->af_tune_block_pkts;
+    if(pps * rl->af_tune_max_tov / 1000.0 < block_pkts){
+        block_pkts = pps * rl->af_tune_max_tov / 1000.0;
+    }
+    uint64_t block_size = rl->af_min_blocksize;
+    while(block_size < block_pkts * slot && block_size < rl->af_blocksize){
+        block_size <<= 1;
+    }
+    /* Keep at least the minimum number of blocks within the budget */
+    while(block_size > rl->af_min_blocksize && budget / block_size < rl->af_min_blocks){
+        block_size >>= 1;
+    }
+
+    double fill_ms = (block_size / slot) / pps * 1000.0;
+    uint32_t tov = rl->af_tune_max_tov;
+    if(fill_ms < tov){
+        tov = (fill_ms > rl->af_tune_min_tov) ? (uint32_t)fill_ms + 1 : rl->af_tune_min_tov;
+    }
+
+    /* A block is handed over when it is full or when it times out */
+    double period_ms = (fill_ms < tov) ? fill_ms : tov;
+    uint64_t block_count = (uint64_t)(rl->af_tune_ring_ms / period_ms) + 1;
+    if(block_count < rl->af_target_blocks){
+        block_count = rl->af_target_blocks;
+    }
+    if(block_count > budget / block_size){
+        block_count = budget / block_size;
+    }
+
+    memset(req, 0, sizeof(*req));
+    req->tp_block_size = block_size;
+    req->tp_frame_size = rl->af_framesize;
+    req->tp_block_nr = block_count;
+    req->tp_frame_nr = (block_size * block_count) / rl->af_framesize;
+    req->tp_retire_blk_tov = tov;
+    req->tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+}
+
+/* Ring auto tuning, run by the stats thread after every interval. The
+ * first interval calibrates: every interface gets rings for the traffic
+ * measured in it. Later an interface is re-tuned when its packet rate
+ * changed more than RING_TUNE_RATE_CHANGE times since, and the capture
+ * threads of the interface then rebuild their rings (see ring_retune()).
+ * socket_before holds each capture thread's socket_packets at the start
+ * of the interval */
+static void ring_autotune(struct stats_tracking *statst, const uint64_t *socket_before,
+        double time_d, double avg_size){
+    for(int i = 0; i < statst->num_ifaces; i++){
+        struct capture_iface *ci = &(statst->ifaces[i]);
+        uint64_t packets = 0;
+        int pending = 0;
+        for(int thread = ci->first_thread; thread < ci->first_thread + ci->num_threads; thread++){
+            struct thread_storage *ts = &(statst->tstor[thread]);
+            packets += ts->socket_packets - socket_before[thread];
+            if(__atomic_load_n(&(ts->tune_gen), __ATOMIC_ACQUIRE) != ci->tune_gen){
+                pending = 1;
+            }
+        }
+        /* The threads are still rebuilding their rings from the last tuning */
+        if(pending){
+            continue;
+        }
+
+        double pps = packets / time_d;
+        if(pps < RING_TUNE_MIN_PPS * ci->num_threads){
+            pps = RING_TUNE_MIN_PPS * ci->num_threads;
+        }
+        if(ci->tuned_pps > 0 && pps < ci->tuned_pps * RING_TUNE_RATE_CHANGE &&
+                pps * RING_TUNE_RATE_CHANGE > ci->tuned_pps){
+            continue;
+        }
+        int calibration = (ci->tuned_pps == 0);
+        ci->tuned_pps = pps;
+
+        struct tpacket_req3 req;
+        ring_request_tune(statst->rl, pps / ci->num_threads, avg_size, ci->ring_budget, &req);
+        if(req.tp_block_size == ci->ring_req.tp_block_size &&
+                req.tp_block_nr == ci->ring_req.tp_block_nr &&
+                req.tp_retire_blk_tov == ci->ring_req.tp_retire_blk_tov){
+            continue;
+        }
+
+        fprintf(stderr, "Ring %s for %s at %.0f packets/s of %.0f bytes: "
+                "%u blocks of %u bytes per thread, block timeout %u ms\n",
+                calibration ? "calibration" : "re-tuning", ci->name, pps, avg_size,
+                req.tp_block_nr, req.tp_block_size, req.tp_retire_blk_tov);
+
+        /* The threads copy ring_req once they see the new generation, and
+         * it is not touched again before they all have */
+        memcpy(&(ci->ring_req), &req, sizeof(req));
+        __atomic_store_n(&(ci->tune_gen), ci->tune_gen + 1, __ATOMIC_RELEASE);
+    }
+}
+
+/* Prints the stage latencies of the processing threads over the last
+ * interval, merged and per thread. now and before hold lat_num_stages
+ * histograms per thread; merged is scratch space for lat_num_stages */
+static void print_latency(const struct stats_tracking *statst, int first_proc, int num_proc,
+        const struct latency_hist *now, const struct latency_hist *before,
+        struct latency_hist *merged, struct latency_summary *merged_summary){
+    memset(merged, 0, lat_num_stages * sizeof(struct latency_hist));
+    for(int thread = 0; thread < num_proc; thread++){
+        for(int s = 0; s < lat_num_stages; s++){
+            struct latency_hist delta;
+            for(uint32_t b = 0; b < LATENCY_BUCKETS; b++){
+                delta.counts[b] = now[thread * lat_num_stages + s].counts[b] -
+                    before[thread * lat_num_stages + s].counts[b];
+            }
+            delta.ticks = now[thread * lat_num_stages + s].ticks - before[thread * lat_num_stages + s].ticks;
+            latency_merge(&(merged[s]), &delta);
+        }
+    }
+
+    fprintf(stderr, "Latency (us)  thread       count        p50        p99      p99.9        max\n");
+    for(int s = 0; s < lat_num_stages; s++){
+        struct latency_summary sum;
+        latency_summarize(&(merged[s]), NULL, &(merged_summary[s]));
+        sum = merged_summary[s];
+        if(sum.count == 0){
+            continue;
+        }
+        fprintf(stderr, "%-12s  %6s  %10" PRIu64 " %10.2f %10.2f %10.2f %10.2f\n",
+                latency_stage_names[s], "all", sum.count, sum.p50 / 1e3, sum.p99 / 1e3,
+                sum.p999 / 1e3, sum.max / 1e3);
+        for(int thread = 0; thread < num_proc && statst->verbosity; thread++){
+            latency_summarize(&(now[thread * lat_num_stages + s]),
+                    &(before[thread * lat_num_stages + s]), &sum);
+            if(sum.count == 0){
+                continue;
+            }
+            fprintf(stderr, "%-12s  %6d  %10" PRIu64 " %10.2f %10.2f %10.2f %10.2f\n",
+                    latency_stage_names[s], first_proc + thread, sum.count, sum.p50 / 1e3,
+                    sum.p99 / 1e3, sum.p999 / 1e3, sum.max / 1e3);
+        }
+    }
+}
+
+/* Records written to the packet logs (mode 1) or the duplicate packet
+ * logs (mode 2). Each log is counted once, whether shared or not */
+static uint64_t log_records(const struct stats_tracking *statst, int mode){
+    uint64_t records = 0;
+    const struct log_file *shared = (mode == 1) ? statst->pkt_log : statst->dup_pkt_log;
+    if(shared != NULL){
+        records += __atomic_load_n(&(shared->records), __ATOMIC_RELAXED);
+    }
+    for(int thread = 0; thread < statst->num_threads + statst->num_workers; thread++){
+        const struct thread_storage *ts = &(statst->tstor[thread]);
+        const struct log_file *log = (mode == 1) ? ts->pkt_log : ts->dup_pkt_log;
+        if(ts->log_access == NULL && log != NULL && log != shared){
+            records += __atomic_load_n(&(log->records), __ATOMIC_RELAXED);
+        }
+    }
+    return records;
+}
+
+/* Heap allocations made by the threads' packet paths. Once the scratch
+ * arenas have grown to the largest block this stays put */
+static uint64_t scratch_heap_allocs(const struct stats_tracking *statst){
+    uint64_t allocs = 0;
+    for(int thread = 0; thread < statst->num_threads + statst->num_workers; thread++){
+        const struct arena *a = statst->tstor[thread].scratch;
+        if(a != NULL){
+            allocs += __atomic_load_n(&(a->heap_allocs), __ATOMIC_RELAXED);
+        }
+    }
+    return allocs;
+}
+
 void *stats_thread_func(void *statst_arg){
 
     struct stats_tracking *statst = (struct stats_tracking *) statst_arg;
@@ -216,49 +532,173 @@ void *stats_thread_func(void *statst_arg){
      */
     enable_all_signals();
 
+    /* Packets are processed by the capture threads, or by the workers
+     * that follow them in tstor in pipeline mode */
+    int first_proc = (statst->num_workers > 0) ? statst->num_threads : 0;
+    int num_proc = (statst->num_workers > 0) ? statst->num_workers : statst->num_threads;
+
+    /* Packets each thread had processed at the start of the interval */
+    uint64_t *thread_packets_before = (uint64_t *)calloc(num_proc, sizeof(uint64_t));
+
+    /* Packets each capture thread's sockets had seen at the start of the interval */
+    uint64_t *socket_before = (uint64_t *)calloc(statst->num_threads, sizeof(uint64_t));
+
+    /* Scratch copy of a thread's ring usage histogram */
+    uint32_t max_bins = 0;
+    for(int thread = 0; thread < statst->num_threads; thread++){
+        if(statst->tstor[thread].ring_usage != NULL &&
+                statst->tstor[thread].ring_usage->num_bins > max_bins){
+            max_bins = statst->tstor[thread].ring_usage->num_bins;
+        }
+    }
+    double *hist = (double *)calloc(max_bins + 1, sizeof(double));
+    if(!socket_before || !hist){
+        perror("could not allocate memory for stats\n");
+        exit(255);
+    }
+
+    double interval = statst->stats_interval;
+    struct timespec interval_ts;
+    interval_ts.tv_sec = (time_t)interval;
+    interval_ts.tv_nsec = (long)((interval - interval_ts.tv_sec) * 1e9);
+
+    /* What the metrics exporter serves, refreshed every interval */
+    struct metrics_snapshot snap;
+    memset(&snap, 0, sizeof(snap));
+    snap.num_threads = statst->num_threads + statst->num_workers;
+    snap.threads = (struct thread_metrics *)calloc(snap.num_threads, sizeof(struct thread_metrics));
+    for(int thread = 0; thread < snap.num_threads; thread++){
+        snap.threads[thread].if_name = statst->tstor[thread].if_name;
+        snap.threads[thread].ring_usage = -1;
+    }
+    uint64_t start_ns = monotonic_ns();
+
+    /* Copies of the processing threads' latency histograms at the start
+     * and the end of the interval */
+    struct latency_hist *lat_before = NULL, *lat_now = NULL, *lat_merged = NULL;
+    if(statst->latency){
+        lat_before = (struct latency_hist *)calloc(num_proc * lat_num_stages, sizeof(struct latency_hist));
+        lat_now = (struct latency_hist *)calloc(num_proc * lat_num_stages, sizeof(struct latency_hist));
+        lat_merged = (struct latency_hist *)calloc(lat_num_stages, sizeof(struct latency_hist));
+        if(!lat_before || !lat_now || !lat_merged){
+            perror("could not allocate memory for latency histograms\n");
+            exit(255);
+        }
+    }
+
     while(sig_close_flag == 0){
+        uint64_t spin_ns_before = 0, sleep_ns_before = 0, idle_ns_before = 0;
+        for(int thread = 0; thread < num_proc; thread++){
+            thread_packets_before[thread] = __atomic_load_n(
+                    &(statst->tstor[first_proc + thread].received_packets), __ATOMIC_RELAXED);
+        }
+        for(int thread = 0; thread < statst->num_threads; thread++){
+            spin_ns_before += __atomic_load_n(&(statst->tstor[thread].spin_ns), __ATOMIC_RELAXED);
+            sleep_ns_before += __atomic_load_n(&(statst->tstor[thread].sleep_ns), __ATOMIC_RELAXED);
+        }
+        for(int thread = statst->num_threads; thread < statst->num_threads + statst->num_workers; thread++){
+            idle_ns_before += __atomic_load_n(&(statst->tstor[thread].sleep_ns), __ATOMIC_RELAXED);
+        }
+        for(int thread = 0; thread < statst->num_threads; thread++){
+            socket_before[thread] = statst->tstor[thread].socket_packets;
+        }
         uint64_t packets_before = statst->received_packets;
+        uint64_t heap_allocs_before = scratch_heap_allocs(statst);
         uint64_t bytes_before = statst->received_bytes;
         uint64_t socket_packets_before = statst->socket_packets;
         uint64_t socket_drops_before = statst->socket_drops;
         uint64_t socket_freezes_before = statst->socket_freezes;
+        uint64_t log_records_before = log_records(statst, 1);
+        for(int thread = 0; statst->latency && thread < num_proc; thread++){
+            latency_copy(&(lat_before[thread * lat_num_stages]), statst->tstor[first_proc + thread].latency);
+        }
     
 
         (void)time_elapsed(&ts);  /* Fills out the struct with current time */
 
-        /* We wait a second until to see whether time delta is working right or not */
-        sleep(3); /* Print every three seconds */
+        /* We wait an interval to see whether time delta is working right or not */
+        nanosleep(&interval_ts, NULL); /* Print every interval, 3 seconds by default */
         time_d = time_elapsed(&ts);
 
-        if((time_d < 0.9 * 3) || (time_d > 1.1 * 3)){
-            fprintf(stderr, "Unable to compute statistics because clock strayed too far from 1 second: %f seconds\n", time_d);
+        if((time_d < 0.9 * interval) || (time_d > 1.1 * interval)){
+            fprintf(stderr, "Unable to compute statistics because clock strayed too far from %g seconds: %f seconds\n",
+                    interval, time_d);
         }
    
+        /* Load imbalance is the busiest thread's packet count relative to
+         * the average. 1.0 means the fanout spreads the load evenly */
+        uint64_t max_thread_packets = 0, sum_thread_packets = 0;
+        for(int thread = 0; thread < num_proc; thread++){
+            uint64_t tpkts = __atomic_load_n(&(statst->tstor[first_proc + thread].received_packets),
+                    __ATOMIC_RELAXED) - thread_packets_before[thread];
+            sum_thread_packets += tpkts;
+            if(tpkts > max_thread_packets){
+                max_thread_packets = tpkts;
+            }
+        }
+        double imbalance = 0;
+        if(sum_thread_packets > 0){
+            imbalance = (double)max_thread_packets /
+                ((double)sum_thread_packets / num_proc);
+        }
+
+        /* Share of the threads' time spent spinning for and sleeping on blocks */
+        uint64_t spin_ns = 0, sleep_ns = 0;
+        for(int thread = 0; thread < statst->num_threads; thread++){
+            spin_ns += __atomic_load_n(&(statst->tstor[thread].spin_ns), __ATOMIC_RELAXED);
+            sleep_ns += __atomic_load_n(&(statst->tstor[thread].sleep_ns), __ATOMIC_RELAXED);
+        }
+        double thread_time_ns = time_d * 1e9 * statst->num_threads;
+        double spin_frac = (spin_ns - spin_ns_before) / thread_time_ns;
+        double sleep_frac = (sleep_ns - sleep_ns_before) / thread_time_ns;
+
+        /* Share of the pipeline workers' time spent waiting for blocks */
+        uint64_t idle_ns = 0;
+        for(int thread = statst->num_threads; thread < statst->num_threads + statst->num_workers; thread++){
+            idle_ns += __atomic_load_n(&(statst->tstor[thread].sleep_ns), __ATOMIC_RELAXED);
+        }
+        double idle_frac = 0;
+        if(statst->num_workers > 0){
+            idle_frac = (idle_ns - idle_ns_before) / (time_d * 1e9 * statst->num_workers);
+        }
+
         /* Collecting socket statistics */
         double tot_rusage = 0;  /* total ring(r) usage across all threads */
         double worst_rusage = 0; /* Worst average buffer usage */
         double worst_i_rusage = 0; /* Worst instantaneous ring buffer usage */
         for(int thread = 0; thread < statst->num_threads; thread++){
 
-            af_packet_stats(statst->tstor[thread].sockfd, (struct stats_tracking *)statst);
-
+            /* Threads replaying capture files do not own a socket */
             int thread_block_count = statst->tstor[thread].ring_params.tp_block_nr;
-            double *bstreak_hist = statst->tstor[thread].block_streak_hist;
+            if(statst->tstor[thread].xsk != NULL){
+                af_xdp_stats(statst->tstor[thread].xsk, (struct stats_tracking *)statst);
+            } else if(statst->tstor[thread].sockfd >= 0){
+                thread_block_count = capture_socket_stats(&(statst->tstor[thread]),
+                        (struct stats_tracking *)statst);
+            }
 
-            /* Get lock for bstreak histogram computation */
-            err = pthread_mutex_lock(&(statst->tstor[thread].bstreak_m));
-            if(err != 0){
-                fprintf(stderr, "%s: error acquiring bstream mutex lock\n",
-                        strerror(err));
+            /* AF_XDP threads have no ring blocks */
+            if(statst->tstor[thread].ring_usage == NULL){
+                continue;
             }
+            double *bstreak_hist = hist;
+            /* With auto tuning the histogram has room for the largest ring,
+             * and may still hold streaks of a ring retired this interval */
+            int num_bins = statst->tstor[thread].ring_usage->num_bins;
+
+            /* Takes the histogram since the last interval, clearing it */
+            ring_usage_collect(statst->tstor[thread].ring_usage, bstreak_hist);
 
             /* Compute total time */
             double ttot = 0;
-            for(int i = 0; i <= thread_block_count; i++){
+            for(int i = 0; i < num_bins; i++){
                 ttot += bstreak_hist[i];
 
                 if(bstreak_hist[i] > 0){
                     double utmp = (double) (i) / (double) thread_block_count;
+                    if(utmp > 1.0){
+                        utmp = 1.0;
+                    }
                     if(utmp > worst_i_rusage){
                         worst_i_rusage = utmp;
                     }
@@ -268,21 +708,12 @@ void *stats_thread_func(void *statst_arg){
             /* Computing average weighted ring usage*/
             double rusage = 0;
             if(ttot > 0){
-                for(int i = 0; i <= thread_block_count; i++){
-                    rusage += (bstreak_hist[i] / ttot ) * ((double)(i) / (double)thread_block_count);
+                for(int i = 0; i < num_bins; i++){
+                    double utmp = (double)(i) / (double)thread_block_count;
+                    rusage += (bstreak_hist[i] / ttot ) * (utmp > 1.0 ? 1.0 : utmp);
                 }
             }
-            /* Clearing the bstreak histogram */ 
-            for(int i = 0; i <= thread_block_count; i++){
-                    bstreak_hist[i] = 0; 
-            }
-
-            err = pthread_mutex_unlock(&(statst->tstor[thread].bstreak_m));
-            if (err != 0){
-                fprintf(stderr, "%s: stats func error releasing block stream mutex lock \n",
-                    strerror(err));
-                exit(255);
-            }
+            snap.threads[thread].ring_usage = rusage;
 
             tot_rusage += rusage;
             if (rusage > worst_rusage){
@@ -290,6 +721,13 @@ void *stats_thread_func(void *statst_arg){
             }
         } /* end of for loop */
 
+        if(statst->ring_autotune){
+            uint64_t packets = statst->received_packets - packets_before;
+            double avg_size = (packets > 0) ?
+                (double)(statst->received_bytes - bytes_before) / packets : RING_TUNE_DEFAULT_SIZE;
+            ring_autotune((struct stats_tracking *)statst, socket_before, time_d, avg_size);
+        }
+
         /* Per second stats scaled by time delta. These values measure number of packets/bytes/socket packets
          * received in one unit of time. */
         double pps = (statst->received_packets - packets_before) / time_d; // packets 
@@ -344,22 +782,336 @@ void *stats_thread_func(void *statst_arg){
                     "%7.03f%s Packets/s; Data Rate %7.03f%s bytes/s; "
                     "Ethernet Rate (est.) %7.03f%s bits/s; "
                     "Socket Packets %7.03f%s; Socket Drops %" PRIu64 " (packets); Socket Freezes %" PRIu64 "; "
-                    "All threads avg. rbuf %4.1f%%; Worst thread avg. rbuf %4.1f%%; Worst instantaneous rbuf %4.1f%%\n",
+                    "All threads avg. rbuf %4.1f%%; Worst thread avg. rbuf %4.1f%%; Worst instantaneous rbuf %4.1f%%; "
+                    "Thread load imbalance (max/avg) %4.2f; Spinning %4.1f%%; Sleeping %4.1f%%; "
+                    "Workers idle %4.1f%%; Heap allocations %" PRIu64 "\n",
                     r_pps, r_pps_s, r_byps, r_byps_s,
                     r_ebips, r_ebips_s,
                     r_spps, r_spps_s, sdps, sfps,
                     (tot_rusage / (statst->num_threads)) * 100.0, worst_rusage * 100.0,
-                    worst_i_rusage * 100.0);
+                    worst_i_rusage * 100.0, imbalance, spin_frac * 100.0, sleep_frac * 100.0,
+                    idle_frac * 100.0, scratch_heap_allocs(statst) - heap_allocs_before);
+        }
+
+        if(statst->latency){
+            for(int thread = 0; thread < num_proc; thread++){
+                latency_copy(&(lat_now[thread * lat_num_stages]), statst->tstor[first_proc + thread].latency);
+            }
+            print_latency(statst, first_proc, num_proc, lat_now, lat_before, lat_merged, snap.latency);
+            /* The counts and sums of the metrics go back to the start */
+            memset(lat_merged, 0, lat_num_stages * sizeof(struct latency_hist));
+            for(int thread = 0; thread < num_proc; thread++){
+                for(int s = 0; s < lat_num_stages; s++){
+                    latency_merge(&(lat_merged[s]), &(lat_now[thread * lat_num_stages + s]));
+                }
+            }
+            for(int s = 0; s < lat_num_stages; s++){
+                latency_summarize(&(lat_merged[s]), NULL, &(snap.latency_total[s]));
+            }
+            snap.have_latency = 1;
+        }
+
+        if(statst->metrics != NULL){
+            snap.uptime = (monotonic_ns() - start_ns) / 1e9;
+            snap.packets = statst->received_packets;
+            snap.bytes = statst->received_bytes;
+            snap.socket_packets = statst->socket_packets;
+            snap.socket_drops = statst->socket_drops;
+            snap.socket_freezes = statst->socket_freezes;
+            snap.log_records = log_records(statst, 1);
+            snap.dup_log_records = log_records(statst, 2);
+            snap.pps = pps;
+            snap.byps = byps;
+            snap.log_rate = (snap.log_records - log_records_before) / time_d;
+            snap.ring_usage_avg = tot_rusage / statst->num_threads;
+            snap.ring_usage_worst = worst_rusage;
+            snap.ring_usage_worst_instant = worst_i_rusage;
+            snap.dup_packets = 0;
+            for(int thread = 0; thread < snap.num_threads; thread++){
+                struct thread_storage *ts = &(statst->tstor[thread]);
+                struct thread_metrics *tm = &(snap.threads[thread]);
+                tm->packets = __atomic_load_n(&(ts->received_packets), __ATOMIC_RELAXED);
+                tm->dup_packets = __atomic_load_n(&(ts->dup_packets), __ATOMIC_RELAXED);
+                tm->spin_ns = __atomic_load_n(&(ts->spin_ns), __ATOMIC_RELAXED);
+                tm->sleep_ns = __atomic_load_n(&(ts->sleep_ns), __ATOMIC_RELAXED);
+                tm->heap_allocs = (ts->scratch != NULL) ?
+                    __atomic_load_n(&(ts->scratch->heap_allocs), __ATOMIC_RELAXED) : 0;
+                snap.dup_packets += tm->dup_packets;
+            }
+            metrics_publish(statst->metrics, &snap);
         }
     duration++;
     }
+    free(thread_packets_before);
+    free(socket_before);
+    free(hist);
+    free(snap.threads);
+    free(lat_before);
+    free(lat_now);
+    free(lat_merged);
     
     return NULL; 
 }
 
+/* Runs duplicate detection on the valid packets of b, keeping their
+ * payload digests in scratch memory for their records */
+static void detect_duplicates(struct packet_batch *b, struct thread_storage *thread_stor,
+        uint64_t *dup_count){
+    struct stats_tracking *statst = thread_stor->statst;
+	int mode = statst->mode;        
+	BloomFilter *bf = statst->bf;
+    struct latency_recorder *lat = thread_stor->latency;
+
+    for(uint32_t i = 0; i < b->count; i++){
+        if(!b->is_valid[i]){
+            continue;
+        }
+        uint64_t packet_start = latency_start(lat);
+        char payload_hash[SHA512_HEX_LENGTH];
+        struct payload_digest *digest = (struct payload_digest *)arena_alloc(thread_stor->scratch,
+                sizeof(struct payload_digest));
+        sha512_bytes(b->frame[i] + b->payload_off[i], b->payload_size[i], digest);
+        b->payload_digest[i] = digest;
+        sha512_hex(digest, payload_hash);
+        latency_end(lat, lat_hash, packet_start);
+
+        uint64_t bloom_start = latency_start(lat);
+        if(mode == 1){	
+            /* Add hash entry to bloom filter and log packet. The bloom
+             * filter only ever sets bits so it needs no lock */
+            add_hash(bf, payload_hash);
+            latency_end(lat, lat_bloom, bloom_start);
+        } else {
+            /* Add log entry to test file.
+            * Check whether hash entry is present. If not, write to 
+            * a seperate log file. */
+            int result = check_hash(bf, payload_hash);
+            latency_end(lat, lat_bloom, bloom_start);
+            if (result == 1){
+                /* Hash is found in the table - a dup packet */ 
+                (*dup_count)++;
+                if(thread_stor->flows != NULL){
+                    flow_table_count_dup(thread_stor->flows, b, i);
+                }
+                write_packet_info(b, i, 1, thread_stor->dup_pkt_log, thread_stor->log_access, lat,
+                        thread_stor->scratch);
+            }
+        }
+        latency_end(lat, lat_packet, packet_start);
+    }
+}
+
+/* Where the records of a thread's ended flows go, its IPFIX exporter or
+ * its flow log. A shared flow log is locked at the first record, until
+ * flow_output_done() */
+struct flow_output {
+    struct thread_storage *thread_stor;
+    int locked;
+    int written;
+};
+
+static void flow_output_record(void *ctx, const struct flow_record *rec){
+    struct flow_output *out = (struct flow_output *)ctx;
+    struct thread_storage *thread_stor = out->thread_stor;
+    if(thread_stor->ipfix != NULL){
+        ipfix_exporter_add(thread_stor->ipfix, rec);
+        return;
+    }
+    if(thread_stor->log_access != NULL && !out->locked){
+        int err = pthread_mutex_lock(thread_stor->log_access);
+        if(err != 0){
+            fprintf(stderr, "%s: error acquiring flow log lock\n", strerror(err));
+        }
+        out->locked = 1;
+    }
+    write_flow_record(rec, thread_stor->flow_log);
+    out->written = 1;
+}
+
+/* Makes the records written current in the file and releases the log.
+ * Exported records are sent once a datagram is full */
+static void flow_output_done(struct flow_output *out){
+    if(out->thread_stor->ipfix != NULL){
+        ipfix_exporter_flush(out->thread_stor->ipfix, 0);
+        return;
+    }
+    struct log_file *log = out->thread_stor->flow_log;
+    if(out->written && log->fp != NULL){
+        fflush(log->fp);
+    }
+    if(out->locked){
+        pthread_mutex_unlock(out->thread_stor->log_access);
+    }
+    out->locked = out->written = 0;
+}
+
+/* Parses the packets of b and runs duplicate detection on them. Shared
+ * by the TPACKET_V3 and AF_XDP paths, b must have its frames, lengths
+ * and timestamps filled in. The frames must stay in place until b is
+ * logged. With TCP stream reassembly, the TCP segments of b are left
+ * out and the messages their streams completed are returned instead,
+ * as a batch of their own; NULL otherwise */
+struct packet_batch *process_packet_batch(struct packet_batch *b, struct thread_storage *thread_stor,
+        uint64_t *dup_count){
+    struct stats_tracking *statst = thread_stor->statst;
+	int mode = statst->mode;        
+    struct latency_recorder *lat = thread_stor->latency;
+    struct packet_batch *messages = NULL;
+
+    uint64_t start = latency_start(lat);
+    parse_packet_batch(b, statst->filter, thread_stor->reassembly);
+    /* Flows count the segments, before streams take them over */
+    if(thread_stor->flows != NULL){
+        struct flow_output out = {thread_stor, 0, 0};
+        flow_table_update(thread_stor->flows, b, flow_output_record, &out);
+        flow_output_done(&out);
+    }
+    if(thread_stor->tcp_streams != NULL){
+        messages = reassemble_streams(b, thread_stor->tcp_streams, statst->filter,
+                thread_stor->scratch);
+    }
+    latency_end(lat, lat_parse, start);
+    if(statst->patterns != NULL){
+        start = latency_start(lat);
+        match_packet_batch(b, statst->patterns, thread_stor->scratch);
+        if(messages != NULL){
+            match_packet_batch(messages, statst->patterns, thread_stor->scratch);
+        }
+        latency_end(lat, lat_match, start);
+    }
+    if(statst->dissect != 0){
+        start = latency_start(lat);
+        dissect_packet_batch(b, statst->dissect, thread_stor->scratch);
+        if(messages != NULL){
+            dissect_packet_batch(messages, statst->dissect, thread_stor->scratch);
+        }
+        latency_end(lat, lat_dissect, start);
+    }
+    if(mode != 1 && mode != 2){
+        return messages;
+    }
+
+    detect_duplicates(b, thread_stor, dup_count);
+    if(messages != NULL){
+        detect_duplicates(messages, thread_stor, dup_count);
+    }
+    return messages;
+}
+
+/* Logs a batch of processed packets and the messages of their TCP
+ * streams, which may be NULL, and the flows that ended by the time of
+ * its last packet, and updates the counters */
+void finish_packet_batch(const struct packet_batch *b, const struct packet_batch *messages,
+        uint64_t byte_count, uint64_t dup_count, struct thread_storage *thread_stor){
+    struct stats_tracking *statst = thread_stor->statst;
+
+	write_packet_info(b, 0, b->count, thread_stor->pkt_log, thread_stor->log_access,
+            thread_stor->latency, thread_stor->scratch);
+    if(messages != NULL){
+        write_packet_info(messages, 0, messages->count, thread_stor->pkt_log,
+                thread_stor->log_access, thread_stor->latency, thread_stor->scratch);
+    }
+    if(thread_stor->flows != NULL && b->count > 0){
+        struct flow_output out = {thread_stor, 0, 0};
+        uint32_t last = b->count - 1;
+        thread_stor->flow_clock_ns = b->ts_sec[last] * 1000000000ULL + b->ts_nsec[last];
+        thread_stor->flow_mono_ns = monotonic_ns();
+        flow_table_expire(thread_stor->flows, thread_stor->flow_clock_ns, flow_output_record, &out);
+        flow_output_done(&out);
+    }
+
+    /* Per thread counters only have a single writer */
+    __atomic_store_n(&(thread_stor->received_packets),
+            thread_stor->received_packets + b->count, __ATOMIC_RELAXED);
+    __atomic_store_n(&(thread_stor->dup_packets),
+            thread_stor->dup_packets + dup_count, __ATOMIC_RELAXED);
+    __sync_add_and_fetch(&(statst->received_packets), b->count);
+    __sync_add_and_fetch(&(statst->received_bytes), byte_count);
+}
+
+/* Keeps flow records going out while a processing thread gets no
+ * packets: the capture time of its last batch is moved on by the time
+ * elapsed since, the flows that timed out by then end, and the IPFIX
+ * datagram left open is sent once it is due. Does the work at most
+ * every IDLE_CHECK_MS */
+static void flows_idle(struct thread_storage *thread_stor){
+    if(thread_stor->flows == NULL){
+        return;
+    }
+    uint64_t now = monotonic_ns();
+    if(now - thread_stor->idle_check_ns < IDLE_CHECK_MS * 1000000ULL){
+        return;
+    }
+    thread_stor->idle_check_ns = now;
+    struct flow_output out = {thread_stor, 0, 0};
+    if(thread_stor->flow_clock_ns != 0){
+        flow_table_expire(thread_stor->flows,
+                thread_stor->flow_clock_ns + (now - thread_stor->flow_mono_ns),
+                flow_output_record, &out);
+    }
+    flow_output_done(&out);
+}
+
+/* Most packets a block of block_size bytes can hold, all of them
+ * frames without a network header */
+static uint32_t block_max_packets(uint64_t block_size){
+    return block_size / TPACKET_ALIGN(TPACKET3_HDRLEN + ETH_HLEN);
+}
+
+/* Scratch memory a thread needs for a block of max_pkts packets: their
+ * batch, a log record and a reassembled datagram, and their payload
+ * digests in the bloom filter modes */
+static size_t scratch_size(uint32_t max_pkts, int mode){
+    size_t digests = (mode == 1 || mode == 2) ? max_pkts * sizeof(struct payload_digest) : 0;
+    return packet_batch_size(max_pkts) + digests + json_record_max() + IP_REASSEMBLY_MAX_DATAGRAM + 4096;
+}
+
+/* The fragment, stream and flow tables of a thread that processes
+ * packets, on its CPU */
+static void thread_tables(struct thread_storage *thread_stor){
+    const struct ip_reassembly_config *rc = &(thread_stor->statst->reassembly);
+    if(rc->memory > 0){
+        thread_stor->reassembly = ip_reassembly_create(rc, thread_stor->scratch);
+        if(thread_stor->reassembly == NULL){
+            perror("could not allocate memory for fragment reassembly\n");
+            exit(255);
+        }
+    }
+    const struct tcp_reassembly_config *sc = &(thread_stor->statst->tcp_streams);
+    if(sc->memory > 0){
+        thread_stor->tcp_streams = tcp_reassembly_create(sc, thread_stor->scratch);
+        if(thread_stor->tcp_streams == NULL){
+            perror("could not allocate memory for TCP stream reassembly\n");
+            exit(255);
+        }
+    }
+    const struct flow_table_config *fc = &(thread_stor->statst->flows);
+    if(fc->flows > 0){
+        thread_stor->flows = flow_table_create(fc);
+        if(thread_stor->flows == NULL){
+            perror("could not allocate memory for the flow table\n");
+            exit(255);
+        }
+    }
+    const struct ipfix_config *xc = &(thread_stor->statst->ipfix);
+    if(xc->collector_len > 0){
+        thread_stor->ipfix = ipfix_exporter_create(xc, thread_stor->tnum + 1);
+        if(thread_stor->ipfix == NULL){
+            exit(255);
+        }
+    }
+}
+
+/* Starts a new block or batch of up to num_pkts packets, the previous
+ * block's scratch memory is released */
+static struct packet_batch *thread_packet_batch(struct thread_storage *thread_stor,
+        uint32_t num_pkts, int if_id){
+    arena_reset(thread_stor->scratch);
+    return packet_batch_alloc(thread_stor->scratch, num_pkts, if_id);
+}
+
 int process_all_packets_in_block(struct tpacket_block_desc *block_hdr, 
-        struct stats_tracking *statst){
-    int err;
+        struct thread_storage *thread_stor, int if_id){
     sniffer_debug("Processing packets in a block\n");
     int num_pkts = block_hdr->hdr.bh1.num_pkts, i;
     unsigned long byte_count = 0; 
@@ -367,22 +1119,19 @@ int process_all_packets_in_block(struct tpacket_block_desc *block_hdr,
         return 0;
     }
 
-	struct log_file *pkt_log = statst->pkt_log;
-	struct log_file *dup_pkt_log = statst->dup_pkt_log;
-	int mode = statst->mode;        
-	BloomFilter *bf = statst->bf;
+    uint64_t dup_count = 0;
+    uint64_t block_start = latency_start(thread_stor->latency);
 
 	struct tpacket3_hdr *pkt_hdr;
     pkt_hdr = (struct tpacket3_hdr *) ((uint8_t *) block_hdr + block_hdr->hdr.bh1.offset_to_first_pkt);
 	
-	struct packet_info *pi = (struct packet_info *)malloc((num_pkts)* sizeof(struct packet_info));
-    memset(pi, 0, num_pkts * sizeof(struct packet_info));
-
-    if(!pi){
-        perror("could not allocate memory");
-    }
+	struct packet_batch *b = thread_packet_batch(thread_stor, num_pkts, if_id);
 
+    /* First pass, down the tp_next_offset chain. Only the packet headers
+     * are read here, the parser that follows prefetches the frames */
     for (i = 0; i < num_pkts; ++i) {
+        struct tpacket3_hdr *next = (struct tpacket3_hdr *)((uint8_t *)pkt_hdr + pkt_hdr->tp_next_offset);
+        __builtin_prefetch(next);
         /* The tp_snaplen value is the actual number of bytes of this packet
          * that made it into the ringbuffer block. A packet can be of any size. The
          * tp_snaplen field says that actual size of packet which gets captured in that
@@ -392,69 +1141,33 @@ int process_all_packets_in_block(struct tpacket_block_desc *block_hdr,
          * could be more (because of extra headers from the ethernet card, truncation, etc.)
          */
         byte_count += pkt_hdr->tp_snaplen;
-  
-          /* Grab the times */
-        pi[i].ts.tv_sec = pkt_hdr->tp_sec;
-        pi[i].ts.tv_nsec = pkt_hdr->tp_nsec;
-  
-        pi[i].caplen = pkt_hdr->tp_snaplen;
-        pi[i].len = pkt_hdr->tp_len;
-        pi[i].is_valid = 0;
-  
-        uint8_t *eth = (uint8_t*)pkt_hdr + pkt_hdr->tp_mac; 
-        parse_packet(eth, &(pi[i]), statst->c_port);
-		if(mode == 1 && pi[i].is_valid){	
-			/* Add hash entry to bloom filter and log packet */	
-			err = pthread_mutex_lock(statst->bf_access);
-	        if(err != 0){
-	            fprintf(stderr, "%s: error acquiring hash add lock\n",
-	                    strerror(err));
-	        } 
-            add_hash(bf, (const char *)pi[i].payload_hash);
-	        err = pthread_mutex_unlock(statst->bf_access);
-	        if(err != 0){
-	            fprintf(stderr, "%s: error releasing hash add lock\n",
-	                    strerror(err));
-	        }
-		} else if(mode == 2 && pi[i].is_valid){
-			/* Add log entry to test file.
-			* Check whether hash entry is present. If not, write to 
-			* a seperate log file. */
-
-			/* TODO
-			* Ideally the lock here is not needed because this operation only
-			* requires read from the bloom filter */
-			pthread_mutex_lock(statst->bf_access);		
-			int result = check_hash(bf, (const char *)pi[i].payload_hash);
-			pthread_mutex_unlock(statst->bf_access); 
-			if (result == 1){
-				/* Hash is found in the table - a dup packet */ 
-				write_packet_info(&(pi[i]), 1, dup_pkt_log, statst->log_access);
-            }
-		}
-		sniffer_debug("Going to point next packet header \n");
-		pkt_hdr = (struct tpacket3_hdr *) ((uint8_t *)pkt_hdr + pkt_hdr->tp_next_offset);
-			
+        b->frame[i] = (uint8_t *)pkt_hdr + pkt_hdr->tp_mac;
+        b->caplen[i] = pkt_hdr->tp_snaplen;
+        b->len[i] = pkt_hdr->tp_len;
+        b->ts_sec[i] = pkt_hdr->tp_sec;
+        b->ts_nsec[i] = pkt_hdr->tp_nsec;
+        /* A tag the kernel stripped is not in the frame any more */
+        b->vlan_id[i] = (pkt_hdr->tp_status & TP_STATUS_VLAN_VALID) ?
+            (pkt_hdr->hv1.tp_vlan_tci & 0x0fff) : 0;
+		pkt_hdr = next;
 	}
+    b->count = num_pkts;
  	
-	write_packet_info(pi, num_pkts, pkt_log, statst->log_access);
-    free(pi);
-    pi = NULL;
+    /* Second pass, the headers */
+    struct packet_batch *messages = process_packet_batch(b, thread_stor, &dup_count);
+    finish_packet_batch(b, messages, byte_count, dup_count, thread_stor);
+    latency_end(thread_stor->latency, lat_block, block_start);
 
     sniffer_debug("Ending processing of packets\n");
-    __sync_add_and_fetch(&(statst->received_packets), num_pkts);
-    __sync_add_and_fetch(&(statst->received_bytes), byte_count);
     return 0; 
 }
 
-int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor){
-    sniffer_debug("Thread number %d is abot to start packet capturing\n", 
-            thread_stor->tnum);
+/* At this point the calling thread is ready to go but
+ * we need to wait for all other threads to be
+ * ready too. We'll wait on a condition broadcast
+ * from the main thread to let us know we can go */
+void wait_for_clean_start(struct thread_storage *thread_stor){
     int err;
-    /* At this point this thread is ready to go but
-     * we need to wait for all other threads to be
-     * ready too. We'll wait on a condition broadcast
-     * from the main thread to let us know we can go */
     err = pthread_mutex_lock(thread_stor->t_start_m);
     if(err!=0){
         fprintf(stderr, "%s: error locking clean start mutex for thread %lu\n",
@@ -475,14 +1188,260 @@ int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor){
                 strerror(err), thread_stor->tid);
         exit(255);
     }
+}
+
+/* How long poll() may sleep. At most a second, and no longer than a
+ * stats interval so that sleeping time shows up in the interval it
+ * was spent in */
+static int poll_timeout_ms(const struct stats_tracking *statst){
+    double ms = statst->stats_interval * 1000.0;
+    return (ms < 1000.0) ? (int)ms : 1000;
+}
+
+/* Spins until the kernel hands block to userspace or until the monotonic
+ * clock reaches deadline_ns. Returns 1 if the block is ready */
+static int spin_on_block(struct tpacket_block_desc *block, uint64_t deadline_ns){
+    for(;;){
+        /* Reading the clock is cheap (vDSO) but not free, so check the
+         * block a few times between clock reads */
+        for(int i = 0; i < 64; i++){
+            if(__atomic_load_n(&(block->hdr.bh1.block_status), __ATOMIC_ACQUIRE) & TP_STATUS_USER){
+                return 1;
+            }
+            cpu_relax();
+        }
+        if(monotonic_ns() >= deadline_ns || sig_close_workers != 0){
+            return 0;
+        }
+    }
+}
+
+/* In pipeline mode a block stays owned by userspace while a worker
+ * processes it, so only blocks that are not in flight are new data */
+static inline int block_is_new(struct tpacket_block_desc *block, const uint8_t *block_state,
+        unsigned int b){
+    return (block->hdr.bh1.block_status & TP_STATUS_USER) != 0 &&
+        (block_state == NULL || block_state[b] == block_idle);
+}
+
+/* Queues block b for a worker. Flow affine fanout keeps all blocks of a
+ * capture thread on one worker, otherwise the block goes to the worker
+ * with the shortest queue */
+static void dispatch_block(struct thread_storage *thread_stor, unsigned int b){
+    struct stats_tracking *statst = thread_stor->statst;
+    int num_workers = statst->num_workers;
+    struct block_queue **queues = &(statst->queues[thread_stor->tnum * num_workers]);
+
+    int w = thread_stor->tnum % num_workers;
+    if(!statst->sticky_dispatch){
+        w = thread_stor->next_worker;
+        uint32_t shortest = block_queue_count(queues[w]);
+        for(int i = 1; i < num_workers && shortest > 0; i++){
+            int candidate = (thread_stor->next_worker + i) % num_workers;
+            uint32_t count = block_queue_count(queues[candidate]);
+            if(count < shortest){
+                shortest = count;
+                w = candidate;
+            }
+        }
+        thread_stor->next_worker = (w + 1) % num_workers;
+    }
+
+    struct block_ref ref;
+    ref.block = thread_stor->block_header[b];
+    ref.state = &(thread_stor->block_state[b]);
+    thread_stor->block_state[b] = block_in_flight;
+    /* Each queue holds a whole ring so this can not fail */
+    if(!block_queue_push(queues[w], &ref)){
+        fprintf(stderr, "error: block queue of thread %d to worker %d is full\n",
+                thread_stor->tnum, w);
+        exit(255);
+    }
+}
+
+/* Returns blocks the workers are done with to the kernel. The kernel
+ * fills blocks in ring order, so blocks are released in that order too,
+ * starting at the oldest block still in flight (*rb) */
+static void release_done_blocks(struct thread_storage *thread_stor, unsigned int *rb,
+        uint32_t *in_flight, unsigned int cb){
+    uint8_t *block_state = thread_stor->block_state;
+    uint32_t thread_block_count = thread_stor->ring_params.tp_block_nr;
+
+    while(*in_flight > 0){
+        uint8_t state = __atomic_load_n(&(block_state[*rb]), __ATOMIC_ACQUIRE);
+        if(state == block_in_flight){
+            break;
+        }
+        if(state == block_done){
+            thread_stor->block_header[*rb]->hdr.bh1.block_status = TP_STATUS_KERNEL;
+            block_state[*rb] = block_idle;
+            (*in_flight)--;
+        }
+        *rb = (*rb + 1) % thread_block_count;
+    }
+    if(*in_flight == 0){
+        *rb = cb;
+    }
+}
+
+static int setup_ring_socket(struct thread_storage *thread_stor);
+
+static int join_fanout_group(struct thread_storage *thread_stor, int fanout_arg,
+        int fanout_bpf_fd);
+
+/* Puts the old ring back in thread_stor, closing and unmapping what
+ * setup_ring_socket() got to of the new one */
+static void ring_restore(struct thread_storage *thread_stor, int old_sockfd, uint8_t *old_buffer,
+        struct tpacket_block_desc **old_header, const struct tpacket_req3 *old_req){
+    if(thread_stor->block_header != old_header){
+        cpu_local_free(thread_stor->block_header,
+                thread_stor->ring_params.tp_block_nr * sizeof(struct tpacket_hdr_v1 *));
+    }
+    if(thread_stor->mapped_buffer != old_buffer){
+        munmap(thread_stor->mapped_buffer,
+                thread_stor->ring_params.tp_block_size * thread_stor->ring_params.tp_block_nr);
+    }
+    if(thread_stor->sockfd != old_sockfd){
+        close(thread_stor->sockfd);
+    }
+    thread_stor->sockfd = old_sockfd;
+    thread_stor->mapped_buffer = old_buffer;
+    thread_stor->block_header = old_header;
+    thread_stor->ring_params = *old_req;
+}
+
+/* Replaces the thread's ring with the one the stats thread tuned for its
+ * interface. Fanout spreads packets over the members of the group in
+ * the order they joined, and the last member takes the place of one
+ * that leaves. So the new socket joins before the old one leaves and
+ * ends up in its place, which keeps every flow on this thread. While
+ * both are members the group has one socket more and hash fanout sends
+ * flows to other threads, so that window is kept short: the new ring is
+ * set up unbound first, and the old one is drained as usual from *cb
+ * on, a ring's worth at most. Then the block the kernel is filling is
+ * waited for, a couple of block timeouts at most unless it is empty.
+ * Once it is handed over, the new socket joins, the block is copied out
+ * and the old socket closed. Packets the old ring got in the meantime
+ * count as socket drops. Returns -1 when the new ring could not be set
+ * up, the thread then keeps the old one from *cb on */
+static int ring_retune(struct thread_storage *thread_stor, unsigned int *cb){
+    struct stats_tracking *statst = thread_stor->statst;
+    struct capture_iface *ci = &(statst->ifaces[thread_stor->if_id]);
+    uint32_t gen = __atomic_load_n(&(ci->tune_gen), __ATOMIC_ACQUIRE);
+
+    int old_sockfd = thread_stor->sockfd;
+    uint8_t *old_buffer = thread_stor->mapped_buffer;
+    struct tpacket_block_desc **old_header = thread_stor->block_header;
+    struct tpacket_req3 old_req = thread_stor->ring_params;
+    uint32_t nr = old_req.tp_block_nr;
+
+    pthread_mutex_lock(&(thread_stor->ring_lock));
+    memcpy(&(thread_stor->ring_params), &(ci->ring_req), sizeof(ci->ring_req));
+    if(setup_ring_socket(thread_stor) != 0){
+        ring_restore(thread_stor, old_sockfd, old_buffer, old_header, &old_req);
+        pthread_mutex_unlock(&(thread_stor->ring_lock));
+        __atomic_store_n(&(thread_stor->tune_gen), gen, __ATOMIC_RELEASE);
+        fprintf(stderr, "Notice: thread %d keeps its ring, the re-tuned one could not be set up\n",
+                thread_stor->tnum);
+        return -1;
+    }
+    /* The stats thread reads the old socket until the swap */
+    int new_sockfd = thread_stor->sockfd;
+    uint8_t *new_buffer = thread_stor->mapped_buffer;
+    struct tpacket_block_desc **new_header = thread_stor->block_header;
+    struct tpacket_req3 new_req = thread_stor->ring_params;
+    thread_stor->sockfd = old_sockfd;
+    thread_stor->mapped_buffer = old_buffer;
+    thread_stor->block_header = old_header;
+    thread_stor->ring_params = old_req;
+    pthread_mutex_unlock(&(thread_stor->ring_lock));
+
+    for(uint32_t n = 0; n < nr; n++){
+        struct tpacket_block_desc *block = old_header[*cb];
+        if((block->hdr.bh1.block_status & TP_STATUS_USER) == 0){
+            break;
+        }
+        process_all_packets_in_block(block, thread_stor, thread_stor->if_id);
+        block->hdr.bh1.num_pkts = 0;
+        block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        *cb = (*cb + 1) % nr;
+    }
+
+    struct tpacket_block_desc *block = old_header[*cb];
+    uint64_t deadline = monotonic_ns() + 2000000ULL * old_req.tp_retire_blk_tov;
+    while((block->hdr.bh1.block_status & TP_STATUS_USER) == 0 && monotonic_ns() < deadline){
+        cpu_relax();
+    }
+    /* Without memory for its copy the block is lost with the rest */
+    uint8_t *last_block = NULL;
+    if(block->hdr.bh1.block_status & TP_STATUS_USER){
+        last_block = (uint8_t *)malloc(old_req.tp_block_size);
+        if(last_block != NULL && thread_stor->scratch != NULL){
+            arena_count_heap_alloc(thread_stor->scratch);
+        }
+    }
+
+    pthread_mutex_lock(&(thread_stor->ring_lock));
+    thread_stor->sockfd = new_sockfd;
+    thread_stor->mapped_buffer = new_buffer;
+    thread_stor->block_header = new_header;
+    thread_stor->ring_params = new_req;
+    if(join_fanout_group(thread_stor, ci->fanout_arg, statst->rl->af_fanout_bpf_fd) != 0){
+        ring_restore(thread_stor, old_sockfd, old_buffer, old_header, &old_req);
+        pthread_mutex_unlock(&(thread_stor->ring_lock));
+        free(last_block);
+        __atomic_store_n(&(thread_stor->tune_gen), gen, __ATOMIC_RELEASE);
+        fprintf(stderr, "Notice: thread %d keeps its ring, the re-tuned one could not join the "
+                "fanout group\n", thread_stor->tnum);
+        return -1;
+    }
+    if(last_block != NULL){
+        uint32_t len = block->hdr.bh1.blk_len;
+        memcpy(last_block, block, len < old_req.tp_block_size ? len : old_req.tp_block_size);
+        block->hdr.bh1.num_pkts = 0;
+    }
+
+    /* Whatever the old ring holds now is lost. The counters of the old
+     * socket are added up by the stats thread */
+    struct tpacket_stats_v3 tp3_stats;
+    socklen_t tp3_len = sizeof(tp3_stats);
+    if(getsockopt(old_sockfd, SOL_PACKET, PACKET_STATISTICS, &tp3_stats, &tp3_len) == 0){
+        uint32_t lost = 0;
+        for(uint32_t b = 0; b < nr; b++){
+            lost += old_header[b]->hdr.bh1.num_pkts;
+        }
+        thread_stor->retired_stats.tp_packets += tp3_stats.tp_packets;
+        thread_stor->retired_stats.tp_drops += tp3_stats.tp_drops + lost;
+        thread_stor->retired_stats.tp_freeze_q_cnt += tp3_stats.tp_freeze_q_cnt;
+    }
+    pthread_mutex_unlock(&(thread_stor->ring_lock));
+
+    /* The socket leaves the fanout group once it is unmapped and closed */
+    munmap(old_buffer, old_req.tp_block_size * nr);
+    close(old_sockfd);
+    cpu_local_free(old_header, nr * sizeof(struct tpacket_hdr_v1 *));
+    if(last_block != NULL){
+        process_all_packets_in_block((struct tpacket_block_desc *)last_block, thread_stor,
+                thread_stor->if_id);
+        free(last_block);
+    }
+
+    __atomic_store_n(&(thread_stor->tune_gen), gen, __ATOMIC_RELEASE);
+    fprintf(stderr, "Thread %d moved to a ring of %u blocks of %u bytes\n", thread_stor->tnum,
+            thread_stor->ring_params.tp_block_nr, thread_stor->ring_params.tp_block_size);
+    return 0;
+}
+
+int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor){
+    sniffer_debug("Thread number %d is abot to start packet capturing\n", 
+            thread_stor->tnum);
+    wait_for_clean_start(thread_stor);
 
     /* get local copies so that we need can skip pointer deferences
      * every time for use */
     int sockfd = thread_stor->sockfd;
     struct tpacket_block_desc **block_header = thread_stor->block_header;
-    struct stats_tracking *statst = thread_stor->statst;
-    double *block_streak_hist = thread_stor->block_streak_hist;
-    pthread_mutex_t *bstreak_m = &(thread_stor->bstreak_m);
+    struct ring_usage *ring_usage = thread_stor->ring_usage;
 
     /* We got clean start all clear so we can get started but while
      * we are waiting out socket was filling up with packets and drops 
@@ -501,6 +1460,7 @@ int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor){
         if((block_header[b]->hdr.bh1.block_status & TP_STATUS_USER) == 0){
             continue;
         } else {
+            block_header[b]->hdr.bh1.num_pkts = 0;
             block_header[b]->hdr.bh1.block_status = TP_STATUS_KERNEL;
         }
     }
@@ -554,17 +1514,43 @@ int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor){
      int polret; /* Return value from poll() */
 
      unsigned int cb = 0; /* Current block pointer */
+     uint8_t *block_state = thread_stor->block_state; /* NULL unless in pipeline mode */
+     unsigned int rb = 0; /* Oldest block a worker may still hold */
+     uint32_t in_flight = 0; /* Blocks handed to workers and not yet released */
+     uint64_t busy_poll_ns = thread_stor->statst->busy_poll_us * 1000ULL; /* Spin budget */
+     uint64_t last_data_ns = monotonic_ns(); /* When we last got a block */
+     int poll_ms = poll_timeout_ms(thread_stor->statst);
      struct timespec ts;
      (void)time_elapsed(&ts); /* Initializes ts with current time */
      double time_d; /* time delta */
 
+     /* Generation of the interface's tuned ring, NULL without auto tuning */
+     uint32_t *tune_gen = thread_stor->statst->ring_autotune ?
+         &(thread_stor->statst->ifaces[thread_stor->if_id].tune_gen) : NULL;
+
      while(sig_close_workers == 0){
+         if(tune_gen != NULL &&
+                 __atomic_load_n(tune_gen, __ATOMIC_RELAXED) != thread_stor->tune_gen &&
+                 ring_retune(thread_stor, &cb) == 0){
+             /* The kernel starts filling the new ring at its first block */
+             sockfd = thread_stor->sockfd;
+             block_header = thread_stor->block_header;
+             thread_block_count = thread_stor->ring_params.tp_block_nr;
+             psockfd.fd = sockfd;
+             cb = 0;
+             pstreak = 0;
+             bstreak = 0;
+         }
+         if(block_state != NULL){
+             release_done_blocks(thread_stor, &rb, &in_flight, cb);
+         }
+
         /* Check whether the 'user' bit is set or not on the block. 
          * If the bit is set, the block has been filled by the kernel and
          * now we should process the block. Otherwise, the block is still owned 
          * by the kernel and we should wait.
          */
-         if((block_header[cb]->hdr.bh1.block_status & TP_STATUS_USER) == 0){ 
+         if(!block_is_new(block_header[cb], block_state, cb)){ 
              /*This branch is for 'user' bit not set meaning the kernel is 
               * still filling up the block with new packets */
 
@@ -574,25 +1560,9 @@ int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor){
              if(bstreak > thread_block_count){
                  bstreak = thread_block_count;
              }
-            /* The use of a mutex can be justified in this case
-             * because 1) this will rarely ever clash with the stats
-             * thread and 2) there aren't any blocks for us to process
-             * at the moment so we can take a tiny bit of time tracking
-             * stats and such
-             */
-             err = pthread_mutex_lock(bstreak_m);
-             if(err != 0){
-                 fprintf(stderr, "%s: error acquiring bstreak mutex lock \n", strerror(err));
-                 exit(255);
-             }
-
-             block_streak_hist[bstreak] += time_d;
-
-             err = pthread_mutex_unlock(bstreak_m);
-             if(err != 0){
-                 fprintf(stderr, "%s: error releasing bstreak mutex unlock \n", strerror(err));
-                 exit(255);
-             }
+             /* Goes to the thread's own half of the histogram, the
+              * stats thread collects the other half without a lock */
+             ring_usage_add(ring_usage, bstreak, time_d);
              bstreak = 0;
 
              /* If poll() has returned but we haven't found any data .. */
@@ -602,19 +1572,50 @@ int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor){
                   * should be out of sync with the kernel's. so we should probe 
                   * all the blocks and reset our pointer to the first filled block. */
                  for(uint32_t i = 0; i < thread_block_count; ++i){
-                     if((block_header[i]->hdr.bh1.block_status & TP_STATUS_USER) != 0){
+                     if(block_is_new(block_header[i], block_state, i)){
                          cb = i;
                          break; /* stopping at first block round */
                      }
                  }
              } 
 
+             /* poll() reports the blocks the workers still hold as data,
+              * so while there are any only wait for them to finish */
+             if(in_flight > 0){
+                 if(busy_poll_ns > 0){
+                     cpu_relax();
+                 } else {
+                     usleep(PIPELINE_NAP_US);
+                 }
+                 continue;
+             }
+
+             /* In busy poll mode the thread spins on the block status
+              * instead of sleeping in poll(), as long as it has seen data
+              * within the spin budget. Only a longer quiet period puts
+              * it to sleep, which costs a wakeup when traffic resumes */
+             if(busy_poll_ns > 0){
+                 uint64_t spin_start = monotonic_ns();
+                 if(spin_start - last_data_ns < busy_poll_ns){
+                     int ready = spin_on_block(block_header[cb], last_data_ns + busy_poll_ns);
+                     __atomic_store_n(&(thread_stor->spin_ns),
+                             thread_stor->spin_ns + (monotonic_ns() - spin_start), __ATOMIC_RELAXED);
+                     if(ready){
+                         continue;
+                     }
+                 }
+             }
+
              /* polling the kernel when the data is returned */
-             polret = poll(&psockfd, 1, 1000); /* letting poll wait up to a second */
+             uint64_t sleep_start = monotonic_ns();
+             polret = poll(&psockfd, 1, poll_ms); /* letting poll wait up to a second at most */
+             __atomic_store_n(&(thread_stor->sleep_ns),
+                     thread_stor->sleep_ns + (monotonic_ns() - sleep_start), __ATOMIC_RELAXED);
              if(polret < 0){
                 perror("poll returned error\n");
              } else if(polret == 0){
                  /* No packets at the moment. (timeout) */
+                 flows_idle(thread_stor);
              } else {
                 pstreak++;
              }
@@ -624,14 +1625,30 @@ int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor){
               * and returned it to us for processing */
              bstreak++;
 
-             /* We found data. Process it */
-             process_all_packets_in_block(block_header[cb], statst); 
+             if(block_state != NULL){
+                 /* Pipeline mode: a worker processes the block and it is
+                  * returned to the kernel once the worker is done */
+                 dispatch_block(thread_stor, cb);
+                 in_flight++;
+             } else {
+                 /* We found data. Process it */
+                 process_all_packets_in_block(block_header[cb], thread_stor, thread_stor->if_id);
+             }
              
              /* Reset accounting */
              pstreak = 0;
               
-             /* return this block to the kernel */
-             block_header[cb]->hdr.bh1.block_status = TP_STATUS_KERNEL;
+             /* return this block to the kernel. The packet count is
+              * cleared so that ring_retune() does not count its packets as
+              * lost; the kernel resets it anyway */
+             if(block_state == NULL){
+                 block_header[cb]->hdr.bh1.num_pkts = 0;
+                 block_header[cb]->hdr.bh1.block_status = TP_STATUS_KERNEL;
+             }
+
+             if(busy_poll_ns > 0){
+                 last_data_ns = monotonic_ns();
+             }
 
              cb += 1;
              cb = cb % thread_block_count;
@@ -643,30 +1660,188 @@ int af_packet_rx_ring_fanout_capture(struct thread_storage *thread_stor){
      return 0;
 }
 
-void *packet_capture_thread_func(void *arg){
+void *packet_capture_thread_func(void *arg){
+    struct thread_storage *thread_stor = (struct thread_storage *)arg;
+    /*
+     * Disabling all signals so that this worker thread is not disturbed
+     * in middle of packet processing.
+     */
+    disable_all_signals();
+
+    /* performing packet processing */
+    if(af_packet_rx_ring_fanout_capture(thread_stor) < 0){
+        fprintf(stdout, "error: could no perform packet capture \n");
+        exit(255);
+    }
+    return NULL;
+}
+
+
+/* AF_XDP counterpart of af_packet_rx_ring_fanout_capture(). Frames are
+ * taken off the socket's rx ring in batches and go through the same per
+ * packet processing as the packets of a TPACKET_V3 block */
+static int xdp_rx_capture(struct thread_storage *thread_stor){
+    wait_for_clean_start(thread_stor);
+
+    struct xsk_socket *xsk = thread_stor->xsk;
+    const struct capture_filter *filter = thread_stor->statst->filter;
+    af_xdp_stats(xsk, NULL); /* Discard bogus stats */
+
+    fprintf(stderr, "Thread %d with thread id %lu started on queue %u\n", thread_stor->tnum,
+            thread_stor->tid, xsk->queue);
+
+    struct xdp_desc descs[XSK_RX_BATCH];
+
+    struct pollfd psockfd;
+    memset(&psockfd, 0, sizeof(psockfd));
+    psockfd.fd = xsk->fd;
+    psockfd.events = POLLIN;
+
+    uint64_t busy_poll_ns = thread_stor->statst->busy_poll_us * 1000ULL; /* Spin budget */
+    uint64_t last_data_ns = monotonic_ns();
+    int poll_ms = poll_timeout_ms(thread_stor->statst);
+
+    while(sig_close_workers == 0){
+        uint32_t n = xsk_rx_batch(xsk, descs, XSK_RX_BATCH);
+        if(n == 0){
+            uint64_t now = monotonic_ns();
+            if(busy_poll_ns > 0 && now - last_data_ns < busy_poll_ns){
+                xsk_wakeup_if_needed(xsk);
+                cpu_relax();
+                __atomic_store_n(&(thread_stor->spin_ns),
+                        thread_stor->spin_ns + (monotonic_ns() - now), __ATOMIC_RELAXED);
+                continue;
+            }
+            /* poll() also wakes up the driver if it waits for us */
+            int polret = poll(&psockfd, 1, poll_ms);
+            if(polret < 0){
+                perror("poll returned error\n");
+            }
+            __atomic_store_n(&(thread_stor->sleep_ns),
+                    thread_stor->sleep_ns + (monotonic_ns() - now), __ATOMIC_RELAXED);
+            if(polret == 0){
+                flows_idle(thread_stor);
+            }
+            continue;
+        }
+
+        /* XDP frames carry no timestamp, take one per batch */
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+
+        /* A batch counts as a block in the latency histograms */
+        uint64_t block_start = latency_start(thread_stor->latency);
+        struct packet_batch *b = thread_packet_batch(thread_stor, n, thread_stor->if_id);
+        uint64_t byte_count = 0, dup_count = 0;
+        for(uint32_t i = 0; i < n; i++){
+            uint8_t *eth = xsk->umem + descs[i].addr;
+            uint32_t len = descs[i].len;
+            /* The parser drops frames that are not IP */
+            if(len < ETH_HLEN){
+                continue;
+            }
+            /* There is no kernel filter on this path */
+            if(!capture_filter_match_expression(filter, eth, len, len)){
+                continue;
+            }
+            b->frame[b->count] = eth;
+            b->caplen[b->count] = len;
+            b->len[b->count] = len;
+            b->ts_sec[b->count] = ts.tv_sec;
+            b->ts_nsec[b->count] = ts.tv_nsec;
+            b->vlan_id[b->count] = 0;
+            byte_count += len;
+            b->count++;
+        }
+        if(b->count > 0){
+            struct packet_batch *messages = process_packet_batch(b, thread_stor, &dup_count);
+            finish_packet_batch(b, messages, byte_count, dup_count, thread_stor);
+            latency_end(thread_stor->latency, lat_block, block_start);
+        }
+
+        /* Frames go back to the kernel once their packet info is logged */
+        xsk_recycle(xsk, descs, n);
+        xsk_wakeup_if_needed(xsk);
+        last_data_ns = monotonic_ns();
+    }
+
+    fprintf(stderr, "Thread %d with thread id %lu exiting \n",
+            thread_stor->tnum, thread_stor->tid);
+    return 0;
+}
+
+void *xdp_capture_thread_func(void *arg){
     struct thread_storage *thread_stor = (struct thread_storage *)arg;
-    /*
-     * Disabling all signals so that this worker thread is not disturbed
-     * in middle of packet processing.
-     */
     disable_all_signals();
-
-    /* performing packet processing */
-    if(af_packet_rx_ring_fanout_capture(thread_stor) < 0){
+    if(xdp_rx_capture(thread_stor) < 0){
         fprintf(stdout, "error: could no perform packet capture \n");
         exit(255);
     }
     return NULL;
 }
 
+/* Pipeline worker: takes blocks from the queues of all capture threads
+ * and processes them. Runs until the capture threads have exited and
+ * its queues are empty */
+void *pipeline_worker_thread_func(void *arg){
+    struct thread_storage *thread_stor = (struct thread_storage *)arg;
+    struct stats_tracking *statst = thread_stor->statst;
+    disable_all_signals();
+    wait_for_clean_start(thread_stor);
+
+    fprintf(stderr, "Worker %d with thread id %lu started\n", thread_stor->tnum,
+            thread_stor->tid);
+
+    int w = thread_stor->tnum - statst->num_threads;
+    uint64_t busy_poll_ns = statst->busy_poll_us * 1000ULL;
+    struct block_ref ref;
+
+    for(;;){
+        /* Read the stop flag first so that a block queued just before
+         * the capture threads exited is still seen below */
+        int stopping = __atomic_load_n(&pipeline_stop, __ATOMIC_ACQUIRE);
+        int found = 0;
+
+        /* One block per queue and pass keeps the capture threads fair */
+        for(int t = 0; t < statst->num_threads; t++){
+            if(block_queue_pop(statst->queues[t * statst->num_workers + w], &ref)){
+                process_all_packets_in_block(ref.block, thread_stor, statst->tstor[t].if_id);
+                __atomic_store_n(ref.state, block_done, __ATOMIC_RELEASE);
+                found = 1;
+            }
+        }
+
+        if(!found){
+            if(stopping){
+                break;
+            }
+            uint64_t sleep_start = monotonic_ns();
+            if(busy_poll_ns > 0){
+                cpu_relax();
+            } else {
+                usleep(PIPELINE_NAP_US);
+            }
+            __atomic_store_n(&(thread_stor->sleep_ns),
+                    thread_stor->sleep_ns + (monotonic_ns() - sleep_start), __ATOMIC_RELAXED);
+            flows_idle(thread_stor);
+        }
+    }
+
+    fprintf(stderr, "Worker %d with thread id %lu exiting \n",
+            thread_stor->tnum, thread_stor->tid);
+    return NULL;
+}
 
 /* Creation of dedicated AF_PACKET TPACKETv3 socket. Reference docs:
  * https://www.kernel.org/doc/Documentation/networking/packet_mmap.txt
  */
-int create_dedicated_socket(struct thread_storage *thread_stor, int fanout_arg){
+/* Creates the thread's socket and maps its ring. The socket gets no
+ * packets until join_fanout_group() binds it, the protocol is only
+ * given there */
+static int setup_ring_socket(struct thread_storage *thread_stor){
     sniffer_debug("Creating dedicated socket \n");
     int err;
-    int sockfd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_IP)); /* Capturing only IP Packet */
+    int sockfd = socket(AF_PACKET, SOCK_RAW, 0);
     if(sockfd == -1){
         fprintf(stderr, "Could not create dedicated socket \n");
         return -1;
@@ -674,6 +1849,13 @@ int create_dedicated_socket(struct thread_storage *thread_stor, int fanout_arg){
     /* Now store this socket file descriptor in thread storage */
     thread_stor->sockfd = sockfd;
 
+    /* Let the kernel drop what we are not interested in before it gets
+     * copied into the ring. Attached before the ring is set up so that
+     * no unfiltered packet gets in */
+    if(capture_filter_attach(thread_stor->statst->filter, sockfd) != 0){
+        return -1;
+    }
+
     /* set AF_PACKET version to v3 since it performs better 
      * by reading blocks of packet and not single packet. 
      * PACKET_VERSION is defined in linux/if_packet.h */
@@ -732,7 +1914,7 @@ int create_dedicated_socket(struct thread_storage *thread_stor, int fanout_arg){
 
     /* A capture contain many blocks. tpacket_block_desc holds 
      * an array of pointers to the start of each block struct */
-    struct tpacket_block_desc **block_header = (struct tpacket_block_desc**)malloc(thread_stor->ring_params.tp_block_nr * sizeof(struct tpacket_hdr_v1 *)); 
+    struct tpacket_block_desc **block_header = (struct tpacket_block_desc**)cpu_local_alloc(thread_stor->ring_params.tp_block_nr * sizeof(struct tpacket_hdr_v1 *)); 
     if(block_header == NULL){
        fprintf(stderr, "error: cound not allocate block_header pointer array for thread %d\n", 0);
     }
@@ -743,8 +1925,22 @@ int create_dedicated_socket(struct thread_storage *thread_stor, int fanout_arg){
     for(unsigned int i = 0; i < thread_stor->ring_params.tp_block_nr; ++i){
         block_header[i] = (struct tpacket_block_desc *)(mapped_buffer + (i * thread_stor->ring_params.tp_block_size));
     }
+    return 0;
+}
+
+/* Binds the socket of setup_ring_socket() to the interface, from when on
+ * it receives packets, and makes it join the interface's fanout group */
+static int join_fanout_group(struct thread_storage *thread_stor, int fanout_arg,
+        int fanout_bpf_fd){
+    int err;
+    int sockfd = thread_stor->sockfd;
+    int interface_number = if_nametoindex(thread_stor->if_name);
+    if(interface_number == 0){
+        fprintf(stderr, "Can't get interface number for interface %s\n", thread_stor->if_name);
+        return -1;
+    }
 
-   /* bind to interface */
+   /* bind to interface. IPv4 and IPv6, the filter drops the rest */
     struct sockaddr_ll bind_address;
     memset(&bind_address, 0, sizeof(bind_address));
     bind_address.sll_family = AF_PACKET;
@@ -779,9 +1975,207 @@ int create_dedicated_socket(struct thread_storage *thread_stor, int fanout_arg){
         fprintf(stderr, "error: could not configure fanout\n");
         return -1;
     }
+
+    /* Let the kernel busy poll the device queue on behalf of this
+     * socket. Not fatal, older kernels lack SO_PREFER_BUSY_POLL */
+    if(thread_stor->statst->sock_busy_poll){
+        int busy_poll = thread_stor->statst->busy_poll_us;
+        int prefer_busy_poll = 1;
+        if(setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll))){
+            fprintf(stderr, "%s: could not set SO_BUSY_POLL\n", strerror(errno));
+        }
+        if(setsockopt(sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer_busy_poll,
+                    sizeof(prefer_busy_poll))){
+            fprintf(stderr, "%s: could not set SO_PREFER_BUSY_POLL\n", strerror(errno));
+        }
+    }
+
+    /* Steering programs are attached to the group once the socket has
+     * joined it */
+    if(((fanout_arg >> 16) & 0xff) == PACKET_FANOUT_CBPF){
+        err = setsockopt(sockfd, SOL_PACKET, PACKET_FANOUT_DATA, &vlan_fanout_prog,
+                sizeof(vlan_fanout_prog));
+        if(err){
+            fprintf(stderr, "%s: could not attach VLAN fanout program\n", strerror(errno));
+            return -1;
+        }
+    }
+    if(fanout_bpf_fd >= 0){
+        err = setsockopt(sockfd, SOL_PACKET, PACKET_FANOUT_DATA, &fanout_bpf_fd,
+                sizeof(fanout_bpf_fd));
+        if(err){
+            fprintf(stderr, "%s: could not attach eBPF fanout program\n", strerror(errno));
+            return -1;
+        }
+    }
     return 0;
 }
 
+int create_dedicated_socket(struct thread_storage *thread_stor, int fanout_arg,
+        int fanout_bpf_fd){
+    if(setup_ring_socket(thread_stor) != 0){
+        return -1;
+    }
+    return join_fanout_group(thread_stor, fanout_arg, fanout_bpf_fd);
+}
+
+/* Parses the interface list of -c, name[:threads[:buffer_fraction]]
+ * separated by commas, e.g. "eth0:4:0.05,eth1:2". Threads and buffer
+ * fraction default to -T and -b. Returns the number of interfaces or
+ * -1 on error */
+static int capture_iface_parse(const char *spec, int default_threads,
+        float default_frac, struct capture_iface **ifaces_out){
+    char buffer[1024];
+    strncpy(buffer, spec, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+
+    int max_ifaces = 1;
+    for(const char *c = buffer; *c; c++){
+        max_ifaces += (*c == ',');
+    }
+    struct capture_iface *ifaces = (struct capture_iface *)calloc(max_ifaces,
+            sizeof(struct capture_iface));
+    if(!ifaces){
+        perror("could not allocate memory for interfaces\n");
+        exit(255);
+    }
+
+    int n = 0;
+    char *saveptr;
+    for(char *token = strtok_r(buffer, ",", &saveptr); token != NULL;
+            token = strtok_r(NULL, ",", &saveptr)){
+        struct capture_iface *ci = &ifaces[n];
+        char *threads = strchr(token, ':');
+        char *frac = NULL;
+        if(threads != NULL){
+            *threads++ = '\0';
+            frac = strchr(threads, ':');
+            if(frac != NULL){
+                *frac++ = '\0';
+            }
+        }
+        if(*token == '\0' || strlen(token) >= IF_NAMESIZE){
+            fprintf(stderr, "error: invalid interface name %s\n", token);
+            goto fail;
+        }
+        for(int i = 0; i < n; i++){
+            if(strcmp(ifaces[i].name, token) == 0){
+                fprintf(stderr, "error: interface %s given twice\n", token);
+                goto fail;
+            }
+        }
+        strcpy(ci->name, token);
+        ci->id = n;
+        ci->num_threads = (threads != NULL) ? atoi(threads) : default_threads;
+        ci->buffer_fraction = (frac != NULL) ? atof(frac) : default_frac;
+        if(ci->num_threads < 1){
+            fprintf(stderr, "error: interface %s needs at least one thread\n", ci->name);
+            goto fail;
+        }
+        if(frac != NULL && (ci->buffer_fraction <= 0.0 || ci->buffer_fraction > 1.0)){
+            fprintf(stderr, "error: invalid buffer fraction for interface %s\n", ci->name);
+            goto fail;
+        }
+        n++;
+    }
+    if(n == 0){
+        goto fail;
+    }
+
+    *ifaces_out = ifaces;
+    return n;
+
+fail:
+    free(ifaces);
+    return -1;
+}
+
+/* Works out the ring of each of num_threads threads sharing
+ * desired_memory. Exits when the rings would be too small */
+static void ring_request_create(const struct ring_limits *rl, uint64_t desired_memory,
+        int num_threads, struct tpacket_req3 *req){
+    uint32_t thread_ring_size;
+    if(desired_memory / num_threads > rl->af_ring_limit) {
+        thread_ring_size = rl->af_ring_limit;
+        fprintf(stderr, "Notice: desired memory exceeds %lx memory for %d threads\n",
+                rl->af_ring_limit, num_threads);
+    } else {
+        thread_ring_size = desired_memory / num_threads;
+    }
+
+    /* If the number of blocks is fewer than our target,
+     * decrease the block size to increase block count */
+    uint32_t thread_ring_blocksize = rl->af_blocksize;
+    while(((thread_ring_blocksize >> 1) >= rl->af_min_blocksize) &&
+            (thread_ring_size / thread_ring_blocksize < rl->af_target_blocks)){
+        thread_ring_blocksize = thread_ring_blocksize >> 1; /* Halve the block size */
+    }
+
+    uint32_t thread_ring_blockcount = thread_ring_size / thread_ring_blocksize;
+    if (thread_ring_blockcount < rl->af_min_blocks){
+        fprintf(stderr, "Error: only able to allocate %u blocks per thread (minimum %lu)\n",
+                thread_ring_blockcount, rl->af_min_blocks);
+        exit(255);
+    }
+
+    /* blocks must be a multiple of frame size */
+    if(thread_ring_blocksize % rl->af_framesize != 0){
+        fprintf(stderr, "Error: blocksize not a multiple of frame size");
+        exit(255);
+    }
+    
+    if((uint64_t)num_threads * (uint64_t)thread_ring_blockcount * (uint64_t)thread_ring_blocksize < desired_memory){
+        fprintf(stderr, "Notice: requested memory will be less than desired memory\n");
+    }
+
+    /*Fill out ring request struct */
+    memset(req, 0, sizeof(*req));
+    req->tp_block_size = thread_ring_blocksize;
+    req->tp_frame_size = rl->af_framesize;
+    req->tp_block_nr = thread_ring_blockcount;
+    req->tp_frame_nr = (thread_ring_blocksize * thread_ring_blockcount) / rl->af_framesize;
+    req->tp_retire_blk_tov = rl->af_blocktimeout;
+    req->tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+}
+
+/* Returns the CPU of each capture thread and then of each pipeline
+ * worker, or NULL when threads are not pinned. A CPU list is handed out
+ * in thread order. With CPU_AFFINITY_AUTO every interface's group is
+ * planned on the CPUs near that interface, together with the workers
+ * it gets in turn (worker w goes with interface w % num_ifaces). The
+ * groups only share CPUs once those near them are all taken */
+static int *cpu_plan_build(const char *spec, const struct capture_iface *ifaces,
+        int num_ifaces, int num_threads, int num_workers, int replay){
+    int *plan;
+    if(spec == NULL || replay || strcmp(spec, CPU_AFFINITY_AUTO) != 0){
+        plan = cpu_plan_create(spec, replay ? NULL : ifaces[0].name, num_threads + num_workers, NULL);
+    } else {
+        cpu_set_t taken;
+        CPU_ZERO(&taken);
+        plan = (int *)malloc((num_threads + num_workers) * sizeof(int));
+        for(int i = 0; i < num_ifaces; i++){
+            int group_workers = num_workers / num_ifaces + (i < num_workers % num_ifaces);
+            int *group = cpu_plan_create(spec, ifaces[i].name,
+                    ifaces[i].num_threads + group_workers, &taken);
+            if(group == NULL){
+                free(plan);
+                return NULL;
+            }
+            memcpy(&plan[ifaces[i].first_thread], group, ifaces[i].num_threads * sizeof(int));
+            for(int w = 0; w < group_workers; w++){
+                plan[num_threads + i + w * num_ifaces] = group[ifaces[i].num_threads + w];
+            }
+            free(group);
+        }
+    }
+
+    for(int t = 0; plan != NULL && t < num_threads + num_workers; t++){
+        fprintf(stderr, "Thread %d pinned to CPU %d (NUMA node %d)\n", t, plan[t],
+                cpu_numa_node(plan[t]));
+    }
+    return plan;
+}
+
 /* Initializes thread, assigns socket, mapped buffer and other
  * thread requirements, dispatches the thread */
 enum status bind_and_dispatch(struct sniffer_config *cfg){
@@ -789,10 +2183,33 @@ enum status bind_and_dispatch(struct sniffer_config *cfg){
     sniffer_debug("Binding sockets and dispatching thread\n");
     struct ring_limits rl;
     ring_limits_init(&rl, cfg->buffer_fraction);
+    if(cfg->fanout_mode != NULL && fanout_config_parse(cfg->fanout_mode, &rl) != 0){
+        fprintf(stderr, "error: invalid fanout configuration %s\n", cfg->fanout_mode);
+        exit(255);
+    }
 
     int err;
-    int num_threads = cfg->num_threads;
-    int fanout_arg = ((getpid() & 0xffff) | (rl.af_fanout_type << 16));
+
+    /* Every interface gets its own group of threads, fanout group and
+     * ring budget. Thread numbers run on from one group to the next */
+    struct capture_iface *ifaces;
+    int num_ifaces = capture_iface_parse(cfg->capture_interface, cfg->num_threads,
+            cfg->buffer_fraction, &ifaces);
+    if(num_ifaces < 0){
+        fprintf(stderr, "error: invalid capture interface list %s\n", cfg->capture_interface);
+        exit(255);
+    }
+    int num_threads = 0;
+    float total_fraction = 0.0;
+    for(int i = 0; i < num_ifaces; i++){
+        ifaces[i].first_thread = num_threads;
+        ifaces[i].fanout_arg = (((getpid() + i) & 0xffff) | (rl.af_fanout_type << 16));
+        num_threads += ifaces[i].num_threads;
+        total_fraction += ifaces[i].buffer_fraction;
+    }
+    if(total_fraction > 1.0){
+        fprintf(stderr, "Notice: rings of all interfaces ask for more than physical memory\n");
+    }
 
     /* All our threads has to clean start at the same time or else
      * some thread start working before other threads are ready and this 
@@ -804,7 +2221,6 @@ enum status bind_and_dispatch(struct sniffer_config *cfg){
     pthread_cond_t t_start_c = PTHREAD_COND_INITIALIZER;
     pthread_mutex_t t_start_m = PTHREAD_MUTEX_INITIALIZER;
     pthread_mutex_t log_access = PTHREAD_MUTEX_INITIALIZER;
-    pthread_mutex_t bf_access = PTHREAD_MUTEX_INITIALIZER;
 
     struct stats_tracking statst;
     memset(&statst, 0, sizeof(statst));
@@ -813,24 +2229,159 @@ enum status bind_and_dispatch(struct sniffer_config *cfg){
     statst.t_start_c = &t_start_c;
     statst.t_start_m = &t_start_m;
     statst.log_access = &log_access;
-    statst.bf_access = &bf_access;
+    statst.ifaces = ifaces;
+    statst.num_ifaces = num_ifaces;
+    statst.xdp = (cfg->xdp_mode != NULL);
+    statst.stats_interval = cfg->stats_interval;
+    statst.latency = cfg->latency;
+    if(statst.latency){
+        latency_calibrate();
+    }
+    if(statst.stats_interval < 0.01){
+        fprintf(stderr, "error: invalid stats interval %f\n", cfg->stats_interval);
+        exit(255);
+    }
+    if(cfg->ascii_max < 0 || cfg->ascii_max > ASCII_DUMP_LIMIT){
+        fprintf(stderr, "error: invalid payload dump length %d\n", cfg->ascii_max);
+        exit(255);
+    }
+    ascii_dump_init(cfg->ascii_max);
+    sniffer_debug("Payload dumps use the %s kernel\n", ascii_dump_kernel());
 
     if(cfg->verbosity == 1){
         statst.verbosity = 1;
     }
 
     statst.mode = cfg->mode;
-    statst.c_port = cfg->c_port;
 
-    statst.pkt_log = (struct log_file *)malloc(sizeof(struct log_file));
-	memset(statst.pkt_log, 0, sizeof(struct log_file));
-	statst.pkt_log->pkt_count = 0;
-	strcpy(statst.pkt_log->dirname, cfg->logdir);
-	strcpy(statst.pkt_log->filename, "");
+    if(cfg->decap_depth < 0 || cfg->decap_depth > DECAP_MAX_DEPTH){
+        fprintf(stderr, "error: invalid decapsulation depth %d, at most %d\n",
+                cfg->decap_depth, DECAP_MAX_DEPTH);
+        exit(255);
+    }
+    struct capture_filter filter;
+    if(tcp_reassembly_config_parse(cfg->tcp_streams, &(statst.tcp_streams)) != 0){
+        exit(255);
+    }
+    if(capture_filter_init(&filter, cfg->ports, cfg->protocol, cfg->min_payload,
+                cfg->filter_expression, cfg->vlans, cfg->decap_depth,
+                statst.tcp_streams.memory > 0) != 0){
+        exit(255);
+    }
+    statst.filter = &filter;
+    if(ip_reassembly_config_parse(cfg->reassembly, &(statst.reassembly)) != 0){
+        exit(255);
+    }
+    if(flow_table_config_parse(cfg->flows, &(statst.flows)) != 0){
+        exit(255);
+    }
+    if(ipfix_config_parse(cfg->ipfix, &(statst.ipfix)) != 0){
+        exit(255);
+    }
+    if(statst.ipfix.collector_len > 0 && statst.flows.flows == 0){
+        statst.flows.flows = FLOW_TABLE_DEFAULT_FLOWS;
+    }
+    struct pattern_set *patterns = NULL;
+    if(cfg->patterns != NULL){
+        patterns = pattern_set_load(cfg->patterns);
+        if(patterns == NULL){
+            exit(255);
+        }
+        fprintf(stderr, "Searching payloads for %u patterns (%s kernel)\n",
+                pattern_set_size(patterns), pattern_set_kernel(patterns));
+    }
+    statst.patterns = patterns;
+    if(dissect_config_parse(cfg->dissect, &(statst.dissect)) != 0){
+        exit(255);
+    }
+    /* Exported flow records are not logged */
+    int flow_logs = statst.flows.flows > 0 && statst.ipfix.collector_len == 0;
+    statst.busy_poll_us = cfg->busy_poll_us;
+    statst.sock_busy_poll = cfg->sock_busy_poll;
+    if(statst.sock_busy_poll && statst.busy_poll_us == 0){
+        fprintf(stderr, "error: socket busy polling needs a spin budget (-B)\n");
+        exit(255);
+    }
+
+    statst.num_workers = cfg->num_workers;
+    if(statst.num_workers < 0){
+        fprintf(stderr, "error: invalid number of pipeline workers %d\n", statst.num_workers);
+        exit(255);
+    }
+    if(statst.num_workers > 0 && cfg->replay_path != NULL){
+        fprintf(stderr, "error: pipeline mode needs a live interface, it can not be used with -r\n");
+        exit(255);
+    }
+
+    if(cfg->xdp_mode != NULL && (cfg->replay_path != NULL || statst.num_workers > 0)){
+        fprintf(stderr, "error: AF_XDP capture can not be combined with -r or -P\n");
+        exit(255);
+    }
+
+    /* Re-tuning swaps rings under the capture threads, which the
+     * pipeline workers and AF_XDP sockets are not prepared for */
+    statst.ring_autotune = cfg->ring_autotune;
+    statst.rl = &rl;
+    if(statst.ring_autotune && (cfg->xdp_mode != NULL || cfg->replay_path != NULL ||
+                statst.num_workers > 0)){
+        fprintf(stderr, "error: ring auto tuning needs TPACKET_V3 capture without -P, -x or -r\n");
+        exit(255);
+    }
+    if(statst.ring_autotune){
+        /* Until the calibration, low latency over few wakeups */
+        rl.af_blocktimeout = rl.af_tune_max_tov;
+    }
+
+    if(cfg->replay_path != NULL){
+        /* Offline mode: packets come from capture files instead of sockets */
+        statst.replay = replay_source_init(cfg->replay_path, cfg->replay_pace,
+                rl.af_blocktimeout);
+        if(statst.replay == NULL){
+            fprintf(stderr, "error: no capture files to replay in %s\n", cfg->replay_path);
+            exit(255);
+        }
+    }
+
 	time_t rawtime;
 	time(&rawtime);
-	sprintf(statst.pkt_log->filename, "%slog%ld.json", statst.pkt_log->dirname, rawtime);
-	statst.pkt_log->mode = 1;
+    statst.pkt_log = log_file_create(cfg->logdir, 1, -1, rawtime);
+
+    /* When every flow sticks to one thread, each thread can write its
+     * own log files and the log mutex is not needed */
+    statst.per_thread_logs = rl.af_fanout_flow_affine && statst.replay == NULL;
+    if(statst.per_thread_logs){
+        fprintf(stderr, "Flow affine fanout: threads write their own log files\n");
+    }
+
+    /* In pipeline mode the workers always write their own log files.
+     * With flow affine fanout every capture thread feeds one worker so
+     * that flows still end up in a single file */
+    if(statst.num_workers > 0){
+        statst.sticky_dispatch = statst.per_thread_logs;
+        statst.per_thread_logs = 1;
+        if(statst.sticky_dispatch && statst.num_workers > num_threads){
+            fprintf(stderr, "Notice: flow affine fanout keeps %d of %d workers idle\n",
+                    statst.num_workers - num_threads, statst.num_workers);
+        }
+    }
+    if(statst.reassembly.memory > 0 && !rl.af_fanout_flow_affine && statst.replay == NULL &&
+            (num_threads > 1 || statst.num_workers > 1)){
+        fprintf(stderr, "Notice: fanout is not flow affine, the fragments of a datagram may "
+                "reach different threads and not be reassembled\n");
+    }
+    if(statst.tcp_streams.memory > 0 && !rl.af_fanout_flow_affine && statst.replay == NULL &&
+            (num_threads > 1 || statst.num_workers > 1)){
+        fprintf(stderr, "Notice: fanout is not flow affine, the segments of a TCP stream may "
+                "reach different threads and be cut into wrong messages\n");
+    }
+    if(statst.flows.flows > 0 && !rl.af_fanout_flow_affine && statst.replay == NULL &&
+            (num_threads > 1 || statst.num_workers > 1)){
+        fprintf(stderr, "Notice: fanout is not flow affine, the packets of a flow may "
+                "reach different threads and get a record in each\n");
+    }
+    if(flow_logs && !statst.per_thread_logs){
+        statst.flow_log = log_file_create(cfg->logdir, 3, -1, rawtime);
+    }
     
     BloomFilter *bf;
 
@@ -844,14 +2395,7 @@ enum status bind_and_dispatch(struct sniffer_config *cfg){
 
     if (statst.mode == 2){
         /* Perform detection */ 
-    	statst.dup_pkt_log = (struct log_file *)malloc(sizeof(struct log_file));
-    	memset(statst.dup_pkt_log, 0, sizeof(struct log_file));
-    	statst.dup_pkt_log->pkt_count = 0;
-    	strcpy(statst.dup_pkt_log->dirname, cfg->logdir);
-    	strcpy(statst.dup_pkt_log->filename, "");
-    	sprintf(statst.dup_pkt_log->filename, "%sdup_pkt_log%ld.json", 
-    			statst.dup_pkt_log->dirname, rawtime);
-    	statst.dup_pkt_log->mode = 2;
+    	statst.dup_pkt_log = log_file_create(cfg->logdir, 2, -1, rawtime);
         printf("Intialized duplicate log file. \nfilename: %s directory name: %s mode: %d \n",
                statst.dup_pkt_log->filename, statst.dup_pkt_log->dirname, statst.dup_pkt_log->mode);
 		load_bloom_filter(bf);
@@ -865,73 +2409,97 @@ enum status bind_and_dispatch(struct sniffer_config *cfg){
     statst.bf = bf;
 	
     struct thread_storage *tstor; // pointer to array of struct thread_storage, one for each thread 
-    tstor = (struct thread_storage *)malloc(num_threads * sizeof(struct thread_storage));
+    int num_workers = statst.num_workers;
+    tstor = (struct thread_storage *)calloc(num_threads + num_workers, sizeof(struct thread_storage));
     if(!tstor){
         perror("could not allocate memory for struct thread storage array\n");
     }
     statst.tstor = tstor;
 
     /* Now that we know the number of threads we have, we need
-     * to figure out ring paramters */
-    uint32_t thread_ring_size;
-    if(rl.af_desired_memory / num_threads > rl.af_ring_limit) {
-        thread_ring_size = rl.af_ring_limit;
-        fprintf(stderr, "Notice: desired memory exceeds %lx memory for %d threads\n",
-                rl.af_ring_limit, num_threads);
-    } else {
-        thread_ring_size = rl.af_desired_memory / num_threads;
+     * to figure out ring paramters. Each interface splits its own
+     * budget between its threads */
+    for(int i = 0; i < num_ifaces; i++){
+        ring_request_create(&rl, ring_memory(ifaces[i].buffer_fraction),
+                ifaces[i].num_threads, &(ifaces[i].ring_req));
+        ifaces[i].ring_budget = ring_memory(ifaces[i].buffer_fraction) / ifaces[i].num_threads;
+        if(ifaces[i].ring_budget > rl.af_ring_limit){
+            ifaces[i].ring_budget = rl.af_ring_limit;
+        }
+        for(int thread = ifaces[i].first_thread;
+                thread < ifaces[i].first_thread + ifaces[i].num_threads; thread++){
+            tstor[thread].if_id = i;
+        }
+        if(statst.replay == NULL){
+            fprintf(stderr, "Interface %s (if_id %d): threads %d to %d, %u blocks of %u bytes each\n",
+                    ifaces[i].name, i, ifaces[i].first_thread,
+                    ifaces[i].first_thread + ifaces[i].num_threads - 1,
+                    ifaces[i].ring_req.tp_block_nr, ifaces[i].ring_req.tp_block_size);
+        }
     }
 
-    /* If the number of blocks is fewer than our target,
-     * decrease the block size to increase block count */
-    uint32_t thread_ring_blocksize = rl.af_blocksize;
-    while(((thread_ring_blocksize >> 1) >= rl.af_min_blocksize) &&
-            (thread_ring_size / thread_ring_blocksize < rl.af_target_blocks)){
-        thread_ring_blocksize = thread_ring_blocksize >> 1; /* Halve the block size */
-    }
+    /* Work out which CPU each thread runs on, if any */
+    int *cpu_plan = cpu_plan_build(cfg->cpu_list, ifaces, num_ifaces,
+            num_threads, num_workers, statst.replay != NULL);
 
-    uint32_t thread_ring_blockcount = thread_ring_size / thread_ring_blocksize;
-    if (thread_ring_blockcount < rl.af_min_blocks){
-        fprintf(stderr, "Error: only able to allocate %u blocks per thread (minimum %lu)\n",
-                thread_ring_blockcount, rl.af_min_blocks);
-        exit(255);
+    /* AF_XDP: one socket per receive queue, the n-th thread of an
+     * interface's group reads its queue n */
+    for(int i = 0; statst.xdp && i < num_ifaces; i++){
+        ifaces[i].xdp = xdp_program_create(ifaces[i].name, cfg->xdp_mode, ifaces[i].num_threads);
+        if(ifaces[i].xdp == NULL){
+            exit(255);
+        }
+        fprintf(stderr, "AF_XDP capture in %s mode on queues 0 to %d of %s\n",
+                cfg->xdp_mode, ifaces[i].num_threads - 1, ifaces[i].name);
     }
 
-    /* blocks must be a multiple of frame size */
-    if(thread_ring_blocksize % rl.af_framesize != 0){
-        fprintf(stderr, "Error: blocksize not a multiple of frame size");
-        exit(255);
-    }
-    
-    if((uint64_t)num_threads * (uint64_t)thread_ring_blockcount * (uint64_t)thread_ring_blocksize < rl.af_desired_memory){
-        fprintf(stderr, "Notice: requested memory will be less than desired memory\n");
+    /* Hand-off queues between capture threads and pipeline workers. A
+     * queue can hold a whole ring, so a capture thread never waits on it */
+    if(num_workers > 0){
+        statst.queues = (struct block_queue **)calloc(num_threads * num_workers,
+                sizeof(struct block_queue *));
+        for(int q = 0; q < num_threads * num_workers; q++){
+            statst.queues[q] = block_queue_create(
+                    ifaces[tstor[q / num_workers].if_id].ring_req.tp_block_nr);
+            if(statst.queues[q] == NULL){
+                perror("could not allocate memory for block queues\n");
+                exit(255);
+            }
+        }
+        fprintf(stderr, "Pipeline mode: %d capture threads feed %d workers\n",
+                num_threads, num_workers);
     }
 
-    /*Fill out ring request struct */
-    struct tpacket_req3 thread_ring_req;
-    memset(&thread_ring_req, 0, sizeof(thread_ring_req));
-    thread_ring_req.tp_block_size = thread_ring_blocksize;
-    thread_ring_req.tp_frame_size = rl.af_framesize;
-    thread_ring_req.tp_block_nr = thread_ring_blockcount;
-    thread_ring_req.tp_frame_nr = (thread_ring_blocksize * thread_ring_blockcount) / rl.af_framesize;
-    thread_ring_req.tp_retire_blk_tov = rl.af_blocktimeout;
-    thread_ring_req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
-
     /* Get all threads and allocate socket */
+    uint32_t scratch_max = 0; /* Most packets in a block of any ring */
     for(int thread = 0; thread < num_threads; thread ++){
 
         /* Initialise the thread */
+        struct capture_iface *ci = &ifaces[tstor[thread].if_id];
         tstor[thread].tnum = thread;
         tstor[thread].tid = 0;
         tstor[thread].sockfd = -1;
-        tstor[thread].if_name = cfg->capture_interface;
+        tstor[thread].mapped_buffer = NULL;
+        tstor[thread].block_header = NULL;
+        tstor[thread].if_name = ci->name;
 		// tstor[thread].output_file_name = cfg->output_file_name;
         tstor[thread].statst = &statst;
         tstor[thread].t_start_p = &t_start_p;
         tstor[thread].t_start_c = &t_start_c;
         tstor[thread].t_start_m = &t_start_m;
-        tstor[thread].log_access = &log_access;
-        tstor[thread].bf_access = &bf_access;
+        if(statst.per_thread_logs && num_workers == 0){
+            tstor[thread].pkt_log = log_file_create(cfg->logdir, 1, thread, rawtime);
+            tstor[thread].dup_pkt_log = (statst.mode == 2) ?
+                log_file_create(cfg->logdir, 2, thread, rawtime) : NULL;
+            tstor[thread].flow_log = flow_logs ?
+                log_file_create(cfg->logdir, 3, thread, rawtime) : NULL;
+            tstor[thread].log_access = NULL;
+        } else {
+            tstor[thread].pkt_log = statst.pkt_log;
+            tstor[thread].dup_pkt_log = statst.dup_pkt_log;
+            tstor[thread].flow_log = statst.flow_log;
+            tstor[thread].log_access = &log_access;
+        }
 
         err = pthread_attr_init(&(tstor[thread].thread_attributes));
         if (err){
@@ -940,34 +2508,122 @@ enum status bind_and_dispatch(struct sniffer_config *cfg){
             exit(255);
         }
 
-        pthread_mutexattr_t m_attr;
-        err = pthread_mutexattr_init(&m_attr);
-        if (err) {
-            fprintf(stderr, "%s: error initializing block streak mutex attributes for thread %d\n",
-                    strerror(err), thread);
+        /* Run on the thread's CPU while its ring, block pointers and
+         * stats get allocated so that they are local to its NUMA node */
+        cpu_set_t saved_cpus;
+        tstor[thread].cpu = (cpu_plan != NULL) ? cpu_plan[thread] : -1;
+        int moved = (tstor[thread].cpu >= 0) &&
+            (cpu_bind_current(tstor[thread].cpu, &saved_cpus) == 0);
+
+        /* A re-tuned ring has at most a budget's worth of the smallest blocks */
+        if(ci->xdp == NULL){
+            tstor[thread].ring_usage = ring_usage_create(statst.ring_autotune ?
+                    ci->ring_budget / rl.af_min_blocksize + 1 : ci->ring_req.tp_block_nr + 1);
+        }
+        if(ci->xdp == NULL && !tstor[thread].ring_usage){
+            perror("could not allocate memory for thread stats block streak histogram \n");
             exit(255);
         }
+        if(statst.latency){
+            tstor[thread].latency = latency_recorder_create();
+            if(!tstor[thread].latency){
+                perror("could not allocate memory for latency histograms\n");
+                exit(255);
+            }
+        }
 
-        err = pthread_mutex_init(&(tstor[thread].bstreak_m), &m_attr);
-        if(err){
-            fprintf(stderr, "%s: error initializing block stream mutex for thread %d\n", strerror(err),
-                    thread);
+        /* Sized for the largest block the ring can have, so that the
+         * packet path never goes to the heap */
+        uint32_t max_pkts = (ci->xdp != NULL) ? XSK_RX_BATCH :
+            block_max_packets(statst.ring_autotune ? rl.af_blocksize : ci->ring_req.tp_block_size);
+        tstor[thread].scratch = arena_create(scratch_size(max_pkts, statst.mode));
+        if(!tstor[thread].scratch){
+            perror("could not allocate scratch memory\n");
             exit(255);
         }
+        scratch_max = (max_pkts > scratch_max) ? max_pkts : scratch_max;
+        if(num_workers == 0){
+            thread_tables(&(tstor[thread]));
+        }
 
-        tstor[thread].block_streak_hist = (double *)calloc(thread_ring_blockcount + 1, sizeof(double));
-        if(!tstor[thread].block_streak_hist){
-            perror("could not allocate memory for thread stats block streak histogram \n");
+        memcpy(&(tstor[thread].ring_params), &(ci->ring_req), sizeof(ci->ring_req));
+        pthread_mutex_init(&(tstor[thread].ring_lock), NULL);
+
+        if(num_workers > 0){
+            tstor[thread].block_state = (uint8_t *)cpu_local_alloc(ci->ring_req.tp_block_nr);
+            if(!tstor[thread].block_state){
+                perror("could not allocate memory for block states\n");
+                exit(255);
+            }
+        }
+
+        /* Replay threads build their own blocks, no socket needed */
+        if(ci->xdp != NULL){
+            tstor[thread].xsk = xsk_socket_create(ci->xdp, thread - ci->first_thread);
+            if(tstor[thread].xsk == NULL){
+                fprintf(stderr, "error creating AF_XDP socket for thread %d\n", thread);
+                exit(255);
+            }
+        } else if(statst.replay == NULL){
+            err = create_dedicated_socket(&(tstor[thread]), ci->fanout_arg, rl.af_fanout_bpf_fd);
+            if(err != 0){
+                fprintf(stderr, "error creating socket for thread %d\n", thread);
+                exit(255);
+            }
         }
 
-        memcpy(&(tstor[thread].ring_params), &thread_ring_req, sizeof(thread_ring_req));
+        if(moved){
+            cpu_restore_current(&saved_cpus);
+        }
+    }
 
-        err = create_dedicated_socket(&(tstor[thread]), fanout_arg);
-        if(err != 0){
-            fprintf(stderr, "error creating socket for thread %d\n", thread);
+    /* Every queue has its socket in the map, start redirecting */
+    for(int i = 0; i < num_ifaces; i++){
+        if(ifaces[i].xdp != NULL && xdp_program_attach(ifaces[i].xdp) != 0){
+            exit(255);
+        }
+    }
+
+    /* Pipeline workers own no socket, only their log files */
+    for(int thread = num_threads; thread < num_threads + num_workers; thread++){
+        tstor[thread].tnum = thread;
+        tstor[thread].sockfd = -1;
+        tstor[thread].if_name = NULL;
+        tstor[thread].if_id = -1;
+        tstor[thread].statst = &statst;
+        tstor[thread].t_start_p = &t_start_p;
+        tstor[thread].t_start_c = &t_start_c;
+        tstor[thread].t_start_m = &t_start_m;
+        tstor[thread].cpu = (cpu_plan != NULL) ? cpu_plan[thread] : -1;
+        tstor[thread].pkt_log = log_file_create(cfg->logdir, 1, thread, rawtime);
+        tstor[thread].dup_pkt_log = (statst.mode == 2) ?
+            log_file_create(cfg->logdir, 2, thread, rawtime) : NULL;
+        tstor[thread].flow_log = flow_logs ?
+            log_file_create(cfg->logdir, 3, thread, rawtime) : NULL;
+        tstor[thread].log_access = NULL;
+
+        cpu_set_t saved_cpus;
+        int moved = (tstor[thread].cpu >= 0) &&
+            (cpu_bind_current(tstor[thread].cpu, &saved_cpus) == 0);
+        if(statst.latency){
+            tstor[thread].latency = latency_recorder_create();
+            if(!tstor[thread].latency){
+                perror("could not allocate memory for latency histograms\n");
+                exit(255);
+            }
+        }
+        /* Workers process blocks of all capture threads */
+        tstor[thread].scratch = arena_create(scratch_size(scratch_max, statst.mode));
+        if(!tstor[thread].scratch){
+            perror("could not allocate scratch memory\n");
             exit(255);
         }
+        thread_tables(&(tstor[thread]));
+        if(moved){
+            cpu_restore_current(&saved_cpus);
+        }
     }
+
     /* Initialize frame handers */
     // TODO 
     
@@ -982,6 +2638,12 @@ enum status bind_and_dispatch(struct sniffer_config *cfg){
         pthread_create(&timer_thread, &attr, track_time, &timeout_time);
     }
     
+    /* The exporter only ever talks to the stats thread */
+    if(cfg->metrics_endpoint != NULL || cfg->stats_file != NULL){
+        statst.metrics = metrics_create(cfg->metrics_endpoint, cfg->stats_file,
+                num_threads + num_workers);
+    }
+
     /* Stats thread is the first thread to be started */
     pthread_t stats_thread;
     err = pthread_create(&stats_thread, NULL, stats_thread_func, &statst);
@@ -989,7 +2651,7 @@ enum status bind_and_dispatch(struct sniffer_config *cfg){
         perror("error creating stats thread\n");
     }
 
-    for(int thread = 0; thread < num_threads; ++thread){
+    for(int thread = 0; thread < num_threads + num_workers; ++thread){
         pthread_attr_t thread_attributes;
         err = pthread_attr_init(&thread_attributes);
         if (err){
@@ -997,9 +2659,30 @@ enum status bind_and_dispatch(struct sniffer_config *cfg){
                     strerror(err), thread);
             exit(255);
         }
+
+        if(tstor[thread].cpu >= 0){
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(tstor[thread].cpu, &cpus);
+            err = pthread_attr_setaffinity_np(&thread_attributes, sizeof(cpus), &cpus);
+            if(err){
+                fprintf(stderr, "%s: error setting CPU affinity for thread %d\n",
+                        strerror(err), thread);
+                exit(255);
+            }
+        }
         
+        void *(*thread_func)(void *) = packet_capture_thread_func;
+        if(statst.replay != NULL){
+            thread_func = replay_thread_func;
+        } else if(statst.xdp){
+            thread_func = xdp_capture_thread_func;
+        } else if(thread >= num_threads){
+            thread_func = pipeline_worker_thread_func;
+        }
+
         err = pthread_create(&(tstor[thread].tid), &thread_attributes,
-               packet_capture_thread_func, &(tstor[thread]));
+               thread_func, &(tstor[thread]));
        if (err){
             fprintf(stderr, "%s: error creating af_packet capture thread %d\n",
                     strerror(err), thread);
@@ -1009,6 +2692,9 @@ enum status bind_and_dispatch(struct sniffer_config *cfg){
 
     /* At this point all threads are started but they are waiting 
      * for clean start condition */
+    if(statst.replay != NULL){
+        replay_start_clock(statst.replay);
+    }
     t_start_p = 1;
     err = pthread_cond_broadcast(&t_start_c); // Wake up all waiting threads
     if(err != 0){
@@ -1020,6 +2706,7 @@ enum status bind_and_dispatch(struct sniffer_config *cfg){
     /* Waiting for stats thread to close (happens only
      * on SIGINT/SIGTERM */
     pthread_join(stats_thread, NULL);
+    metrics_free(statst.metrics);
 
     /* Let workers thread know that stats tracking closed */
     sig_close_workers = 1;
@@ -1029,22 +2716,88 @@ enum status bind_and_dispatch(struct sniffer_config *cfg){
         pthread_join(tstor[thread].tid, NULL);
     }
 
+    /* Workers finish the blocks still queued before the rings go away */
+    __atomic_store_n(&pipeline_stop, 1, __ATOMIC_RELEASE);
+    for(int thread = num_threads; thread < num_threads + num_workers; ++thread){
+        pthread_join(tstor[thread].tid, NULL);
+    }
+
     /* Free up resources */
     for(int thread = 0; thread < num_threads; ++thread){
-        free(tstor[thread].block_header);
-        munmap(tstor[thread].mapped_buffer, 
-                tstor[thread].ring_params.tp_block_size * tstor[thread].ring_params.tp_block_nr);
-        free(tstor[thread].block_streak_hist);
-        close(tstor[thread].sockfd);
+        cpu_local_free(tstor[thread].block_header,
+                tstor[thread].ring_params.tp_block_nr * sizeof(struct tpacket_hdr_v1 *));
+        if(tstor[thread].mapped_buffer != NULL){
+            munmap(tstor[thread].mapped_buffer, 
+                    tstor[thread].ring_params.tp_block_size * tstor[thread].ring_params.tp_block_nr);
+        }
+        ring_usage_free(tstor[thread].ring_usage);
+        if(tstor[thread].sockfd >= 0){
+            close(tstor[thread].sockfd);
+        }
+        cpu_local_free(tstor[thread].block_state, tstor[thread].ring_params.tp_block_nr);
+        xsk_socket_free(tstor[thread].xsk);
+        pthread_mutex_destroy(&(tstor[thread].ring_lock));
+    }
+    /* Detaches the XDP programs */
+    for(int i = 0; i < num_ifaces; i++){
+        xdp_program_free(ifaces[i].xdp);
+    }
+    uint64_t heap_allocs = scratch_heap_allocs(&statst);
+    struct ip_reassembly_stats frag_stats;
+    memset(&frag_stats, 0, sizeof(frag_stats));
+    struct tcp_reassembly_stats stream_stats;
+    memset(&stream_stats, 0, sizeof(stream_stats));
+    struct flow_table_stats flow_stats;
+    memset(&flow_stats, 0, sizeof(flow_stats));
+    struct ipfix_stats export_stats;
+    memset(&export_stats, 0, sizeof(export_stats));
+    for(int thread = 0; thread < num_threads + num_workers; ++thread){
+        latency_recorder_free(tstor[thread].latency);
+        ip_reassembly_stats_add(tstor[thread].reassembly, &frag_stats);
+        ip_reassembly_free(tstor[thread].reassembly);
+        tcp_reassembly_stats_add(tstor[thread].tcp_streams, &stream_stats);
+        tcp_reassembly_free(tstor[thread].tcp_streams);
+        if(tstor[thread].flows != NULL){
+            /* The flows still going get their record now */
+            struct flow_output out = {&(tstor[thread]), 0, 0};
+            if(tstor[thread].ipfix != NULL){
+                ipfix_exporter_stop(tstor[thread].ipfix);
+            }
+            flow_table_flush(tstor[thread].flows, flow_output_record, &out);
+            flow_output_done(&out);
+            flow_table_stats_add(tstor[thread].flows, &flow_stats);
+            flow_table_free(tstor[thread].flows);
+        }
+        if(tstor[thread].ipfix != NULL){
+            ipfix_exporter_flush(tstor[thread].ipfix, 1);
+            ipfix_stats_add(tstor[thread].ipfix, &export_stats);
+            ipfix_exporter_free(tstor[thread].ipfix);
+        }
+        arena_free(tstor[thread].scratch);
+        /* Threads that do not share the logs own theirs */
+        if(tstor[thread].log_access == NULL){
+            log_file_free(tstor[thread].pkt_log);
+            log_file_free(tstor[thread].dup_pkt_log);
+            log_file_free(tstor[thread].flow_log);
+        }
+    }
+    for(int q = 0; q < num_threads * num_workers; q++){
+        block_queue_free(statst.queues[q]);
     }
+    free(statst.queues);
 
     free(tstor);
+    free(ifaces);
+    free(cpu_plan);
     printf("Closed all threads \n");
     sniffer_debug("Closed all threads. Printing packet statistics\n");
 
-    free(statst.pkt_log);
+    capture_filter_free(&filter);
+    pattern_set_free(patterns);
+    log_file_free(statst.pkt_log);
+    log_file_free(statst.flow_log);
     if(statst.mode == 2){
-        free(statst.dup_pkt_log);
+        log_file_free(statst.dup_pkt_log);
     }
 
 	if(statst.mode == 1){
@@ -1057,8 +2810,42 @@ enum status bind_and_dispatch(struct sniffer_config *cfg){
       "%" PRIu64 " bytes captured\n"
       "%" PRIu64 " packets seen by socket\n"
       "%" PRIu64 " packets dropped\n"
-      "%" PRIu64 " socket queue freezes\n",
-      statst.received_packets, statst.received_bytes, statst.socket_packets, statst.socket_drops, statst.socket_freezes);
+      "%" PRIu64 " socket queue freezes\n"
+      "%" PRIu64 " heap allocations on the packet path\n",
+      statst.received_packets, statst.received_bytes, statst.socket_packets, statst.socket_drops, statst.socket_freezes,
+      heap_allocs);
+    if(frag_stats.fragments > 0){
+        fprintf(stderr,
+          "%" PRIu64 " fragments, %" PRIu64 " datagrams reassembled\n"
+          "%" PRIu64 " incomplete datagrams expired, %" PRIu64 " evicted, %" PRIu64 " dropped for overlaps\n"
+          "%" PRIu64 " malformed fragments and datagrams dropped\n",
+          frag_stats.fragments, frag_stats.datagrams, frag_stats.expired, frag_stats.evicted,
+          frag_stats.overlaps, frag_stats.dropped);
+    }
+    if(stream_stats.streams > 0){
+        fprintf(stderr,
+          "%" PRIu64 " TCP streams, %" PRIu64 " segments, %" PRIu64 " messages\n"
+          "%" PRIu64 " stream gaps skipped, %" PRIu64 " streams expired, %" PRIu64 " evicted, "
+          "%" PRIu64 " segments dropped\n",
+          stream_stats.streams, stream_stats.segments, stream_stats.messages, stream_stats.gaps,
+          stream_stats.expired, stream_stats.evicted, stream_stats.dropped);
+    }
+    if(flow_stats.flows > 0){
+        fprintf(stderr,
+          "%" PRIu64 " flows, %" PRIu64 " flow records, %" PRIu64 " flows evicted from full tables\n",
+          flow_stats.flows, flow_stats.records, flow_stats.evicted);
+    }
+    if(statst.ipfix.collector_len > 0){
+        fprintf(stderr,
+          "%" PRIu64 " flow records exported in %" PRIu64 " IPFIX datagrams, %" PRIu64 " dropped, "
+          "%" PRIu64 " datagrams refused\n",
+          export_stats.records, export_stats.datagrams, export_stats.dropped, export_stats.errors);
+    }
+
+    if(statst.replay != NULL){
+        replay_report(statst.replay, statst.received_packets, statst.received_bytes);
+        replay_source_free(statst.replay);
+    }
   
     /* Control reaches here only if interrupt is pressed 
      * before timeout */ 
@@ -0,0 +1,389 @@
+/*
+ * af_xdp.c
+ *
+ * AF_XDP (XSK) sockets as an alternative to the TPACKET_V3 rings.
+ *
+ * A tiny XDP program redirects every IPv4 frame, every IPv6 frame but
+ * ICMPv6 and every VLAN tagged or MPLS frame to the AF_XDP socket of the
+ * receive queue it arrived on, so packets skip skb allocation and land
+ * straight in a per thread UMEM. Each socket owns
+ *  - a UMEM of XSK_NUM_FRAMES frames of XSK_FRAME_SIZE bytes
+ *  - a fill ring, on which we hand free frames to the kernel
+ *  - an rx ring, on which the kernel returns filled frames
+ *  - a completion ring, required by the kernel even though we never
+ *    transmit
+ *
+ * The program and its XSKMAP are loaded with the bpf() syscall directly
+ * so that there is no dependency on libbpf or libxdp. Attaching uses a
+ * BPF link (Linux 5.9 and later), which detaches the program when the
+ * application exits, however it exits.
+ *
+ * Reference docs: https://www.kernel.org/doc/html/latest/networking/af_xdp.html
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_ether.h>
+#include <linux/if_xdp.h>
+
+#include "include/sniffer.h"
+#include "include/af_packet_v3.h"
+#include "include/af_xdp.h"
+#include "include/cpu_affinity.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+static int sys_bpf(int cmd, union bpf_attr *attr){
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* Loads
+ *      if the frame is not IPv4, IPv6, VLAN tagged or MPLS, return XDP_PASS
+ *      if the frame is ICMPv6, return XDP_PASS
+ *      return bpf_redirect_map(xskmap, ctx->rx_queue_index, XDP_PASS)
+ * Like with the TPACKET_V3 sockets only IP is captured; ARP, IPv6
+ * neighbour discovery and everything else still reach the network
+ * stack. So do frames of queues without a socket in the map. Tagged
+ * frames are all redirected, what they carry is left to the parser */
+static int xdp_program_load(int map_fd){
+    struct bpf_insn insns[] = {
+        { BPF_LDX | BPF_W | BPF_MEM, 2, 1, 0, 0 },            /* r2 = ctx->data */
+        { BPF_LDX | BPF_W | BPF_MEM, 3, 1, 4, 0 },            /* r3 = ctx->data_end */
+        { BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0 },
+        { BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, ETH_HLEN },
+        { BPF_JMP | BPF_JGT | BPF_X, 4, 3, 17, 0 },           /* short frame: pass */
+        { BPF_LDX | BPF_H | BPF_MEM, 4, 2, 12, 0 },           /* r4 = ethertype */
+        { BPF_JMP | BPF_JEQ | BPF_K, 4, 0, 9, htons(ETH_P_IP) }, /* IPv4: redirect */
+        { BPF_JMP | BPF_JEQ | BPF_K, 4, 0, 8, htons(ETH_P_8021Q) }, /* tagged: redirect */
+        { BPF_JMP | BPF_JEQ | BPF_K, 4, 0, 7, htons(ETH_P_8021AD) },
+        { BPF_JMP | BPF_JEQ | BPF_K, 4, 0, 6, htons(ETH_P_MPLS_UC) },
+        { BPF_JMP | BPF_JNE | BPF_K, 4, 0, 11, htons(ETH_P_IPV6) }, /* not IPv6: pass */
+        { BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0 },
+        { BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, ETH_HLEN + 40 },
+        { BPF_JMP | BPF_JGT | BPF_X, 4, 3, 8, 0 },            /* short IPv6 header: pass */
+        { BPF_LDX | BPF_B | BPF_MEM, 4, 2, ETH_HLEN + 6, 0 }, /* r4 = next header */
+        { BPF_JMP | BPF_JEQ | BPF_K, 4, 0, 6, IPPROTO_ICMPV6 }, /* ICMPv6: pass */
+        { BPF_LDX | BPF_W | BPF_MEM, 2, 1, 16, 0 },           /* r2 = ctx->rx_queue_index */
+        { BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, map_fd },
+        { 0, 0, 0, 0, 0 },
+        { BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS },
+        { BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map },
+        { BPF_JMP | BPF_EXIT, 0, 0, 0, 0 },
+        { BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS },   /* pass: */
+        { BPF_JMP | BPF_EXIT, 0, 0, 0, 0 },
+    };
+    char log[4096] = "";
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uint64_t)(unsigned long)insns;
+    attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+    attr.license = (uint64_t)(unsigned long)"GPL";
+    attr.log_buf = (uint64_t)(unsigned long)log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    int fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if(fd < 0){
+        fprintf(stderr, "%s: could not load XDP program\n%s\n", strerror(errno), log);
+    }
+    return fd;
+}
+
+/* Creates the XSKMAP and loads the redirect program for if_name. mode
+ * is "skb" (generic XDP, works on any device including veth), "drv"
+ * (native XDP, frames copied into the UMEM) or "zc" (native zero copy) */
+struct xdp_program *xdp_program_create(const char *if_name, const char *mode,
+        int num_queues){
+    struct xdp_program *xp = (struct xdp_program *)calloc(1, sizeof(struct xdp_program));
+    xp->map_fd = xp->prog_fd = xp->link_fd = -1;
+
+    if(strcmp(mode, "skb") == 0){
+        xp->attach_flags = XDP_FLAGS_SKB_MODE;
+        xp->bind_flags = XDP_COPY;
+    } else if(strcmp(mode, "drv") == 0){
+        xp->attach_flags = XDP_FLAGS_DRV_MODE;
+        xp->bind_flags = XDP_COPY;
+    } else if(strcmp(mode, "zc") == 0){
+        xp->attach_flags = XDP_FLAGS_DRV_MODE;
+        xp->bind_flags = XDP_ZEROCOPY;
+    } else {
+        fprintf(stderr, "error: invalid XDP mode %s, expected skb, drv or zc\n", mode);
+        free(xp);
+        return NULL;
+    }
+    xp->bind_flags |= XDP_USE_NEED_WAKEUP;
+
+    xp->ifindex = if_nametoindex(if_name);
+    if(xp->ifindex == 0){
+        fprintf(stderr, "Can't get interface number for interface %s\n", if_name);
+        free(xp);
+        return NULL;
+    }
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = num_queues;
+    xp->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if(xp->map_fd < 0){
+        fprintf(stderr, "%s: could not create XSKMAP\n", strerror(errno));
+        xdp_program_free(xp);
+        return NULL;
+    }
+
+    xp->prog_fd = xdp_program_load(xp->map_fd);
+    if(xp->prog_fd < 0){
+        xdp_program_free(xp);
+        return NULL;
+    }
+    return xp;
+}
+
+/* Attaches the program to the interface once all sockets are in the map */
+int xdp_program_attach(struct xdp_program *xp){
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = xp->prog_fd;
+    attr.link_create.target_ifindex = xp->ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = xp->attach_flags;
+    xp->link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+    if(xp->link_fd < 0){
+        fprintf(stderr, "%s: could not attach XDP program (is another one attached?)\n",
+                strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void xdp_program_free(struct xdp_program *xp){
+    if(xp == NULL){
+        return;
+    }
+    if(xp->link_fd >= 0){
+        close(xp->link_fd);
+    }
+    if(xp->prog_fd >= 0){
+        close(xp->prog_fd);
+    }
+    if(xp->map_fd >= 0){
+        close(xp->map_fd);
+    }
+    free(xp);
+}
+
+/* Maps one of the socket's rings */
+static int xsk_ring_map(int fd, struct xsk_ring *ring, const struct xdp_ring_offset *off,
+        uint32_t size, size_t desc_size, off_t pgoff){
+    ring->map_size = off->desc + size * desc_size;
+    ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if(ring->map == MAP_FAILED){
+        ring->map = NULL;
+        return -1;
+    }
+    ring->producer = (uint32_t *)((uint8_t *)ring->map + off->producer);
+    ring->consumer = (uint32_t *)((uint8_t *)ring->map + off->consumer);
+    ring->flags = (uint32_t *)((uint8_t *)ring->map + off->flags);
+    ring->descs = (uint8_t *)ring->map + off->desc;
+    ring->size = size;
+    ring->mask = size - 1;
+    return 0;
+}
+
+static int xsk_set_ring_size(int fd, int opt, uint32_t size){
+    return setsockopt(fd, SOL_XDP, opt, &size, sizeof(size));
+}
+
+/* Creates a socket with its own UMEM, binds it to queue and adds it to
+ * the program's map. The UMEM is allocated by the calling thread, so it
+ * should run on the CPU the capture thread will use */
+struct xsk_socket *xsk_socket_create(struct xdp_program *xp, uint32_t queue){
+    struct xsk_socket *xsk = (struct xsk_socket *)calloc(1, sizeof(struct xsk_socket));
+    xsk->queue = queue;
+    xsk->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if(xsk->fd < 0){
+        fprintf(stderr, "%s: could not create AF_XDP socket\n", strerror(errno));
+        free(xsk);
+        return NULL;
+    }
+
+    xsk->umem_size = (size_t)XSK_NUM_FRAMES * XSK_FRAME_SIZE;
+    xsk->umem = (uint8_t *)cpu_local_alloc(xsk->umem_size);
+    if(xsk->umem == NULL){
+        fprintf(stderr, "error: could not allocate UMEM for queue %u\n", queue);
+        xsk_socket_free(xsk);
+        return NULL;
+    }
+
+    struct xdp_umem_reg umem_reg;
+    memset(&umem_reg, 0, sizeof(umem_reg));
+    umem_reg.addr = (uint64_t)(unsigned long)xsk->umem;
+    umem_reg.len = xsk->umem_size;
+    umem_reg.chunk_size = XSK_FRAME_SIZE;
+    umem_reg.headroom = 0;
+    if(setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &umem_reg, sizeof(umem_reg)) != 0 ||
+            xsk_set_ring_size(xsk->fd, XDP_UMEM_FILL_RING, XSK_NUM_FRAMES) != 0 ||
+            xsk_set_ring_size(xsk->fd, XDP_UMEM_COMPLETION_RING, XSK_COMP_RING_SIZE) != 0 ||
+            xsk_set_ring_size(xsk->fd, XDP_RX_RING, XSK_RX_RING_SIZE) != 0){
+        fprintf(stderr, "%s: could not set up UMEM for queue %u\n", strerror(errno), queue);
+        xsk_socket_free(xsk);
+        return NULL;
+    }
+
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    if(getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) != 0 ||
+            xsk_ring_map(xsk->fd, &(xsk->rx), &(off.rx), XSK_RX_RING_SIZE,
+                sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) != 0 ||
+            xsk_ring_map(xsk->fd, &(xsk->fill), &(off.fr), XSK_NUM_FRAMES,
+                sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) != 0 ||
+            xsk_ring_map(xsk->fd, &(xsk->comp), &(off.cr), XSK_COMP_RING_SIZE,
+                sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) != 0){
+        fprintf(stderr, "%s: could not map AF_XDP rings for queue %u\n", strerror(errno), queue);
+        xsk_socket_free(xsk);
+        return NULL;
+    }
+
+    /* Every frame starts out on the fill ring */
+    uint64_t *fill = (uint64_t *)xsk->fill.descs;
+    for(uint32_t i = 0; i < XSK_NUM_FRAMES; i++){
+        fill[i] = (uint64_t)i * XSK_FRAME_SIZE;
+    }
+    __atomic_store_n(xsk->fill.producer, XSK_NUM_FRAMES, __ATOMIC_RELEASE);
+
+    struct sockaddr_xdp sxdp;
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = xp->ifindex;
+    sxdp.sxdp_queue_id = queue;
+    sxdp.sxdp_flags = xp->bind_flags;
+    if(bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) != 0){
+        fprintf(stderr, "%s: could not bind AF_XDP socket to queue %u "
+                "(does the interface have that many queues?)\n", strerror(errno), queue);
+        xsk_socket_free(xsk);
+        return NULL;
+    }
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = xp->map_fd;
+    attr.key = (uint64_t)(unsigned long)&queue;
+    attr.value = (uint64_t)(unsigned long)&(xsk->fd);
+    if(sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) != 0){
+        fprintf(stderr, "%s: could not add socket of queue %u to XSKMAP\n", strerror(errno), queue);
+        xsk_socket_free(xsk);
+        return NULL;
+    }
+    return xsk;
+}
+
+void xsk_socket_free(struct xsk_socket *xsk){
+    if(xsk == NULL){
+        return;
+    }
+    struct xsk_ring *rings[] = { &(xsk->rx), &(xsk->fill), &(xsk->comp) };
+    for(int r = 0; r < 3; r++){
+        if(rings[r]->map != NULL){
+            munmap(rings[r]->map, rings[r]->map_size);
+        }
+    }
+    if(xsk->fd >= 0){
+        close(xsk->fd);
+    }
+    cpu_local_free(xsk->umem, xsk->umem_size);
+    free(xsk);
+}
+
+/* Copies up to max received descriptors and returns their slots on the
+ * rx ring. The frames stay ours until xsk_recycle() */
+uint32_t xsk_rx_batch(struct xsk_socket *xsk, struct xdp_desc *descs, uint32_t max){
+    struct xsk_ring *rx = &(xsk->rx);
+    uint32_t cons = *(rx->consumer);
+    uint32_t avail = __atomic_load_n(rx->producer, __ATOMIC_ACQUIRE) - cons;
+    uint32_t n = (avail < max) ? avail : max;
+    const struct xdp_desc *ring = (const struct xdp_desc *)rx->descs;
+    for(uint32_t i = 0; i < n; i++){
+        descs[i] = ring[(cons + i) & rx->mask];
+    }
+    if(n > 0){
+        __atomic_store_n(rx->consumer, cons + n, __ATOMIC_RELEASE);
+        __atomic_store_n(&(xsk->rx_frames), xsk->rx_frames + n, __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+/* Hands the frames of a processed batch back to the kernel. Every frame
+ * came off the fill ring, so there is always room for it there */
+void xsk_recycle(struct xsk_socket *xsk, const struct xdp_desc *descs, uint32_t n){
+    struct xsk_ring *fill = &(xsk->fill);
+    uint64_t *ring = (uint64_t *)fill->descs;
+    uint32_t prod = *(fill->producer);
+    for(uint32_t i = 0; i < n; i++){
+        /* The address may point past the start of the chunk */
+        ring[(prod + i) & fill->mask] = descs[i].addr & ~((uint64_t)XSK_FRAME_SIZE - 1);
+    }
+    __atomic_store_n(fill->producer, prod + n, __ATOMIC_RELEASE);
+
+    /* Nothing is transmitted so the completion ring stays empty, but
+     * drain it in case the kernel ever posts to it */
+    struct xsk_ring *comp = &(xsk->comp);
+    uint32_t comp_prod = __atomic_load_n(comp->producer, __ATOMIC_ACQUIRE);
+    if(comp_prod != *(comp->consumer)){
+        __atomic_store_n(comp->consumer, comp_prod, __ATOMIC_RELEASE);
+    }
+}
+
+/* With XDP_USE_NEED_WAKEUP the driver stops polling when the fill ring
+ * ran dry and has to be kicked once frames are back */
+void xsk_wakeup_if_needed(struct xsk_socket *xsk){
+    if(__atomic_load_n(xsk->fill.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP){
+        recvfrom(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+}
+
+/* Adds the socket's counters since the previous call to statst, the
+ * same way af_packet_stats() does for TPACKET_V3 sockets */
+void af_xdp_stats(struct xsk_socket *xsk, struct stats_tracking *statst){
+    struct xdp_statistics xstats;
+    socklen_t optlen = sizeof(xstats);
+    memset(&xstats, 0, sizeof(xstats));
+    if(getsockopt(xsk->fd, SOL_XDP, XDP_STATISTICS, &xstats, &optlen) != 0){
+        fprintf(stderr, "%s: error getting AF_XDP statistics\n", strerror(errno));
+        return;
+    }
+
+    uint64_t frames = __atomic_load_n(&(xsk->rx_frames), __ATOMIC_RELAXED);
+    uint64_t drops = xstats.rx_dropped + xstats.rx_invalid_descs + xstats.rx_ring_full;
+    uint64_t fill_empty = xstats.rx_fill_ring_empty_descs;
+
+    if(statst != NULL){
+        statst->socket_packets += (frames - xsk->last_frames) + (drops - xsk->last_drops);
+        statst->socket_drops += drops - xsk->last_drops;
+        /* Running out of fill ring frames is the XDP analogue of a queue freeze */
+        statst->socket_freezes += fill_empty - xsk->last_fill_empty;
+    }
+    xsk->last_frames = frames;
+    xsk->last_drops = drops;
+    xsk->last_fill_empty = fill_empty;
+}
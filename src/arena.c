@@ -0,0 +1,148 @@
+/*
+ * arena.c
+ *
+ * Per thread scratch memory. A thread allocates what it needs for a
+ * block from its arena and resets the arena once the block is done, so
+ * the packet path does not go to the heap once the arena has grown to
+ * the largest block seen.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "include/arena.h"
+
+#define ARENA_ALIGN 64
+#define ARENA_HUGE_PAGE (2 * (1 << 20))
+
+/* A heap fallback, the allocation follows the header */
+struct arena_spill {
+    struct arena_spill *next;
+} __attribute__((aligned(ARENA_ALIGN)));
+
+static size_t round_up(size_t size, size_t to){
+    return (size + to - 1) & ~(to - 1);
+}
+
+/* Maps zeroed memory, from explicit huge pages when there are enough
+ * of them, else from pages the kernel may back with transparent huge
+ * pages. Touching it here faults it in on the calling thread's NUMA
+ * node rather than in the middle of a block */
+static uint8_t *arena_map(size_t *size, int *huge){
+    void *ptr = MAP_FAILED;
+    *huge = 0;
+    if(*size >= ARENA_HUGE_PAGE){
+        size_t huge_size = round_up(*size, ARENA_HUGE_PAGE);
+        ptr = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(ptr != MAP_FAILED){
+            *size = huge_size;
+            *huge = 1;
+        }
+    }
+    if(ptr == MAP_FAILED){
+        *size = round_up(*size, 4096);
+        ptr = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(ptr == MAP_FAILED){
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(ptr, *size, MADV_HUGEPAGE);
+#endif
+    }
+    memset(ptr, 0, *size);
+    return (uint8_t *)ptr;
+}
+
+/* Creates an arena of at least size bytes. It should be called on the
+ * CPU of the thread that will use it */
+struct arena *arena_create(size_t size){
+    struct arena *a = (struct arena *)calloc(1, sizeof(struct arena));
+    if(a == NULL){
+        return NULL;
+    }
+    a->size = size;
+    a->base = arena_map(&(a->size), &(a->huge));
+    if(a->base == NULL){
+        free(a);
+        return NULL;
+    }
+    return a;
+}
+
+static void arena_free_spill(struct arena *a){
+    while(a->spill != NULL){
+        struct arena_spill *next = a->spill->next;
+        free(a->spill);
+        a->spill = next;
+    }
+    a->spilled = 0;
+}
+
+void arena_free(struct arena *a){
+    if(a == NULL){
+        return;
+    }
+    arena_free_spill(a);
+    munmap(a->base, a->size);
+    free(a);
+}
+
+/* Also called for heap memory taken on the packet path outside the
+ * arena, so that the stats count it */
+void arena_count_heap_alloc(struct arena *a){
+    __atomic_store_n(&(a->heap_allocs), a->heap_allocs + 1, __ATOMIC_RELAXED);
+}
+
+/* Returns size bytes aligned to a cache line. The memory is not zeroed */
+void *arena_alloc(struct arena *a, size_t size){
+    size = round_up(size, ARENA_ALIGN);
+    if(a->used + size <= a->size){
+        void *ptr = a->base + a->used;
+        a->used += size;
+        if(a->used + a->spilled > a->wanted){
+            a->wanted = a->used + a->spilled;
+        }
+        return ptr;
+    }
+
+    /* Too small for this block, the heap covers for it until the reset */
+    struct arena_spill *sp = (struct arena_spill *)malloc(sizeof(struct arena_spill) + size);
+    if(sp == NULL){
+        perror("could not allocate scratch memory");
+        exit(255);
+    }
+    arena_count_heap_alloc(a);
+    sp->next = a->spill;
+    a->spill = sp;
+    a->spilled += size;
+    if(a->used + a->spilled > a->wanted){
+        a->wanted = a->used + a->spilled;
+    }
+    return sp + 1;
+}
+
+/* Releases everything. If the arena was too small since the last reset
+ * it is replaced by one large enough */
+void arena_reset(struct arena *a){
+    a->used = 0;
+    if(a->spill == NULL){
+        return;
+    }
+    arena_free_spill(a);
+
+    size_t size = a->wanted + a->wanted / 4;
+    int huge;
+    uint8_t *base = arena_map(&size, &huge);
+    arena_count_heap_alloc(a);
+    if(base != NULL){
+        munmap(a->base, a->size);
+        a->base = base;
+        a->size = size;
+        a->huge = huge;
+    }
+    a->wanted = 0;
+}
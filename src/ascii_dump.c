@@ -0,0 +1,146 @@
+/*
+ * ascii_dump.c
+ *
+ * Printable view of packet payloads for the log records. The kernels
+ * classify a whole vector of bytes at a time; the widest one the CPU
+ * supports is picked once at startup.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "include/ascii_dump.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/* Printable bytes are ' ' (32) to 'z' (122), less '"' and '\' which
+ * would need escaping in JSON */
+#define ASCII_FIRST 32
+#define ASCII_SPAN (122 - ASCII_FIRST)
+
+static ascii_dump_fn dump_kernel = ascii_dump_scalar;
+static const char *dump_kernel_name = "scalar";
+static uint32_t dump_max = ASCII_DUMP_DEFAULT_MAX;
+
+static inline char ascii_byte(uint8_t byte){
+    if((uint8_t)(byte - ASCII_FIRST) <= ASCII_SPAN && byte != '"' && byte != '\\'){
+        return byte;
+    }
+    return '.';
+}
+
+uint32_t ascii_dump_scalar(const uint8_t *in, uint32_t len, char *out){
+    for(uint32_t i = 0; i < len; i++){
+        out[i] = ascii_byte(in[i]);
+    }
+    out[len] = '\0';
+    return len;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/* Shifted by ' ', printable bytes are the ones not above ASCII_SPAN
+ * unsigned, i.e. those equal to their minimum with ASCII_SPAN */
+__attribute__((target("sse2")))
+uint32_t ascii_dump_sse2(const uint8_t *in, uint32_t len, char *out){
+    const __m128i first = _mm_set1_epi8(ASCII_FIRST);
+    const __m128i span = _mm_set1_epi8(ASCII_SPAN);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i dot = _mm_set1_epi8('.');
+    uint32_t i = 0;
+    for(; i + 16 <= len; i += 16){
+        __m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i y = _mm_sub_epi8(x, first);
+        __m128i ok = _mm_cmpeq_epi8(_mm_min_epu8(y, span), y);
+        __m128i esc = _mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, backslash));
+        ok = _mm_andnot_si128(esc, ok);
+        __m128i r = _mm_or_si128(_mm_and_si128(ok, x), _mm_andnot_si128(ok, dot));
+        _mm_storeu_si128((__m128i *)(out + i), r);
+    }
+    for(; i < len; i++){
+        out[i] = ascii_byte(in[i]);
+    }
+    out[len] = '\0';
+    return len;
+}
+
+__attribute__((target("avx2")))
+uint32_t ascii_dump_avx2(const uint8_t *in, uint32_t len, char *out){
+    const __m256i first = _mm256_set1_epi8(ASCII_FIRST);
+    const __m256i span = _mm256_set1_epi8(ASCII_SPAN);
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i dot = _mm256_set1_epi8('.');
+    uint32_t i = 0;
+    for(; i + 32 <= len; i += 32){
+        __m256i x = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i y = _mm256_sub_epi8(x, first);
+        __m256i ok = _mm256_cmpeq_epi8(_mm256_min_epu8(y, span), y);
+        __m256i esc = _mm256_or_si256(_mm256_cmpeq_epi8(x, quote), _mm256_cmpeq_epi8(x, backslash));
+        ok = _mm256_andnot_si256(esc, ok);
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_blendv_epi8(dot, x, ok));
+    }
+    /* Not through ascii_dump_sse2(), mixing in legacy SSE code would
+     * cost a state transition per call */
+    for(; i < len; i++){
+        out[i] = ascii_byte(in[i]);
+    }
+    out[len] = '\0';
+    return len;
+}
+
+/* Masked loads and stores cover the tail too */
+__attribute__((target("avx512f,avx512bw")))
+uint32_t ascii_dump_avx512(const uint8_t *in, uint32_t len, char *out){
+    const __m512i first = _mm512_set1_epi8(ASCII_FIRST);
+    const __m512i span = _mm512_set1_epi8(ASCII_SPAN);
+    const __m512i quote = _mm512_set1_epi8('"');
+    const __m512i backslash = _mm512_set1_epi8('\\');
+    const __m512i dot = _mm512_set1_epi8('.');
+    for(uint32_t i = 0; i < len; i += 64){
+        __mmask64 live = (len - i >= 64) ? ~(__mmask64)0 : (((__mmask64)1 << (len - i)) - 1);
+        __m512i x = _mm512_maskz_loadu_epi8(live, in + i);
+        __mmask64 ok = _mm512_cmple_epu8_mask(_mm512_sub_epi8(x, first), span)
+            & ~_mm512_cmpeq_epi8_mask(x, quote) & ~_mm512_cmpeq_epi8_mask(x, backslash);
+        _mm512_mask_storeu_epi8(out + i, live, _mm512_mask_blend_epi8(ok, dot, x));
+    }
+    out[len] = '\0';
+    return len;
+}
+
+#endif
+
+/* Picks the kernel for this CPU and sets how many payload bytes a
+ * dump shows at most */
+void ascii_dump_init(uint32_t max_len){
+    dump_max = max_len;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512bw")){
+        dump_kernel = ascii_dump_avx512;
+        dump_kernel_name = "avx512";
+    } else if(__builtin_cpu_supports("avx2")){
+        dump_kernel = ascii_dump_avx2;
+        dump_kernel_name = "avx2";
+    } else if(__builtin_cpu_supports("sse2")){
+        dump_kernel = ascii_dump_sse2;
+        dump_kernel_name = "sse2";
+    }
+#endif
+}
+
+uint32_t ascii_dump_max(void){
+    return dump_max;
+}
+
+const char *ascii_dump_kernel(void){
+    return dump_kernel_name;
+}
+
+/* Dumps at most ascii_dump_max() bytes, out needs one more for the NUL */
+uint32_t ascii_dump(const uint8_t *in, uint32_t len, char *out){
+    return dump_kernel(in, (len < dump_max) ? len : dump_max, out);
+}
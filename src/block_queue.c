@@ -0,0 +1,74 @@
+/*
+ * block_queue.c
+ *
+ * Lock-free single producer single consumer queue used to hand ring
+ * blocks from capture threads to processing workers in pipeline mode.
+ * Every capture thread has one queue per worker, so no queue ever sees
+ * more than one producer or consumer and plain acquire/release ordering
+ * on head and tail is enough.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/block_queue.h"
+
+/* Creates a queue holding at least capacity references */
+struct block_queue *block_queue_create(uint32_t capacity){
+    uint32_t size = 1;
+    while(size < capacity){
+        size <<= 1;
+    }
+
+    struct block_queue *q = (struct block_queue *)aligned_alloc(64, sizeof(struct block_queue));
+    if(q == NULL){
+        return NULL;
+    }
+    memset(q, 0, sizeof(struct block_queue));
+    q->slots = (struct block_ref *)calloc(size, sizeof(struct block_ref));
+    if(q->slots == NULL){
+        free(q);
+        return NULL;
+    }
+    q->mask = size - 1;
+    return q;
+}
+
+void block_queue_free(struct block_queue *q){
+    if(q != NULL){
+        free(q->slots);
+        free(q);
+    }
+}
+
+/* Called by the producer only. Returns 0 when the queue is full */
+int block_queue_push(struct block_queue *q, const struct block_ref *ref){
+    uint32_t tail = q->tail;
+    uint32_t head = __atomic_load_n(&(q->head), __ATOMIC_ACQUIRE);
+    if(tail - head > q->mask){
+        return 0;
+    }
+    q->slots[tail & q->mask] = *ref;
+    /* Publish the slot before the new tail */
+    __atomic_store_n(&(q->tail), tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Called by the consumer only. Returns 0 when the queue is empty */
+int block_queue_pop(struct block_queue *q, struct block_ref *ref){
+    uint32_t head = q->head;
+    uint32_t tail = __atomic_load_n(&(q->tail), __ATOMIC_ACQUIRE);
+    if(head == tail){
+        return 0;
+    }
+    *ref = q->slots[head & q->mask];
+    /* The slot may be reused by the producer once head moves */
+    __atomic_store_n(&(q->head), head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Number of references in the queue as seen by the producer */
+uint32_t block_queue_count(struct block_queue *q){
+    return q->tail - __atomic_load_n(&(q->head), __ATOMIC_ACQUIRE);
+}
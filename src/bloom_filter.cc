@@ -63,10 +63,13 @@ long BloomFilter::compute_hash(std::string message, int seed) const{
     return result % this->m;
 }
 
+/* add() and check() are called by all capture threads without a lock.
+ * Bits are only ever set, so relaxed atomic accesses are enough: a
+ * concurrent check() either sees a bit or misses a hash still being added */
 int BloomFilter::add(std::string message){
     for(int i=0; i < this->k; ++i){
         long hash = compute_hash(message, i);
-        this->bit_array[hash] = 1;
+        __atomic_store_n(&(this->bit_array[hash]), true, __ATOMIC_RELAXED);
     }
     return 1;
 }
@@ -117,7 +120,7 @@ int BloomFilter::check(std::string message) const{
      */
     for(int i=0; i<this->k; ++i){
         long hash = compute_hash(message, i);
-        if(this->bit_array[hash] == 0)
+        if(__atomic_load_n(&(this->bit_array[hash]), __ATOMIC_RELAXED) == 0)
             return 0;
     }
 //    std::cout << "Hash is present " << std::endl;
@@ -0,0 +1,486 @@
+/*
+ * capture_filter.c
+ *
+ * Compiles the capture criteria (VLAN ids, ports and port ranges, L4
+ * protocol, minimum payload length and an optional pcap-filter
+ * expression) into a
+ * classic BPF program that is attached to every capture socket, so that
+ * the kernel drops uninteresting packets before they are copied into
+ * the ring.
+ *
+ * The generated program is
+ *
+ *      check on the VLAN id the kernel stripped
+ *      checks on ethertype and protocol, IPv4 and IPv6 apart
+ *      checks on ports and payload length, X holding the IP header length
+ *  pass:   ret #snaplen      (or ja over reject when an expression follows)
+ *  reject: ret #0
+ *          the expression compiled by libpcap, if any
+ *
+ * The checks only jump forward to labels within the generated part.
+ * Conditional jumps reach at most 255 instructions, unconditional ones
+ * any distance. When the VLAN and port range checks together would
+ * make the program too long or a conditional jump too far, the VLAN
+ * checks and then the port checks are left to userspace.
+ *
+ * libpcap's struct bpf_insn and the kernel's struct sock_filter have the
+ * same layout. The header only uses the kernel type so that it can be
+ * included next to linux/bpf.h, whose struct bpf_insn clashes with pcap's.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pcap.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+
+#include "include/sniffer.h"
+#include "include/capture_filter.h"
+#include "include/pkt_processing.h"
+
+#define FILTER_SNAPLEN 0x40000
+/* Room for the VLAN and the port range checks together, at their
+ * longest, next to the fixed part */
+#define FILTER_MAX_GENERATED (128 + 6 * CAPTURE_FILTER_MAX_BPF_RANGES)
+
+/* Jump targets that are resolved once the generated part is complete */
+enum filter_label {
+    label_pass,
+    label_reject,
+    label_vlan_in_frame,
+    label_vlan_ok,
+    label_ipv6,
+    label_tagged,
+    label_l4,
+    label_port_ok,
+    label_udp_len,
+    label_check_len,
+    num_labels
+};
+
+/* Jump offsets below zero refer to a label */
+#define L(label) (-(label) - 1)
+
+struct filter_builder {
+    struct sock_filter insns[FILTER_MAX_GENERATED];
+    int jt[FILTER_MAX_GENERATED];
+    int jf[FILTER_MAX_GENERATED];
+    int len;
+    int overflow;           /* Instructions were left out for lack of room */
+    int label_pos[num_labels];
+};
+
+static void emit_jump(struct filter_builder *fb, uint16_t code, uint32_t k, int jt, int jf){
+    if(fb->len == FILTER_MAX_GENERATED){
+        fb->overflow = 1;
+        return;
+    }
+    fb->insns[fb->len].code = code;
+    fb->insns[fb->len].k = k;
+    fb->jt[fb->len] = jt;
+    fb->jf[fb->len] = jf;
+    fb->len++;
+}
+
+static void emit_stmt(struct filter_builder *fb, uint16_t code, uint32_t k){
+    emit_jump(fb, code, k, 0, 0);
+}
+
+static void place_label(struct filter_builder *fb, enum filter_label label){
+    fb->label_pos[label] = fb->len;
+}
+
+/* Offset from instruction i to target, a label or an offset already */
+static int resolve_offset(const struct filter_builder *fb, int i, int target){
+    if(target >= 0){
+        return target;
+    }
+    return fb->label_pos[-target - 1] - (i + 1);
+}
+
+/* Turns label references into relative offsets. Unconditional jumps
+ * take theirs in k, conditional ones must fit in 8 bits */
+static int resolve_labels(struct filter_builder *fb){
+    if(fb->overflow){
+        return -1;
+    }
+    for(int i = 0; i < fb->len; i++){
+        int jt = resolve_offset(fb, i, fb->jt[i]);
+        int jf = resolve_offset(fb, i, fb->jf[i]);
+        if(fb->insns[i].code == (BPF_JMP | BPF_JA)){
+            if(jt < 0){
+                return -1;
+            }
+            fb->insns[i].k = jt;
+            jt = jf = 0;
+        } else if(jt < 0 || jt > 255 || jf < 0 || jf > 255){
+            return -1;
+        }
+        fb->insns[i].jt = jt;
+        fb->insns[i].jf = jf;
+    }
+    return 0;
+}
+
+/* Parses a list like "80,443,8000-8080" of numbers from 1 to max_id into
+ * a bitmap and a range list */
+static int parse_id_list(const char *list, long max_id, uint8_t *bitmap,
+        struct port_range **ranges_out, int *num_ranges_out){
+    const char *p = list;
+    int max_ranges = 16, num_ranges = 0;
+    struct port_range *ranges = (struct port_range *)malloc(max_ranges * sizeof(struct port_range));
+    *ranges_out = ranges;
+    *num_ranges_out = 0;
+
+    while(*p != '\0'){
+        char *end;
+        long lo = strtol(p, &end, 10);
+        long hi = lo;
+        if(end == p){
+            return -1;
+        }
+        p = end;
+        if(*p == '-'){
+            hi = strtol(p + 1, &end, 10);
+            if(end == p + 1){
+                return -1;
+            }
+            p = end;
+        }
+        if(lo < 1 || hi > max_id || hi < lo){
+            return -1;
+        }
+        if(*p == ','){
+            p++;
+        } else if(*p != '\0'){
+            return -1;
+        }
+
+        if(num_ranges == max_ranges){
+            max_ranges *= 2;
+            ranges = (struct port_range *)realloc(ranges, max_ranges * sizeof(struct port_range));
+            *ranges_out = ranges;
+        }
+        ranges[num_ranges].lo = lo;
+        ranges[num_ranges].hi = hi;
+        *num_ranges_out = ++num_ranges;
+        for(long id = lo; id <= hi; id++){
+            bitmap[id >> 3] |= 1 << (id & 7);
+        }
+    }
+    return 0;
+}
+
+/* Emits a check of the value loaded in A against every range. A match
+ * jumps to label ok, otherwise control falls through */
+static void emit_range_checks(struct filter_builder *fb, const struct port_range *ranges,
+        int num_ranges, enum filter_label ok){
+    for(int r = 0; r < num_ranges; r++){
+        if(ranges[r].lo == ranges[r].hi){
+            emit_jump(fb, BPF_JMP | BPF_JEQ | BPF_K, ranges[r].lo, L(ok), 0);
+        } else {
+            emit_jump(fb, BPF_JMP | BPF_JGE | BPF_K, ranges[r].lo, 0, 1);
+            emit_jump(fb, BPF_JMP | BPF_JGT | BPF_K, ranges[r].hi, 0, L(ok));
+        }
+    }
+}
+
+/* Emits a jump to label ok for frames whose ethertype, loaded in A,
+ * says that VLAN tags or MPLS labels come first. Userspace walks them */
+static void emit_tagged_checks(struct filter_builder *fb, int mpls, enum filter_label ok){
+    emit_jump(fb, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_8021Q, L(ok), 0);
+    emit_jump(fb, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_8021AD, L(ok), 0);
+    emit_jump(fb, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_QINQ1, L(ok), 0);
+    if(mpls){
+        emit_jump(fb, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_MPLS_UC, L(ok), 0);
+        emit_jump(fb, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_MPLS_MC, L(ok), 0);
+    }
+    emit_jump(fb, BPF_JMP | BPF_JA, 0, L(label_reject), 0);
+}
+
+/* Emits a check of the protocol loaded in A. Only TCP and UDP are
+ * parsed, anything else is rejected. With a minimum payload or when
+ * decapsulating, the protocol is kept in M[1] */
+static void emit_protocol_check(struct filter_builder *fb, const struct capture_filter *cf){
+    if(cf->decap_depth > 0){
+        /* The protocol that counts is that of the innermost packet,
+         * userspace checks it. UDP tunnels are told by their port */
+        emit_jump(fb, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_GRE, L(label_pass), 0);
+        emit_jump(fb, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_IPIP, L(label_pass), 0);
+        emit_jump(fb, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_IPV6, L(label_pass), 0);
+        emit_jump(fb, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 1, 0);
+        emit_jump(fb, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, L(label_reject));
+        emit_stmt(fb, BPF_ST, 1);
+        return;
+    }
+    if(cf->protocol != 0){
+        emit_jump(fb, BPF_JMP | BPF_JEQ | BPF_K, cf->protocol, 0, L(label_reject));
+    } else {
+        emit_jump(fb, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 1, 0);
+        emit_jump(fb, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, L(label_reject));
+    }
+    if(cf->min_payload > 0){
+        emit_stmt(fb, BPF_ST, 1);
+    }
+}
+
+/* Generates the kernel program, with the VLAN and port range checks
+ * when vlans and ports say so. Returns -1 if it does not fit */
+static int build_kernel_prog(struct capture_filter *cf, int vlans, int ports){
+    struct filter_builder fb;
+    memset(&fb, 0, sizeof(fb));
+
+    if(vlans){
+        /* The kernel usually strips the outermost tag. Frames that still
+         * carry it are left to userspace, through the checks of tagged
+         * frames below */
+        emit_stmt(&fb, BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT);
+        emit_jump(&fb, BPF_JMP | BPF_JEQ | BPF_K, 0, L(label_vlan_in_frame), 0);
+        emit_stmt(&fb, BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_VLAN_TAG);
+        emit_stmt(&fb, BPF_ALU | BPF_AND | BPF_K, 0x0fff);
+        emit_range_checks(&fb, cf->vlan_ranges, cf->num_vlan_ranges, label_vlan_ok);
+        emit_jump(&fb, BPF_JMP | BPF_JA, 0, L(label_reject), 0);
+        place_label(&fb, label_vlan_in_frame);
+        emit_stmt(&fb, BPF_LD | BPF_H | BPF_ABS, 12);
+        emit_tagged_checks(&fb, 0, label_vlan_ok);
+        place_label(&fb, label_vlan_ok);
+    }
+
+    /* Only IPv4 and IPv6 frames. The socket gets every protocol */
+    emit_stmt(&fb, BPF_LD | BPF_H | BPF_ABS, 12);
+    emit_jump(&fb, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, L(label_ipv6));
+
+    emit_stmt(&fb, BPF_LD | BPF_B | BPF_ABS, ETH_HLEN + 9);
+    emit_protocol_check(&fb, cf);
+
+    /* Fragments are left to userspace, which reassembles them: only the
+     * first has the L4 header and only the datagram the payload length */
+    emit_stmt(&fb, BPF_LD | BPF_H | BPF_ABS, ETH_HLEN + 6);
+    emit_jump(&fb, BPF_JMP | BPF_JSET | BPF_K, 0x3fff, L(label_pass), 0);
+
+    /* X = IP header length */
+    emit_stmt(&fb, BPF_LDX | BPF_B | BPF_MSH, ETH_HLEN);
+    if(cf->min_payload > 0){
+        /* M[0] = IP total length - IP header length */
+        emit_stmt(&fb, BPF_LD | BPF_H | BPF_ABS, ETH_HLEN + 2);
+        emit_stmt(&fb, BPF_ALU | BPF_SUB | BPF_X, 0);
+        emit_stmt(&fb, BPF_ST, 0);
+    }
+    emit_jump(&fb, BPF_JMP | BPF_JA, 0, L(label_l4), 0);
+
+    place_label(&fb, label_ipv6);
+    emit_jump(&fb, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IPV6, 0, L(label_tagged));
+    emit_stmt(&fb, BPF_LD | BPF_B | BPF_ABS, ETH_HLEN + 6);
+    /* Extension headers would need a loop, which cBPF does not have.
+     * Userspace walks them */
+    emit_jump(&fb, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_HOPOPTS, L(label_pass), 0);
+    emit_jump(&fb, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ROUTING, L(label_pass), 0);
+    emit_jump(&fb, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_FRAGMENT, L(label_pass), 0);
+    emit_jump(&fb, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_DSTOPTS, L(label_pass), 0);
+    emit_protocol_check(&fb, cf);
+    if(cf->min_payload > 0){
+        /* M[0] = payload length, which leaves out the IPv6 header */
+        emit_stmt(&fb, BPF_LD | BPF_H | BPF_ABS, ETH_HLEN + 4);
+        emit_stmt(&fb, BPF_ST, 0);
+    }
+    emit_stmt(&fb, BPF_LDX | BPF_IMM, 40);
+    emit_jump(&fb, BPF_JMP | BPF_JA, 0, L(label_l4), 0);
+
+    place_label(&fb, label_tagged);
+    emit_tagged_checks(&fb, 1, label_pass);
+
+    place_label(&fb, label_l4);
+
+    if(cf->decap_depth > 0){
+        emit_stmt(&fb, BPF_LD | BPF_H | BPF_IND, ETH_HLEN + 2);  /* destination port */
+        emit_jump(&fb, BPF_JMP | BPF_JEQ | BPF_K, VXLAN_PORT, L(label_pass), 0);
+        emit_jump(&fb, BPF_JMP | BPF_JEQ | BPF_K, GENEVE_PORT, L(label_pass), 0);
+        if(cf->protocol != 0){
+            emit_stmt(&fb, BPF_LD | BPF_MEM, 1);
+            emit_jump(&fb, BPF_JMP | BPF_JEQ | BPF_K, cf->protocol, 0, L(label_reject));
+        }
+    }
+
+    if(ports){
+        emit_stmt(&fb, BPF_LD | BPF_H | BPF_IND, ETH_HLEN);      /* source port */
+        emit_range_checks(&fb, cf->ranges, cf->num_ranges, label_port_ok);
+        emit_stmt(&fb, BPF_LD | BPF_H | BPF_IND, ETH_HLEN + 2);  /* destination port */
+        emit_range_checks(&fb, cf->ranges, cf->num_ranges, label_port_ok);
+        emit_jump(&fb, BPF_JMP | BPF_JA, 0, L(label_reject), 0);
+        place_label(&fb, label_port_ok);
+    }
+
+    if(cf->min_payload > 0){
+        /* M[0] holds the L4 length and M[1] the protocol */
+        emit_stmt(&fb, BPF_LD | BPF_MEM, 1);
+        emit_jump(&fb, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 0, L(label_udp_len));
+        if(cf->tcp_streams){
+            /* SYN, FIN or RST */
+            emit_stmt(&fb, BPF_LD | BPF_B | BPF_IND, ETH_HLEN + 13);
+            emit_jump(&fb, BPF_JMP | BPF_JSET | BPF_K, 0x07, L(label_pass), 0);
+        }
+        /* TCP: subtract data offset * 4 */
+        emit_stmt(&fb, BPF_LD | BPF_B | BPF_IND, ETH_HLEN + 12);
+        emit_stmt(&fb, BPF_ALU | BPF_RSH | BPF_K, 2);
+        emit_stmt(&fb, BPF_ALU | BPF_AND | BPF_K, 0x3c);
+        emit_stmt(&fb, BPF_MISC | BPF_TAX, 0);
+        emit_stmt(&fb, BPF_LD | BPF_MEM, 0);
+        emit_stmt(&fb, BPF_ALU | BPF_SUB | BPF_X, 0);
+        if(cf->tcp_streams){
+            /* Any data, the length check is on the messages */
+            emit_jump(&fb, BPF_JMP | BPF_JGT | BPF_K, 0, L(label_pass), L(label_reject));
+        } else {
+            emit_jump(&fb, BPF_JMP | BPF_JA, 0, L(label_check_len), 0);
+        }
+        /* UDP: subtract the 8 byte header */
+        place_label(&fb, label_udp_len);
+        emit_stmt(&fb, BPF_LD | BPF_MEM, 0);
+        emit_stmt(&fb, BPF_ALU | BPF_SUB | BPF_K, 8);
+        place_label(&fb, label_check_len);
+        emit_jump(&fb, BPF_JMP | BPF_JGE | BPF_K, cf->min_payload, L(label_pass), L(label_reject));
+    }
+
+    place_label(&fb, label_pass);
+    if(cf->expression != NULL){
+        emit_jump(&fb, BPF_JMP | BPF_JA, 0, 1, 0);
+    } else {
+        emit_stmt(&fb, BPF_RET | BPF_K, FILTER_SNAPLEN);
+    }
+    place_label(&fb, label_reject);
+    emit_stmt(&fb, BPF_RET | BPF_K, 0);
+
+    if(resolve_labels(&fb) != 0){
+        return -1;
+    }
+
+    /* Append the expression, it ends in its own return instructions */
+    uint32_t user_len = (cf->expression != NULL) ? cf->user_prog.len : 0;
+    if(fb.len + user_len > BPF_MAXINSNS){
+        return -1;
+    }
+    cf->kernel_prog.len = fb.len + user_len;
+    cf->kernel_prog.filter = (struct sock_filter *)malloc(cf->kernel_prog.len * sizeof(struct sock_filter));
+    memcpy(cf->kernel_prog.filter, fb.insns, fb.len * sizeof(struct sock_filter));
+    if(user_len > 0){
+        memcpy(cf->kernel_prog.filter + fb.len, cf->user_prog.filter,
+                user_len * sizeof(struct sock_filter));
+    }
+    return 0;
+}
+
+/* Sets up the filter from the command line options. ports, protocol
+ * and vlans may be NULL for any, expression may be NULL for none. With
+ * a decap_depth, tunnels are followed and the checks apply to the
+ * innermost packet. With tcp_streams, TCP segments are let through
+ * whatever their length, as long as they carry data or open or close
+ * their stream */
+int capture_filter_init(struct capture_filter *cf, const char *ports,
+        const char *protocol, int min_payload, const char *expression,
+        const char *vlans, int decap_depth, int tcp_streams){
+    memset(cf, 0, sizeof(struct capture_filter));
+    cf->min_payload = min_payload;
+    cf->decap_depth = decap_depth;
+    cf->tcp_streams = tcp_streams;
+
+    if(ports != NULL && parse_id_list(ports, 65535, cf->port_bitmap,
+                &(cf->ranges), &(cf->num_ranges)) != 0){
+        fprintf(stderr, "error: invalid port list %s\n", ports);
+        return -1;
+    }
+    cf->have_ports = cf->num_ranges > 0;
+
+    if(vlans != NULL && parse_id_list(vlans, 4094, cf->vlan_bitmap,
+                &(cf->vlan_ranges), &(cf->num_vlan_ranges)) != 0){
+        fprintf(stderr, "error: invalid VLAN list %s, VLAN ids go from 1 to 4094\n", vlans);
+        return -1;
+    }
+    cf->have_vlans = cf->num_vlan_ranges > 0;
+
+    if(protocol == NULL || strcmp(protocol, "any") == 0){
+        cf->protocol = 0;
+    } else if(strcmp(protocol, "tcp") == 0){
+        cf->protocol = IPPROTO_TCP;
+    } else if(strcmp(protocol, "udp") == 0){
+        cf->protocol = IPPROTO_UDP;
+    } else {
+        fprintf(stderr, "error: invalid protocol %s, expected tcp, udp or any\n", protocol);
+        return -1;
+    }
+
+    if(expression != NULL){
+        pcap_t *dead = pcap_open_dead(DLT_EN10MB, FILTER_SNAPLEN);
+        if(dead == NULL){
+            fprintf(stderr, "error: could not compile filter expression\n");
+            return -1;
+        }
+        struct bpf_program compiled;
+        if(pcap_compile(dead, &compiled, expression, 1, PCAP_NETMASK_UNKNOWN) != 0){
+            fprintf(stderr, "error: invalid filter expression \"%s\": %s\n",
+                    expression, pcap_geterr(dead));
+            pcap_close(dead);
+            return -1;
+        }
+        cf->user_prog.len = compiled.bf_len;
+        cf->user_prog.filter = (struct sock_filter *)malloc(compiled.bf_len * sizeof(struct sock_filter));
+        memcpy(cf->user_prog.filter, compiled.bf_insns, compiled.bf_len * sizeof(struct sock_filter));
+        pcap_freecode(&compiled);
+        pcap_close(dead);
+        cf->expression = strdup(expression);
+    }
+
+    /* The range checks that do not fit in the kernel program are left
+     * to userspace, VLANs first */
+    int vlans_in_kernel = cf->have_vlans && cf->num_vlan_ranges <= CAPTURE_FILTER_MAX_BPF_RANGES;
+    int ports_in_kernel = cf->have_ports && cf->num_ranges <= CAPTURE_FILTER_MAX_BPF_RANGES;
+    if(vlans_in_kernel && build_kernel_prog(cf, 1, ports_in_kernel) == 0){
+        return 0;
+    }
+    if(cf->have_vlans){
+        fprintf(stderr, "Notice: %d VLAN ranges do not fit in the kernel filter, "
+                "VLANs are only checked in userspace\n", cf->num_vlan_ranges);
+    }
+    if(ports_in_kernel && build_kernel_prog(cf, 0, 1) == 0){
+        return 0;
+    }
+    if(cf->have_ports){
+        fprintf(stderr, "Notice: %d port ranges do not fit in the kernel filter, "
+                "ports are only checked in userspace\n", cf->num_ranges);
+    }
+    if(build_kernel_prog(cf, 0, 0) != 0){
+        fprintf(stderr, "error: capture filter is longer than %d instructions\n", BPF_MAXINSNS);
+        return -1;
+    }
+    return 0;
+}
+
+void capture_filter_free(struct capture_filter *cf){
+    free(cf->expression);
+    free(cf->user_prog.filter);
+    free(cf->kernel_prog.filter);
+    free(cf->ranges);
+    free(cf->vlan_ranges);
+}
+
+/* Attaches the kernel program to a capture socket */
+int capture_filter_attach(const struct capture_filter *cf, int sockfd){
+    if(setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &(cf->kernel_prog),
+                sizeof(cf->kernel_prog)) != 0){
+        fprintf(stderr, "%s: could not attach capture filter\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Runs the filter expression on a packet in userspace, for packets that
+ * did not pass the kernel filter such as replayed ones */
+int capture_filter_match_expression(const struct capture_filter *cf,
+        const uint8_t *data, uint32_t len, uint32_t caplen){
+    if(cf->expression == NULL){
+        return 1;
+    }
+    return bpf_filter((const struct bpf_insn *)cf->user_prog.filter, data, len, caplen) != 0;
+}
@@ -0,0 +1,310 @@
+/*
+ * cpu_affinity.c
+ *
+ * Pins capture threads to CPUs and places their memory on the NUMA
+ * node of that CPU.
+ *
+ * The CPU plan is either an explicit CPU list ("0-3,8,10-11") or "auto".
+ * The auto planner prefers the CPUs that service the interrupts of the
+ * capture interface, then the other CPUs of the interface's NUMA node
+ * and finally any online CPU. Memory is placed with the kernel's first
+ * touch policy: a buffer is allocated and zeroed while the calling
+ * thread runs on the target CPU, so its pages come from that CPU's node.
+ * This avoids a dependency on libnuma.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "include/sniffer.h"
+#include "include/cpu_affinity.h"
+
+#define MAX_CPUS CPU_SETSIZE
+
+/* Parses a Linux cpulist ("0-3,8,10-11") into cpus.
+ * Returns the number of CPUs parsed or -1 on a malformed list */
+int cpu_list_parse(const char *list, int *cpus, int max_cpus){
+    int count = 0;
+    const char *p = list;
+
+    while(*p != '\0'){
+        while(*p == ',' || isspace((unsigned char)*p)){
+            p++;
+        }
+        if(*p == '\0'){
+            break;
+        }
+        if(!isdigit((unsigned char)*p)){
+            return -1;
+        }
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        p = end;
+        if(*p == '-'){
+            last = strtol(p + 1, &end, 10);
+            if(end == p + 1){
+                return -1;
+            }
+            p = end;
+        }
+        if(last < first || last >= MAX_CPUS){
+            return -1;
+        }
+        for(long c = first; c <= last && count < max_cpus; c++){
+            cpus[count++] = (int)c;
+        }
+    }
+    return count;
+}
+
+/* Reads a cpulist from a sysfs/procfs file */
+static int cpu_list_read(const char *path, int *cpus, int max_cpus){
+    char buffer[4096];
+    FILE *fp = fopen(path, "r");
+    if(fp == NULL){
+        return -1;
+    }
+    if(fgets(buffer, sizeof(buffer), fp) == NULL){
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    return cpu_list_parse(buffer, cpus, max_cpus);
+}
+
+static int read_int_file(const char *path, int *value){
+    FILE *fp = fopen(path, "r");
+    if(fp == NULL){
+        return -1;
+    }
+    int ret = fscanf(fp, "%d", value);
+    fclose(fp);
+    return ret == 1 ? 0 : -1;
+}
+
+/* Returns the NUMA node of cpu, or -1 when it can't be determined */
+int cpu_numa_node(int cpu){
+    char path[256];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if(dir == NULL){
+        return -1;
+    }
+    int node = -1;
+    struct dirent *d;
+    while((d = readdir(dir)) != NULL){
+        if(strncmp(d->d_name, "node", 4) == 0 && isdigit((unsigned char)d->d_name[4])){
+            node = atoi(d->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+/* Appends cpu to plan unless already present or not allowed for this process */
+static void plan_add(int *plan, int *count, int cpu, const cpu_set_t *allowed){
+    if(cpu < 0 || cpu >= MAX_CPUS || !CPU_ISSET(cpu, allowed)){
+        return;
+    }
+    for(int i = 0; i < *count; i++){
+        if(plan[i] == cpu){
+            return;
+        }
+    }
+    plan[(*count)++] = cpu;
+}
+
+/* Number of the count CPUs of plan that are not in taken */
+static int plan_count_free(const int *plan, int count, const cpu_set_t *taken){
+    int n = 0;
+    for(int i = 0; i < count; i++){
+        n += (taken == NULL || !CPU_ISSET(plan[i], taken));
+    }
+    return n;
+}
+
+/* Adds the CPUs handling the interrupts of the interface's device. The
+ * MSI vectors listed under the device are the RSS queue interrupts */
+static void plan_add_irq_cpus(int *plan, int *count, const char *if_name,
+        int node, const cpu_set_t *allowed){
+    char path[256];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/msi_irqs", if_name);
+    DIR *dir = opendir(path);
+    if(dir == NULL){
+        return;
+    }
+
+    /* Collect and sort the IRQ numbers so that queue order is kept */
+    int irqs[1024];
+    int num_irqs = 0;
+    struct dirent *d;
+    while((d = readdir(dir)) != NULL && num_irqs < 1024){
+        if(isdigit((unsigned char)d->d_name[0])){
+            irqs[num_irqs++] = atoi(d->d_name);
+        }
+    }
+    closedir(dir);
+    for(int i = 1; i < num_irqs; i++){
+        for(int j = i; j > 0 && irqs[j - 1] > irqs[j]; j--){
+            int tmp = irqs[j];
+            irqs[j] = irqs[j - 1];
+            irqs[j - 1] = tmp;
+        }
+    }
+
+    int cpus[MAX_CPUS];
+    for(int i = 0; i < num_irqs; i++){
+        snprintf(path, sizeof(path), "/proc/irq/%d/smp_affinity_list", irqs[i]);
+        int n = cpu_list_read(path, cpus, MAX_CPUS);
+        /* An IRQ allowed on every CPU doesn't tell us anything */
+        if(n <= 0 || n == CPU_COUNT(allowed)){
+            continue;
+        }
+        for(int c = 0; c < n; c++){
+            if(node < 0 || cpu_numa_node(cpus[c]) == node){
+                plan_add(plan, count, cpus[c], allowed);
+            }
+        }
+    }
+}
+
+/* Returns an array with one CPU per thread, or NULL when threads should
+ * not be pinned. spec is either a cpulist or CPU_AFFINITY_AUTO. CPUs in
+ * taken, which may be NULL, went to other threads already: they are
+ * only used again once the candidates run out. The CPUs of the plan
+ * are added to it */
+int *cpu_plan_create(const char *spec, const char *if_name, int num_threads, cpu_set_t *taken){
+    if(spec == NULL){
+        return NULL;
+    }
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0){
+        fprintf(stderr, "%s: could not get CPU affinity\n", strerror(errno));
+        return NULL;
+    }
+
+    int *candidates = (int *)malloc(MAX_CPUS * sizeof(int));
+    int num_candidates = 0;
+    int cpus[MAX_CPUS];
+
+    if(strcmp(spec, CPU_AFFINITY_AUTO) == 0){
+        int node = -1;
+        char path[256];
+        if(if_name != NULL){
+            snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", if_name);
+            if(read_int_file(path, &node) != 0){
+                node = -1;
+            }
+            plan_add_irq_cpus(candidates, &num_candidates, if_name, node, &allowed);
+        }
+        if(node >= 0){
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+            int n = cpu_list_read(path, cpus, MAX_CPUS);
+            for(int c = 0; c < n; c++){
+                plan_add(candidates, &num_candidates, cpus[c], &allowed);
+            }
+        }
+        /* Threads beyond the local node's free CPUs may go anywhere */
+        if(plan_count_free(candidates, num_candidates, taken) < num_threads){
+            int n = cpu_list_read("/sys/devices/system/cpu/online", cpus, MAX_CPUS);
+            for(int c = 0; c < n; c++){
+                plan_add(candidates, &num_candidates, cpus[c], &allowed);
+            }
+        }
+        fprintf(stderr, "CPU planner: interface %s is on NUMA node %d\n",
+                if_name != NULL ? if_name : "(none)", node);
+    } else {
+        int n = cpu_list_parse(spec, cpus, MAX_CPUS);
+        if(n <= 0){
+            fprintf(stderr, "error: invalid CPU list %s\n", spec);
+            free(candidates);
+            exit(255);
+        }
+        for(int c = 0; c < n; c++){
+            if(!CPU_ISSET(cpus[c], &allowed)){
+                fprintf(stderr, "Notice: CPU %d is not available, skipping it\n", cpus[c]);
+            }
+            plan_add(candidates, &num_candidates, cpus[c], &allowed);
+        }
+    }
+
+    if(num_candidates == 0){
+        fprintf(stderr, "Notice: no CPU available for pinning, threads are not pinned\n");
+        free(candidates);
+        return NULL;
+    }
+    int num_free = plan_count_free(candidates, num_candidates, taken);
+    if(num_free < num_threads){
+        fprintf(stderr, "Notice: %d threads share %d CPUs\n", num_threads,
+                num_free > 0 ? num_free : num_candidates);
+    }
+
+    /* The free CPUs in the order of preference, then the others */
+    int *plan = (int *)malloc(num_threads * sizeof(int));
+    int n = 0;
+    for(int c = 0; c < num_candidates && n < num_threads; c++){
+        if(taken == NULL || !CPU_ISSET(candidates[c], taken)){
+            plan[n++] = candidates[c];
+        }
+    }
+    for(int t = n; t < num_threads; t++){
+        plan[t] = (n > 0) ? plan[t % n] : candidates[t % num_candidates];
+    }
+    for(int t = 0; taken != NULL && t < num_threads; t++){
+        CPU_SET(plan[t], taken);
+    }
+    free(candidates);
+    return plan;
+}
+
+/* Moves the calling thread to cpu so that memory it touches is allocated
+ * on cpu's node. The previous affinity is stored in saved */
+int cpu_bind_current(int cpu, cpu_set_t *saved){
+    cpu_set_t set;
+    if(sched_getaffinity(0, sizeof(cpu_set_t), saved) != 0){
+        return -1;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(sched_setaffinity(0, sizeof(set), &set) != 0){
+        fprintf(stderr, "%s: could not move to CPU %d\n", strerror(errno), cpu);
+        return -1;
+    }
+    return 0;
+}
+
+void cpu_restore_current(cpu_set_t *saved){
+    if(sched_setaffinity(0, sizeof(cpu_set_t), saved) != 0){
+        fprintf(stderr, "%s: could not restore CPU affinity\n", strerror(errno));
+    }
+}
+
+/* Allocates zeroed page backed memory. The pages are touched by the
+ * caller so they land on the NUMA node the caller runs on */
+void *cpu_local_alloc(size_t size){
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ptr == MAP_FAILED){
+        return NULL;
+    }
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+void cpu_local_free(void *ptr, size_t size){
+    if(ptr != NULL){
+        munmap(ptr, size);
+    }
+}
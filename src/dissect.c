@@ -0,0 +1,522 @@
+/*
+ * dissect.c
+ *
+ * Application layer dissectors: HTTP requests and responses, DNS
+ * questions and TLS ClientHellos. A payload goes to the one dissector
+ * its ports or first bytes point to, which reads only the bytes it
+ * needs in a single pass and records where the fields are in the
+ * payload instead of copying them. The fields, and the JA3 fingerprint
+ * of a ClientHello, are rendered when the packet's record is built, so
+ * packets that are not logged do not pay for them. A payload cut short
+ * by the capture or by the segment it came in gives the fields found
+ * before the cut.
+ */
+
+/* The MD5 of the fingerprint uses a context on the stack, like sha512.c */
+#define OPENSSL_API_COMPAT 0x10100000L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include <openssl/md5.h>
+
+#include "include/dissect.h"
+#include "include/ascii_dump.h"
+
+#define DNS_PORT 53
+#define MDNS_PORT 5353
+#define LLMNR_PORT 5355
+#define DNS_HEADER_LEN 12
+#define DNS_MAX_NAME 255          /* Wire length of a name, root label included */
+#define DNS_MAX_LABEL 63
+
+#define TLS_RECORD_HEADER_LEN 5
+#define TLS_HANDSHAKE_HEADER_LEN 4
+#define TLS_RANDOM_LEN 32
+#define TLS_HANDSHAKE 22          /* Record content type */
+#define TLS_CLIENT_HELLO 1        /* Handshake type */
+#define TLS_EXT_SNI 0
+#define TLS_EXT_GROUPS 10
+#define TLS_EXT_POINT_FORMATS 11
+#define TLS_EXT_ALPN 16
+
+#define MD5_HEX_LENGTH (2 * MD5_DIGEST_LENGTH + 1)
+
+static const char *app_proto_names[] = {"none", "http", "dns", "tls"};
+
+static const struct {
+    const char *name;
+    uint32_t len;
+} http_methods[] = {
+    {"GET", 3}, {"POST", 4}, {"HEAD", 4}, {"PUT", 3}, {"DELETE", 6},
+    {"OPTIONS", 7}, {"PATCH", 5}, {"CONNECT", 7}, {"TRACE", 5}
+};
+
+static inline uint16_t load_be16(const uint8_t *p){
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t load_be24(const uint8_t *p){
+    return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+}
+
+/* Text field of len bytes at p, cut to what a record shows */
+static inline struct app_span text_span(const uint8_t *payload, const uint8_t *p, uint32_t len){
+    struct app_span s = {(uint32_t)(p - payload), (len < DISSECT_FIELD_MAX) ? len : DISSECT_FIELD_MAX};
+    return s;
+}
+
+/* Parses a comma separated list of http, dns and tls, or all, into a
+ * bit set of enum app_proto. No spec dissects nothing */
+int dissect_config_parse(const char *spec, uint32_t *protos){
+    *protos = 0;
+    if(spec == NULL){
+        return 0;
+    }
+    const char *p = spec;
+    while(*p != '\0'){
+        size_t n = strcspn(p, ",");
+        if(n == 3 && strncmp(p, "all", n) == 0){
+            *protos |= DISSECT_ALL;
+        } else {
+            int proto = APP_NONE;
+            for(int k = APP_HTTP; k <= APP_TLS; k++){
+                if(strlen(app_proto_names[k]) == n && strncmp(p, app_proto_names[k], n) == 0){
+                    proto = k;
+                }
+            }
+            if(proto == APP_NONE){
+                fprintf(stderr, "error: unknown dissector %.*s in %s (http, dns, tls or all)\n",
+                        (int)n, p, spec);
+                return -1;
+            }
+            *protos |= 1u << proto;
+        }
+        p += (p[n] == ',') ? n + 1 : n;
+    }
+    if(*protos == 0){
+        fprintf(stderr, "error: no dissector in %s\n", spec);
+        return -1;
+    }
+    return 0;
+}
+
+const char *app_proto_name(int proto){
+    return (proto >= APP_NONE && proto <= APP_TLS) ? app_proto_names[proto] : "unknown";
+}
+
+/* End of the line starting at p: its LF, or end when it is cut short */
+static inline const uint8_t *line_end(const uint8_t *p, const uint8_t *end){
+    const uint8_t *lf = (const uint8_t *)memchr(p, '\n', end - p);
+    return (lf != NULL) ? lf : end;
+}
+
+/* Before the LF at e and the CR preceding it, if any */
+static inline const uint8_t *line_trim(const uint8_t *p, const uint8_t *e){
+    return (e > p && e[-1] == '\r') ? e - 1 : e;
+}
+
+static inline int is_digit(uint8_t c){
+    return c >= '0' && c <= '9';
+}
+
+/* A request line, method SP URI [SP HTTP/x.y], with its Host header,
+ * or the status line of a response */
+static int dissect_http(const uint8_t *payload, uint32_t len, struct app_fields *af){
+    const uint8_t *end = payload + len;
+    if(len >= 12 && memcmp(payload, "HTTP/1.", 7) == 0 && payload[8] == ' ' &&
+            is_digit(payload[9]) && is_digit(payload[10]) && is_digit(payload[11])){
+        af->http.status = (payload[9] - '0') * 100 + (payload[10] - '0') * 10 + (payload[11] - '0');
+        return APP_HTTP;
+    }
+
+    uint32_t method_len = 0;
+    for(size_t k = 0; k < sizeof(http_methods) / sizeof(http_methods[0]); k++){
+        if(len > http_methods[k].len && payload[http_methods[k].len] == ' ' &&
+                memcmp(payload, http_methods[k].name, http_methods[k].len) == 0){
+            method_len = http_methods[k].len;
+            break;
+        }
+    }
+    if(method_len == 0){
+        return APP_NONE;
+    }
+    const uint8_t *uri = payload + method_len + 1;
+    const uint8_t *eol = line_end(uri, end);
+    const uint8_t *line = line_trim(uri, eol);
+    const uint8_t *sp = (const uint8_t *)memchr(uri, ' ', line - uri);
+    const uint8_t *uri_end = (sp != NULL) ? sp : line;
+    if(uri_end == uri){
+        return APP_NONE;
+    }
+    if(sp != NULL){
+        /* The version, as far as it was captured */
+        size_t n = (line - sp - 1 < 5) ? line - sp - 1 : 5;
+        if(memcmp(sp + 1, "HTTP/", n) != 0){
+            return APP_NONE;
+        }
+    }
+    af->http.method = text_span(payload, payload, method_len);
+    af->http.uri = text_span(payload, uri, uri_end - uri);
+
+    /* Headers, up to the empty line ending them */
+    for(const uint8_t *p = eol + 1; p < end; ){
+        const uint8_t *e = line_end(p, end);
+        const uint8_t *le = line_trim(p, e);
+        if(le == p){
+            break;
+        }
+        if(le - p >= 5 && strncasecmp((const char *)p, "host:", 5) == 0){
+            const uint8_t *v = p + 5;
+            while(v < le && (*v == ' ' || *v == '\t')){
+                v++;
+            }
+            const uint8_t *ve = le;
+            while(ve > v && (ve[-1] == ' ' || ve[-1] == '\t')){
+                ve--;
+            }
+            af->http.host = text_span(payload, v, ve - v);
+            break;
+        }
+        p = e + 1;
+    }
+    return APP_HTTP;
+}
+
+static inline int is_dns_port(uint16_t port){
+    return port == DNS_PORT || port == MDNS_PORT || port == LLMNR_PORT;
+}
+
+/* The header and first question of the DNS message of len bytes at
+ * msg, which is in payload */
+static int dissect_dns(const uint8_t *payload, const uint8_t *msg, uint32_t len,
+        struct app_fields *af){
+    if(len < DNS_HEADER_LEN + 1 + 2){
+        return APP_NONE;
+    }
+    uint16_t flags = load_be16(msg + 2);
+    uint16_t qdcount = load_be16(msg + 4);
+    if(qdcount == 0){
+        return APP_NONE;
+    }
+    const uint8_t *name = msg + DNS_HEADER_LEN, *end = msg + len;
+    const uint8_t *p = name;
+    while(1){
+        if(p >= end){
+            return APP_NONE;
+        }
+        /* Compression pointers do not start the first name */
+        if(*p > DNS_MAX_LABEL){
+            return APP_NONE;
+        }
+        if(*p == 0){
+            break;
+        }
+        p += 1 + *p;
+        if(p - name >= DNS_MAX_NAME){
+            return APP_NONE;
+        }
+    }
+    p++;
+    if(end - p < 2){
+        return APP_NONE;
+    }
+    af->dns.qname.off = name - payload;
+    af->dns.qname.len = p - name;
+    af->dns.qtype = load_be16(p);
+    af->dns.rcode = flags & 0x0f;
+    af->dns.response = flags >> 15;
+    return APP_DNS;
+}
+
+/* The version, cipher suites, extensions, server name and ALPN list of
+ * a ClientHello. A hello cut short keeps the fields read before the
+ * cut, and gets no fingerprint */
+static int dissect_tls(const uint8_t *payload, uint32_t len, struct app_fields *af){
+    const uint32_t fixed = TLS_RECORD_HEADER_LEN + TLS_HANDSHAKE_HEADER_LEN + 2 + TLS_RANDOM_LEN + 1;
+    if(len < fixed || payload[0] != TLS_HANDSHAKE || payload[1] != 3 ||
+            payload[TLS_RECORD_HEADER_LEN] != TLS_CLIENT_HELLO){
+        return APP_NONE;
+    }
+    uint32_t record_len = load_be16(payload + 3);
+    uint32_t hello_len = load_be24(payload + TLS_RECORD_HEADER_LEN + 1);
+    const uint8_t *p = payload + TLS_RECORD_HEADER_LEN + TLS_HANDSHAKE_HEADER_LEN;
+    const uint8_t *end = p + hello_len;
+    int complete = hello_len + TLS_HANDSHAKE_HEADER_LEN <= record_len && end <= payload + len;
+    if(end > payload + len){
+        end = payload + len;
+    }
+
+    af->tls.version = load_be16(p);
+    p += 2 + TLS_RANDOM_LEN;
+    p += 1 + p[0];                              /* Session id */
+    if(end - p < 2){
+        return APP_TLS;
+    }
+    uint32_t n = load_be16(p);
+    p += 2;
+    if(end - p < n){
+        return APP_TLS;
+    }
+    af->tls.ciphers.off = p - payload;
+    af->tls.ciphers.len = n;
+    p += n;
+    if(end - p < 1 || end - p < 1 + p[0]){
+        return APP_TLS;
+    }
+    p += 1 + p[0];                              /* Compression methods */
+    if(end - p < 2){
+        /* A hello may end before the extensions */
+        af->tls.complete = complete && p == end;
+        return APP_TLS;
+    }
+    n = load_be16(p);
+    p += 2;
+    const uint8_t *ext_end = (end - p < n) ? end : p + n;
+    complete = complete && ext_end == p + n;
+    af->tls.extensions.off = p - payload;
+    af->tls.extensions.len = ext_end - p;
+
+    while(ext_end - p >= 4){
+        uint16_t type = load_be16(p);
+        uint32_t ext_len = load_be16(p + 2);
+        const uint8_t *d = p + 4;
+        if(ext_end - d < ext_len){
+            complete = 0;
+            break;
+        }
+        /* server_name_list: the first name, if a host name */
+        if(type == TLS_EXT_SNI && ext_len >= 5 && d[2] == 0 && 5 + load_be16(d + 3) <= ext_len){
+            af->tls.sni = text_span(payload, d + 5, load_be16(d + 3));
+        } else if(type == TLS_EXT_ALPN && ext_len >= 2 && 2 + load_be16(d) <= ext_len){
+            af->tls.alpn = text_span(payload, d + 2, load_be16(d));
+        }
+        p = d + ext_len;
+    }
+    af->tls.complete = complete && p == ext_end;
+    return APP_TLS;
+}
+
+/* Runs the dissector the ports and first bytes of the len bytes of
+ * payload at payload point to, among the protos set, and fills af.
+ * Returns the enum app_proto of what was found, APP_NONE if nothing */
+int dissect_payload(const uint8_t *payload, uint32_t len, uint8_t protocol,
+        uint16_t sport, uint16_t dport, uint32_t protos, struct app_fields *af){
+    memset(af, 0, sizeof(struct app_fields));
+    if(len == 0){
+        return APP_NONE;
+    }
+    int dns = (protos & (1u << APP_DNS)) && (is_dns_port(sport) || is_dns_port(dport));
+    int proto = APP_NONE;
+    if(protocol == IPPROTO_UDP){
+        if(dns){
+            proto = dissect_dns(payload, payload, len, af);
+        }
+    } else if(protocol == IPPROTO_TCP){
+        if(dns){
+            /* Messages on TCP come after their length */
+            if(len > 2){
+                proto = dissect_dns(payload, payload + 2, len - 2, af);
+            }
+        } else if(payload[0] == TLS_HANDSHAKE){
+            if(protos & (1u << APP_TLS)){
+                proto = dissect_tls(payload, len, af);
+            }
+        } else if(payload[0] >= 'A' && payload[0] <= 'Z'){
+            if(protos & (1u << APP_HTTP)){
+                proto = dissect_http(payload, len, af);
+            }
+        }
+    }
+    if(proto == APP_NONE){
+        memset(af, 0, sizeof(struct app_fields));
+    }
+    af->proto = proto;
+    return proto;
+}
+
+/* Appends "name":"<printable view of s>", when s is not empty */
+static size_t put_text(char *out, size_t len, size_t size, const char *name,
+        const uint8_t *payload, struct app_span s){
+    if(s.len == 0 || len + strlen(name) + s.len + 7 > size){
+        return len;
+    }
+    len += sprintf(out + len, "\"%s\":\"", name);
+    len += ascii_dump_scalar(payload + s.off, s.len, out + len);
+    len += sprintf(out + len, "\",");
+    return len;
+}
+
+/* Names of the DNS qname with dots between their labels, "." for the root */
+static size_t put_qname(char *out, size_t len, size_t size, const uint8_t *payload,
+        struct app_span s){
+    uint8_t name[DNS_MAX_NAME];
+    uint32_t n = 0;
+    for(const uint8_t *p = payload + s.off; *p != 0; p += 1 + *p){
+        if(n > 0){
+            name[n++] = '.';
+        }
+        memcpy(name + n, p + 1, *p);
+        n += *p;
+    }
+    if(n == 0){
+        name[n++] = '.';
+    }
+    struct app_span text = {0, n};
+    return put_text(out, len, size, "dns_qname", name, text);
+}
+
+/* Appends the ALPN protocol names as a JSON list, leaving out a name
+ * cut by the end of the span */
+static size_t put_alpn(char *out, size_t len, size_t size, const uint8_t *payload,
+        struct app_span s){
+    /* Every name is at least one byte after its length */
+    if(s.len == 0 || len + 2 * s.len + 16 > size){
+        return len;
+    }
+    len += sprintf(out + len, "\"tls_alpn\":[");
+    const uint8_t *p = payload + s.off, *end = p + s.len;
+    int first = 1;
+    while(p < end && end - p - 1 >= *p){
+        if(*p > 0){
+            len += sprintf(out + len, first ? "\"" : ",\"");
+            len += ascii_dump_scalar(p + 1, *p, out + len);
+            out[len++] = '"';
+            first = 0;
+        }
+        p += 1 + *p;
+    }
+    len += sprintf(out + len, "],");
+    return len;
+}
+
+/* GREASE values (RFC 8701) are left out of fingerprints */
+static inline int is_grease(uint16_t v){
+    return (v & 0x0f0f) == 0x0a0a && (v >> 8) == (v & 0xff);
+}
+
+/* The fingerprint text is digested as it is built, a buffer at a time */
+struct ja3_digest {
+    MD5_CTX ctx;
+    char buf[256];
+    uint32_t len;
+    int first;                /* No '-' before the next value of a list */
+};
+
+static void ja3_flush(struct ja3_digest *d){
+    MD5_Update(&(d->ctx), d->buf, d->len);
+    d->len = 0;
+}
+
+/* Starts a field, with the ',' separating it from the previous one */
+static void ja3_field(struct ja3_digest *d){
+    if(d->len + 1 > sizeof(d->buf)){
+        ja3_flush(d);
+    }
+    d->buf[d->len++] = ',';
+    d->first = 1;
+}
+
+static void ja3_value(struct ja3_digest *d, uint32_t v){
+    if(d->len + 8 > sizeof(d->buf)){
+        ja3_flush(d);
+    }
+    d->len += sprintf(d->buf + d->len, d->first ? "%u" : "-%u", v);
+    d->first = 0;
+}
+
+/* Values of width 1 or 2 bytes in the n bytes at p */
+static void ja3_list(struct ja3_digest *d, const uint8_t *p, uint32_t n, int width){
+    for(uint32_t k = 0; k + width <= n; k += width){
+        uint16_t v = (width == 2) ? load_be16(p + k) : p[k];
+        if(width == 1 || !is_grease(v)){
+            ja3_value(d, v);
+        }
+    }
+}
+
+/* Writes the JA3 fingerprint of a complete ClientHello, the MD5 of
+ * version,ciphers,extensions,groups,point formats with the values of
+ * each list joined by '-', as hex */
+static void tls_ja3(const struct app_fields *af, const uint8_t *payload, char *hex){
+    struct ja3_digest d;
+    MD5_Init(&(d.ctx));
+    d.len = 0;
+    d.first = 1;
+    ja3_value(&d, af->tls.version);
+    ja3_field(&d);
+    ja3_list(&d, payload + af->tls.ciphers.off, af->tls.ciphers.len, 2);
+
+    const uint8_t *ext = payload + af->tls.extensions.off;
+    const uint8_t *ext_end = ext + af->tls.extensions.len;
+    const uint8_t *groups = NULL, *formats = NULL;
+    uint32_t groups_len = 0, formats_len = 0;
+    ja3_field(&d);
+    for(const uint8_t *p = ext; ext_end - p >= 4; p += 4 + load_be16(p + 2)){
+        uint16_t type = load_be16(p);
+        uint32_t ext_len = load_be16(p + 2);
+        if(!is_grease(type)){
+            ja3_value(&d, type);
+        }
+        if(type == TLS_EXT_GROUPS && ext_len >= 2){
+            groups = p + 6;
+            groups_len = load_be16(p + 4);
+            groups_len = (groups_len <= ext_len - 2) ? groups_len : 0;
+        } else if(type == TLS_EXT_POINT_FORMATS && ext_len >= 1){
+            formats = p + 5;
+            formats_len = p[4];
+            formats_len = (formats_len <= ext_len - 1) ? formats_len : 0;
+        }
+    }
+    ja3_field(&d);
+    ja3_list(&d, groups, groups_len, 2);
+    ja3_field(&d);
+    ja3_list(&d, formats, formats_len, 1);
+    ja3_flush(&d);
+
+    unsigned char md[MD5_DIGEST_LENGTH];
+    MD5_Final(md, &(d.ctx));
+    for(int k = 0; k < MD5_DIGEST_LENGTH; k++){
+        sprintf(hex + 2 * k, "%02x", md[k]);
+    }
+}
+
+/* Writes the fields of af, found in payload, to out as JSON members
+ * each followed by a ',', in at most size bytes with the terminating
+ * NUL, and returns their length. DISSECT_JSON_MAX bytes are enough */
+size_t app_fields_json(const struct app_fields *af, const uint8_t *payload,
+        char *out, size_t size){
+    size_t len = 0;
+    if(af->proto == APP_NONE || size < 64){
+        return 0;
+    }
+    len += sprintf(out, "\"app\":\"%s\",", app_proto_name(af->proto));
+    switch(af->proto){
+    case APP_HTTP:
+        if(af->http.status != 0){
+            len += sprintf(out + len, "\"http_status\":%u,", af->http.status);
+        }
+        len = put_text(out, len, size, "http_method", payload, af->http.method);
+        len = put_text(out, len, size, "http_host", payload, af->http.host);
+        len = put_text(out, len, size, "http_uri", payload, af->http.uri);
+        break;
+    case APP_DNS:
+        len = put_qname(out, len, size, payload, af->dns.qname);
+        len += snprintf(out + len, size - len, "\"dns_qtype\":%u,\"dns_rcode\":%u,\"dns_response\":%u,",
+                af->dns.qtype, af->dns.rcode, af->dns.response);
+        break;
+    case APP_TLS:
+        len += snprintf(out + len, size - len, "\"tls_version\":%u,", af->tls.version);
+        len = put_text(out, len, size, "tls_sni", payload, af->tls.sni);
+        len = put_alpn(out, len, size, payload, af->tls.alpn);
+        if(af->tls.complete && len + MD5_HEX_LENGTH + 10 <= size){
+            char ja3[MD5_HEX_LENGTH];
+            tls_ja3(af, payload, ja3);
+            len += sprintf(out + len, "\"ja3\":\"%s\",", ja3);
+        }
+        break;
+    }
+    return len;
+}
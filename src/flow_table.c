@@ -0,0 +1,426 @@
+/*
+ * flow_table.c
+ *
+ * Per flow counters, kept by each processing thread for the packets it
+ * handles. With flow affine fanout a flow only ever reaches one thread,
+ * so the tables need no lock. A table is an open addressing hash table
+ * with Robin Hood probing, one array per field: a lookup walks the
+ * short probe distance and hash arrays and only reads a key on a hash
+ * match. The hash is that of the key alone: the kernel's rxhash would
+ * differ between the fragmented and whole datagrams of a flow, or
+ * between packets captured with and without it. Flows end on a timer
+ * wheel with a slot per second, driven by the capture time of the
+ * packets, and their record goes to a callback.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "include/flow_table.h"
+#include "include/sniffer.h"
+#include "include/cpu_affinity.h"
+
+#define FLOW_WHEEL_SLOTS 4096   /* Seconds, a power of two above FLOW_TABLE_MAX_TIMEOUT */
+#define FLOW_MIN_CAPACITY 64
+#define FLOW_NIL UINT32_MAX
+
+/* The columns of the table, each also a field of struct flow_row */
+#define FOR_EACH_FLOW_COLUMN(DO) \
+    DO(dist) DO(hash) DO(key) DO(timer) \
+    DO(packets) DO(bytes) DO(first_ns) DO(last_ns) DO(dup_packets) DO(tcp_flags)
+
+/* A flow while it moves between slots */
+struct flow_row {
+    uint16_t dist;              /* Probe distance + 1, 0 for an empty slot */
+    uint32_t hash;
+    struct flow_key key;
+    uint32_t timer;             /* Its node on the timer wheel */
+    uint64_t packets, bytes;
+    uint64_t first_ns, last_ns;
+    uint64_t dup_packets;
+    uint8_t tcp_flags;
+};
+
+/* A flow's entry on the wheel. Flows move between slots of the table
+ * as others come and go, their timer does not, so the wheel's lists
+ * are never touched by a move */
+struct flow_timer {
+    uint32_t flow;              /* Slot of the flow in the table */
+    uint32_t next;              /* In the wheel slot, or of the free timers */
+};
+
+struct flow_table {
+    struct flow_table_config fc;
+    uint64_t seed;              /* Of the key hash, so that slots can not be aimed at */
+    uint8_t *base;              /* The columns and timers live in this mapping */
+    size_t size;
+    uint32_t capacity;          /* Slots, a power of two */
+    uint32_t mask;
+    uint32_t count;
+    uint32_t max_count;         /* Load limit, flows are evicted past it */
+    uint16_t *dist;
+    uint32_t *hash;
+    struct flow_key *key;
+    uint32_t *timer;
+    uint64_t *packets, *bytes;
+    uint64_t *first_ns, *last_ns;
+    uint64_t *dup_packets;
+    uint8_t *tcp_flags;
+    struct flow_timer *timers;
+    uint32_t free_timer;
+    uint32_t wheel[FLOW_WHEEL_SLOTS]; /* First timer of each second */
+    uint64_t cursor;            /* Next second of the wheel to run, 0 before the first flow */
+    struct flow_table_stats stats;
+};
+
+static void count(uint64_t *counter){
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+static size_t round_up(size_t size){
+    return (size + 63) & ~(size_t)63;
+}
+
+/* Parses a flow table spec of the form <flows>[,<idle>s[,<active>s]],
+ * for example "65536" or "65536,30s,600s": the flows each thread tracks
+ * at once, and when flows get their record. A NULL spec turns flow
+ * tracking off */
+int flow_table_config_parse(const char *spec, struct flow_table_config *fc){
+    fc->flows = 0;
+    fc->idle = FLOW_TABLE_DEFAULT_IDLE;
+    fc->active = FLOW_TABLE_DEFAULT_ACTIVE;
+    if(spec == NULL){
+        return 0;
+    }
+
+    char buffer[128];
+    strncpy(buffer, spec, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+    char *saveptr, *end;
+    char *token = strtok_r(buffer, ",", &saveptr);
+    long flows = (token != NULL) ? strtol(token, &end, 10) : -1;
+    if(token == NULL || *end != '\0' || flows <= 0 || flows > (1L << 28)){
+        fprintf(stderr, "error: invalid number of flows in %s\n", spec);
+        return -1;
+    }
+    fc->flows = flows;
+
+    uint32_t *timeouts[2] = {&(fc->idle), &(fc->active)};
+    for(int t = 0; (token = strtok_r(NULL, ",", &saveptr)) != NULL; t++){
+        long seconds = strtol(token, &end, 10);
+        if(t > 1 || end == token || strcmp(end, "s") != 0 || seconds <= 0 ||
+                seconds > FLOW_TABLE_MAX_TIMEOUT){
+            fprintf(stderr, "error: invalid flow timeout %s, expected 1s to %ds\n",
+                    token, FLOW_TABLE_MAX_TIMEOUT);
+            return -1;
+        }
+        *(timeouts[t]) = seconds;
+    }
+    return 0;
+}
+
+/* Creates the table of a thread, for fc->flows flows. It should be
+ * called on the CPU of the thread that will use it */
+struct flow_table *flow_table_create(const struct flow_table_config *fc){
+    struct flow_table *ft = (struct flow_table *)calloc(1, sizeof(struct flow_table));
+    if(ft == NULL){
+        return NULL;
+    }
+    ft->fc = *fc;
+
+    /* Probe sequences stay short below 7/8 full */
+    ft->capacity = FLOW_MIN_CAPACITY;
+    while(ft->capacity - ft->capacity / 8 < fc->flows){
+        ft->capacity <<= 1;
+    }
+    ft->mask = ft->capacity - 1;
+    ft->max_count = ft->capacity - ft->capacity / 8;
+
+    const struct flow_row *r = NULL;
+    ft->size = 0;
+#define COLUMN_SIZE(col) ft->size += round_up(ft->capacity * sizeof(r->col));
+    FOR_EACH_FLOW_COLUMN(COLUMN_SIZE)
+#undef COLUMN_SIZE
+    ft->size += round_up(ft->capacity * sizeof(struct flow_timer));
+    ft->base = (uint8_t *)cpu_local_alloc(ft->size);
+    if(ft->base == NULL){
+        free(ft);
+        return NULL;
+    }
+    size_t off = 0;
+#define COLUMN_CARVE(col) \
+    ft->col = (__typeof__(ft->col))(ft->base + off); \
+    off += round_up(ft->capacity * sizeof(r->col));
+    FOR_EACH_FLOW_COLUMN(COLUMN_CARVE)
+#undef COLUMN_CARVE
+    ft->timers = (struct flow_timer *)(ft->base + off);
+
+    memset(ft->dist, 0, ft->capacity * sizeof(uint16_t));
+    for(uint32_t t = 0; t < ft->capacity; t++){
+        ft->timers[t].next = (t + 1 < ft->capacity) ? t + 1 : FLOW_NIL;
+    }
+    ft->free_timer = 0;
+    memset(ft->wheel, 0xff, sizeof(ft->wheel));
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ft->seed = ((uint64_t)ts.tv_sec << 32) ^ ts.tv_nsec ^ (uint64_t)(uintptr_t)ft;
+    return ft;
+}
+
+void flow_table_free(struct flow_table *ft){
+    if(ft == NULL){
+        return;
+    }
+    cpu_local_free(ft->base, ft->size);
+    free(ft);
+}
+
+static void row_load(const struct flow_table *ft, uint32_t slot, struct flow_row *r){
+#define COLUMN_LOAD(col) r->col = ft->col[slot];
+    FOR_EACH_FLOW_COLUMN(COLUMN_LOAD)
+#undef COLUMN_LOAD
+}
+
+static void row_store(struct flow_table *ft, uint32_t slot, const struct flow_row *r){
+#define COLUMN_STORE(col) ft->col[slot] = r->col;
+    FOR_EACH_FLOW_COLUMN(COLUMN_STORE)
+#undef COLUMN_STORE
+    ft->timers[r->timer].flow = slot;
+}
+
+static uint32_t key_hash(const struct flow_table *ft, const struct flow_key *key){
+    uint64_t h = ft->seed;
+    for(size_t off = 0; off < sizeof(struct flow_key); off += sizeof(uint64_t)){
+        uint64_t w;
+        memcpy(&w, (const uint8_t *)key + off, sizeof(w));
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    return (uint32_t)h;
+}
+
+/* The key and hash of packet i of b */
+static uint32_t row_key(const struct flow_table *ft, const struct packet_batch *b, uint32_t i,
+        struct flow_key *key){
+    memset(key, 0, sizeof(struct flow_key));
+    if(b->ip_version[i] == 6){
+        memcpy(key->addr, b->ip6_addr[i], 32);
+    } else {
+        memcpy(key->addr, &(b->ip_src[i]), 4);
+        memcpy(key->addr + 16, &(b->ip_dst[i]), 4);
+    }
+    key->sport = b->sport[i];
+    key->dport = b->dport[i];
+    key->vlan_id = b->vlan_id[i];
+    key->if_id = b->if_id;
+    key->version = b->ip_version[i];
+    key->protocol = b->protocol[i];
+    return key_hash(ft, key);
+}
+
+/* Slot of the flow, FLOW_NIL if it is not in the table. A flow sits no
+ * further from its home slot than the flows it passes */
+static uint32_t flow_find(const struct flow_table *ft, uint32_t hash, const struct flow_key *key){
+    uint32_t slot = hash & ft->mask;
+    for(uint32_t dist = 1; ft->dist[slot] >= dist; dist++){
+        if(ft->hash[slot] == hash && memcmp(&(ft->key[slot]), key, sizeof(struct flow_key)) == 0){
+            return slot;
+        }
+        slot = (slot + 1) & ft->mask;
+    }
+    return FLOW_NIL;
+}
+
+/* Puts timer t on the wheel for the second deadline, or for the next
+ * second run if that one is past */
+static void timer_arm(struct flow_table *ft, uint32_t t, uint64_t deadline){
+    uint32_t slot = ((deadline < ft->cursor) ? ft->cursor : deadline) & (FLOW_WHEEL_SLOTS - 1);
+    ft->timers[t].next = ft->wheel[slot];
+    ft->wheel[slot] = t;
+}
+
+/* Takes the flow in slot out of the table. The flows after it that are
+ * away from their home slot move back by one */
+static void flow_delete(struct flow_table *ft, uint32_t slot){
+    ft->timers[ft->timer[slot]].next = ft->free_timer;
+    ft->free_timer = ft->timer[slot];
+    uint32_t next = (slot + 1) & ft->mask;
+    while(ft->dist[next] > 1){
+        struct flow_row r;
+        row_load(ft, next, &r);
+        r.dist--;
+        row_store(ft, slot, &r);
+        slot = next;
+        next = (next + 1) & ft->mask;
+    }
+    ft->dist[slot] = 0;
+    ft->count--;
+}
+
+/* Hands the record of the flow in slot to emit and deletes the flow */
+static void flow_end(struct flow_table *ft, uint32_t slot, int reason,
+        flow_record_fn emit, void *ctx){
+    struct flow_record rec;
+    rec.key = ft->key[slot];
+    rec.packets = ft->packets[slot];
+    rec.bytes = ft->bytes[slot];
+    rec.first_ns = ft->first_ns[slot];
+    rec.last_ns = ft->last_ns[slot];
+    rec.dup_packets = ft->dup_packets[slot];
+    rec.tcp_flags = ft->tcp_flags[slot];
+    rec.end_reason = reason;
+    flow_delete(ft, slot);
+    count(&(ft->stats.records));
+    emit(ctx, &rec);
+}
+
+/* Ends a flow to make room: one of the first due on the wheel */
+static void flow_evict(struct flow_table *ft, flow_record_fn emit, void *ctx){
+    for(uint32_t k = 0; k < FLOW_WHEEL_SLOTS; k++){
+        uint32_t slot = (ft->cursor + k) & (FLOW_WHEEL_SLOTS - 1);
+        uint32_t t = ft->wheel[slot];
+        if(t != FLOW_NIL){
+            ft->wheel[slot] = ft->timers[t].next;
+            count(&(ft->stats.evicted));
+            flow_end(ft, ft->timers[t].flow, FLOW_END_RESOURCES, emit, ctx);
+            return;
+        }
+    }
+}
+
+/* Adds a new flow and returns its slot. Flows are placed ahead of those
+ * closer to their home slot, which then move on */
+static uint32_t flow_insert(struct flow_table *ft, uint32_t hash, const struct flow_key *key,
+        uint64_t ts_ns){
+    struct flow_row r;
+    memset(&r, 0, sizeof(r));
+    r.dist = 1;
+    r.hash = hash;
+    r.key = *key;
+    r.timer = ft->free_timer;
+    ft->free_timer = ft->timers[r.timer].next;
+    r.first_ns = r.last_ns = ts_ns;
+    if(ft->cursor == 0){
+        ft->cursor = ts_ns / 1000000000ULL;
+    }
+    timer_arm(ft, r.timer, ts_ns / 1000000000ULL +
+            ((ft->fc.idle < ft->fc.active) ? ft->fc.idle : ft->fc.active));
+
+    uint32_t slot = hash & ft->mask, placed = FLOW_NIL;
+    for(;;){
+        if(ft->dist[slot] == 0){
+            row_store(ft, slot, &r);
+            break;
+        }
+        if(ft->dist[slot] < r.dist){
+            struct flow_row richer;
+            row_load(ft, slot, &richer);
+            row_store(ft, slot, &r);
+            r = richer;
+            placed = (placed == FLOW_NIL) ? slot : placed;
+        }
+        slot = (slot + 1) & ft->mask;
+        r.dist++;
+    }
+    ft->count++;
+    count(&(ft->stats.flows));
+    return (placed == FLOW_NIL) ? slot : placed;
+}
+
+/* Counts the valid packets of b, parsed already, in their flows. emit
+ * gets the records of the flows evicted to make room for new ones, and
+ * of those that ended before a packet, so that a packet never counts
+ * in a flow that timed out ahead of it */
+void flow_table_update(struct flow_table *ft, const struct packet_batch *b,
+        flow_record_fn emit, void *ctx){
+    for(uint32_t i = 0; i < b->count; i++){
+        if(!b->is_valid[i]){
+            continue;
+        }
+        struct flow_key key;
+        uint32_t hash = row_key(ft, b, i, &key);
+        uint64_t ts_ns = b->ts_sec[i] * 1000000000ULL + b->ts_nsec[i];
+        if(b->ts_sec[i] >= ft->cursor && ft->cursor != 0){
+            flow_table_expire(ft, ts_ns, emit, ctx);
+        }
+        uint32_t slot = flow_find(ft, hash, &key);
+        if(slot == FLOW_NIL){
+            if(ft->count == ft->max_count){
+                flow_evict(ft, emit, ctx);
+            }
+            slot = flow_insert(ft, hash, &key, ts_ns);
+        }
+        ft->packets[slot]++;
+        ft->bytes[slot] += b->len[i];
+        ft->tcp_flags[slot] |= b->tcp_flags[i]; // 0 for UDP
+        ft->last_ns[slot] = (ts_ns > ft->last_ns[slot]) ? ts_ns : ft->last_ns[slot];
+    }
+}
+
+/* Counts packet i of b, found in the bloom filter, as a duplicate of
+ * its flow */
+void flow_table_count_dup(struct flow_table *ft, const struct packet_batch *b, uint32_t i){
+    struct flow_key key;
+    uint32_t hash = row_key(ft, b, i, &key);
+    uint32_t slot = flow_find(ft, hash, &key);
+    if(slot != FLOW_NIL){
+        ft->dup_packets[slot]++;
+    }
+}
+
+/* Ends the flows idle for the idle timeout, or active for the active
+ * timeout, as of the capture time now_ns. Timers sit in the slot of the
+ * second their flow would end without more packets; a flow that got
+ * packets since is put back on the wheel for its new deadline */
+void flow_table_expire(struct flow_table *ft, uint64_t now_ns, flow_record_fn emit, void *ctx){
+    uint64_t now = now_ns / 1000000000ULL;
+    if(ft->cursor == 0){
+        return;
+    }
+    /* After a jump in time, a single turn of the wheel sees every timer */
+    for(uint32_t turns = 0; ft->cursor <= now && turns < FLOW_WHEEL_SLOTS; turns++){
+        uint32_t wslot = ft->cursor & (FLOW_WHEEL_SLOTS - 1);
+        uint32_t t = ft->wheel[wslot];
+        ft->wheel[wslot] = FLOW_NIL;
+        ft->cursor++;
+        while(t != FLOW_NIL){
+            uint32_t next = ft->timers[t].next;
+            uint32_t slot = ft->timers[t].flow;
+            uint64_t idle_end = ft->last_ns[slot] / 1000000000ULL + ft->fc.idle;
+            uint64_t active_end = ft->first_ns[slot] / 1000000000ULL + ft->fc.active;
+            if(idle_end <= now || active_end <= now){
+                flow_end(ft, slot, (idle_end <= now) ? FLOW_END_IDLE : FLOW_END_ACTIVE, emit, ctx);
+            } else {
+                timer_arm(ft, t, (idle_end < active_end) ? idle_end : active_end);
+            }
+            t = next;
+        }
+    }
+    if(ft->cursor <= now){
+        ft->cursor = now + 1;
+    }
+}
+
+/* Ends every flow, when the sniffer stops */
+void flow_table_flush(struct flow_table *ft, flow_record_fn emit, void *ctx){
+    for(uint32_t wslot = 0; wslot < FLOW_WHEEL_SLOTS; wslot++){
+        uint32_t t;
+        while((t = ft->wheel[wslot]) != FLOW_NIL){
+            ft->wheel[wslot] = ft->timers[t].next;
+            flow_end(ft, ft->timers[t].flow, FLOW_END_FORCED, emit, ctx);
+        }
+    }
+}
+
+/* Adds the counters of ft, which may be NULL, to sum */
+void flow_table_stats_add(const struct flow_table *ft, struct flow_table_stats *sum){
+    if(ft == NULL){
+        return;
+    }
+    sum->flows += __atomic_load_n(&(ft->stats.flows), __ATOMIC_RELAXED);
+    sum->records += __atomic_load_n(&(ft->stats.records), __ATOMIC_RELAXED);
+    sum->evicted += __atomic_load_n(&(ft->stats.evicted), __ATOMIC_RELAXED);
+}
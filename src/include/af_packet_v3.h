@@ -1,12 +1,152 @@
 /*
  * af_packet_v3.h
  *
- * Header library for af_packet_v3.c 
+ * Header library for af_packet_v3.c
  */
 
 #ifndef AF_PACKET_V3_H
 #define AF_PACKET_V3_H
 
+#include <pthread.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+
+#include "sniffer.h"
+#include "json_file_io.h"
+#include "bloom_filter.h"
+#include "block_queue.h"
+#include "capture_filter.h"
+#include "af_xdp.h"
+#include "ring_usage.h"
+#include "metrics.h"
+#include "latency.h"
+#include "arena.h"
+#include "ip_reassembly.h"
+#include "tcp_reassembly.h"
+#include "flow_table.h"
+#include "ipfix.h"
+#include "pattern_match.h"
+#include "dissect.h"
+
+/* An interface captured by its own group of threads. Each group has
+ * its own fanout group and ring memory budget */
+struct capture_iface {
+    char name[IF_NAMESIZE];
+    int id;                 /* Index in the interface list, logged as if_id */
+    int num_threads;
+    int first_thread;       /* The group is tstor[first_thread] onwards */
+    float buffer_fraction;  /* Share of physical memory for the group's rings */
+    int fanout_arg;         /* Fanout group id and type for PACKET_FANOUT */
+    struct tpacket_req3 ring_req; /* Ring of each thread in the group */
+    struct xdp_program *xdp; /* Non NULL when capturing with AF_XDP sockets */
+    uint64_t ring_budget;   /* Ring memory of each thread, the most auto tuning may use */
+    double tuned_pps;       /* Packet rate the rings were last tuned for, 0 before calibration */
+    uint32_t tune_gen;      /* Bumped by the stats thread when ring_req was re-tuned */
+};
+
+struct ring_limits;
+
+/* struct stats_tracking tracks stats for each thread and stores
+ * those stats. It is one of the first to get started.
+ * This thread also stores the pointer to bloom filter
+ * data structure which is used for analysis.*/
+struct stats_tracking {
+    struct thread_storage *tstor;
+    BloomFilter *bf;
+	struct log_file *pkt_log;
+	struct log_file *dup_pkt_log;
+    int num_threads;
+	int mode;
+    const struct capture_filter *filter; /* Capture criteria */
+    uint64_t received_packets;
+    uint64_t received_bytes;
+    uint64_t socket_packets;
+    uint64_t socket_drops;
+    uint64_t socket_freezes;
+    int verbosity;
+    int *t_start_p;  /* Clean start predicate */
+    pthread_cond_t *t_start_c; /* Clean start condition */
+    pthread_mutex_t *t_start_m; /* Clean start mutex */
+    pthread_mutex_t *log_access;
+    int per_thread_logs; /* Each thread writes its own log files, no log_access needed */
+    uint32_t busy_poll_us; /* Spin budget of the capture loop, 0 to always poll() */
+    int sock_busy_poll;  /* Set SO_BUSY_POLL/SO_PREFER_BUSY_POLL on the sockets */
+    struct replay_source *replay; /* Non NULL when reading from capture files */
+    int num_workers;     /* Processing workers in pipeline mode, 0 when capture threads process */
+    struct block_queue **queues; /* Capture thread t hands blocks to worker w through queues[t * num_workers + w] */
+    int sticky_dispatch; /* Each capture thread feeds a single worker to keep flows together */
+    struct capture_iface *ifaces; /* Interfaces captured, each with its thread group */
+    int num_ifaces;
+    int xdp;             /* Capturing with AF_XDP sockets */
+    double stats_interval; /* Seconds between stats lines */
+    struct metrics *metrics; /* Exporter fed by the stats thread, or NULL */
+    int latency;         /* Threads keep stage latency histograms */
+    int ring_autotune;   /* Rings follow the measured traffic, see ring_autotune() */
+    const struct ring_limits *rl;
+    struct ip_reassembly_config reassembly; /* Of the processing threads, memory 0 when off */
+    struct tcp_reassembly_config tcp_streams; /* Likewise */
+    struct flow_table_config flows; /* Flow records, flows 0 when off */
+    struct log_file *flow_log; /* Shared flow log, NULL when off or not shared */
+    struct ipfix_config ipfix; /* Collector the flow records go to instead, if any */
+    const struct pattern_set *patterns; /* Payloads are searched for, NULL for none */
+    uint32_t dissect;    /* Bit set of the enum app_proto dissected, 0 for none */
+};
+
+/* Stores details about the thread */
+struct thread_storage {
+    int tnum;      /* Thread Number */
+    pthread_t tid; /*Thread ID */
+    pthread_attr_t thread_attributes;
+    int sockfd;   /* Socket owned by this thread */
+    int cpu;      /* CPU the thread is pinned to, -1 if not pinned */
+    const char *if_name; /* Name of interface to bind the socket to */
+    int if_id;           /* Index of that interface in statst->ifaces, -1 for workers */
+    char *output_file_name; /* Name of output file */
+    uint8_t *mapped_buffer; /* The pointer to the mmap()'d region */
+    struct tpacket_block_desc **block_header; /* The pointer to each block in mmap()'d region */
+    struct tpacket_req3 ring_params; /* The ring allocation params to setsockopt() */
+    struct stats_tracking *statst;  /* A pointer to struct with stats counters */
+    struct ring_usage *ring_usage; /* Block streak histogram, lock free */
+    int *t_start_p;  /* Clean start predicate */
+    pthread_cond_t *t_start_c; /* Clean start condition */
+    pthread_mutex_t *t_start_m;   /* Clean start mutex */
+    struct log_file *pkt_log;     /* Own log with flow affine fanout, else the shared one */
+    struct log_file *dup_pkt_log;
+    pthread_mutex_t *log_access;  /* NULL when the logs are not shared */
+    uint64_t received_packets;    /* Packets processed by this thread */
+    uint64_t dup_packets;         /* Bloom filter hits in this thread */
+    uint64_t spin_ns;             /* Time spent spinning on an empty block */
+    uint64_t sleep_ns;            /* Time spent sleeping in poll() */
+    uint8_t *block_state;         /* Pipeline ownership of each ring block, see enum block_state */
+    int next_worker;              /* Worker to try first for the next block */
+    struct xsk_socket *xsk;       /* AF_XDP socket used instead of sockfd, or NULL */
+    struct latency_recorder *latency; /* Stage latency histograms, NULL unless -L */
+    pthread_mutex_t ring_lock;    /* Held while the socket or ring is swapped or its stats read */
+    uint32_t tune_gen;            /* The interface's tune_gen the ring was last built for */
+    uint64_t socket_packets;      /* Packets seen by the thread's sockets, stats thread only */
+    struct tpacket_stats_v3 retired_stats; /* Counters of sockets replaced by re-tuning */
+    struct arena *scratch;        /* Per block scratch memory: packet batch, log records */
+    struct ip_reassembly *reassembly; /* Fragments of the thread's packets, NULL if it does not process or reassemble */
+    struct tcp_reassembly *tcp_streams; /* Likewise for TCP streams */
+    struct flow_table *flows;     /* Likewise for flow records */
+    struct log_file *flow_log;    /* Where they go, owned like pkt_log */
+    struct ipfix_exporter *ipfix; /* Or where they are sent, NULL if not exported */
+    uint64_t flow_clock_ns;       /* Capture time of the last batch, 0 before the first */
+    uint64_t flow_mono_ns;        /* Monotonic time it was processed at */
+    uint64_t idle_check_ns;       /* Last flows_idle() that did the work */
+};
+
+struct packet_batch *process_packet_batch(struct packet_batch *b, struct thread_storage *thread_stor,
+        uint64_t *dup_count);
+
+void finish_packet_batch(const struct packet_batch *b, const struct packet_batch *messages,
+        uint64_t byte_count, uint64_t dup_count, struct thread_storage *thread_stor);
+
+int process_all_packets_in_block(struct tpacket_block_desc *block_hdr,
+        struct thread_storage *thread_stor, int if_id);
+
+void wait_for_clean_start(struct thread_storage *thread_stor);
+
 enum status bind_and_dispatch(struct sniffer_config *cfg);
 
 #endif
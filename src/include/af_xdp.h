@@ -0,0 +1,78 @@
+/*
+ * af_xdp.h
+ *
+ * Header library for af_xdp.c
+ */
+
+#ifndef AF_XDP_H
+#define AF_XDP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/if_xdp.h>
+
+#define XSK_FRAME_SIZE 4096  /* UMEM chunk size, one frame per chunk */
+#define XSK_NUM_FRAMES 4096  /* Frames in each thread's UMEM */
+#define XSK_RX_RING_SIZE 2048
+#define XSK_COMP_RING_SIZE 64 /* Receive only, the kernel requires one anyway */
+#define XSK_RX_BATCH 64      /* Descriptors processed per batch */
+
+struct stats_tracking;
+
+/* A single producer single consumer ring shared with the kernel */
+struct xsk_ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *descs;
+    uint32_t size;
+    uint32_t mask;
+    void *map;          /* The mmap()'d region */
+    size_t map_size;
+};
+
+/* An AF_XDP socket bound to one receive queue with its own UMEM */
+struct xsk_socket {
+    int fd;
+    uint32_t queue;
+    uint8_t *umem;      /* Packet buffers, XSK_NUM_FRAMES frames */
+    size_t umem_size;
+    struct xsk_ring rx;
+    struct xsk_ring fill;
+    struct xsk_ring comp;
+    uint64_t rx_frames;     /* Frames taken off the rx ring */
+    uint64_t last_frames;   /* Counters at the previous af_xdp_stats() */
+    uint64_t last_drops;
+    uint64_t last_fill_empty;
+};
+
+/* The XDP program redirecting every queue to its socket */
+struct xdp_program {
+    int map_fd;     /* XSKMAP, queue number -> socket */
+    int prog_fd;
+    int link_fd;    /* Closing it detaches the program */
+    int ifindex;
+    uint32_t attach_flags;
+    uint32_t bind_flags;
+};
+
+struct xdp_program *xdp_program_create(const char *if_name, const char *mode,
+        int num_queues);
+
+int xdp_program_attach(struct xdp_program *xp);
+
+void xdp_program_free(struct xdp_program *xp);
+
+struct xsk_socket *xsk_socket_create(struct xdp_program *xp, uint32_t queue);
+
+void xsk_socket_free(struct xsk_socket *xsk);
+
+uint32_t xsk_rx_batch(struct xsk_socket *xsk, struct xdp_desc *descs, uint32_t max);
+
+void xsk_recycle(struct xsk_socket *xsk, const struct xdp_desc *descs, uint32_t n);
+
+void xsk_wakeup_if_needed(struct xsk_socket *xsk);
+
+void af_xdp_stats(struct xsk_socket *xsk, struct stats_tracking *statst);
+
+#endif /* AF_XDP_H */
@@ -0,0 +1,51 @@
+/*
+ * arena.h
+ *
+ * Header library for arena.c
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bump allocator for per-block scratch memory. Allocations are released
+ * together, by rewinding to a mark or by arena_reset(). When the arena
+ * is too small, allocations fall back to the heap and the arena grows
+ * at the next reset */
+struct arena {
+    uint8_t *base;
+    size_t size;
+    size_t used;
+    size_t spilled;      /* Bytes in heap fallbacks */
+    size_t wanted;       /* Size the arena would have needed since the last reset */
+    int huge;            /* Backed by explicit huge pages */
+    struct arena_spill *spill; /* Heap fallbacks, freed by arena_reset() */
+    uint64_t heap_allocs; /* Heap allocations made, single writer, read by the stats thread */
+};
+
+struct arena *arena_create(size_t size);
+
+void arena_free(struct arena *a);
+
+void *arena_alloc(struct arena *a, size_t size);
+
+void arena_reset(struct arena *a);
+
+void arena_count_heap_alloc(struct arena *a);
+
+/* Position to come back to with arena_rewind(), for scratch memory that
+ * is only needed for a while */
+static inline size_t arena_mark(const struct arena *a){
+    return a->used;
+}
+
+/* Releases what was allocated since mark, heap fallbacks excepted */
+static inline void arena_rewind(struct arena *a, size_t mark){
+    if(mark <= a->used){
+        a->used = mark;
+    }
+}
+
+#endif /* ARENA_H */
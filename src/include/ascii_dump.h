@@ -0,0 +1,35 @@
+/*
+ * ascii_dump.h
+ *
+ * Header library for ascii_dump.c
+ */
+
+#ifndef ASCII_DUMP_H
+#define ASCII_DUMP_H
+
+#include <stdint.h>
+
+#define ASCII_DUMP_DEFAULT_MAX 4096 /* Payload bytes shown in a record */
+#define ASCII_DUMP_LIMIT 65535      /* Largest cap, an IP packet is no longer */
+
+/* Writes the printable view of len bytes at in to out and returns the
+ * number of bytes written, without the terminating NUL. Bytes outside
+ * ' '..'z', '"' and '\' become '.' */
+typedef uint32_t (*ascii_dump_fn)(const uint8_t *in, uint32_t len, char *out);
+
+uint32_t ascii_dump_scalar(const uint8_t *in, uint32_t len, char *out);
+#if defined(__x86_64__) || defined(__i386__)
+uint32_t ascii_dump_sse2(const uint8_t *in, uint32_t len, char *out);
+uint32_t ascii_dump_avx2(const uint8_t *in, uint32_t len, char *out);
+uint32_t ascii_dump_avx512(const uint8_t *in, uint32_t len, char *out);
+#endif
+
+void ascii_dump_init(uint32_t max_len);
+
+uint32_t ascii_dump_max(void);
+
+const char *ascii_dump_kernel(void);
+
+uint32_t ascii_dump(const uint8_t *in, uint32_t len, char *out);
+
+#endif /* ASCII_DUMP_H */
@@ -0,0 +1,48 @@
+/*
+ * block_queue.h
+ *
+ * Header library for block_queue.c
+ */
+
+#ifndef BLOCK_QUEUE_H
+#define BLOCK_QUEUE_H
+
+#include <stdint.h>
+#include <linux/if_packet.h>
+
+/* Ownership of a ring block in pipeline mode. The capture thread marks a
+ * block in flight when it queues it, the worker marks it done and the
+ * capture thread returns done blocks to the kernel in ring order */
+enum block_state {
+    block_idle = 0,
+    block_in_flight = 1,
+    block_done = 2
+};
+
+/* A reference to a ring block handed from a capture thread to a worker */
+struct block_ref {
+    struct tpacket_block_desc *block;
+    uint8_t *state;   /* Set to block_done by the worker */
+};
+
+/* Single producer single consumer queue of block references. head and
+ * tail live on their own cache lines so that the producer and the
+ * consumer do not bounce a line between them on every operation */
+struct block_queue {
+    struct block_ref *slots;
+    uint32_t mask;    /* Capacity - 1, capacity is a power of two */
+    uint32_t head __attribute__((aligned(64)));  /* Next slot to pop, written by the consumer */
+    uint32_t tail __attribute__((aligned(64)));  /* Next slot to push, written by the producer */
+};
+
+struct block_queue *block_queue_create(uint32_t capacity);
+
+void block_queue_free(struct block_queue *q);
+
+int block_queue_push(struct block_queue *q, const struct block_ref *ref);
+
+int block_queue_pop(struct block_queue *q, struct block_ref *ref);
+
+uint32_t block_queue_count(struct block_queue *q);
+
+#endif /* BLOCK_QUEUE_H */
@@ -0,0 +1,71 @@
+/*
+ * capture_filter.h
+ *
+ * Header library for capture_filter.c
+ */
+
+#ifndef CAPTURE_FILTER_H
+#define CAPTURE_FILTER_H
+
+#include <stdint.h>
+#include <linux/filter.h>
+
+/* Port or VLAN ranges beyond this are only checked in userspace, the
+ * kernel program would need jumps longer than cBPF allows */
+#define CAPTURE_FILTER_MAX_BPF_RANGES 48
+
+/* Payloads shorter than this are not logged unless -l says otherwise */
+#define CAPTURE_FILTER_DEFAULT_MIN_PAYLOAD 4
+
+/* Ports, or VLAN ids */
+struct port_range {
+    uint16_t lo;
+    uint16_t hi;
+};
+
+/* The capture criteria. They are compiled into a cBPF program attached
+ * to every socket, but the userspace checks stay authoritative since
+ * replayed packets never went through the kernel filter */
+struct capture_filter {
+    int have_ports;                 /* 0: any port */
+    uint8_t port_bitmap[65536 / 8]; /* Ports of interest, one bit each */
+    struct port_range *ranges;      /* The same ports as ranges */
+    int num_ranges;
+    int have_vlans;                 /* 0: any VLAN or none */
+    uint8_t vlan_bitmap[4096 / 8];  /* Outermost VLAN ids of interest */
+    struct port_range *vlan_ranges;
+    int num_vlan_ranges;
+    int protocol;                   /* IPPROTO_TCP, IPPROTO_UDP or 0 for both */
+    int min_payload;                /* Minimum L4 payload in bytes */
+    int decap_depth;                /* Tunnels followed to the inner packet, 0 for none */
+    int tcp_streams;                /* TCP streams are reassembled, min_payload applies to their messages */
+    char *expression;               /* pcap-filter expression or NULL */
+    struct sock_fprog user_prog;    /* expression compiled for the userspace check */
+    struct sock_fprog kernel_prog;  /* Program attached with SO_ATTACH_FILTER */
+};
+
+int capture_filter_init(struct capture_filter *cf, const char *ports,
+        const char *protocol, int min_payload, const char *expression,
+        const char *vlans, int decap_depth, int tcp_streams);
+
+void capture_filter_free(struct capture_filter *cf);
+
+int capture_filter_attach(const struct capture_filter *cf, int sockfd);
+
+int capture_filter_match_expression(const struct capture_filter *cf,
+        const uint8_t *data, uint32_t len, uint32_t caplen);
+
+/* Returns 1 when either port is of interest */
+static inline int capture_filter_port_match(const struct capture_filter *cf,
+        uint16_t sport, uint16_t dport){
+    return !cf->have_ports ||
+        (cf->port_bitmap[sport >> 3] & (1 << (sport & 7))) ||
+        (cf->port_bitmap[dport >> 3] & (1 << (dport & 7)));
+}
+
+/* Returns 1 when the VLAN id is of interest */
+static inline int capture_filter_vlan_match(const struct capture_filter *cf, uint16_t vlan_id){
+    return !cf->have_vlans || (cf->vlan_bitmap[vlan_id >> 3] & (1 << (vlan_id & 7)));
+}
+
+#endif /* CAPTURE_FILTER_H */
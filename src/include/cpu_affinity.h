@@ -0,0 +1,29 @@
+/*
+ * cpu_affinity.h
+ *
+ * Header library for cpu_affinity.c
+ */
+
+#ifndef CPU_AFFINITY_H
+#define CPU_AFFINITY_H
+
+#include <stddef.h>
+#include <sched.h>
+
+#define CPU_AFFINITY_AUTO "auto"
+
+int cpu_list_parse(const char *list, int *cpus, int max_cpus);
+
+int *cpu_plan_create(const char *spec, const char *if_name, int num_threads, cpu_set_t *taken);
+
+int cpu_numa_node(int cpu);
+
+int cpu_bind_current(int cpu, cpu_set_t *saved);
+
+void cpu_restore_current(cpu_set_t *saved);
+
+void *cpu_local_alloc(size_t size);
+
+void cpu_local_free(void *ptr, size_t size);
+
+#endif /* CPU_AFFINITY_H */
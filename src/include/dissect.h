@@ -0,0 +1,66 @@
+/*
+ * dissect.h
+ *
+ * Header library for dissect.c
+ */
+
+#ifndef DISSECT_H
+#define DISSECT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DISSECT_FIELD_MAX 256     /* Bytes of a text field shown in a record */
+#define DISSECT_JSON_MAX 1024     /* Longest application fields of a record */
+
+enum app_proto {
+    APP_NONE = 0,
+    APP_HTTP,
+    APP_DNS,
+    APP_TLS
+};
+
+#define DISSECT_ALL ((1u << APP_HTTP) | (1u << APP_DNS) | (1u << APP_TLS))
+
+/* Bytes of a payload, from its start. Fields point into the payload
+ * rather than being copied */
+struct app_span {
+    uint32_t off;
+    uint32_t len;             /* 0 when absent */
+};
+
+/* The fields a dissector found in a payload */
+struct app_fields {
+    uint8_t proto;            /* enum app_proto */
+    union {
+        struct {
+            struct app_span method, uri, host; /* Of a request */
+            uint16_t status;  /* Of a response, 0 for a request */
+        } http;
+        struct {
+            struct app_span qname; /* Labels of the first question as sent, root label included */
+            uint16_t qtype;
+            uint8_t rcode;
+            uint8_t response;
+        } dns;
+        struct {
+            uint16_t version; /* Of the ClientHello */
+            uint8_t complete; /* Captured to its last extension, the fingerprint needs it */
+            struct app_span sni;
+            struct app_span alpn; /* Protocol name list of the extension */
+            struct app_span ciphers, extensions; /* Whole blocks, for the fingerprint */
+        } tls;
+    };
+};
+
+int dissect_config_parse(const char *spec, uint32_t *protos);
+
+const char *app_proto_name(int proto);
+
+int dissect_payload(const uint8_t *payload, uint32_t len, uint8_t protocol,
+        uint16_t sport, uint16_t dport, uint32_t protos, struct app_fields *af);
+
+size_t app_fields_json(const struct app_fields *af, const uint8_t *payload,
+        char *out, size_t size);
+
+#endif /* DISSECT_H */
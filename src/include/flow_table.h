@@ -0,0 +1,86 @@
+/*
+ * flow_table.h
+ *
+ * Header library for flow_table.c
+ */
+
+#ifndef FLOW_TABLE_H
+#define FLOW_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FLOW_TABLE_DEFAULT_FLOWS 65536   /* Per thread, when flows are exported but -k is not given */
+#define FLOW_TABLE_DEFAULT_IDLE 15      /* Seconds without a packet before a flow ends */
+#define FLOW_TABLE_DEFAULT_ACTIVE 300   /* Seconds before a long flow gets a record anyway */
+#define FLOW_TABLE_MAX_TIMEOUT 3600     /* Must stay below the timer wheel's span */
+
+/* Why a flow got its record, numbered as the IPFIX flowEndReason
+ * (RFC 7012) */
+enum flow_end_reason {
+    FLOW_END_IDLE = 1,
+    FLOW_END_ACTIVE = 2,
+    FLOW_END_FORCED = 4,        /* The sniffer stopped */
+    FLOW_END_RESOURCES = 5      /* Evicted from a full table */
+};
+
+struct flow_table_config {
+    uint32_t flows;             /* Flows per thread, 0 to not track flows */
+    uint32_t idle;              /* Seconds, see FLOW_TABLE_DEFAULT_IDLE */
+    uint32_t active;            /* Seconds, see FLOW_TABLE_DEFAULT_ACTIVE */
+};
+
+/* A flow is one direction of the packets between two ports. Must be
+ * zeroed before it is filled in, it is compared as a whole */
+struct flow_key {
+    uint8_t addr[32];           /* Source then destination, IPv4 in the first 4 bytes of each */
+    uint16_t sport, dport;
+    uint16_t vlan_id;
+    int16_t if_id;
+    uint8_t version;
+    uint8_t protocol;
+    uint8_t pad[6];
+};
+
+/* What is known of a flow when it ends */
+struct flow_record {
+    struct flow_key key;
+    uint64_t packets;
+    uint64_t bytes;             /* Frame lengths on the wire */
+    uint64_t first_ns, last_ns; /* Capture times of the first and last packet */
+    uint64_t dup_packets;       /* Payloads found in the bloom filter (mode 2) */
+    uint8_t tcp_flags;          /* Of all its packets, or'ed */
+    uint8_t end_reason;         /* enum flow_end_reason */
+};
+
+/* Called with the record of every flow that ends */
+typedef void (*flow_record_fn)(void *ctx, const struct flow_record *rec);
+
+/* Counters, single writer. Read them with flow_table_stats_add() */
+struct flow_table_stats {
+    uint64_t flows;             /* Flows seen */
+    uint64_t records;           /* Records emitted */
+    uint64_t evicted;           /* Flows ended early to make room */
+};
+
+struct flow_table;
+struct packet_batch;
+
+int flow_table_config_parse(const char *spec, struct flow_table_config *fc);
+
+struct flow_table *flow_table_create(const struct flow_table_config *fc);
+
+void flow_table_free(struct flow_table *ft);
+
+void flow_table_update(struct flow_table *ft, const struct packet_batch *b,
+        flow_record_fn emit, void *ctx);
+
+void flow_table_count_dup(struct flow_table *ft, const struct packet_batch *b, uint32_t i);
+
+void flow_table_expire(struct flow_table *ft, uint64_t now_ns, flow_record_fn emit, void *ctx);
+
+void flow_table_flush(struct flow_table *ft, flow_record_fn emit, void *ctx);
+
+void flow_table_stats_add(const struct flow_table *ft, struct flow_table_stats *sum);
+
+#endif /* FLOW_TABLE_H */
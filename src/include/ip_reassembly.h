@@ -0,0 +1,81 @@
+/*
+ * ip_reassembly.h
+ *
+ * Header library for ip_reassembly.c
+ */
+
+#ifndef IP_REASSEMBLY_H
+#define IP_REASSEMBLY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define IP_REASSEMBLY_DEFAULT_MB 4        /* Fragment memory of each thread */
+#define IP_REASSEMBLY_DEFAULT_TIMEOUT 30  /* Seconds an incomplete datagram waits for a fragment */
+#define IP_REASSEMBLY_MAX_DATAGRAM 65535  /* Longest IP payload, longer datagrams are dropped */
+
+/* What happens when a fragment overlaps data already received with
+ * different bytes. IPv6 datagrams are always dropped, RFC 5722 */
+enum frag_policy {
+    FRAG_POLICY_DROP = 0,   /* Drop the whole datagram, like Linux does */
+    FRAG_POLICY_FIRST,      /* Keep the bytes received first */
+    FRAG_POLICY_LAST        /* Keep the bytes received last */
+};
+
+struct ip_reassembly_config {
+    size_t memory;          /* Bytes of fragment data per thread, 0 to not reassemble */
+    int policy;             /* enum frag_policy */
+    uint32_t timeout;       /* Seconds, see IP_REASSEMBLY_DEFAULT_TIMEOUT */
+};
+
+/* Identifies the datagram a fragment belongs to. Must be zeroed before
+ * it is filled in, it is hashed and compared as a whole */
+struct frag_key {
+    uint8_t addr[32];       /* Source then destination, IPv4 in the first 4 bytes of each */
+    uint32_t id;
+    uint16_t vlan_id;
+    int16_t if_id;
+    uint8_t version;
+    uint8_t protocol;       /* IPv4 only, IPv6 does not key on it */
+    uint8_t pad[6];
+};
+
+/* A fragment handed to ip_reassembly_add() */
+struct ip_fragment {
+    struct frag_key key;
+    const uint8_t *data;    /* Fragmentable part, in the frame */
+    uint32_t offset;        /* Of data in the datagram */
+    uint32_t len;
+    uint32_t max_len;       /* Longest datagram the headers in front allow */
+    int more;               /* More fragments follow */
+    uint8_t protocol;       /* Of the datagram: IPv4 protocol, IPv6 next header */
+    uint64_t ts_ns;         /* Capture time */
+};
+
+/* Counters, single writer. Read them with ip_reassembly_stats_add() */
+struct ip_reassembly_stats {
+    uint64_t fragments;     /* Fragments seen */
+    uint64_t datagrams;     /* Datagrams reassembled */
+    uint64_t expired;       /* Incomplete datagrams whose fragments stopped coming */
+    uint64_t evicted;       /* Incomplete datagrams dropped to make room */
+    uint64_t overlaps;      /* Datagrams dropped for overlapping fragments */
+    uint64_t dropped;       /* Malformed, oversized or too fragmented datagrams and fragments */
+};
+
+struct ip_reassembly;
+struct arena;
+
+int ip_reassembly_config_parse(const char *spec, struct ip_reassembly_config *rc);
+
+struct ip_reassembly *ip_reassembly_create(const struct ip_reassembly_config *rc, struct arena *out);
+
+void ip_reassembly_free(struct ip_reassembly *ra);
+
+const uint8_t *ip_reassembly_add(struct ip_reassembly *ra, const struct ip_fragment *frag,
+        uint32_t *len, uint8_t *protocol);
+
+void ip_reassembly_expire(struct ip_reassembly *ra, uint64_t now_ns);
+
+void ip_reassembly_stats_add(const struct ip_reassembly *ra, struct ip_reassembly_stats *sum);
+
+#endif /* IP_REASSEMBLY_H */
@@ -0,0 +1,50 @@
+/*
+ * ipfix.h
+ *
+ * Header library for ipfix.c
+ */
+
+#ifndef IPFIX_H
+#define IPFIX_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define IPFIX_DEFAULT_PORT 4739
+#define IPFIX_DATAGRAM_SIZE 1400    /* Stays below the MTU of the usual paths */
+#define IPFIX_QUEUE_DATAGRAMS 64    /* Datagrams a thread holds while its socket is busy */
+#define IPFIX_TEMPLATE_REFRESH 60   /* Seconds between resent templates (RFC 7011 10.3.6) */
+#define IPFIX_FLUSH_MS 1000         /* Longest a record waits for its datagram to fill */
+#define IPFIX_PEN 32473             /* Enterprise of the duplicate count, the one RFC 5612 sets aside for examples */
+
+struct ipfix_config {
+    struct sockaddr_storage collector;
+    socklen_t collector_len;    /* 0 when not exporting */
+};
+
+/* Counters, single writer. Read them with ipfix_stats_add() */
+struct ipfix_stats {
+    uint64_t records;           /* Flow records put in datagrams */
+    uint64_t datagrams;         /* Datagrams sent */
+    uint64_t dropped;           /* Records that found the queue full */
+    uint64_t errors;            /* Datagrams the socket refused */
+};
+
+struct ipfix_exporter;
+struct flow_record;
+
+int ipfix_config_parse(const char *spec, struct ipfix_config *xc);
+
+struct ipfix_exporter *ipfix_exporter_create(const struct ipfix_config *xc, uint32_t domain);
+
+void ipfix_exporter_free(struct ipfix_exporter *ex);
+
+void ipfix_exporter_add(struct ipfix_exporter *ex, const struct flow_record *rec);
+
+void ipfix_exporter_flush(struct ipfix_exporter *ex, int force);
+
+void ipfix_exporter_stop(struct ipfix_exporter *ex);
+
+void ipfix_stats_add(const struct ipfix_exporter *ex, struct ipfix_stats *sum);
+
+#endif /* IPFIX_H */
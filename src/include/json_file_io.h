@@ -1,17 +1,38 @@
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
 #include "sniffer.h"
 
 #ifndef JSON_FILE_IO_H
 #define JSON_FILE_IO_H
 
+#define JSON_RECORD_FIELDS 1024 /* Longest record without its application fields and payload dump */
+
 struct log_file {
 	char dirname[256];
 	char filename[300];
+	FILE *fp;     /* Open stream of filename, NULL until the first record */
+	char *buffer; /* Its stdio buffer */
 	unsigned long pkt_count;
+	uint64_t records; /* Records written since start, read by the stats thread */
 	int mode;
+	int tnum; /* Thread owning the log, -1 if shared by all threads */
 };
 
-int write_packet_info(struct packet_info *, int, 
-        struct log_file *, pthread_mutex_t *);
+struct log_file *log_file_create(const char *dirname, int mode, int tnum, time_t rawtime);
+
+void log_file_free(struct log_file *log);
+
+size_t json_record_max(void);
+
+struct latency_recorder;
+struct arena;
+struct flow_record;
+
+int write_packet_info(const struct packet_batch *, uint32_t, uint32_t,
+        struct log_file *, pthread_mutex_t *, struct latency_recorder *, struct arena *);
+
+int write_flow_record(const struct flow_record *, struct log_file *);
 
 #endif
@@ -0,0 +1,118 @@
+/*
+ * latency.h
+ *
+ * Header library for latency.c
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Log-linear buckets in the style of HdrHistogram: every power of two
+ * is split into LATENCY_SUB_BUCKETS buckets, so a value is known to
+ * within 1/16th. Values are in timestamp counter ticks */
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS 40 /* Longer durations land in the last bucket */
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+/* The stages timed while processing a block */
+enum latency_stage {
+    lat_block = 0,   /* A whole block, processing and logging */
+    lat_packet,      /* A packet, hashing and bloom filter */
+    lat_parse,       /* Header parsing of a block */
+    lat_hash,        /* sha512 of the payload, for the bloom filter or a record */
+    lat_bloom,       /* Bloom filter add or check */
+    lat_extract,     /* Building a JSON record, payload dump and hash included */
+    lat_write,       /* Writing a JSON record */
+    lat_log_lock,    /* Waiting for a shared log */
+    lat_match,       /* Pattern search of a block's payloads */
+    lat_dissect,     /* Application layer dissection of a block's payloads */
+    lat_num_stages
+};
+
+/* Histogram counts only ever grow and have a single writer, so readers
+ * take the difference of two copies to get an interval and copies of
+ * several threads can simply be added up */
+struct latency_hist {
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t ticks;             /* Sum of the recorded durations */
+};
+
+/* A thread's histograms, one per stage */
+struct latency_recorder {
+    struct latency_hist stages[lat_num_stages];
+} __attribute__((aligned(64)));
+
+/* Quantiles of a histogram, in nanoseconds */
+struct latency_summary {
+    uint64_t count;
+    double sum;                 /* Of the durations, exact */
+    double p50, p99, p999, max;
+};
+
+extern const char *latency_stage_names[lat_num_stages];
+
+void latency_calibrate(void);
+
+struct latency_recorder *latency_recorder_create(void);
+
+void latency_recorder_free(struct latency_recorder *lat);
+
+void latency_copy(struct latency_hist *dst, const struct latency_recorder *src);
+
+void latency_merge(struct latency_hist *dst, const struct latency_hist *src);
+
+void latency_summarize(const struct latency_hist *now, const struct latency_hist *before,
+        struct latency_summary *out);
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t latency_now(void){
+    return __rdtsc();
+}
+#else
+static inline uint64_t latency_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+static inline uint32_t latency_bucket(uint64_t ticks){
+    if(ticks < LATENCY_SUB_BUCKETS){
+        return ticks;
+    }
+    if(ticks >> LATENCY_MAX_BITS){
+        return LATENCY_BUCKETS - 1;
+    }
+    uint32_t shift = (63 - __builtin_clzll(ticks)) - LATENCY_SUB_BITS;
+    return (shift + 1) * LATENCY_SUB_BUCKETS + ((ticks >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/* Time stamp for latency_end(), 0 when lat is NULL (not measuring) */
+static inline uint64_t latency_start(const struct latency_recorder *lat){
+    return (lat != NULL) ? latency_now() : 0;
+}
+
+/* Adds a duration to the histogram of stage. Only the thread owning
+ * lat may call this */
+static inline void latency_record(struct latency_recorder *lat, int stage, uint64_t ticks){
+    uint64_t *count = &(lat->stages[stage].counts[latency_bucket(ticks)]);
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&(lat->stages[stage].ticks), lat->stages[stage].ticks + ticks, __ATOMIC_RELAXED);
+}
+
+/* Records the time since start for stage and returns it */
+static inline uint64_t latency_end(struct latency_recorder *lat, int stage, uint64_t start){
+    if(lat == NULL){
+        return 0;
+    }
+    uint64_t ticks = latency_now() - start;
+    latency_record(lat, stage, ticks);
+    return ticks;
+}
+
+#endif /* LATENCY_H */
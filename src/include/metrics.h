@@ -0,0 +1,71 @@
+/*
+ * metrics.h
+ *
+ * Header library for metrics.c
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "latency.h"
+
+/* Counters of one capture thread or pipeline worker */
+struct thread_metrics {
+    const char *if_name;    /* Interface of a capture thread, NULL for workers */
+    uint64_t packets;       /* Packets processed */
+    uint64_t dup_packets;   /* Bloom filter hits */
+    uint64_t spin_ns;       /* Time spent spinning on empty blocks */
+    uint64_t sleep_ns;      /* Time spent sleeping in poll() or waiting for blocks */
+    uint64_t heap_allocs;   /* Heap allocations on the packet path, flat once warmed up */
+    double ring_usage;      /* Average ring usage over the last interval, -1 if no ring */
+};
+
+/* Everything exported, filled by the stats thread at the end of every
+ * interval. Counters are monotonic, rates and ring usage cover the last
+ * interval */
+struct metrics_snapshot {
+    double uptime;
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t socket_packets;
+    uint64_t socket_drops;
+    uint64_t socket_freezes;
+    uint64_t dup_packets;
+    uint64_t log_records;      /* Records written to the packet logs */
+    uint64_t dup_log_records;  /* Records written to the duplicate packet logs */
+    double pps;
+    double byps;
+    double log_rate;           /* Packet log records per second */
+    double ring_usage_avg;
+    double ring_usage_worst;
+    double ring_usage_worst_instant;
+    int have_latency;          /* Stage latencies were measured (-L) */
+    struct latency_summary latency[lat_num_stages]; /* Over the last interval, all threads */
+    struct latency_summary latency_total[lat_num_stages]; /* Since the start, all threads */
+    int num_threads;
+    struct thread_metrics *threads;
+};
+
+/* The exporter. The stats thread publishes snapshots, the exporter
+ * thread serves the latest one. The capture path is not involved */
+struct metrics {
+    pthread_mutex_t lock;      /* Between the stats and exporter threads only */
+    struct metrics_snapshot snap;
+    int have_snap;
+    int listen_fd;             /* -1 when not serving */
+    char *unix_path;           /* Unix socket to unlink at exit */
+    char *json_path;           /* Stats file rewritten every interval, or NULL */
+    pthread_t tid;
+    int stop;
+};
+
+struct metrics *metrics_create(const char *endpoint, const char *json_path, int num_threads);
+
+void metrics_free(struct metrics *m);
+
+void metrics_publish(struct metrics *m, const struct metrics_snapshot *snap);
+
+#endif /* METRICS_H */
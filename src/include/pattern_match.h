@@ -0,0 +1,42 @@
+/*
+ * pattern_match.h
+ *
+ * Header library for pattern_match.c
+ */
+
+#ifndef PATTERN_MATCH_H
+#define PATTERN_MATCH_H
+
+#include <stdint.h>
+
+#define PATTERN_MAX_LEN 1024      /* Bytes of a pattern, escapes decoded */
+#define PATTERN_MAX_MATCHES 8     /* Distinct patterns a record lists */
+#define PATTERN_WINDOW 4          /* Bytes the filter hashes at every payload offset */
+
+struct pattern_set;
+
+/* Looks for the patterns of ps in len bytes at data. Writes the ids of
+ * the patterns found, each once, to ids and returns their number, at
+ * most max_ids */
+typedef uint32_t (*pattern_match_fn)(const struct pattern_set *ps, const uint8_t *data,
+        uint32_t len, uint32_t *ids, uint32_t max_ids);
+
+struct pattern_set *pattern_set_load(const char *path);
+
+void pattern_set_free(struct pattern_set *ps);
+
+uint32_t pattern_set_size(const struct pattern_set *ps);
+
+const char *pattern_set_kernel(const struct pattern_set *ps);
+
+uint32_t pattern_match(const struct pattern_set *ps, const uint8_t *data, uint32_t len,
+        uint32_t *ids, uint32_t max_ids);
+
+uint32_t pattern_match_scalar(const struct pattern_set *ps, const uint8_t *data, uint32_t len,
+        uint32_t *ids, uint32_t max_ids);
+#if defined(__x86_64__) || defined(__i386__)
+uint32_t pattern_match_avx2(const struct pattern_set *ps, const uint8_t *data, uint32_t len,
+        uint32_t *ids, uint32_t max_ids);
+#endif
+
+#endif /* PATTERN_MATCH_H */
@@ -0,0 +1,36 @@
+/*
+ * pcap_replay.h
+ *
+ * Header library for pcap_replay.c
+ */
+
+#ifndef PCAP_REPLAY_H
+#define PCAP_REPLAY_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* The replay_source struct describes the capture files which are read
+ * instead of a live interface and is shared by all replay threads */
+struct replay_source {
+    char **files;           /* Capture files in the order they are read */
+    int num_files;
+    int pace;               /* 1: follow the original packet timestamps */
+    uint32_t blocktimeout;  /* milliseconds before a paced block is returned partially full */
+    int threads_done;       /* Number of threads done with all their files */
+    struct timespec start;  /* Time at which replay threads got clean start */
+    struct timespec end;    /* Time at which the last replay thread finished */
+};
+
+struct replay_source *replay_source_init(const char *path, int pace,
+        uint32_t blocktimeout);
+
+void replay_source_free(struct replay_source *rs);
+
+void replay_start_clock(struct replay_source *rs);
+
+void *replay_thread_func(void *arg);
+
+void replay_report(struct replay_source *rs, uint64_t packets, uint64_t bytes);
+
+#endif /* PCAP_REPLAY_H */
@@ -8,6 +8,39 @@
 #define IP_HEADER_LEN 20 
 #define UDP_HEADER_LEN 8
 
-int parse_packet(uint8_t *eth, struct packet_info *pi, int);
+#define VXLAN_PORT 4789
+#define GENEVE_PORT 6081
+#define DECAP_MAX_DEPTH 8   /* Most tunnels -u follows */
+
+/* Tunnels that are decapsulated, see struct packet_batch tunnel */
+enum tunnel_type {
+    TUNNEL_NONE = 0,
+    TUNNEL_IPIP,    /* IPv4 or IPv6 in IPv4 or IPv6 */
+    TUNNEL_GRE,
+    TUNNEL_VXLAN,
+    TUNNEL_GENEVE
+};
+
+struct capture_filter;
+struct arena;
+struct ip_reassembly;
+struct tcp_reassembly;
+struct pattern_set;
+
+size_t packet_batch_size(uint32_t capacity);
+
+struct packet_batch *packet_batch_alloc(struct arena *a, uint32_t capacity, int if_id);
+
+void parse_packet_batch(struct packet_batch *b, const struct capture_filter *cf,
+        struct ip_reassembly *ra);
+
+struct packet_batch *reassemble_streams(struct packet_batch *b, struct tcp_reassembly *tr,
+        const struct capture_filter *cf, struct arena *a);
+
+void match_packet_batch(struct packet_batch *b, const struct pattern_set *ps, struct arena *a);
+
+void dissect_packet_batch(struct packet_batch *b, uint32_t protos, struct arena *a);
+
+const char *tunnel_name(int tunnel);
 
 #endif
@@ -0,0 +1,43 @@
+/*
+ * ring_usage.h
+ *
+ * Header library for ring_usage.c
+ */
+
+#ifndef RING_USAGE_H
+#define RING_USAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Ring occupancy histogram of a capture thread: time spent with i blocks
+ * in a row ready, for i = 0..num_bins-1. It has two halves. The capture
+ * thread adds to the half selected by epoch while the stats thread flips
+ * epoch and then reads and clears the other half, so the capture loop
+ * never takes a lock. epoch and seq live on their own cache lines, each
+ * written by one side only */
+struct ring_usage {
+    uint32_t epoch __attribute__((aligned(64))); /* Written by the stats thread */
+    uint32_t seq __attribute__((aligned(64)));   /* Odd while the capture thread updates a half */
+    uint32_t num_bins;
+    size_t alloc_size;
+    double *bins[2];
+};
+
+struct ring_usage *ring_usage_create(uint32_t num_bins);
+
+void ring_usage_free(struct ring_usage *ru);
+
+void ring_usage_collect(struct ring_usage *ru, double *out);
+
+/* Adds time to bin, called by the owning capture thread only */
+static inline void ring_usage_add(struct ring_usage *ru, uint32_t bin, double time){
+    __atomic_store_n(&(ru->seq), ru->seq + 1, __ATOMIC_RELAXED);
+    /* seq must be visible as odd before epoch is read, see ring_usage_collect() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint32_t epoch = __atomic_load_n(&(ru->epoch), __ATOMIC_ACQUIRE);
+    ru->bins[epoch & 1][bin] += time;
+    __atomic_store_n(&(ru->seq), ru->seq + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* RING_USAGE_H */
@@ -8,9 +8,21 @@
 #ifndef SHA512_H
 #define SHA512_H
 
+#include <stdint.h>
 #include <openssl/sha.h>
 #include <string.h>
 
-int sha512(const char *data, unsigned char *digest);
+#define SHA512_HEX_LENGTH (2 * SHA512_DIGEST_LENGTH + 1)
+
+/* A payload's digest, kept with its packet so that it is computed once */
+struct payload_digest {
+    uint8_t bytes[SHA512_DIGEST_LENGTH];
+};
+
+void sha512_bytes(const uint8_t *data, size_t len, struct payload_digest *d);
+
+void sha512_hex(const struct payload_digest *d, char *digest);
+
+int sha512(const uint8_t *data, size_t len, char *digest);
 
 #endif /*sha512.h*/
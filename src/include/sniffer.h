@@ -33,40 +33,92 @@ struct sniffer_config{
     int verbosity;
     float buffer_fraction;
     int mode;
-    int c_port;
+    char *ports;       // Ports and port ranges to capture, "53,8000-8080", NULL for any
     long n_elements;  // Parameters for bloom filter
     double fp_rate;
+    char *replay_path; // pcap/pcapng file or directory read instead of capture_interface
+    int replay_pace;   // Replay following the original packet timestamps
+    char *cpu_list;    // CPUs to pin threads to, "auto" or NULL for no pinning
+    char *fanout_mode; // PACKET_FANOUT mode and flags, e.g. "hash,defrag"
+    int busy_poll_us;  // Spin on empty blocks for up to this long before poll()
+    int sock_busy_poll; // Also enable SO_BUSY_POLL/SO_PREFER_BUSY_POLL on the sockets
+    int num_workers;   // Processing workers fed by the capture threads, 0 to process inline
+    char *protocol;    // "tcp", "udp" or NULL for both
+    int min_payload;   // Packets with a shorter L4 payload are not captured
+    char *filter_expression; // pcap-filter expression applied on top of the above
+    char *xdp_mode;    // Capture with AF_XDP sockets: "skb", "drv" or "zc", NULL for TPACKET_V3
+    float stats_interval; // Seconds between stats lines
+    char *metrics_endpoint; // Serve metrics on "[address:]port" or "unix:<path>", NULL for none
+    char *stats_file;  // JSON stats file rewritten every stats interval, NULL for none
+    int latency;       // Keep per thread latency histograms of the processing stages
+    int ring_autotune; // Size the rings and block timeout from the measured traffic
+    int ascii_max;     // Payload bytes shown in the payload_ascii of a record
+    char *vlans;       // Outermost VLAN ids to capture, "100,200-299", NULL for any
+    int decap_depth;   // Tunnels followed to the innermost packet, 0 to not decapsulate
+    char *reassembly;  // Fragment reassembly, "<MB>[,drop|first|last][,<seconds>s]", NULL for the defaults
+    char *tcp_streams; // TCP stream reassembly, "<bytes>|psh[,<MB>][,<KB>k][,<seconds>s]", NULL for none
+    char *flows;       // Flow records, "<flows>[,<idle>s[,<active>s]]" per thread, NULL for none
+    char *ipfix;       // IPFIX collector of the flow records, "<address>[:<port>]", NULL for none
+    char *patterns;    // Pattern file, payloads are searched for its patterns, NULL for none
+    char *dissect;     // Application protocols dissected, "http,dns,tls" or "all", NULL for none
 };
 
 
-#define sniffer_config_init() { (char *)"wlp3s0", (char *)"output/", 0, 1, 20, 0, 0.1, 0, 0, 100, 0.01}
-
-struct packet_info {
-    struct timespec ts;
-    uint32_t caplen;
-    uint32_t len; 
-    u_short is_valid;
-    u_short ip_version;
-    struct in_addr ip_src, ip_dst;
-    u_short protocol;
-    u_short ip_ttl;
-    u_short sport, dport;
-
-    uint32_t seq, ack_seq;
-    u_short doff;
-    u_short res1, res2;
-    u_short urg;
-    u_short ack;
-    u_short psh;
-    u_short rst;
-    u_short fin;
-    u_short syn;
-
-    int payload_size;
-    int ip_len;
-    unsigned char payload_ascii[512*8]; /*Not to be used during implementation */
-    unsigned char payload_hash[2*(SHA512_DIGEST_LENGTH + 1)];
-    // TODO use a union like data type for storing tcp and udp packet details
+#define sniffer_config_init() { (char *)"wlp3s0", (char *)"output/", 0, 1, 20, 0, 0.1, 0, NULL, 100, 0.01, NULL, 0, NULL, NULL, 0, 0, 0, NULL, 4, NULL, NULL, 3.0, NULL, NULL, 0, 0, 4096, NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL}
+
+struct app_fields;
+
+/* The packets of a block or batch, one array (column) per field, so
+ * that each stage only touches the fields it needs and loops over them
+ * in order. Payloads are not copied, they stay in the block the frames
+ * point into, so the block may only be handed back once the batch is
+ * logged. The payload dump and hash are rendered by whoever needs them,
+ * usually only for records that are written */
+struct packet_batch {
+    uint32_t count;
+    int16_t if_id;            /* Interface the packets came in on, see -c */
+
+    /* From the capture, filled before parsing */
+    const uint8_t **frame;    /* Ethernet header, or the IP payload of a reassembled datagram */
+    uint32_t *caplen;
+    uint32_t *len;
+    uint32_t *ts_sec, *ts_nsec;
+    uint16_t *vlan_id;        /* Outermost VLAN, 0 if none. Set here when the kernel stripped the tag */
+
+    /* From the headers, filled by parse_packet_batch() */
+    uint8_t *is_valid;        /* Passes the filters and gets logged */
+    uint8_t *ip_version;
+    uint8_t *protocol;        /* L4 protocol, after any IPv6 extension headers */
+    uint8_t *ip_ttl;          /* IPv6: hop limit */
+    uint16_t *ip_len;         /* IPv4: total length, IPv6: payload length */
+    uint32_t *ip_src, *ip_dst; /* IPv4, network byte order */
+    const uint8_t **ip6_addr; /* IPv6: source address in the frame, the destination follows */
+    uint16_t *sport, *dport;
+    uint32_t *seq, *ack_seq;
+    uint8_t *tcp_off;         /* Byte 12 of the TCP header: data offset and reserved bits */
+    uint8_t *tcp_flags;       /* Byte 13 of the TCP header, TH_FIN to TH_URG and ECN */
+    uint16_t *payload_off;    /* L4 payload, from the frame */
+    uint32_t *payload_size;   /* From the IP and L4 headers, cut to what was captured */
+
+    /* Outermost headers of tunneled packets, the ones above are those of
+     * the innermost packet. Only set when tunnel is not TUNNEL_NONE */
+    uint8_t *tunnel;          /* enum tunnel_type of the outermost tunnel */
+    uint8_t *outer_ip_version;
+    uint8_t *outer_protocol;
+    uint32_t *outer_ip_src, *outer_ip_dst;
+    const uint8_t **outer_ip6_addr;
+    uint16_t *outer_sport, *outer_dport; /* 0 for GRE and IP in IP */
+
+    /* Patterns found in the payload by match_packet_batch(), with -W */
+    uint8_t *match_count;     /* 0 when none, or not searched */
+    const uint32_t **match_ids; /* Their ids, in scratch memory */
+
+    /* Payload digests of the bloom filter, in modes 1 and 2, that the
+     * records reuse */
+    const struct payload_digest **payload_digest; /* NULL when the record hashes the payload. In scratch memory */
+
+    /* Application fields found by dissect_packet_batch(), with -y */
+    const struct app_fields **app; /* NULL when none, or not dissected. In scratch memory */
 };
 
 enum status{
@@ -0,0 +1,77 @@
+/*
+ * tcp_reassembly.h
+ *
+ * Header library for tcp_reassembly.c
+ */
+
+#ifndef TCP_REASSEMBLY_H
+#define TCP_REASSEMBLY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TCP_REASSEMBLY_DEFAULT_MB 64        /* Stream memory of each thread */
+#define TCP_REASSEMBLY_DEFAULT_FLOW_KB 256  /* Most bytes a stream buffers */
+#define TCP_REASSEMBLY_MIN_FLOW_KB 64       /* Room for the largest segment */
+#define TCP_REASSEMBLY_DEFAULT_TIMEOUT 60   /* Seconds a stream waits for a segment */
+
+struct tcp_reassembly_config {
+    uint32_t window;        /* Bytes of a message, 0 for messages that end with a PSH segment */
+    size_t memory;          /* Bytes of stream data per thread, 0 to not reassemble */
+    uint32_t flow_limit;    /* Bytes a stream may buffer, the longest message */
+    uint32_t timeout;       /* Seconds, see TCP_REASSEMBLY_DEFAULT_TIMEOUT */
+};
+
+/* Identifies a stream, one direction of a connection. Must be zeroed
+ * before it is filled in, it is hashed and compared as a whole */
+struct tcp_stream_key {
+    uint8_t addr[32];       /* Source then destination, IPv4 in the first 4 bytes of each */
+    uint16_t sport, dport;
+    uint16_t vlan_id;
+    int16_t if_id;
+    uint8_t version;
+    uint8_t pad[7];
+};
+
+/* A segment handed to tcp_reassembly_add() */
+struct tcp_segment {
+    struct tcp_stream_key key;
+    const uint8_t *data;    /* Payload, in the frame */
+    uint32_t len;
+    uint32_t seq;
+    uint8_t flags;          /* TH_FIN to TH_URG */
+    uint64_t ts_ns;         /* Capture time */
+};
+
+/* Called for every message a segment completes, with the message copied
+ * to the out arena and the sequence number of its first byte */
+typedef void (*tcp_message_fn)(void *ctx, const uint8_t *data, uint32_t len, uint32_t seq);
+
+/* Counters, single writer. Read them with tcp_reassembly_stats_add() */
+struct tcp_reassembly_stats {
+    uint64_t segments;      /* Segments with a payload */
+    uint64_t messages;      /* Messages emitted */
+    uint64_t streams;       /* Streams followed */
+    uint64_t gaps;          /* Holes skipped, for the flow limit or segments never seen */
+    uint64_t expired;       /* Streams whose segments stopped coming */
+    uint64_t evicted;       /* Streams dropped to make room */
+    uint64_t dropped;       /* Segments that found no room */
+};
+
+struct tcp_reassembly;
+struct arena;
+
+int tcp_reassembly_config_parse(const char *spec, struct tcp_reassembly_config *rc);
+
+struct tcp_reassembly *tcp_reassembly_create(const struct tcp_reassembly_config *rc, struct arena *out);
+
+void tcp_reassembly_free(struct tcp_reassembly *tr);
+
+void tcp_reassembly_add(struct tcp_reassembly *tr, const struct tcp_segment *seg,
+        tcp_message_fn emit, void *ctx);
+
+void tcp_reassembly_expire(struct tcp_reassembly *tr, uint64_t now_ns);
+
+void tcp_reassembly_stats_add(const struct tcp_reassembly *tr, struct tcp_reassembly_stats *sum);
+
+#endif /* TCP_REASSEMBLY_H */
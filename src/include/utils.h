@@ -1,9 +1,20 @@
 #ifndef SNIFFER_UTILS_H
 #define SNIFFER_UTILS_H
 
+#include <stdint.h>
+
 void get_readable_number_float(double power,
                                double input,
                                double *num_output,
                                char **str_output);
 
+uint64_t monotonic_ns(void);
+
+/* Hint to the CPU that we are in a spin-wait loop */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
 #endif
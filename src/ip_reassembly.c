@@ -0,0 +1,531 @@
+/*
+ * ip_reassembly.c
+ *
+ * Reassembly of fragmented IPv4 and IPv6 datagrams, so that a datagram
+ * is filtered, hashed and logged as a whole. Every processing thread
+ * has its own table, allocated once. Fragment data goes to fixed size
+ * pages of a pool, so a thread never holds more than its budget
+ * whatever the traffic. When the pool or the table runs out, incomplete
+ * datagrams are evicted: first those that only got one fragment, the
+ * longest waiting first, so that a flood of lone fragments can not push
+ * out datagrams that are making progress.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "include/ip_reassembly.h"
+#include "include/arena.h"
+#include "include/cpu_affinity.h"
+
+#define FRAG_PAGE_SIZE 1024
+#define FRAG_MAX_PAGES ((IP_REASSEMBLY_MAX_DATAGRAM + FRAG_PAGE_SIZE - 1) / FRAG_PAGE_SIZE)
+#define FRAG_MAX_RANGES 16      /* Disjoint pieces of a datagram received out of order */
+#define FRAG_MAX_FRAGMENTS 128  /* Fragments of a datagram, retransmissions included */
+#define FRAG_PAGES_PER_ENTRY 4  /* Pages of the average datagram the table is sized for */
+#define FRAG_MIN_ENTRIES 16
+#define FRAG_NIL UINT32_MAX
+
+/* Incomplete datagrams are on one of two lists, each in the order of
+ * their last fragment. Eviction takes from probation first */
+enum frag_list_id {
+    FRAG_PROBATION = 0,         /* A single fragment so far */
+    FRAG_PROTECTED = 1          /* More fragments came */
+};
+
+/* Bytes start to end - 1 of a datagram */
+struct frag_range {
+    uint32_t start, end;
+};
+
+struct frag_entry {
+    struct frag_key key;
+    uint32_t bucket;
+    uint32_t hnext;             /* Next entry of the hash bucket */
+    uint32_t prev, next;        /* In its list. Free entries are chained by next */
+    uint64_t last_ns;           /* Capture time of the last fragment */
+    uint32_t total;             /* Datagram length, 0 until the last fragment came */
+    uint16_t num_frags;
+    uint8_t num_ranges;
+    uint8_t list;               /* enum frag_list_id */
+    uint8_t protocol;           /* From the fragment at offset 0 */
+    struct frag_range ranges[FRAG_MAX_RANGES]; /* What was received, sorted and merged */
+    uint32_t pages[FRAG_MAX_PAGES]; /* Page of every FRAG_PAGE_SIZE bytes, FRAG_NIL if none yet */
+};
+
+struct frag_list {
+    uint32_t head, tail;
+};
+
+struct ip_reassembly {
+    struct ip_reassembly_config rc;
+    uint64_t timeout_ns;
+    uint64_t seed;              /* Of the hash, so that buckets can not be aimed at */
+    uint8_t *base;              /* Everything below lives in this mapping */
+    size_t size;
+    struct frag_entry *entries;
+    uint32_t num_entries;
+    uint32_t free_entry;
+    uint32_t *buckets;
+    uint32_t bucket_mask;
+    uint8_t *pages;
+    uint32_t num_pages;
+    uint32_t *free_pages;       /* Stack of the pages not in use */
+    uint32_t num_free_pages;
+    struct frag_list lists[2];
+    struct arena *out;          /* Complete datagrams are copied here */
+    struct ip_reassembly_stats stats;
+};
+
+static void count(uint64_t *counter){
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+static size_t round_up(size_t size){
+    return (size + 63) & ~(size_t)63;
+}
+
+/* Parses a reassembly spec of the form <MB>[,drop|first|last][,<seconds>s],
+ * for example "16,first" or "8,drop,60s". 0 MB turns reassembly off. A
+ * NULL spec gives the defaults */
+int ip_reassembly_config_parse(const char *spec, struct ip_reassembly_config *rc){
+    rc->memory = (size_t)IP_REASSEMBLY_DEFAULT_MB << 20;
+    rc->policy = FRAG_POLICY_DROP;
+    rc->timeout = IP_REASSEMBLY_DEFAULT_TIMEOUT;
+    if(spec == NULL){
+        return 0;
+    }
+
+    char buffer[128];
+    strncpy(buffer, spec, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+    char *saveptr, *end;
+    char *token = strtok_r(buffer, ",", &saveptr);
+    long mb = (token != NULL) ? strtol(token, &end, 10) : -1;
+    if(token == NULL || *end != '\0' || mb < 0 || mb > 65536){
+        fprintf(stderr, "error: invalid fragment memory in %s\n", spec);
+        return -1;
+    }
+    rc->memory = (size_t)mb << 20;
+
+    while((token = strtok_r(NULL, ",", &saveptr)) != NULL){
+        long seconds = strtol(token, &end, 10);
+        if(strcmp(token, "drop") == 0){
+            rc->policy = FRAG_POLICY_DROP;
+        } else if(strcmp(token, "first") == 0){
+            rc->policy = FRAG_POLICY_FIRST;
+        } else if(strcmp(token, "last") == 0){
+            rc->policy = FRAG_POLICY_LAST;
+        } else if(end != token && strcmp(end, "s") == 0 && seconds > 0 && seconds <= 3600){
+            rc->timeout = seconds;
+        } else {
+            fprintf(stderr, "error: unknown reassembly option %s\n", token);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Creates the table of a thread, with rc->memory bytes of pages. It
+ * should be called on the CPU of the thread that will use it.
+ * Reassembled datagrams are allocated from out */
+struct ip_reassembly *ip_reassembly_create(const struct ip_reassembly_config *rc, struct arena *out){
+    struct ip_reassembly *ra = (struct ip_reassembly *)calloc(1, sizeof(struct ip_reassembly));
+    if(ra == NULL){
+        return NULL;
+    }
+    ra->rc = *rc;
+    ra->timeout_ns = rc->timeout * 1000000000ULL;
+    ra->out = out;
+
+    /* Room for at least the largest datagram */
+    ra->num_pages = rc->memory / FRAG_PAGE_SIZE;
+    if(ra->num_pages < FRAG_MAX_PAGES){
+        ra->num_pages = FRAG_MAX_PAGES;
+    }
+    ra->num_entries = ra->num_pages / FRAG_PAGES_PER_ENTRY;
+    if(ra->num_entries < FRAG_MIN_ENTRIES){
+        ra->num_entries = FRAG_MIN_ENTRIES;
+    }
+    uint32_t num_buckets = 1;
+    while(num_buckets < 2 * ra->num_entries){
+        num_buckets <<= 1;
+    }
+    ra->bucket_mask = num_buckets - 1;
+
+    size_t entries_size = round_up(ra->num_entries * sizeof(struct frag_entry));
+    size_t buckets_size = round_up(num_buckets * sizeof(uint32_t));
+    size_t free_size = round_up(ra->num_pages * sizeof(uint32_t));
+    ra->size = entries_size + buckets_size + free_size + (size_t)ra->num_pages * FRAG_PAGE_SIZE;
+    ra->base = (uint8_t *)cpu_local_alloc(ra->size);
+    if(ra->base == NULL){
+        free(ra);
+        return NULL;
+    }
+    ra->entries = (struct frag_entry *)ra->base;
+    ra->buckets = (uint32_t *)(ra->base + entries_size);
+    ra->free_pages = (uint32_t *)(ra->base + entries_size + buckets_size);
+    ra->pages = ra->base + entries_size + buckets_size + free_size;
+
+    memset(ra->buckets, 0xff, num_buckets * sizeof(uint32_t));
+    for(uint32_t i = 0; i < ra->num_entries; i++){
+        ra->entries[i].next = (i + 1 < ra->num_entries) ? i + 1 : FRAG_NIL;
+    }
+    ra->free_entry = 0;
+    for(uint32_t i = 0; i < ra->num_pages; i++){
+        ra->free_pages[i] = ra->num_pages - 1 - i;
+    }
+    ra->num_free_pages = ra->num_pages;
+    ra->lists[FRAG_PROBATION].head = ra->lists[FRAG_PROBATION].tail = FRAG_NIL;
+    ra->lists[FRAG_PROTECTED].head = ra->lists[FRAG_PROTECTED].tail = FRAG_NIL;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ra->seed = ((uint64_t)ts.tv_sec << 32) ^ ts.tv_nsec ^ (uint64_t)(uintptr_t)ra;
+    return ra;
+}
+
+void ip_reassembly_free(struct ip_reassembly *ra){
+    if(ra == NULL){
+        return;
+    }
+    cpu_local_free(ra->base, ra->size);
+    free(ra);
+}
+
+static uint32_t frag_hash(const struct ip_reassembly *ra, const struct frag_key *key){
+    uint64_t h = ra->seed;
+    for(size_t off = 0; off < sizeof(struct frag_key); off += sizeof(uint64_t)){
+        uint64_t w;
+        memcpy(&w, (const uint8_t *)key + off, sizeof(w));
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    return (uint32_t)h & ra->bucket_mask;
+}
+
+static uint8_t *page_data(const struct ip_reassembly *ra, uint32_t page){
+    return ra->pages + (size_t)page * FRAG_PAGE_SIZE;
+}
+
+static void list_remove(struct ip_reassembly *ra, uint32_t idx){
+    struct frag_entry *e = &(ra->entries[idx]);
+    struct frag_list *l = &(ra->lists[e->list]);
+    if(e->prev != FRAG_NIL){
+        ra->entries[e->prev].next = e->next;
+    } else {
+        l->head = e->next;
+    }
+    if(e->next != FRAG_NIL){
+        ra->entries[e->next].prev = e->prev;
+    } else {
+        l->tail = e->prev;
+    }
+}
+
+static void list_append(struct ip_reassembly *ra, uint32_t idx, int list){
+    struct frag_entry *e = &(ra->entries[idx]);
+    struct frag_list *l = &(ra->lists[list]);
+    e->list = list;
+    e->prev = l->tail;
+    e->next = FRAG_NIL;
+    if(l->tail != FRAG_NIL){
+        ra->entries[l->tail].next = idx;
+    } else {
+        l->head = idx;
+    }
+    l->tail = idx;
+}
+
+static uint32_t entry_find(const struct ip_reassembly *ra, const struct frag_key *key, uint32_t bucket){
+    for(uint32_t idx = ra->buckets[bucket]; idx != FRAG_NIL; idx = ra->entries[idx].hnext){
+        if(memcmp(&(ra->entries[idx].key), key, sizeof(struct frag_key)) == 0){
+            return idx;
+        }
+    }
+    return FRAG_NIL;
+}
+
+/* Forgets entry idx, its pages go back to the pool */
+static void entry_release(struct ip_reassembly *ra, uint32_t idx){
+    struct frag_entry *e = &(ra->entries[idx]);
+    uint32_t *link = &(ra->buckets[e->bucket]);
+    while(*link != idx){
+        link = &(ra->entries[*link].hnext);
+    }
+    *link = e->hnext;
+    list_remove(ra, idx);
+    for(uint32_t p = 0; p < FRAG_MAX_PAGES; p++){
+        if(e->pages[p] != FRAG_NIL){
+            ra->free_pages[ra->num_free_pages++] = e->pages[p];
+        }
+    }
+    e->next = ra->free_entry;
+    ra->free_entry = idx;
+}
+
+/* The entry to evict to make room for exclude: the longest waiting of
+ * those with a single fragment, else of the others */
+static uint32_t entry_victim(const struct ip_reassembly *ra, uint32_t exclude){
+    for(int list = FRAG_PROBATION; list <= FRAG_PROTECTED; list++){
+        uint32_t idx = ra->lists[list].head;
+        if(idx != FRAG_NIL && idx == exclude){
+            idx = ra->entries[idx].next;
+        }
+        if(idx != FRAG_NIL){
+            return idx;
+        }
+    }
+    return FRAG_NIL;
+}
+
+static uint32_t entry_new(struct ip_reassembly *ra, const struct frag_key *key, uint32_t bucket){
+    if(ra->free_entry == FRAG_NIL){
+        entry_release(ra, entry_victim(ra, FRAG_NIL));
+        count(&(ra->stats.evicted));
+    }
+    uint32_t idx = ra->free_entry;
+    struct frag_entry *e = &(ra->entries[idx]);
+    ra->free_entry = e->next;
+    memcpy(&(e->key), key, sizeof(struct frag_key));
+    e->bucket = bucket;
+    e->hnext = ra->buckets[bucket];
+    ra->buckets[bucket] = idx;
+    e->total = 0;
+    e->num_frags = 0;
+    e->num_ranges = 0;
+    e->protocol = 0;
+    memset(e->pages, 0xff, sizeof(e->pages));
+    list_append(ra, idx, FRAG_PROBATION);
+    return idx;
+}
+
+/* Gives entry idx the pages for bytes start to end - 1, evicting other
+ * entries when the pool runs dry. Returns 0 if that is not enough */
+static int entry_reserve(struct ip_reassembly *ra, uint32_t idx, uint32_t start, uint32_t end){
+    struct frag_entry *e = &(ra->entries[idx]);
+    uint32_t needed = 0;
+    for(uint32_t p = start / FRAG_PAGE_SIZE; p <= (end - 1) / FRAG_PAGE_SIZE; p++){
+        needed += (e->pages[p] == FRAG_NIL);
+    }
+    while(ra->num_free_pages < needed){
+        uint32_t victim = entry_victim(ra, idx);
+        if(victim == FRAG_NIL){
+            return 0;
+        }
+        entry_release(ra, victim);
+        count(&(ra->stats.evicted));
+    }
+    for(uint32_t p = start / FRAG_PAGE_SIZE; p <= (end - 1) / FRAG_PAGE_SIZE; p++){
+        if(e->pages[p] == FRAG_NIL){
+            e->pages[p] = ra->free_pages[--ra->num_free_pages];
+        }
+    }
+    return 1;
+}
+
+/* Copies len bytes at offset off of the datagram of e from buf to its
+ * pages, or from its pages to buf */
+static void entry_copy(const struct ip_reassembly *ra, const struct frag_entry *e,
+        uint32_t off, uint8_t *buf, uint32_t len, int to_pages){
+    while(len > 0){
+        uint32_t in_page = off % FRAG_PAGE_SIZE;
+        uint32_t n = (FRAG_PAGE_SIZE - in_page < len) ? FRAG_PAGE_SIZE - in_page : len;
+        uint8_t *data = page_data(ra, e->pages[off / FRAG_PAGE_SIZE]) + in_page;
+        if(to_pages){
+            memcpy(data, buf, n);
+        } else {
+            memcpy(buf, data, n);
+        }
+        off += n;
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Whether the len bytes at offset off, all received, are those of buf */
+static int entry_equal(const struct ip_reassembly *ra, const struct frag_entry *e,
+        uint32_t off, const uint8_t *buf, uint32_t len){
+    while(len > 0){
+        uint32_t in_page = off % FRAG_PAGE_SIZE;
+        uint32_t n = (FRAG_PAGE_SIZE - in_page < len) ? FRAG_PAGE_SIZE - in_page : len;
+        if(memcmp(page_data(ra, e->pages[off / FRAG_PAGE_SIZE]) + in_page, buf, n) != 0){
+            return 0;
+        }
+        off += n;
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/* Copies the bytes of buf, at start of the datagram, that fall in the
+ * holes of what e received */
+static void entry_fill_holes(const struct ip_reassembly *ra, const struct frag_entry *e,
+        uint32_t start, const uint8_t *buf, uint32_t len){
+    uint32_t end = start + len, cursor = start;
+    for(uint32_t r = 0; r < e->num_ranges && e->ranges[r].start < end; r++){
+        if(e->ranges[r].end <= cursor){
+            continue;
+        }
+        if(e->ranges[r].start > cursor){
+            entry_copy(ra, e, cursor, (uint8_t *)buf + (cursor - start),
+                    e->ranges[r].start - cursor, 1);
+        }
+        cursor = e->ranges[r].end;
+    }
+    if(cursor < end){
+        entry_copy(ra, e, cursor, (uint8_t *)buf + (cursor - start), end - cursor, 1);
+    }
+}
+
+/* Whether start to end - 1 overlaps what e received, and if so whether
+ * it lies wholly inside a received range */
+static int range_overlap(const struct frag_entry *e, uint32_t start, uint32_t end, int *inside){
+    int overlap = 0;
+    *inside = 0;
+    for(uint32_t r = 0; r < e->num_ranges; r++){
+        if(e->ranges[r].start < end && e->ranges[r].end > start){
+            overlap = 1;
+            *inside |= (e->ranges[r].start <= start) & (e->ranges[r].end >= end);
+        }
+    }
+    return overlap;
+}
+
+/* Adds start to end - 1 to the received ranges of e, merging it with
+ * the ranges it touches. Returns 0 when that would make more than
+ * FRAG_MAX_RANGES of them */
+static int range_add(struct frag_entry *e, uint32_t start, uint32_t end){
+    uint32_t n = e->num_ranges, i = 0, j;
+    while(i < n && e->ranges[i].end < start){
+        i++;
+    }
+    for(j = i; j < n && e->ranges[j].start <= end; j++){
+        ;
+    }
+    if(j > i){
+        start = (e->ranges[i].start < start) ? e->ranges[i].start : start;
+        end = (e->ranges[j - 1].end > end) ? e->ranges[j - 1].end : end;
+    } else if(n == FRAG_MAX_RANGES){
+        return 0;
+    }
+    /* Ranges i to j - 1 become one */
+    memmove(&(e->ranges[i + 1]), &(e->ranges[j]), (n - j) * sizeof(struct frag_range));
+    e->ranges[i].start = start;
+    e->ranges[i].end = end;
+    e->num_ranges = n - (j - i) + 1;
+    return 1;
+}
+
+/* Adds a fragment. When it completes its datagram, returns the datagram,
+ * from the IP payload on, copied to the out arena, and sets its length
+ * and protocol. Returns NULL otherwise, the fragment being kept, a
+ * duplicate or dropped */
+const uint8_t *ip_reassembly_add(struct ip_reassembly *ra, const struct ip_fragment *frag,
+        uint32_t *len, uint8_t *protocol){
+    uint32_t start = frag->offset, end = frag->offset + frag->len;
+    count(&(ra->stats.fragments));
+    /* All fragments but the last carry a multiple of 8 bytes */
+    if(frag->len == 0 || end > frag->max_len || (frag->more && (frag->len & 7))){
+        count(&(ra->stats.dropped));
+        return NULL;
+    }
+
+    uint32_t bucket = frag_hash(ra, &(frag->key));
+    uint32_t idx = entry_find(ra, &(frag->key), bucket);
+    if(idx != FRAG_NIL && ra->entries[idx].last_ns + ra->timeout_ns <= frag->ts_ns){
+        /* Not swept yet, the fragment starts a new datagram */
+        entry_release(ra, idx);
+        count(&(ra->stats.expired));
+        idx = FRAG_NIL;
+    }
+    if(idx == FRAG_NIL){
+        idx = entry_new(ra, &(frag->key), bucket);
+    }
+    struct frag_entry *e = &(ra->entries[idx]);
+
+    /* The last fragment sets the length, no fragment may go past it */
+    uint32_t total = frag->more ? e->total : end;
+    int bad = (total != 0 && end > total) ||
+        (!frag->more && e->total != 0 && e->total != end) ||
+        (!frag->more && e->num_ranges > 0 && e->ranges[e->num_ranges - 1].end > end) ||
+        (++e->num_frags > FRAG_MAX_FRAGMENTS);
+
+    int inside = 0, overlap = !bad && range_overlap(e, start, end, &inside);
+    if(overlap && inside && entry_equal(ra, e, start, frag->data, frag->len)){
+        /* A retransmission, it changes nothing */
+        e->last_ns = frag->ts_ns;
+        list_remove(ra, idx);
+        list_append(ra, idx, e->list);
+        return NULL;
+    }
+    if(overlap && (ra->rc.policy == FRAG_POLICY_DROP || frag->key.version == 6)){
+        entry_release(ra, idx);
+        count(&(ra->stats.overlaps));
+        return NULL;
+    }
+    if(bad || !entry_reserve(ra, idx, start, end)){
+        entry_release(ra, idx);
+        count(&(ra->stats.dropped));
+        return NULL;
+    }
+    if(overlap && ra->rc.policy == FRAG_POLICY_FIRST){
+        entry_fill_holes(ra, e, start, frag->data, frag->len);
+    } else {
+        entry_copy(ra, e, start, (uint8_t *)frag->data, frag->len, 1);
+    }
+    int had_data = e->num_ranges > 0;
+    if(!range_add(e, start, end)){
+        entry_release(ra, idx);
+        count(&(ra->stats.dropped));
+        return NULL;
+    }
+    if(start == 0){
+        e->protocol = frag->protocol;
+    }
+    e->total = total;
+    e->last_ns = frag->ts_ns;
+    list_remove(ra, idx);
+    list_append(ra, idx, had_data ? FRAG_PROTECTED : FRAG_PROBATION);
+
+    if(total == 0 || e->num_ranges != 1 || e->ranges[0].start != 0 || e->ranges[0].end != total){
+        return NULL;
+    }
+    uint8_t *datagram = (uint8_t *)arena_alloc(ra->out, total);
+    entry_copy(ra, e, 0, datagram, total, 0);
+    *len = total;
+    *protocol = e->protocol;
+    entry_release(ra, idx);
+    count(&(ra->stats.datagrams));
+    return datagram;
+}
+
+/* Drops the incomplete datagrams that got no fragment for the timeout.
+ * The lists are in the order of the last fragment, so only their heads
+ * need looking at */
+void ip_reassembly_expire(struct ip_reassembly *ra, uint64_t now_ns){
+    for(int list = FRAG_PROBATION; list <= FRAG_PROTECTED; list++){
+        uint32_t idx;
+        while((idx = ra->lists[list].head) != FRAG_NIL &&
+                ra->entries[idx].last_ns + ra->timeout_ns <= now_ns){
+            entry_release(ra, idx);
+            count(&(ra->stats.expired));
+        }
+    }
+}
+
+/* Adds the counters of ra, which may be NULL, to sum */
+void ip_reassembly_stats_add(const struct ip_reassembly *ra, struct ip_reassembly_stats *sum){
+    if(ra == NULL){
+        return;
+    }
+    sum->fragments += __atomic_load_n(&(ra->stats.fragments), __ATOMIC_RELAXED);
+    sum->datagrams += __atomic_load_n(&(ra->stats.datagrams), __ATOMIC_RELAXED);
+    sum->expired += __atomic_load_n(&(ra->stats.expired), __ATOMIC_RELAXED);
+    sum->evicted += __atomic_load_n(&(ra->stats.evicted), __ATOMIC_RELAXED);
+    sum->overlaps += __atomic_load_n(&(ra->stats.overlaps), __ATOMIC_RELAXED);
+    sum->dropped += __atomic_load_n(&(ra->stats.dropped), __ATOMIC_RELAXED);
+}
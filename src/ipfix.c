@@ -0,0 +1,415 @@
+/*
+ * ipfix.c
+ *
+ * Export of flow records as IPFIX (RFC 7011) over UDP. Every thread
+ * that keeps a flow table has an exporter of its own, with its own
+ * socket and observation domain, so the packet path never waits on
+ * another thread. Records are packed into datagrams as their flows
+ * end; complete datagrams queue up and are handed to the kernel
+ * together with sendmmsg() at the end of the batch that completed
+ * them. A socket that can not keep up fills the queue, after which
+ * records are dropped and counted rather than stalling the capture.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "include/ipfix.h"
+#include "include/flow_table.h"
+
+#define IPFIX_VERSION 10
+#define IPFIX_HEADER_LEN 16
+#define IPFIX_SET_HEADER_LEN 4
+#define IPFIX_TEMPLATE_SET 2
+#define IPFIX_TEMPLATE_V4 256
+#define IPFIX_TEMPLATE_V6 257
+#define IPFIX_ENTERPRISE 0x8000
+
+/* Information elements (IANA IPFIX registry) */
+#define IE_OCTET_DELTA_COUNT 1
+#define IE_PACKET_DELTA_COUNT 2
+#define IE_PROTOCOL_IDENTIFIER 4
+#define IE_TCP_CONTROL_BITS 6
+#define IE_SOURCE_TRANSPORT_PORT 7
+#define IE_SOURCE_IPV4_ADDRESS 8
+#define IE_INGRESS_INTERFACE 10
+#define IE_DESTINATION_TRANSPORT_PORT 11
+#define IE_DESTINATION_IPV4_ADDRESS 12
+#define IE_SOURCE_IPV6_ADDRESS 27
+#define IE_DESTINATION_IPV6_ADDRESS 28
+#define IE_VLAN_ID 58
+#define IE_FLOW_END_REASON 136
+#define IE_FLOW_START_MILLISECONDS 152
+#define IE_FLOW_END_MILLISECONDS 153
+#define IE_DUPLICATE_PACKETS (IPFIX_ENTERPRISE | 1) /* Of IPFIX_PEN */
+
+struct ipfix_field {
+    uint16_t id;
+    uint16_t len;
+};
+
+/* The fields of a record, in order. The addresses are those of the
+ * version of the template */
+static const struct ipfix_field ipfix_fields[] = {
+    {IE_FLOW_START_MILLISECONDS, 8},
+    {IE_FLOW_END_MILLISECONDS, 8},
+    {IE_SOURCE_IPV4_ADDRESS, 4},
+    {IE_DESTINATION_IPV4_ADDRESS, 4},
+    {IE_SOURCE_TRANSPORT_PORT, 2},
+    {IE_DESTINATION_TRANSPORT_PORT, 2},
+    {IE_PROTOCOL_IDENTIFIER, 1},
+    {IE_TCP_CONTROL_BITS, 2},
+    {IE_INGRESS_INTERFACE, 4},
+    {IE_VLAN_ID, 2},
+    {IE_PACKET_DELTA_COUNT, 8},
+    {IE_OCTET_DELTA_COUNT, 8},
+    {IE_FLOW_END_REASON, 1},
+    {IE_DUPLICATE_PACKETS, 8}
+};
+
+#define IPFIX_NUM_FIELDS (sizeof(ipfix_fields) / sizeof(ipfix_fields[0]))
+#define IPFIX_RECORD_V4 62
+#define IPFIX_RECORD_V6 (IPFIX_RECORD_V4 + 2 * 12)
+
+struct ipfix_datagram {
+    uint8_t data[IPFIX_DATAGRAM_SIZE];
+    uint16_t len;
+};
+
+struct ipfix_exporter {
+    int fd;                     /* Connected to the collector */
+    uint32_t domain;            /* Observation domain, sequence numbers are counted per domain */
+    uint32_t sequence;          /* Data records before the next message */
+    struct ipfix_datagram *queue; /* Ring of IPFIX_QUEUE_DATAGRAMS */
+    uint32_t head, count;       /* Complete datagrams, oldest first */
+    int open;                   /* The datagram after them is being filled */
+    uint16_t set_off;           /* Of its open data set, 0 if none */
+    uint16_t set_id;
+    uint64_t opened_ms;         /* When it got its first record */
+    uint64_t template_ms;       /* When the templates were last sent, 0 never */
+    int flags;                  /* Of sendmmsg(), MSG_DONTWAIT until the exporter stops */
+    struct mmsghdr msgs[IPFIX_QUEUE_DATAGRAMS];
+    struct iovec iov[IPFIX_QUEUE_DATAGRAMS];
+    struct ipfix_stats stats;
+};
+
+static void count(uint64_t *counter, uint64_t n){
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static uint64_t now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static uint8_t *put16(uint8_t *p, uint16_t v){
+    v = htons(v);
+    memcpy(p, &v, 2);
+    return p + 2;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v){
+    v = htonl(v);
+    memcpy(p, &v, 4);
+    return p + 4;
+}
+
+static uint8_t *put64(uint8_t *p, uint64_t v){
+    p = put32(p, v >> 32);
+    return put32(p, (uint32_t)v);
+}
+
+/* Parses the collector, <IPv4 address>[:<port>] or [<IPv6 address>][:<port>],
+ * for example "127.0.0.1" or "[::1]:2055". A NULL spec turns the export
+ * off */
+int ipfix_config_parse(const char *spec, struct ipfix_config *xc){
+    memset(xc, 0, sizeof(struct ipfix_config));
+    if(spec == NULL){
+        return 0;
+    }
+
+    char host[INET6_ADDRSTRLEN];
+    const char *port = NULL;
+    const char *start = spec, *end;
+    if(spec[0] == '['){
+        start = spec + 1;
+        end = strchr(start, ']');
+        port = (end != NULL && end[1] == ':') ? end + 2 : NULL;
+        if(end == NULL || (end[1] != '\0' && port == NULL)){
+            fprintf(stderr, "error: invalid IPFIX collector %s\n", spec);
+            return -1;
+        }
+    } else {
+        end = strchr(spec, ':');
+        port = (end != NULL) ? end + 1 : NULL;
+        end = (end != NULL) ? end : spec + strlen(spec);
+    }
+    if((size_t)(end - start) >= sizeof(host)){
+        fprintf(stderr, "error: invalid IPFIX collector %s\n", spec);
+        return -1;
+    }
+    memcpy(host, start, end - start);
+    host[end - start] = '\0';
+
+    char *port_end;
+    long port_num = (port != NULL) ? strtol(port, &port_end, 10) : IPFIX_DEFAULT_PORT;
+    if(port != NULL && (*port_end != '\0' || port_end == port)){
+        port_num = -1;
+    }
+    if(port_num <= 0 || port_num > 65535){
+        fprintf(stderr, "error: invalid IPFIX collector port in %s\n", spec);
+        return -1;
+    }
+
+    struct sockaddr_in *sin = (struct sockaddr_in *)&(xc->collector);
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&(xc->collector);
+    if(inet_pton(AF_INET, host, &(sin->sin_addr)) == 1){
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port_num);
+        xc->collector_len = sizeof(struct sockaddr_in);
+    } else if(inet_pton(AF_INET6, host, &(sin6->sin6_addr)) == 1){
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port_num);
+        xc->collector_len = sizeof(struct sockaddr_in6);
+    } else {
+        fprintf(stderr, "error: invalid IPFIX collector address %s\n", host);
+        return -1;
+    }
+    return 0;
+}
+
+/* Creates the exporter of a thread, sending as observation domain
+ * domain. Each thread needs a domain of its own, collectors keep the
+ * templates and sequence numbers of an exporter per domain */
+struct ipfix_exporter *ipfix_exporter_create(const struct ipfix_config *xc, uint32_t domain){
+    struct ipfix_exporter *ex = (struct ipfix_exporter *)calloc(1, sizeof(struct ipfix_exporter));
+    if(ex == NULL){
+        return NULL;
+    }
+    ex->queue = (struct ipfix_datagram *)calloc(IPFIX_QUEUE_DATAGRAMS, sizeof(struct ipfix_datagram));
+    if(ex->queue == NULL){
+        free(ex);
+        return NULL;
+    }
+    ex->domain = domain;
+    ex->flags = MSG_DONTWAIT;
+    ex->fd = socket(xc->collector.ss_family, SOCK_DGRAM, 0);
+    if(ex->fd < 0 || connect(ex->fd, (const struct sockaddr *)&(xc->collector),
+                xc->collector_len) != 0){
+        fprintf(stderr, "%s: could not open the IPFIX socket\n", strerror(errno));
+        ipfix_exporter_free(ex);
+        return NULL;
+    }
+    return ex;
+}
+
+void ipfix_exporter_free(struct ipfix_exporter *ex){
+    if(ex == NULL){
+        return;
+    }
+    if(ex->fd >= 0){
+        close(ex->fd);
+    }
+    free(ex->queue);
+    free(ex);
+}
+
+/* Writes the template record of the IP version's template at p */
+static uint8_t *template_record(uint8_t *p, int version){
+    p = put16(p, (version == 6) ? IPFIX_TEMPLATE_V6 : IPFIX_TEMPLATE_V4);
+    p = put16(p, IPFIX_NUM_FIELDS);
+    for(size_t f = 0; f < IPFIX_NUM_FIELDS; f++){
+        struct ipfix_field field = ipfix_fields[f];
+        if(version == 6 && field.id == IE_SOURCE_IPV4_ADDRESS){
+            field = (struct ipfix_field){IE_SOURCE_IPV6_ADDRESS, 16};
+        } else if(version == 6 && field.id == IE_DESTINATION_IPV4_ADDRESS){
+            field = (struct ipfix_field){IE_DESTINATION_IPV6_ADDRESS, 16};
+        }
+        p = put16(p, field.id);
+        p = put16(p, field.len);
+        if(field.id & IPFIX_ENTERPRISE){
+            p = put32(p, IPFIX_PEN);
+        }
+    }
+    return p;
+}
+
+static struct ipfix_datagram *open_datagram(struct ipfix_exporter *ex){
+    return &(ex->queue[(ex->head + ex->count) % IPFIX_QUEUE_DATAGRAMS]);
+}
+
+/* Completes the lengths of the open data set */
+static void close_set(struct ipfix_exporter *ex, struct ipfix_datagram *d){
+    if(ex->set_off != 0){
+        put16(d->data + ex->set_off + 2, d->len - ex->set_off);
+        ex->set_off = 0;
+    }
+}
+
+/* Completes the open datagram and queues it for sending */
+static void close_datagram(struct ipfix_exporter *ex){
+    struct ipfix_datagram *d = open_datagram(ex);
+    close_set(ex, d);
+    put16(d->data + 2, d->len);
+    put32(d->data + 4, (uint32_t)time(NULL));
+    ex->open = 0;
+    ex->count++;
+}
+
+/* Starts a datagram in the free slot after the queued ones, with the
+ * templates when they are due */
+static void start_datagram(struct ipfix_exporter *ex){
+    struct ipfix_datagram *d = open_datagram(ex);
+    uint8_t *p = d->data;
+    p = put16(p, IPFIX_VERSION);
+    p = put16(p, 0);                    /* Length, when complete */
+    p = put32(p, 0);                    /* Export time, likewise */
+    p = put32(p, ex->sequence);
+    p = put32(p, ex->domain);
+
+    uint64_t now = now_ms();
+    if(ex->template_ms == 0 || now - ex->template_ms >= IPFIX_TEMPLATE_REFRESH * 1000ULL){
+        uint8_t *set = p;
+        p = template_record(set + IPFIX_SET_HEADER_LEN, 4);
+        p = template_record(p, 6);
+        put16(set, IPFIX_TEMPLATE_SET);
+        put16(set + 2, p - set);
+        ex->template_ms = now;
+    }
+    d->len = p - d->data;
+    ex->set_off = 0;
+    ex->opened_ms = now;
+    ex->open = 1;
+}
+
+/* Hands the queued datagrams to the kernel. A refused datagram is
+ * given a second chance, the error may be that of an earlier one */
+static void send_datagrams(struct ipfix_exporter *ex){
+    int retried = 0;
+    while(ex->count > 0){
+        for(uint32_t k = 0; k < ex->count; k++){
+            struct ipfix_datagram *d = &(ex->queue[(ex->head + k) % IPFIX_QUEUE_DATAGRAMS]);
+            ex->iov[k].iov_base = d->data;
+            ex->iov[k].iov_len = d->len;
+            memset(&(ex->msgs[k].msg_hdr), 0, sizeof(struct msghdr));
+            ex->msgs[k].msg_hdr.msg_iov = &(ex->iov[k]);
+            ex->msgs[k].msg_hdr.msg_iovlen = 1;
+        }
+        int sent = sendmmsg(ex->fd, ex->msgs, ex->count, ex->flags);
+        if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS ||
+                    errno == EINTR)){
+            return;
+        }
+        if(sent < 0){
+            if(!retried){
+                retried = 1;
+                continue;
+            }
+            sent = 1;   /* Dropped */
+            count(&(ex->stats.errors), 1);
+        } else {
+            count(&(ex->stats.datagrams), sent);
+        }
+        ex->head = (ex->head + sent) % IPFIX_QUEUE_DATAGRAMS;
+        ex->count -= sent;
+    }
+}
+
+/* Adds the record of a flow that ended to the open datagram */
+void ipfix_exporter_add(struct ipfix_exporter *ex, const struct flow_record *rec){
+    const struct flow_key *key = &(rec->key);
+    uint16_t template_id = (key->version == 6) ? IPFIX_TEMPLATE_V6 : IPFIX_TEMPLATE_V4;
+    uint32_t record_len = (key->version == 6) ? IPFIX_RECORD_V6 : IPFIX_RECORD_V4;
+
+    struct ipfix_datagram *d = open_datagram(ex);
+    uint32_t need = record_len + ((ex->set_off != 0 && ex->set_id == template_id) ?
+            0 : IPFIX_SET_HEADER_LEN);
+    if(ex->open && d->len + need > IPFIX_DATAGRAM_SIZE){
+        close_datagram(ex);
+    }
+    if(!ex->open){
+        if(ex->count == IPFIX_QUEUE_DATAGRAMS){
+            send_datagrams(ex);
+        }
+        if(ex->count == IPFIX_QUEUE_DATAGRAMS){
+            /* Counted in the sequence all the same, which is how the
+             * collector learns of the loss */
+            ex->sequence++;
+            count(&(ex->stats.dropped), 1);
+            return;
+        }
+        start_datagram(ex);
+        d = open_datagram(ex);
+    }
+    if(ex->set_off == 0 || ex->set_id != template_id){
+        close_set(ex, d);
+        ex->set_off = d->len;
+        ex->set_id = template_id;
+        put16(d->data + d->len, template_id);
+        d->len += IPFIX_SET_HEADER_LEN;
+    }
+
+    uint8_t *p = d->data + d->len;
+    p = put64(p, rec->first_ns / 1000000);
+    p = put64(p, rec->last_ns / 1000000);
+    /* Addresses are kept in network byte order */
+    if(key->version == 6){
+        memcpy(p, key->addr, 16);
+        memcpy(p + 16, key->addr + 16, 16);
+        p += 32;
+    } else {
+        memcpy(p, key->addr, 4);
+        memcpy(p + 4, key->addr + 16, 4);
+        p += 8;
+    }
+    p = put16(p, key->sport);
+    p = put16(p, key->dport);
+    *p++ = key->protocol;
+    p = put16(p, rec->tcp_flags);
+    p = put32(p, key->if_id);
+    p = put16(p, key->vlan_id);
+    p = put64(p, rec->packets);
+    p = put64(p, rec->bytes);
+    *p++ = rec->end_reason;
+    p = put64(p, rec->dup_packets);
+    d->len = p - d->data;
+    ex->sequence++;
+    count(&(ex->stats.records), 1);
+}
+
+/* Sends the complete datagrams, and the open one when force is set or
+ * its first record waited IPFIX_FLUSH_MS */
+void ipfix_exporter_flush(struct ipfix_exporter *ex, int force){
+    if(ex->open && (force || now_ms() - ex->opened_ms >= IPFIX_FLUSH_MS)){
+        close_datagram(ex);
+    }
+    if(ex->count > 0){
+        send_datagrams(ex);
+    }
+}
+
+/* From now on sends wait for the socket rather than leave datagrams
+ * queued, for the records of the flows still going at exit */
+void ipfix_exporter_stop(struct ipfix_exporter *ex){
+    ex->flags = 0;
+}
+
+/* Adds the counters of ex, which may be NULL, to sum */
+void ipfix_stats_add(const struct ipfix_exporter *ex, struct ipfix_stats *sum){
+    if(ex == NULL){
+        return;
+    }
+    sum->records += __atomic_load_n(&(ex->stats.records), __ATOMIC_RELAXED);
+    sum->datagrams += __atomic_load_n(&(ex->stats.datagrams), __ATOMIC_RELAXED);
+    sum->dropped += __atomic_load_n(&(ex->stats.dropped), __ATOMIC_RELAXED);
+    sum->errors += __atomic_load_n(&(ex->stats.errors), __ATOMIC_RELAXED);
+}
@@ -1,131 +1,308 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <pthread.h>
 #include <pcap/pcap.h>
 #include <openssl/sha.h>
 #include <string.h>
+#include <errno.h>
 #include <time.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
 #include "include/json_file_io.h"
 #include "include/sniffer.h"
 #include "include/bloom_filter.h"
+#include "include/ascii_dump.h"
+#include "include/sha512.h"
+#include "include/latency.h"
+#include "include/arena.h"
+#include "include/pkt_processing.h"
+#include "include/flow_table.h"
+#include "include/dissect.h"
 
-#define MAX_JSON_STRING_SIZE 65536
-#define MAX_FIELD_SIZE 65536
 #define ENTRIES_PER_LOG 10000000
+#define LOG_BUFFER_SIZE (1 << 20)
 
-int write_json(const char *json_string, struct log_file *log){
+/* Builds the name of a log file. Logs owned by a single thread
+ * carry the thread number so that threads never share a file */
+static void log_file_name(struct log_file *log, const char *prefix, time_t rawtime){
+    if(log->tnum < 0)
+        sprintf(log->filename, "%s%s%ld.json", log->dirname, prefix, rawtime);
+    else
+        sprintf(log->filename, "%s%s%ld_t%d.json", log->dirname, prefix, rawtime, log->tnum);
+}
+
+/* Creates a log file descriptor. mode 1 is the packet log, mode 2 the
+ * duplicate packet log, mode 3 the flow log. tnum is -1 for a log
+ * shared by all threads */
+struct log_file *log_file_create(const char *dirname, int mode, int tnum, time_t rawtime){
+    struct log_file *log = (struct log_file *)calloc(1, sizeof(struct log_file));
+    if(!log){
+        perror("could not allocate memory for log file\n");
+        exit(255);
+    }
+    strcpy(log->dirname, dirname);
+    log->mode = mode;
+    log->tnum = tnum;
+    log_file_name(log, mode == 1 ? "log" : (mode == 2 ? "dup_pkt_log" : "flow_log"), rawtime);
+    return log;
+}
+
+/* Opens the current file of log. The stream stays open, with a large
+ * buffer, until the log rotates or is freed */
+static FILE *log_file_open(struct log_file *log){
+    FILE *fp = fopen(log->filename, "a");
+    if(!fp){
+        fprintf(stderr, "%s: could not open log file %s\n", strerror(errno), log->filename);
+        return NULL;
+    }
+    if(log->buffer == NULL){
+        log->buffer = (char *)malloc(LOG_BUFFER_SIZE);
+    }
+    if(log->buffer != NULL){
+        setvbuf(fp, log->buffer, _IOFBF, LOG_BUFFER_SIZE);
+    }
+    return fp;
+}
+
+void log_file_free(struct log_file *log){
+    if(log == NULL){
+        return;
+    }
+    if(log->fp != NULL){
+        fclose(log->fp);
+    }
+    free(log->buffer);
+    free(log);
+}
+
+/* Longest record, with the longest application fields and payload dump */
+size_t json_record_max(void){
+    return JSON_RECORD_FIELDS + DISSECT_JSON_MAX + ascii_dump_max() + 1;
+}
+
+int write_json(const char *json_string, int len, struct log_file *log){
     log->pkt_count = (log->pkt_count + 1) % ENTRIES_PER_LOG;
+    /* Only one thread writes a log at a time */
+    __atomic_store_n(&(log->records), log->records + 1, __ATOMIC_RELAXED);
 	if(log->pkt_count == 0){
 		time_t rawtime;
 		time(&rawtime);
 		strcpy(log->filename, "");
 		if(log->mode == 1)
-			sprintf(log->filename, "%spkt_log%ld.json", log->dirname, rawtime);
+			log_file_name(log, "pkt_log", rawtime);
 		else if(log->mode == 2)
-			sprintf(log->filename, "%sdup_pkt_log%ld.json", log->dirname, rawtime);
+			log_file_name(log, "dup_pkt_log", rawtime);
+		else if(log->mode == 3)
+			log_file_name(log, "flow_log", rawtime);
+        if(log->fp != NULL){
+            fclose(log->fp);
+            log->fp = NULL;
+        }
 	}
 	
-    // create file if it doesn't exist
-    FILE* fp = fopen(log->filename, "r"); 
-    if (!fp)
-    {
-       fp = fopen(log->filename, "w"); 
-    } 
-    fclose(fp);
-    
-    // add the document to the file
-    fp = fopen(log->filename, "a");
-    if (fp)
-    {
-        // append the document
-        fputs(json_string, fp);
-        fputs("\n", fp);     
+    if(log->fp == NULL){
+        log->fp = log_file_open(log);
+        if(log->fp == NULL){
+            return -1;
+        }
     }
-    fclose(fp);
+    fwrite(json_string, 1, len, log->fp);
+    fputc('\n', log->fp);
 
     return 0;
 }
 
-int extract_packet(struct packet_info *pi, char *json_string){
-	char text[MAX_FIELD_SIZE] = "";
-    sprintf(text, "{\"timestamp\":%lld.%.9ld,", (long long)pi->ts.tv_sec, pi->ts.tv_nsec);
-    strcpy(json_string, text);
-
-    sprintf(text, "\"s_ip\":\"%s\",", inet_ntoa(pi->ip_src));
-    strcat(json_string, text);
-
-    sprintf(text, "\"d_ip\":\"%s\",", inet_ntoa(pi->ip_dst));
-    strcat(json_string, text);
-
-    sprintf(text, "\"ip_version\":%d,", pi->ip_version);
-    strcat(json_string, text);
+/* Formats an IPv4 address pair, or the IPv6 one at ip6 */
+static void format_ip_pair(int version, uint32_t src, uint32_t dst, const uint8_t *ip6,
+        char *s_ip, char *d_ip){
+    if(version == 6){
+        inet_ntop(AF_INET6, ip6, s_ip, INET6_ADDRSTRLEN);
+        inet_ntop(AF_INET6, ip6 + 16, d_ip, INET6_ADDRSTRLEN);
+    } else {
+        inet_ntop(AF_INET, &src, s_ip, INET6_ADDRSTRLEN);
+        inet_ntop(AF_INET, &dst, d_ip, INET6_ADDRSTRLEN);
+    }
+}
 
-    sprintf(text, "\"protocol\":%d,", pi->protocol);
-    strcat(json_string, text);
-    
-    sprintf(text, "\"s_port\":%d, \"d_port\":%d,", 
-            pi->sport, pi->dport);
-    strcat(json_string, text);
+/* Builds the record of packet i of b in json_string, which has room for
+ * json_record_max() bytes, and returns its length. The application
+ * fields, payload dump and hash are rendered here, so only packets that
+ * are logged pay for them. lat, when not NULL, gets the hashing time */
+int extract_packet(const struct packet_batch *b, uint32_t i, char *json_string,
+        struct latency_recorder *lat){
+    int size = json_record_max();
+    int len = 0;
+    char s_ip[INET6_ADDRSTRLEN], d_ip[INET6_ADDRSTRLEN];
+    format_ip_pair(b->ip_version[i], b->ip_src[i], b->ip_dst[i], b->ip6_addr[i], s_ip, d_ip);
+    len += snprintf(json_string + len, size - len,
+            "{\"timestamp\":%lld.%.9ld,", (long long)b->ts_sec[i], (long)b->ts_nsec[i]);
+    len += snprintf(json_string + len, size - len, "\"if_id\":%d,", b->if_id);
+    if(b->vlan_id[i] != 0){
+        len += snprintf(json_string + len, size - len, "\"vlan_id\":%d,", b->vlan_id[i]);
+    }
+    len += snprintf(json_string + len, size - len,
+            "\"s_ip\":\"%s\",", s_ip);
+    len += snprintf(json_string + len, size - len,
+            "\"d_ip\":\"%s\",", d_ip);
+    len += snprintf(json_string + len, size - len,
+            "\"ip_version\":%d,", b->ip_version[i]);
+    len += snprintf(json_string + len, size - len, "\"protocol\":%d,", b->protocol[i]);
+    len += snprintf(json_string + len, size - len,
+            "\"s_port\":%d, \"d_port\":%d,", b->sport[i], b->dport[i]);
+    if(b->tunnel[i] != TUNNEL_NONE){
+        /* The fields above are those of the innermost packet */
+        format_ip_pair(b->outer_ip_version[i], b->outer_ip_src[i], b->outer_ip_dst[i],
+                b->outer_ip6_addr[i], s_ip, d_ip);
+        len += snprintf(json_string + len, size - len,
+                "\"tunnel\":\"%s\",\"outer_s_ip\":\"%s\",\"outer_d_ip\":\"%s\","
+                "\"outer_ip_version\":%d,\"outer_protocol\":%d,"
+                "\"outer_s_port\":%d, \"outer_d_port\":%d,",
+                tunnel_name(b->tunnel[i]), s_ip, d_ip, b->outer_ip_version[i],
+                b->outer_protocol[i], b->outer_sport[i], b->outer_dport[i]);
+    }
     
-    if(pi->protocol == IPPROTO_TCP){
-        sprintf(text, "\"seq\":%d, \"ack_seq\":%d,",
-                pi->seq, pi->ack_seq);
-        strcat(json_string, text);
-
-        sprintf(text, "\"doff\":%d, \"res1\":%d,",
-                pi->doff, pi->res1);
-        strcat(json_string, text);
-
-        sprintf(text, "\"res2\":%d, \"urg\":%d,",
-            pi->res2, pi->urg);
-        strcat(json_string, text);
-
-        sprintf(text, "\"ack\":%d, \"psh\":%d,",
-            pi->ack, pi->psh);
-        strcat(json_string, text);
-
-        sprintf(text, "\"syn\":%d, \"rst\":%d, \"fin\":%d,",
-                pi->syn, pi->rst, pi->fin);
-		strcat(json_string, text);
-
+    if(b->protocol[i] == IPPROTO_TCP){
+        uint8_t off = b->tcp_off[i], flags = b->tcp_flags[i];
+        len += snprintf(json_string + len, size - len,
+                "\"seq\":%u, \"ack_seq\":%u,"
+                "\"doff\":%d, \"res1\":%d,"
+                "\"res2\":%d, \"urg\":%d,"
+                "\"ack\":%d, \"psh\":%d,"
+                "\"syn\":%d, \"rst\":%d, \"fin\":%d,",
+                b->seq[i], b->ack_seq[i], off >> 4, off & 0x0f, flags >> 6,
+                (flags & TH_URG) != 0, (flags & TH_ACK) != 0, (flags & TH_PUSH) != 0,
+                (flags & TH_SYN) != 0, (flags & TH_RST) != 0, (flags & TH_FIN) != 0);
     }
 
-    sprintf(text, "\"payload_size\":%d,", pi->payload_size);
-    strcat(json_string, text);
+    if(b->match_count[i] > 0){
+        len += snprintf(json_string + len, size - len, "\"matches\":[");
+        for(uint32_t k = 0; k < b->match_count[i]; k++){
+            len += snprintf(json_string + len, size - len, (k > 0) ? ",%u" : "%u",
+                    b->match_ids[i][k]);
+        }
+        len += snprintf(json_string + len, size - len, "],");
+    }
 
-    sprintf(text, "\"payload_ascii\":\"%s\",", pi->payload_ascii);
-    strcat(json_string, text);
+    const uint8_t *payload = b->frame[i] + b->payload_off[i];
+    if(b->app[i] != NULL){
+        len += app_fields_json(b->app[i], payload, json_string + len, DISSECT_JSON_MAX);
+    }
+    len += snprintf(json_string + len, size - len, "\"payload_size\":%u,", b->payload_size[i]);
+    /* -D 0 leaves the dump out */
+    if(ascii_dump_max() > 0){
+        len += snprintf(json_string + len, size - len, "\"payload_ascii\":\"");
+        len += ascii_dump(payload, b->payload_size[i], json_string + len);
+        len += snprintf(json_string + len, size - len, "\",");
+    }
 
-    sprintf(text, "\"payload_hash\":\"%s\"}", pi->payload_hash);
-    strcat(json_string, text);
+    /* Packets of the bloom filter modes were hashed already */
+    char payload_hash[SHA512_HEX_LENGTH];
+    if(b->payload_digest[i] != NULL){
+        sha512_hex(b->payload_digest[i], payload_hash);
+    } else {
+        uint64_t hash_start = latency_start(lat);
+        sha512(payload, b->payload_size[i], payload_hash);
+        latency_end(lat, lat_hash, hash_start);
+    }
+    len += snprintf(json_string + len, size - len,
+            "\"payload_hash\":\"%s\"}", payload_hash);
 
-	return 0;
+	return len;
 }
 
-int write_packet_info(struct packet_info *pi, int num_pkts, 
-		struct log_file *log, pthread_mutex_t *lock){
+/* Logs the valid packets among count packets of b from first on. lat,
+ * when not NULL, gets the time spent extracting and writing the
+ * records and waiting for the lock. The record is built in scratch
+ * memory, which is given back before returning */
+int write_packet_info(const struct packet_batch *b, uint32_t first, uint32_t count,
+		struct log_file *log, pthread_mutex_t *lock, struct latency_recorder *lat,
+        struct arena *scratch){
     
-    char json_string[MAX_JSON_STRING_SIZE] = "";
+    size_t mark = arena_mark(scratch);
+    char *json_string = (char *)arena_alloc(scratch, json_record_max());
 
     int err;
-    err = pthread_mutex_lock(lock);
-    if(err != 0){
-        fprintf(stderr, "%s: error acquiring hash add lock\n",
-                strerror(err));
-    } 
-	for(int i=0; i<num_pkts; i++){
-		strcpy(json_string, "");
-		if(pi[i].is_valid){
-			extract_packet(&(pi[i]), json_string);
-			write_json(json_string, log);
+    /* lock is NULL when the log is owned by the calling thread */
+    if(lock != NULL){
+        uint64_t lock_start = latency_start(lat);
+        err = pthread_mutex_lock(lock);
+        if(err != 0){
+            fprintf(stderr, "%s: error acquiring hash add lock\n",
+                    strerror(err));
+        } 
+        latency_end(lat, lat_log_lock, lock_start);
+    }
+	for(uint32_t i=first; i<first + count; i++){
+		if(b->is_valid[i]){
+			uint64_t start = latency_start(lat);
+			int len = extract_packet(b, i, json_string, lat);
+			latency_end(lat, lat_extract, start);
+			start = latency_start(lat);
+			write_json(json_string, len, log);
+			latency_end(lat, lat_write, start);
 		}
 	}
-    err = pthread_mutex_unlock(lock);
-    if(err != 0){
-        fprintf(stderr, "%s: error releasing file write lock\n",
-                strerror(err));
-    } 
+    /* One write for the batch, and the file is current between batches */
+    if(log->fp != NULL){
+        fflush(log->fp);
+    }
+    if(lock != NULL){
+        err = pthread_mutex_unlock(lock);
+        if(err != 0){
+            fprintf(stderr, "%s: error releasing file write lock\n",
+                    strerror(err));
+        } 
+    }
+    arena_rewind(scratch, mark);
     sniffer_debug("Extracted packet details in write_packet_info \n");    
     return 0;         
 }
+
+static const char *flow_end_reason_name(int reason){
+    switch(reason){
+        case FLOW_END_IDLE: return "idle";
+        case FLOW_END_ACTIVE: return "active";
+        case FLOW_END_FORCED: return "forced";
+        case FLOW_END_RESOURCES: return "evicted";
+        default: return "unknown";
+    }
+}
+
+/* Logs the record of a flow that ended. The caller holds the log's lock
+ * when it is shared, and flushes it */
+int write_flow_record(const struct flow_record *rec, struct log_file *log){
+    char json_string[JSON_RECORD_FIELDS];
+    int size = sizeof(json_string);
+    int len = 0;
+    char s_ip[INET6_ADDRSTRLEN], d_ip[INET6_ADDRSTRLEN];
+    uint32_t src, dst;
+    memcpy(&src, rec->key.addr, 4);
+    memcpy(&dst, rec->key.addr + 16, 4);
+    format_ip_pair(rec->key.version, src, dst, rec->key.addr, s_ip, d_ip);
+    len += snprintf(json_string + len, size - len,
+            "{\"flow_start\":%llu.%.9llu,\"flow_end\":%llu.%.9llu,",
+            (unsigned long long)(rec->first_ns / 1000000000ULL),
+            (unsigned long long)(rec->first_ns % 1000000000ULL),
+            (unsigned long long)(rec->last_ns / 1000000000ULL),
+            (unsigned long long)(rec->last_ns % 1000000000ULL));
+    len += snprintf(json_string + len, size - len, "\"if_id\":%d,", rec->key.if_id);
+    if(rec->key.vlan_id != 0){
+        len += snprintf(json_string + len, size - len, "\"vlan_id\":%d,", rec->key.vlan_id);
+    }
+    len += snprintf(json_string + len, size - len,
+            "\"s_ip\":\"%s\",\"d_ip\":\"%s\",\"ip_version\":%d,\"protocol\":%d,"
+            "\"s_port\":%d, \"d_port\":%d,",
+            s_ip, d_ip, rec->key.version, rec->key.protocol, rec->key.sport, rec->key.dport);
+    len += snprintf(json_string + len, size - len,
+            "\"packets\":%llu,\"bytes\":%llu,",
+            (unsigned long long)rec->packets, (unsigned long long)rec->bytes);
+    if(rec->key.protocol == IPPROTO_TCP){
+        len += snprintf(json_string + len, size - len, "\"tcp_flags\":%d,", rec->tcp_flags);
+    }
+    len += snprintf(json_string + len, size - len,
+            "\"dup_packets\":%llu,\"end_reason\":\"%s\"}",
+            (unsigned long long)rec->dup_packets, flow_end_reason_name(rec->end_reason));
+    return write_json(json_string, len, log);
+}
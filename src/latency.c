@@ -0,0 +1,125 @@
+/*
+ * latency.c
+ *
+ * Per thread latency histograms of the processing stages. Recording is
+ * a bucket lookup and a counter increment on memory owned by the
+ * thread; quantiles are worked out by the stats thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "include/latency.h"
+#include "include/cpu_affinity.h"
+#include "include/utils.h"
+
+const char *latency_stage_names[lat_num_stages] = {
+    "block", "packet", "parse", "hash", "bloom", "extract", "write", "log_lock", "match", "dissect"
+};
+
+static double ticks_per_ns = 1.0;
+
+/* Measures the timestamp counter against the monotonic clock */
+void latency_calibrate(void){
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec nap = { 0, 20000000 }; /* 20 ms */
+    uint64_t ns_start = monotonic_ns();
+    uint64_t ticks_start = latency_now();
+    nanosleep(&nap, NULL);
+    uint64_t ticks = latency_now() - ticks_start;
+    uint64_t ns = monotonic_ns() - ns_start;
+    if(ns > 0 && ticks > 0){
+        ticks_per_ns = (double)ticks / (double)ns;
+    }
+#endif
+    fprintf(stderr, "Latency histograms: %.3f ticks per nanosecond\n", ticks_per_ns);
+}
+
+/* Allocates a recorder local to the calling thread's NUMA node */
+struct latency_recorder *latency_recorder_create(void){
+    return (struct latency_recorder *)cpu_local_alloc(sizeof(struct latency_recorder));
+}
+
+void latency_recorder_free(struct latency_recorder *lat){
+    cpu_local_free(lat, sizeof(struct latency_recorder));
+}
+
+/* Copies the counts of a recorder that its thread keeps updating */
+void latency_copy(struct latency_hist *dst, const struct latency_recorder *src){
+    for(int s = 0; s < lat_num_stages; s++){
+        for(uint32_t b = 0; b < LATENCY_BUCKETS; b++){
+            dst[s].counts[b] = __atomic_load_n(&(src->stages[s].counts[b]), __ATOMIC_RELAXED);
+        }
+        dst[s].ticks = __atomic_load_n(&(src->stages[s].ticks), __ATOMIC_RELAXED);
+    }
+}
+
+/* Adds the counts of src to dst, e.g. to merge threads */
+void latency_merge(struct latency_hist *dst, const struct latency_hist *src){
+    for(uint32_t b = 0; b < LATENCY_BUCKETS; b++){
+        dst->counts[b] += src->counts[b];
+    }
+    dst->ticks += src->ticks;
+}
+
+/* Smallest and largest value of a bucket, in ticks */
+static uint64_t bucket_low(uint32_t b){
+    if(b < LATENCY_SUB_BUCKETS){
+        return b;
+    }
+    uint32_t shift = b / LATENCY_SUB_BUCKETS - 1;
+    return (uint64_t)(LATENCY_SUB_BUCKETS + b % LATENCY_SUB_BUCKETS) << shift;
+}
+
+static uint64_t bucket_high(uint32_t b){
+    if(b < LATENCY_SUB_BUCKETS){
+        return b;
+    }
+    uint32_t shift = b / LATENCY_SUB_BUCKETS - 1;
+    return bucket_low(b) + (1ULL << shift) - 1;
+}
+
+/* Value at quantile q of the counts, the middle of its bucket */
+static double quantile(const uint64_t *counts, uint64_t total, double q){
+    uint64_t rank = (uint64_t)(q * total);
+    if(rank >= total){
+        rank = total - 1;
+    }
+    uint64_t seen = 0;
+    for(uint32_t b = 0; b < LATENCY_BUCKETS; b++){
+        seen += counts[b];
+        if(seen > rank){
+            return (bucket_low(b) + bucket_high(b)) / 2.0;
+        }
+    }
+    return bucket_high(LATENCY_BUCKETS - 1);
+}
+
+/* Quantiles of the values recorded between the copies before and now.
+ * before may be NULL for everything recorded in now */
+void latency_summarize(const struct latency_hist *now, const struct latency_hist *before,
+        struct latency_summary *out){
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t total = 0;
+    uint32_t highest = 0;
+    for(uint32_t b = 0; b < LATENCY_BUCKETS; b++){
+        counts[b] = now->counts[b] - (before != NULL ? before->counts[b] : 0);
+        total += counts[b];
+        if(counts[b] > 0){
+            highest = b;
+        }
+    }
+
+    memset(out, 0, sizeof(*out));
+    out->count = total;
+    if(total == 0){
+        return;
+    }
+    out->sum = (now->ticks - (before != NULL ? before->ticks : 0)) / ticks_per_ns;
+    out->p50 = quantile(counts, total, 0.5) / ticks_per_ns;
+    out->p99 = quantile(counts, total, 0.99) / ticks_per_ns;
+    out->p999 = quantile(counts, total, 0.999) / ticks_per_ns;
+    out->max = bucket_high(highest) / ticks_per_ns;
+}
@@ -0,0 +1,420 @@
+/*
+ * metrics.c
+ *
+ * Exports the capture statistics in the Prometheus text format, or as
+ * JSON, over a local TCP or Unix socket and optionally to a stats file.
+ * The stats thread publishes a snapshot at the end of every interval
+ * (-i); everything here works on the latest snapshot, so the capture
+ * and processing threads are never synchronized with.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "include/metrics.h"
+#include "include/signal_handling.h"
+
+#define METRICS_DEFAULT_HOST "127.0.0.1"
+#define METRICS_BACKLOG 16
+#define METRICS_REQUEST_SIZE 2048
+
+/* Opens the listening socket. endpoint is unix:<path>, <port> or
+ * <address>:<port>; a bare port listens on the loopback address only */
+static int metrics_listen(struct metrics *m, const char *endpoint){
+    int fd;
+    if(strncmp(endpoint, "unix:", 5) == 0){
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if(strlen(endpoint + 5) >= sizeof(addr.sun_path)){
+            fprintf(stderr, "error: metrics socket path %s is too long\n", endpoint + 5);
+            return -1;
+        }
+        strcpy(addr.sun_path, endpoint + 5);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0){
+            fprintf(stderr, "%s: could not create metrics socket\n", strerror(errno));
+            return -1;
+        }
+        unlink(addr.sun_path); /* Left over from a previous run */
+        if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0){
+            fprintf(stderr, "%s: could not bind metrics socket %s\n", strerror(errno),
+                    addr.sun_path);
+            close(fd);
+            return -1;
+        }
+        m->unix_path = strdup(addr.sun_path);
+    } else {
+        char host[64] = METRICS_DEFAULT_HOST;
+        const char *port = strrchr(endpoint, ':');
+        if(port != NULL){
+            size_t len = port - endpoint;
+            if(len >= sizeof(host)){
+                fprintf(stderr, "error: invalid metrics address %s\n", endpoint);
+                return -1;
+            }
+            memcpy(host, endpoint, len);
+            host[len] = '\0';
+            port++;
+        } else {
+            port = endpoint;
+        }
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        int port_num = atoi(port);
+        if(port_num <= 0 || port_num > 65535 || inet_pton(AF_INET, host, &addr.sin_addr) != 1){
+            fprintf(stderr, "error: invalid metrics address %s\n", endpoint);
+            return -1;
+        }
+        addr.sin_port = htons(port_num);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(fd < 0){
+            fprintf(stderr, "%s: could not create metrics socket\n", strerror(errno));
+            return -1;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0){
+            fprintf(stderr, "%s: could not bind metrics socket to %s:%d\n", strerror(errno),
+                    host, port_num);
+            close(fd);
+            return -1;
+        }
+    }
+
+    if(listen(fd, METRICS_BACKLOG) != 0){
+        fprintf(stderr, "%s: could not listen on metrics socket\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    m->listen_fd = fd;
+    return 0;
+}
+
+/* Labels of a thread's series */
+static void thread_labels(FILE *f, const struct metrics_snapshot *s, int t){
+    if(s->threads[t].if_name != NULL){
+        fprintf(f, "{thread=\"%d\",role=\"capture\",interface=\"%s\"}", t, s->threads[t].if_name);
+    } else {
+        fprintf(f, "{thread=\"%d\",role=\"worker\"}", t);
+    }
+}
+
+static void prom_metric(FILE *f, const char *name, const char *type, const char *help){
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Renders s in the Prometheus text exposition format */
+static void render_prometheus(FILE *f, const struct metrics_snapshot *s){
+    prom_metric(f, "sniffer_uptime_seconds", "gauge", "Time since capture started");
+    fprintf(f, "sniffer_uptime_seconds %.3f\n", s->uptime);
+
+    prom_metric(f, "sniffer_packets_total", "counter", "Packets processed");
+    fprintf(f, "sniffer_packets_total %" PRIu64 "\n", s->packets);
+    prom_metric(f, "sniffer_bytes_total", "counter", "Bytes processed");
+    fprintf(f, "sniffer_bytes_total %" PRIu64 "\n", s->bytes);
+    prom_metric(f, "sniffer_socket_packets_total", "counter", "Packets seen by the sockets");
+    fprintf(f, "sniffer_socket_packets_total %" PRIu64 "\n", s->socket_packets);
+    prom_metric(f, "sniffer_socket_drops_total", "counter", "Packets dropped by the sockets");
+    fprintf(f, "sniffer_socket_drops_total %" PRIu64 "\n", s->socket_drops);
+    prom_metric(f, "sniffer_socket_freezes_total", "counter", "Socket queue freezes");
+    fprintf(f, "sniffer_socket_freezes_total %" PRIu64 "\n", s->socket_freezes);
+    prom_metric(f, "sniffer_bloom_hits_total", "counter", "Packets found in the bloom filter");
+    fprintf(f, "sniffer_bloom_hits_total %" PRIu64 "\n", s->dup_packets);
+    prom_metric(f, "sniffer_log_records_total", "counter", "Records written to the log files");
+    fprintf(f, "sniffer_log_records_total{log=\"packets\"} %" PRIu64 "\n", s->log_records);
+    fprintf(f, "sniffer_log_records_total{log=\"duplicates\"} %" PRIu64 "\n", s->dup_log_records);
+
+    prom_metric(f, "sniffer_packets_per_second", "gauge", "Packet rate over the last interval");
+    fprintf(f, "sniffer_packets_per_second %.3f\n", s->pps);
+    prom_metric(f, "sniffer_bytes_per_second", "gauge", "Byte rate over the last interval");
+    fprintf(f, "sniffer_bytes_per_second %.3f\n", s->byps);
+    prom_metric(f, "sniffer_log_records_per_second", "gauge", "Packet log write rate over the last interval");
+    fprintf(f, "sniffer_log_records_per_second %.3f\n", s->log_rate);
+    prom_metric(f, "sniffer_ring_usage_ratio", "gauge", "Average ring usage over the last interval");
+    fprintf(f, "sniffer_ring_usage_ratio{threads=\"all\"} %.4f\n", s->ring_usage_avg);
+    fprintf(f, "sniffer_ring_usage_ratio{threads=\"worst\"} %.4f\n", s->ring_usage_worst);
+    prom_metric(f, "sniffer_ring_usage_instant_max_ratio", "gauge",
+            "Worst instantaneous ring usage over the last interval");
+    fprintf(f, "sniffer_ring_usage_instant_max_ratio %.4f\n", s->ring_usage_worst_instant);
+
+    if(s->have_latency){
+        prom_metric(f, "sniffer_stage_latency_seconds", "summary",
+                "Processing stage latency, quantiles over the last interval");
+        for(int st = 0; st < lat_num_stages; st++){
+            const struct latency_summary *ls = &(s->latency[st]);
+            const char *stage = latency_stage_names[st];
+            fprintf(f, "sniffer_stage_latency_seconds{stage=\"%s\",quantile=\"0.5\"} %.9f\n", stage, ls->p50 / 1e9);
+            fprintf(f, "sniffer_stage_latency_seconds{stage=\"%s\",quantile=\"0.99\"} %.9f\n", stage, ls->p99 / 1e9);
+            fprintf(f, "sniffer_stage_latency_seconds{stage=\"%s\",quantile=\"0.999\"} %.9f\n", stage, ls->p999 / 1e9);
+            fprintf(f, "sniffer_stage_latency_seconds{stage=\"%s\",quantile=\"1\"} %.9f\n", stage, ls->max / 1e9);
+            fprintf(f, "sniffer_stage_latency_seconds_sum{stage=\"%s\"} %.9f\n", stage,
+                    s->latency_total[st].sum / 1e9);
+            fprintf(f, "sniffer_stage_latency_seconds_count{stage=\"%s\"} %" PRIu64 "\n", stage,
+                    s->latency_total[st].count);
+        }
+    }
+
+    prom_metric(f, "sniffer_thread_packets_total", "counter", "Packets processed by the thread");
+    for(int t = 0; t < s->num_threads; t++){
+        fprintf(f, "sniffer_thread_packets_total");
+        thread_labels(f, s, t);
+        fprintf(f, " %" PRIu64 "\n", s->threads[t].packets);
+    }
+    prom_metric(f, "sniffer_thread_bloom_hits_total", "counter", "Bloom filter hits in the thread");
+    for(int t = 0; t < s->num_threads; t++){
+        fprintf(f, "sniffer_thread_bloom_hits_total");
+        thread_labels(f, s, t);
+        fprintf(f, " %" PRIu64 "\n", s->threads[t].dup_packets);
+    }
+    prom_metric(f, "sniffer_thread_spin_seconds_total", "counter", "Time the thread spent spinning");
+    for(int t = 0; t < s->num_threads; t++){
+        fprintf(f, "sniffer_thread_spin_seconds_total");
+        thread_labels(f, s, t);
+        fprintf(f, " %.6f\n", s->threads[t].spin_ns / 1e9);
+    }
+    prom_metric(f, "sniffer_thread_sleep_seconds_total", "counter", "Time the thread spent sleeping");
+    for(int t = 0; t < s->num_threads; t++){
+        fprintf(f, "sniffer_thread_sleep_seconds_total");
+        thread_labels(f, s, t);
+        fprintf(f, " %.6f\n", s->threads[t].sleep_ns / 1e9);
+    }
+    prom_metric(f, "sniffer_thread_heap_allocations_total", "counter",
+            "Heap allocations on the thread's packet path");
+    for(int t = 0; t < s->num_threads; t++){
+        fprintf(f, "sniffer_thread_heap_allocations_total");
+        thread_labels(f, s, t);
+        fprintf(f, " %" PRIu64 "\n", s->threads[t].heap_allocs);
+    }
+    prom_metric(f, "sniffer_thread_ring_usage_ratio", "gauge",
+            "Average ring usage of the thread over the last interval");
+    for(int t = 0; t < s->num_threads; t++){
+        if(s->threads[t].ring_usage >= 0){
+            fprintf(f, "sniffer_thread_ring_usage_ratio");
+            thread_labels(f, s, t);
+            fprintf(f, " %.4f\n", s->threads[t].ring_usage);
+        }
+    }
+}
+
+/* Renders s as a single JSON object */
+static void render_json(FILE *f, const struct metrics_snapshot *s){
+    fprintf(f, "{\"uptime\":%.3f,\"packets\":%" PRIu64 ",\"bytes\":%" PRIu64 ","
+            "\"socket_packets\":%" PRIu64 ",\"socket_drops\":%" PRIu64 ",\"socket_freezes\":%" PRIu64 ","
+            "\"bloom_hits\":%" PRIu64 ",\"log_records\":%" PRIu64 ",\"dup_log_records\":%" PRIu64 ","
+            "\"pps\":%.3f,\"byps\":%.3f,\"log_rate\":%.3f,"
+            "\"ring_usage_avg\":%.4f,\"ring_usage_worst\":%.4f,\"ring_usage_worst_instant\":%.4f,"
+            "\"latency\":[",
+            s->uptime, s->packets, s->bytes, s->socket_packets, s->socket_drops, s->socket_freezes,
+            s->dup_packets, s->log_records, s->dup_log_records, s->pps, s->byps, s->log_rate,
+            s->ring_usage_avg, s->ring_usage_worst, s->ring_usage_worst_instant);
+    for(int st = 0; s->have_latency && st < lat_num_stages; st++){
+        const struct latency_summary *ls = &(s->latency[st]);
+        fprintf(f, "%s{\"stage\":\"%s\",\"count\":%" PRIu64 ",\"p50_ns\":%.1f,"
+                "\"p99_ns\":%.1f,\"p999_ns\":%.1f,\"max_ns\":%.1f}",
+                st > 0 ? "," : "", latency_stage_names[st], ls->count, ls->p50, ls->p99,
+                ls->p999, ls->max);
+    }
+    fprintf(f, "],\"threads\":[");
+    for(int t = 0; t < s->num_threads; t++){
+        const struct thread_metrics *tm = &(s->threads[t]);
+        fprintf(f, "%s{\"thread\":%d,\"role\":\"%s\",", t > 0 ? "," : "", t,
+                tm->if_name != NULL ? "capture" : "worker");
+        if(tm->if_name != NULL){
+            fprintf(f, "\"interface\":\"%s\",", tm->if_name);
+        }
+        fprintf(f, "\"packets\":%" PRIu64 ",\"bloom_hits\":%" PRIu64 ","
+                "\"spin_seconds\":%.6f,\"sleep_seconds\":%.6f,\"heap_allocations\":%" PRIu64,
+                tm->packets, tm->dup_packets, tm->spin_ns / 1e9, tm->sleep_ns / 1e9, tm->heap_allocs);
+        if(tm->ring_usage >= 0){
+            fprintf(f, ",\"ring_usage\":%.4f", tm->ring_usage);
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "]}\n");
+}
+
+/* Renders the latest snapshot into a malloc()'d buffer */
+static char *metrics_render(struct metrics *m, int json, size_t *len){
+    char *buf = NULL;
+    FILE *f = open_memstream(&buf, len);
+    if(f == NULL){
+        return NULL;
+    }
+    pthread_mutex_lock(&(m->lock));
+    if(m->have_snap){
+        if(json){
+            render_json(f, &(m->snap));
+        } else {
+            render_prometheus(f, &(m->snap));
+        }
+    }
+    pthread_mutex_unlock(&(m->lock));
+    fclose(f);
+    return buf;
+}
+
+static void write_all(int fd, const char *buf, size_t len){
+    while(len > 0){
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if(n <= 0){
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Answers one HTTP request. GET /json returns JSON, anything else the
+ * Prometheus text format */
+static void metrics_serve(struct metrics *m, int fd){
+    struct timeval tv = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    char request[METRICS_REQUEST_SIZE];
+    ssize_t n = recv(fd, request, sizeof(request) - 1, 0);
+    if(n <= 0){
+        return;
+    }
+    request[n] = '\0';
+    int json = (strncmp(request, "GET /json", 9) == 0);
+
+    size_t len = 0;
+    char *body = metrics_render(m, json, &len);
+    if(body == NULL){
+        return;
+    }
+    char header[256];
+    int hlen = snprintf(header, sizeof(header),
+            "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+            json ? "application/json" : "text/plain; version=0.0.4", len);
+    write_all(fd, header, hlen);
+    write_all(fd, body, len);
+    free(body);
+}
+
+static void *metrics_thread_func(void *arg){
+    struct metrics *m = (struct metrics *)arg;
+    disable_all_signals();
+
+    struct pollfd pfd;
+    pfd.fd = m->listen_fd;
+    pfd.events = POLLIN;
+    while(!__atomic_load_n(&(m->stop), __ATOMIC_RELAXED)){
+        if(poll(&pfd, 1, 200) <= 0){
+            continue;
+        }
+        int fd = accept(m->listen_fd, NULL, NULL);
+        if(fd < 0){
+            continue;
+        }
+        metrics_serve(m, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/* Sets up the exporter. endpoint (see metrics_listen()) and json_path
+ * may each be NULL. Exits when the endpoint can not be opened */
+struct metrics *metrics_create(const char *endpoint, const char *json_path, int num_threads){
+    struct metrics *m = (struct metrics *)calloc(1, sizeof(struct metrics));
+    if(m == NULL){
+        perror("could not allocate memory for metrics\n");
+        exit(255);
+    }
+    pthread_mutex_init(&(m->lock), NULL);
+    m->listen_fd = -1;
+    m->snap.num_threads = num_threads;
+    m->snap.threads = (struct thread_metrics *)calloc(num_threads, sizeof(struct thread_metrics));
+    if(m->snap.threads == NULL){
+        perror("could not allocate memory for metrics\n");
+        exit(255);
+    }
+    if(json_path != NULL){
+        m->json_path = strdup(json_path);
+    }
+
+    if(endpoint != NULL){
+        if(metrics_listen(m, endpoint) != 0){
+            exit(255);
+        }
+        int err = pthread_create(&(m->tid), NULL, metrics_thread_func, m);
+        if(err != 0){
+            fprintf(stderr, "%s: error creating metrics thread\n", strerror(err));
+            exit(255);
+        }
+        fprintf(stderr, "Serving metrics on %s\n", endpoint);
+    }
+    return m;
+}
+
+void metrics_free(struct metrics *m){
+    if(m == NULL){
+        return;
+    }
+    if(m->listen_fd >= 0){
+        __atomic_store_n(&(m->stop), 1, __ATOMIC_RELAXED);
+        pthread_join(m->tid, NULL);
+        close(m->listen_fd);
+    }
+    if(m->unix_path != NULL){
+        unlink(m->unix_path);
+        free(m->unix_path);
+    }
+    free(m->json_path);
+    free(m->snap.threads);
+    pthread_mutex_destroy(&(m->lock));
+    free(m);
+}
+
+/* Rewrites the stats file. Readers never see a partial file since the
+ * new one replaces the old with rename() */
+static void metrics_write_file(struct metrics *m){
+    size_t len = 0;
+    char *body = metrics_render(m, 1, &len);
+    if(body == NULL){
+        return;
+    }
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", m->json_path);
+    FILE *f = fopen(tmp_path, "w");
+    if(f == NULL){
+        fprintf(stderr, "%s: could not write stats file %s\n", strerror(errno), tmp_path);
+        free(body);
+        return;
+    }
+    fwrite(body, 1, len, f);
+    fclose(f);
+    if(rename(tmp_path, m->json_path) != 0){
+        fprintf(stderr, "%s: could not replace stats file %s\n", strerror(errno), m->json_path);
+    }
+    free(body);
+}
+
+/* Makes snap the snapshot served from now on. Called by the stats
+ * thread, snap must have as many threads as given to metrics_create() */
+void metrics_publish(struct metrics *m, const struct metrics_snapshot *snap){
+    pthread_mutex_lock(&(m->lock));
+    struct thread_metrics *threads = m->snap.threads;
+    memcpy(&(m->snap), snap, sizeof(*snap));
+    m->snap.threads = threads;
+    memcpy(threads, snap->threads, snap->num_threads * sizeof(struct thread_metrics));
+    m->have_snap = 1;
+    pthread_mutex_unlock(&(m->lock));
+
+    if(m->json_path != NULL){
+        metrics_write_file(m);
+    }
+}
@@ -0,0 +1,521 @@
+/*
+ * pattern_match.c
+ *
+ * Multi-pattern search of payloads, for tagging records with the known
+ * content they carry. The pattern file is compiled once at startup into
+ * a set shared read only by all threads. At every payload offset the
+ * first 4 bytes are hashed into a bit filter holding the starts of all
+ * patterns, so that most offsets cost a hash and one bit test whatever
+ * the number of patterns; offsets that pass are looked up in a table
+ * of pattern starts. The patterns sharing a start are sorted, and those
+ * found at the offset are the ones a few binary searches turn up, so
+ * that thousands of patterns starting with "GET " cost no more than a
+ * handful. Patterns of 1 to 3 bytes have a table of their own, behind
+ * a bitmap of their first 2 bytes that fits in the L1 cache, and do
+ * not widen what the main filter lets through. The filter of a few
+ * tens of thousands of patterns stays within the L2 cache, where the
+ * states of an Aho-Corasick automaton for them would not. The AVX2
+ * kernel tests 8 offsets at a time; the widest kernel the CPU supports
+ * is picked when the set is loaded.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+
+#include "include/pattern_match.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define PATTERN_FILTER_MIN_BITS 16
+#define PATTERN_FILTER_MAX_BITS 25  /* 4 MB */
+#define PATTERN_FILTER_LOAD 64      /* Filter bits per pattern, about 1.5% of offsets pass */
+#define PATTERN_SHORT_FILTER_BITS 16 /* First 2 bytes of the short patterns, 8 KB */
+#define PATTERN_HASH_MUL 0x9e3779b1u
+
+struct pattern {
+    uint32_t id;
+    uint32_t key;               /* See window_key() and short_key() */
+    uint32_t len;
+    uint32_t off;               /* Of its bytes in the set's store */
+};
+
+/* Open addressing table from a key to the run of patterns that have it */
+struct pattern_index {
+    uint32_t bits;              /* log2 of the slots */
+    uint32_t *key;
+    uint32_t *first;            /* First pattern with the key + 1, 0 for an empty slot */
+    uint32_t *end;              /* Past the last one */
+};
+
+struct pattern_set {
+    pattern_match_fn kernel;
+    const char *kernel_name;
+    uint32_t num_patterns;
+    uint8_t *bytes;
+
+    /* Patterns of PATTERN_WINDOW bytes or more, sorted by their bytes */
+    uint32_t num_long;
+    struct pattern *patterns;
+    uint32_t filter_bits;       /* log2 of the bits of the filter */
+    uint32_t *filter;
+    struct pattern_index starts; /* By window_key() */
+
+    /* Shorter patterns, sorted by short_key() */
+    uint32_t num_short;
+    struct pattern *short_patterns;
+    uint32_t *short_filter;     /* Bit of every first 2 bytes they can start with */
+    struct pattern_index shorts;
+};
+
+/* The key of the PATTERN_WINDOW bytes at data */
+static inline uint32_t window_key(const uint8_t *data){
+    uint32_t key;
+    memcpy(&key, data, 4);
+    return key;
+}
+
+/* The key of the len bytes at data, len below PATTERN_WINDOW */
+static inline uint32_t short_key(const uint8_t *data, uint32_t len){
+    uint32_t key = len << 24;
+    for(uint32_t k = 0; k < len; k++){
+        key |= (uint32_t)data[k] << (8 * k);
+    }
+    return key;
+}
+
+static inline uint32_t filter_hash(uint32_t key, uint32_t bits){
+    return (key * PATTERN_HASH_MUL) >> (32 - bits);
+}
+
+static inline int filter_test(const struct pattern_set *ps, uint32_t key){
+    uint32_t h = filter_hash(key, ps->filter_bits);
+    return (ps->filter[h >> 5] >> (h & 31)) & 1;
+}
+
+/* Sets first and end to the run of patterns with key, returns 0 if none */
+static inline int index_find(const struct pattern_index *ix, uint32_t key,
+        uint32_t *first, uint32_t *end){
+    uint32_t mask = (1u << ix->bits) - 1;
+    for(uint32_t slot = filter_hash(key, ix->bits); ix->first[slot] != 0;
+            slot = (slot + 1) & mask){
+        if(ix->key[slot] == key){
+            *first = ix->first[slot] - 1;
+            *end = ix->end[slot];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Adds id to the n ids unless it is there, returns the new number */
+static inline uint32_t add_id(uint32_t *ids, uint32_t n, uint32_t id){
+    uint32_t k = 0;
+    while(k < n && ids[k] != id){
+        k++;
+    }
+    if(k == n){
+        ids[n++] = id;
+    }
+    return n;
+}
+
+/* Orders pattern pat against the first len bytes of s the way the
+ * patterns are sorted: by their bytes, a prefix before what extends it */
+static inline int pattern_order(const struct pattern_set *ps, const struct pattern *pat,
+        const uint8_t *s, uint32_t len){
+    int c = memcmp(ps->bytes + pat->off, s, (pat->len < len) ? pat->len : len);
+    if(c != 0){
+        return c;
+    }
+    return (pat->len < len) ? -1 : (pat->len > len);
+}
+
+/* Bytes pattern pat has in common with the len bytes at s */
+static inline uint32_t common_prefix(const struct pattern_set *ps, const struct pattern *pat,
+        const uint8_t *s, uint32_t len){
+    const uint8_t *p = ps->bytes + pat->off;
+    uint32_t n = (pat->len < len) ? pat->len : len;
+    uint32_t k = PATTERN_WINDOW;    /* The window matched already */
+    while(k < n && p[k] == s[k]){
+        k++;
+    }
+    return k;
+}
+
+/* Adds the patterns with key that the payload at pos starts with to
+ * ids, and returns the new number of ids. The patterns found are
+ * prefixes of one another: the last pattern sorted before the payload
+ * is either one of them, the longest, or has in common with the
+ * payload a prefix that bounds their length. Either way the bound
+ * shrinks and the search is repeated below it */
+static uint32_t verify(const struct pattern_set *ps, const uint8_t *data, uint32_t len,
+        uint32_t pos, uint32_t key, uint32_t *ids, uint32_t n, uint32_t max_ids){
+    uint32_t first, end;
+    if(!index_find(&(ps->starts), key, &first, &end)){
+        return n;
+    }
+    const uint8_t *s = data + pos;
+    uint32_t bound = (len - pos < PATTERN_MAX_LEN) ? len - pos : PATTERN_MAX_LEN;
+    while(bound >= PATTERN_WINDOW && n < max_ids){
+        /* Last pattern not after the first bound bytes */
+        uint32_t lo = first, hi = end;
+        while(lo < hi){
+            uint32_t mid = lo + (hi - lo) / 2;
+            if(pattern_order(ps, &(ps->patterns[mid]), s, bound) <= 0){
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if(lo == first){
+            break;
+        }
+        const struct pattern *pat = &(ps->patterns[lo - 1]);
+        uint32_t common = common_prefix(ps, pat, s, bound);
+        if(common < pat->len){
+            bound = common;
+            continue;
+        }
+        /* Found, with the patterns of the same bytes before it */
+        for(uint32_t p = lo; p > first && n < max_ids; p--){
+            const struct pattern *same = &(ps->patterns[p - 1]);
+            if(same->len != pat->len || memcmp(ps->bytes + same->off, s, pat->len) != 0){
+                break;
+            }
+            n = add_id(ids, n, same->id);
+        }
+        bound = pat->len - 1;
+    }
+    return n;
+}
+
+/* Adds the short patterns found in the payload to ids */
+static uint32_t match_short(const struct pattern_set *ps, const uint8_t *data, uint32_t len,
+        uint32_t *ids, uint32_t n, uint32_t max_ids){
+    for(uint32_t pos = 0; pos < len && n < max_ids; pos++){
+        uint32_t k2 = data[pos] | ((pos + 1 < len) ? (uint32_t)data[pos + 1] << 8 : 0);
+        if(((ps->short_filter[k2 >> 5] >> (k2 & 31)) & 1) == 0){
+            continue;
+        }
+        for(uint32_t l = 1; l < PATTERN_WINDOW && l <= len - pos && n < max_ids; l++){
+            uint32_t first, end;
+            if(index_find(&(ps->shorts), short_key(data + pos, l), &first, &end)){
+                for(uint32_t p = first; p < end && n < max_ids; p++){
+                    n = add_id(ids, n, ps->short_patterns[p].id);
+                }
+            }
+        }
+    }
+    return n;
+}
+
+uint32_t pattern_match_scalar(const struct pattern_set *ps, const uint8_t *data, uint32_t len,
+        uint32_t *ids, uint32_t max_ids){
+    uint32_t n = 0;
+    for(uint32_t pos = 0; ps->num_long > 0 && pos + PATTERN_WINDOW <= len && n < max_ids; pos++){
+        uint32_t key = window_key(data + pos);
+        if(filter_test(ps, key)){
+            n = verify(ps, data, len, pos, key, ids, n, max_ids);
+        }
+    }
+    if(ps->num_short > 0){
+        n = match_short(ps, data, len, ids, n, max_ids);
+    }
+    return n;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/* The windows of 8 consecutive offsets are shuffled out of one 16 byte
+ * load, hashed together and their filter words gathered. Short
+ * patterns are rare enough to be left to the scalar loop */
+__attribute__((target("avx2")))
+uint32_t pattern_match_avx2(const struct pattern_set *ps, const uint8_t *data, uint32_t len,
+        uint32_t *ids, uint32_t max_ids){
+    const __m256i windows = _mm256_setr_epi8(0, 1, 2, 3, 1, 2, 3, 4, 2, 3, 4, 5, 3, 4, 5, 6,
+            4, 5, 6, 7, 5, 6, 7, 8, 6, 7, 8, 9, 7, 8, 9, 10);
+    const __m256i mul = _mm256_set1_epi32(PATTERN_HASH_MUL);
+    const __m128i shift = _mm_cvtsi32_si128(32 - ps->filter_bits);
+    const __m256i low5 = _mm256_set1_epi32(31);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t n = 0;
+    uint32_t pos = 0;
+    if(ps->num_long == 0){
+        pos = len;
+    }
+    for(; pos + 16 <= len && n < max_ids; pos += 8){
+        __m256i x = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(data + pos)));
+        __m256i key = _mm256_shuffle_epi8(x, windows);
+        __m256i h = _mm256_srl_epi32(_mm256_mullo_epi32(key, mul), shift);
+        __m256i word = _mm256_i32gather_epi32((const int *)ps->filter, _mm256_srli_epi32(h, 5), 4);
+        __m256i bit = _mm256_sllv_epi32(one, _mm256_and_si256(h, low5));
+        __m256i miss = _mm256_cmpeq_epi32(_mm256_and_si256(word, bit), zero);
+        uint32_t hits = ~_mm256_movemask_ps(_mm256_castsi256_ps(miss)) & 0xff;
+        while(hits != 0 && n < max_ids){
+            uint32_t k = __builtin_ctz(hits);
+            hits &= hits - 1;
+            n = verify(ps, data, len, pos + k, window_key(data + pos + k), ids, n, max_ids);
+        }
+    }
+    for(; pos + PATTERN_WINDOW <= len && n < max_ids; pos++){
+        uint32_t key = window_key(data + pos);
+        if(filter_test(ps, key)){
+            n = verify(ps, data, len, pos, key, ids, n, max_ids);
+        }
+    }
+    if(ps->num_short > 0){
+        n = match_short(ps, data, len, ids, n, max_ids);
+    }
+    return n;
+}
+
+#endif
+
+static int long_compare(const void *a, const void *b, void *arg){
+    const struct pattern_set *ps = (const struct pattern_set *)arg;
+    const struct pattern *pa = (const struct pattern *)a, *pb = (const struct pattern *)b;
+    int c = pattern_order(ps, pa, ps->bytes + pb->off, pb->len);
+    if(c != 0){
+        return c;
+    }
+    return (pa->id < pb->id) ? -1 : (pa->id > pb->id);
+}
+
+static int short_compare(const void *a, const void *b){
+    const struct pattern *pa = (const struct pattern *)a, *pb = (const struct pattern *)b;
+    if(pa->key != pb->key){
+        return (pa->key < pb->key) ? -1 : 1;
+    }
+    return (pa->id < pb->id) ? -1 : (pa->id > pb->id);
+}
+
+/* Builds the table of the runs of equal keys of the n sorted patterns */
+static void index_build(struct pattern_index *ix, const struct pattern *patterns, uint32_t n){
+    ix->bits = 4;
+    while((1ULL << ix->bits) < 2ULL * n){
+        ix->bits++;
+    }
+    uint32_t *table = (uint32_t *)calloc((size_t)3 << ix->bits, sizeof(uint32_t));
+    if(table == NULL){
+        perror("could not allocate memory for the pattern table\n");
+        exit(255);
+    }
+    ix->key = table;
+    ix->first = table + ((size_t)1 << ix->bits);
+    ix->end = table + ((size_t)2 << ix->bits);
+    uint32_t mask = (1u << ix->bits) - 1;
+    uint32_t slot = 0;
+    for(uint32_t p = 0; p < n; p++){
+        uint32_t key = patterns[p].key;
+        if(p > 0 && patterns[p - 1].key == key){
+            ix->end[slot] = p + 1;
+            continue;
+        }
+        slot = filter_hash(key, ix->bits);
+        while(ix->first[slot] != 0){
+            slot = (slot + 1) & mask;
+        }
+        ix->key[slot] = key;
+        ix->first[slot] = p + 1;
+        ix->end[slot] = p + 1;
+    }
+}
+
+static int hex_digit(char c){
+    return isdigit((unsigned char)c) ? c - '0' : tolower((unsigned char)c) - 'a' + 10;
+}
+
+/* Decodes a pattern line into out, \xHH and \\ being the escapes.
+ * Returns its length, -1 if it is malformed */
+static int pattern_decode(const char *line, uint8_t *out){
+    int len = 0;
+    for(const char *c = line; *c != '\0'; c++){
+        if(len == PATTERN_MAX_LEN){
+            return -1;
+        }
+        if(*c != '\\'){
+            out[len++] = (uint8_t)*c;
+        } else if(c[1] == '\\'){
+            out[len++] = '\\';
+            c++;
+        } else if(c[1] == 'x' && isxdigit((unsigned char)c[2]) && isxdigit((unsigned char)c[3])){
+            out[len++] = hex_digit(c[2]) * 16 + hex_digit(c[3]);
+            c += 3;
+        } else {
+            return -1;
+        }
+    }
+    return len;
+}
+
+/* Compiles the patterns of the file at path, one per line. A line is a
+ * pattern, its id being the line number, or <id><TAB><pattern>. Empty
+ * lines and lines starting with # are skipped */
+struct pattern_set *pattern_set_load(const char *path){
+    FILE *fp = fopen(path, "r");
+    if(fp == NULL){
+        fprintf(stderr, "%s: could not open pattern file %s\n", strerror(errno), path);
+        return NULL;
+    }
+    struct pattern_set *ps = (struct pattern_set *)calloc(1, sizeof(struct pattern_set));
+    uint32_t capacity = 1024;
+    size_t bytes_capacity = 16384, bytes_used = 0;
+    struct pattern *all = (struct pattern *)malloc(capacity * sizeof(struct pattern));
+    ps->bytes = (uint8_t *)malloc(bytes_capacity);
+    if(all == NULL || ps->bytes == NULL){
+        perror("could not allocate memory for the patterns\n");
+        exit(255);
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t line_len;
+    uint32_t line_num = 0;
+    uint8_t decoded[PATTERN_MAX_LEN];
+    while((line_len = getline(&line, &line_size, fp)) >= 0){
+        line_num++;
+        while(line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')){
+            line[--line_len] = '\0';
+        }
+        if(line_len == 0 || line[0] == '#'){
+            continue;
+        }
+        uint32_t id = line_num;
+        char *text = line, *end;
+        unsigned long explicit_id = strtoul(line, &end, 10);
+        if(end != line && *end == '\t' && explicit_id <= UINT32_MAX){
+            id = explicit_id;
+            text = end + 1;
+        }
+        int len = pattern_decode(text, decoded);
+        if(len <= 0){
+            fprintf(stderr, "error: invalid pattern on line %u of %s\n", line_num, path);
+            free(line);
+            free(all);
+            fclose(fp);
+            pattern_set_free(ps);
+            return NULL;
+        }
+        if(ps->num_patterns == capacity){
+            capacity *= 2;
+            all = (struct pattern *)realloc(all, capacity * sizeof(struct pattern));
+        }
+        while(bytes_used + len > bytes_capacity){
+            bytes_capacity *= 2;
+            ps->bytes = (uint8_t *)realloc(ps->bytes, bytes_capacity);
+        }
+        if(all == NULL || ps->bytes == NULL){
+            perror("could not allocate memory for the patterns\n");
+            exit(255);
+        }
+        memcpy(ps->bytes + bytes_used, decoded, len);
+        all[ps->num_patterns++] = (struct pattern){id, 0, (uint32_t)len, (uint32_t)bytes_used};
+        bytes_used += len;
+        ps->num_short += (len < PATTERN_WINDOW);
+    }
+    free(line);
+    fclose(fp);
+    if(ps->num_patterns == 0){
+        fprintf(stderr, "error: no patterns in %s\n", path);
+        free(all);
+        pattern_set_free(ps);
+        return NULL;
+    }
+
+    /* Split by length, the long patterns keeping the array */
+    ps->num_long = ps->num_patterns - ps->num_short;
+    ps->short_patterns = (struct pattern *)malloc((ps->num_short + 1) * sizeof(struct pattern));
+    if(ps->short_patterns == NULL){
+        perror("could not allocate memory for the patterns\n");
+        exit(255);
+    }
+    uint32_t num_long = 0, num_short = 0;
+    for(uint32_t p = 0; p < ps->num_patterns; p++){
+        struct pattern pat = all[p];
+        if(pat.len < PATTERN_WINDOW){
+            pat.key = short_key(ps->bytes + pat.off, pat.len);
+            ps->short_patterns[num_short++] = pat;
+        } else {
+            pat.key = window_key(ps->bytes + pat.off);
+            all[num_long++] = pat;
+        }
+    }
+    ps->patterns = all;
+    qsort_r(ps->patterns, ps->num_long, sizeof(struct pattern), long_compare, ps);
+    qsort(ps->short_patterns, ps->num_short, sizeof(struct pattern), short_compare);
+
+    ps->filter_bits = PATTERN_FILTER_MIN_BITS;
+    while(ps->filter_bits < PATTERN_FILTER_MAX_BITS &&
+            (1ULL << ps->filter_bits) < (uint64_t)ps->num_long * PATTERN_FILTER_LOAD){
+        ps->filter_bits++;
+    }
+    ps->filter = (uint32_t *)calloc(((size_t)1 << ps->filter_bits) / 32, sizeof(uint32_t));
+    ps->short_filter = (uint32_t *)calloc(((size_t)1 << PATTERN_SHORT_FILTER_BITS) / 32,
+            sizeof(uint32_t));
+    if(ps->filter == NULL || ps->short_filter == NULL){
+        perror("could not allocate memory for the pattern filter\n");
+        exit(255);
+    }
+    for(uint32_t p = 0; p < ps->num_long; p++){
+        uint32_t h = filter_hash(ps->patterns[p].key, ps->filter_bits);
+        ps->filter[h >> 5] |= 1u << (h & 31);
+    }
+    /* A 1 byte pattern may be followed by any byte, or by none */
+    for(uint32_t p = 0; p < ps->num_short; p++){
+        const uint8_t *b = ps->bytes + ps->short_patterns[p].off;
+        for(uint32_t second = 0; second < 256; second++){
+            if(ps->short_patterns[p].len > 1 && second != b[1]){
+                continue;
+            }
+            uint32_t k2 = b[0] | (second << 8);
+            ps->short_filter[k2 >> 5] |= 1u << (k2 & 31);
+        }
+    }
+    index_build(&(ps->starts), ps->patterns, ps->num_long);
+    index_build(&(ps->shorts), ps->short_patterns, ps->num_short);
+
+    ps->kernel = pattern_match_scalar;
+    ps->kernel_name = "scalar";
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        ps->kernel = pattern_match_avx2;
+        ps->kernel_name = "avx2";
+    }
+#endif
+    return ps;
+}
+
+void pattern_set_free(struct pattern_set *ps){
+    if(ps == NULL){
+        return;
+    }
+    free(ps->filter);
+    free(ps->short_filter);
+    free(ps->starts.key);
+    free(ps->shorts.key);
+    free(ps->patterns);
+    free(ps->short_patterns);
+    free(ps->bytes);
+    free(ps);
+}
+
+uint32_t pattern_set_size(const struct pattern_set *ps){
+    return ps->num_patterns;
+}
+
+const char *pattern_set_kernel(const struct pattern_set *ps){
+    return ps->kernel_name;
+}
+
+uint32_t pattern_match(const struct pattern_set *ps, const uint8_t *data, uint32_t len,
+        uint32_t *ids, uint32_t max_ids){
+    return ps->kernel(ps, data, len, ids, max_ids);
+}
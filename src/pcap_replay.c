@@ -0,0 +1,367 @@
+/*
+ * pcap_replay.c
+ *
+ * Offline capture from pcap/pcapng files. Packets read with libpcap
+ * are repacked into synthetic TPACKET_V3 blocks which then go through
+ * process_all_packets_in_block() exactly like blocks from the ring.
+ * This lets the parser, hashing and bloom filter paths be exercised
+ * and benchmarked without a NIC or root privileges.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <pcap.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "include/sniffer.h"
+#include "include/af_packet_v3.h"
+#include "include/pcap_replay.h"
+#include "include/signal_handling.h"
+#include "include/utils.h"
+
+extern int sig_close_flag; /* Defined in signal_handling.c */
+
+/* Offsets used by the kernel when it lays out a TPACKET_V3 block. We
+ * mirror them so that the block walking code can't tell the difference */
+#define REPLAY_FIRST_PKT_OFFSET TPACKET_ALIGN(sizeof(struct tpacket_block_desc))
+#define REPLAY_MAC_OFFSET TPACKET_ALIGN(TPACKET3_HDRLEN)
+
+/* A synthetic block under construction */
+struct replay_block {
+    uint8_t *buffer;
+    uint32_t size;              /* Block size, same as the ring block size */
+    uint32_t used;              /* Offset to the next free byte */
+    uint32_t num_pkts;
+    struct tpacket3_hdr *last;  /* Last packet header written in the block */
+    struct timespec first_ts;   /* Timestamp of the first packet in the block */
+    int owned;                  /* 0: block is processed by another thread */
+};
+
+/* Per thread replay state */
+struct replay_state {
+    struct thread_storage *thread_stor;
+    struct replay_source *rs;
+    struct replay_block block;
+    int shared;                 /* All threads read the same files and split blocks */
+    uint64_t block_seq;         /* Number of blocks built so far */
+    int paced_started;          /* Set once the first packet timestamp is known */
+    struct timespec ts_origin;  /* Timestamp of the first packet replayed */
+    struct timespec wall_origin;/* Monotonic time at which it was replayed */
+};
+
+static double ts_diff(const struct timespec *a, const struct timespec *b){
+    return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1000000000.0;
+}
+
+static int is_regular_file(const char *path){
+    struct stat st;
+    if(stat(path, &st) != 0){
+        return 0;
+    }
+    return S_ISREG(st.st_mode);
+}
+
+static int dirent_filter(const struct dirent *d){
+    return d->d_name[0] != '.';
+}
+
+struct replay_source *replay_source_init(const char *path, int pace,
+        uint32_t blocktimeout){
+    struct stat st;
+    if(stat(path, &st) != 0){
+        fprintf(stderr, "%s: could not access %s\n", strerror(errno), path);
+        return NULL;
+    }
+
+    struct replay_source *rs = (struct replay_source *)calloc(1, sizeof(struct replay_source));
+    if(!rs){
+        perror("could not allocate memory for replay source\n");
+        return NULL;
+    }
+    rs->pace = pace;
+    rs->blocktimeout = blocktimeout;
+
+    if(S_ISDIR(st.st_mode)){
+        /* Every regular file of the directory is replayed in name order */
+        struct dirent **namelist;
+        int n = scandir(path, &namelist, dirent_filter, alphasort);
+        if(n < 0){
+            fprintf(stderr, "%s: could not read directory %s\n", strerror(errno), path);
+            free(rs);
+            return NULL;
+        }
+        rs->files = (char **)calloc(n > 0 ? n : 1, sizeof(char *));
+        for(int i = 0; i < n; i++){
+            size_t len = strlen(path) + strlen(namelist[i]->d_name) + 2;
+            char *file = (char *)malloc(len);
+            snprintf(file, len, "%s/%s", path, namelist[i]->d_name);
+            if(is_regular_file(file)){
+                rs->files[rs->num_files++] = file;
+            } else {
+                free(file);
+            }
+            free(namelist[i]);
+        }
+        free(namelist);
+    } else {
+        rs->files = (char **)calloc(1, sizeof(char *));
+        rs->files[0] = strdup(path);
+        rs->num_files = 1;
+    }
+
+    if(rs->num_files == 0){
+        replay_source_free(rs);
+        return NULL;
+    }
+    fprintf(stderr, "Replaying %d capture file(s) from %s%s\n", rs->num_files, path,
+            pace ? " paced by packet timestamps" : "");
+    return rs;
+}
+
+void replay_source_free(struct replay_source *rs){
+    for(int i = 0; i < rs->num_files; i++){
+        free(rs->files[i]);
+    }
+    free(rs->files);
+    free(rs);
+}
+
+void replay_start_clock(struct replay_source *rs){
+    clock_gettime(CLOCK_MONOTONIC, &(rs->start));
+}
+
+static void replay_block_open(struct replay_state *st){
+    struct replay_block *rb = &(st->block);
+    int num_threads = st->thread_stor->statst->num_threads;
+
+    rb->used = REPLAY_FIRST_PKT_OFFSET;
+    rb->num_pkts = 0;
+    rb->last = NULL;
+    /* When the threads share a file every one of them walks the whole
+     * file but only copies and processes its own share of blocks */
+    rb->owned = !st->shared || (st->block_seq % num_threads) == (uint64_t)st->thread_stor->tnum;
+}
+
+static void replay_block_flush(struct replay_state *st){
+    struct replay_block *rb = &(st->block);
+    if(rb->num_pkts == 0){
+        return;
+    }
+
+    if(rb->owned){
+        struct tpacket_block_desc *block_hdr = (struct tpacket_block_desc *)rb->buffer;
+        block_hdr->version = TPACKET_V3;
+        block_hdr->offset_to_priv = 0;
+        block_hdr->hdr.bh1.block_status = TP_STATUS_USER;
+        block_hdr->hdr.bh1.num_pkts = rb->num_pkts;
+        block_hdr->hdr.bh1.offset_to_first_pkt = REPLAY_FIRST_PKT_OFFSET;
+        block_hdr->hdr.bh1.blk_len = rb->used;
+        block_hdr->hdr.bh1.seq_num = st->block_seq;
+        block_hdr->hdr.bh1.ts_first_pkt.ts_sec = rb->first_ts.tv_sec;
+        block_hdr->hdr.bh1.ts_first_pkt.ts_nsec = rb->first_ts.tv_nsec;
+        block_hdr->hdr.bh1.ts_last_pkt.ts_sec = rb->last->tp_sec;
+        block_hdr->hdr.bh1.ts_last_pkt.ts_nsec = rb->last->tp_nsec;
+        rb->last->tp_next_offset = 0;
+
+        process_all_packets_in_block(block_hdr, st->thread_stor, st->thread_stor->if_id);
+    }
+
+    st->block_seq++;
+    replay_block_open(st);
+}
+
+/* Sleeps until the packet with timestamp ts is due, relative to the
+ * first packet that was replayed */
+static void replay_pace(struct replay_state *st, const struct timespec *ts){
+    if(!st->paced_started){
+        st->ts_origin = *ts;
+        clock_gettime(CLOCK_MONOTONIC, &(st->wall_origin));
+        st->paced_started = 1;
+        return;
+    }
+
+    double offset = ts_diff(ts, &(st->ts_origin));
+    if(offset <= 0){
+        return;
+    }
+    struct timespec due = st->wall_origin;
+    due.tv_sec += (time_t)offset;
+    due.tv_nsec += (long)((offset - (time_t)offset) * 1000000000.0);
+    if(due.tv_nsec >= 1000000000L){
+        due.tv_sec++;
+        due.tv_nsec -= 1000000000L;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(ts_diff(&due, &now) <= 0){
+        return;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+}
+
+static void replay_add_packet(struct replay_state *st, const struct pcap_pkthdr *hdr,
+        const u_char *data){
+    struct replay_block *rb = &(st->block);
+    struct timespec ts;
+    ts.tv_sec = hdr->ts.tv_sec;
+    ts.tv_nsec = hdr->ts.tv_usec; /* Opened with nanosecond precision */
+
+    uint32_t snaplen = hdr->caplen;
+    uint32_t max_snaplen = rb->size - REPLAY_FIRST_PKT_OFFSET - REPLAY_MAC_OFFSET;
+    if(snaplen > max_snaplen){
+        snaplen = max_snaplen;
+    }
+    uint32_t frame_len = TPACKET_ALIGN(REPLAY_MAC_OFFSET + snaplen);
+
+    /* Like the kernel, retire the block when it is full or, when pacing,
+     * when the block has been open for longer than the block timeout.
+     * Both decisions only depend on the file contents so all threads
+     * sharing a file agree on the block boundaries. */
+    if(rb->num_pkts > 0){
+        if(rb->used + frame_len > rb->size){
+            replay_block_flush(st);
+        } else if(st->rs->pace &&
+                ts_diff(&ts, &(rb->first_ts)) * 1000.0 >= st->rs->blocktimeout){
+            replay_block_flush(st);
+        }
+    }
+
+    if(st->rs->pace){
+        replay_pace(st, &ts);
+    }
+
+    if(rb->num_pkts == 0){
+        rb->first_ts = ts;
+    }
+
+    if(rb->owned){
+        struct tpacket3_hdr *pkt_hdr = (struct tpacket3_hdr *)(rb->buffer + rb->used);
+        memset(pkt_hdr, 0, sizeof(struct tpacket3_hdr));
+        pkt_hdr->tp_sec = ts.tv_sec;
+        pkt_hdr->tp_nsec = ts.tv_nsec;
+        pkt_hdr->tp_snaplen = snaplen;
+        pkt_hdr->tp_len = hdr->len;
+        pkt_hdr->tp_status = TP_STATUS_USER;
+        pkt_hdr->tp_mac = REPLAY_MAC_OFFSET;
+        pkt_hdr->tp_net = REPLAY_MAC_OFFSET + ETH_HLEN;
+        memcpy((uint8_t *)pkt_hdr + REPLAY_MAC_OFFSET, data, snaplen);
+
+        if(rb->last != NULL){
+            rb->last->tp_next_offset = (uint8_t *)pkt_hdr - (uint8_t *)rb->last;
+        }
+        rb->last = pkt_hdr;
+    }
+    rb->used += frame_len;
+    rb->num_pkts++;
+}
+
+static int replay_file(struct replay_state *st, const char *file){
+    char errbuf[PCAP_ERRBUF_SIZE];
+    pcap_t *handle = pcap_open_offline_with_tstamp_precision(file,
+            PCAP_TSTAMP_PRECISION_NANO, errbuf);
+    if(handle == NULL){
+        fprintf(stderr, "error: could not open capture file %s: %s\n", file, errbuf);
+        return -1;
+    }
+    if(pcap_datalink(handle) != DLT_EN10MB){
+        fprintf(stderr, "error: capture file %s is not an Ethernet capture\n", file);
+        pcap_close(handle);
+        return -1;
+    }
+
+    struct pcap_pkthdr *hdr;
+    const u_char *data;
+    int ret = 0;
+    while(sig_close_flag == 0 && (ret = pcap_next_ex(handle, &hdr, &data)) >= 0){
+        if(ret == 0){
+            continue;
+        }
+        /* The kernel filter never saw these packets */
+        if(!capture_filter_match_expression(st->thread_stor->statst->filter, data,
+                    hdr->len, hdr->caplen)){
+            continue;
+        }
+        replay_add_packet(st, hdr, data);
+    }
+    if(ret == -1){
+        fprintf(stderr, "error: reading capture file %s: %s\n", file, pcap_geterr(handle));
+    }
+    pcap_close(handle);
+    return 0;
+}
+
+void *replay_thread_func(void *arg){
+    struct thread_storage *thread_stor = (struct thread_storage *)arg;
+    struct stats_tracking *statst = thread_stor->statst;
+    struct replay_source *rs = statst->replay;
+    int num_threads = statst->num_threads;
+
+    /* Replay threads get shut down the same way as capture threads */
+    disable_all_signals();
+    wait_for_clean_start(thread_stor);
+    fprintf(stderr, "Replay thread %d with thread id %lu started\n", thread_stor->tnum,
+            thread_stor->tid);
+
+    struct replay_state st;
+    memset(&st, 0, sizeof(st));
+    st.thread_stor = thread_stor;
+    st.rs = rs;
+    /* With fewer files than threads every thread reads every file and
+     * takes every num_threads'th block, otherwise files are dealt out */
+    st.shared = rs->num_files < num_threads;
+    st.block.size = thread_stor->ring_params.tp_block_size;
+    st.block.buffer = (uint8_t *)aligned_alloc(getpagesize(), st.block.size);
+    if(!st.block.buffer){
+        perror("could not allocate memory for replay block\n");
+        exit(255);
+    }
+    replay_block_open(&st);
+
+    for(int f = 0; f < rs->num_files && sig_close_flag == 0; f++){
+        if(!st.shared && (f % num_threads) != thread_stor->tnum){
+            continue;
+        }
+        replay_file(&st, rs->files[f]);
+    }
+    replay_block_flush(&st);
+    free(st.block.buffer);
+
+    fprintf(stderr, "Replay thread %d with thread id %lu exiting\n",
+            thread_stor->tnum, thread_stor->tid);
+
+    /* The last thread to finish stops the program */
+    if(__sync_add_and_fetch(&(rs->threads_done), 1) == num_threads){
+        clock_gettime(CLOCK_MONOTONIC, &(rs->end));
+        sig_close_flag = 1;
+    }
+    return NULL;
+}
+
+void replay_report(struct replay_source *rs, uint64_t packets, uint64_t bytes){
+    if(rs->end.tv_sec == 0 && rs->end.tv_nsec == 0){
+        /* Interrupted before all threads finished */
+        clock_gettime(CLOCK_MONOTONIC, &(rs->end));
+    }
+    double duration = ts_diff(&(rs->end), &(rs->start));
+    if(duration <= 0){
+        duration = 1e-9;
+    }
+
+    double r_pps, r_byps;
+    char *r_pps_s, *r_byps_s;
+    get_readable_number_float(1000, packets / duration, &r_pps, &r_pps_s);
+    get_readable_number_float(1000, bytes / duration, &r_byps, &r_byps_s);
+    fprintf(stderr, "Replayed %" PRIu64 " packets from %d file(s) in %.3f seconds: "
+            "%7.03f%s Packets/s; Data Rate %7.03f%s bytes/s\n",
+            packets, rs->num_files, duration, r_pps, r_pps_s, r_byps, r_byps_s);
+}
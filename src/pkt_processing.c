@@ -1,13 +1,18 @@
  /*
   * pkt_processing.c
   *
-  * Extract's packet properties from raw payload.
+  * Extract's packet properties from raw payload. A whole block is parsed
+  * at a time into the columns of a struct packet_batch. Tunneled packets
+  * can be followed to the innermost packet, whose payload is then the
+  * one hashed. Fragmented datagrams are reassembled and hashed whole,
+  * and TCP streams can be too, cut into messages.
   */
 
 #include <stdio.h>
 #include <pcap.h>
 #include <openssl/sha.h>
 #include <stdlib.h>
+#include <string.h>
 #include <netinet/if_ether.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
@@ -16,140 +21,642 @@
 #include "include/sniffer.h"
 #include "include/sha512.h"
 #include "include/pkt_processing.h"
+#include "include/capture_filter.h"
+#include "include/arena.h"
+#include "include/ip_reassembly.h"
+#include "include/tcp_reassembly.h"
+#include "include/pattern_match.h"
+#include "include/dissect.h"
 
-void ascii_hex_dump(const char *payload, int payload_size,
-         unsigned char *ascii_dump){
-    sniffer_debug("Getting ascii of payload..  ");
-    unsigned char byte;
-    int i;
-    for(i=0; i<payload_size; i++){
-        byte = payload[i];
-        if((byte > 31) && (byte < 123) //Byte in printable character range
-                && (byte != 34) && (byte != 92))
-            sprintf((char*)ascii_dump+i, "%c", byte);
-        else
-            sprintf((char*)ascii_dump+i, ".");
-        if(i == 4096) //Records only the first 512 bytes
-            break;
-    }
-    
-    sniffer_debug("Got payload ascii\n");
+/* Frames are prefetched this many packets ahead of the parser, far
+ * enough to hide a memory access behind the parsing of the others */
+#define PARSE_PREFETCH_AHEAD 8
+
+#define TCP_HEADER_LEN 20
+#define IPV6_HEADER_LEN 40
+
+/* Extension headers walked looking for the L4 header of an IPv6 packet,
+ * packets with more are dropped */
+#define IPV6_MAX_EXT_HEADERS 8
+
+/* Read instead of the headers of frames too short to hold them, so that
+ * the parser needs no branch to skip them */
+static const uint8_t zero_header[64] __attribute__((aligned(64)));
+
+/* The columns of struct packet_batch */
+#define FOR_EACH_BATCH_COLUMN(DO) \
+    DO(frame) DO(caplen) DO(len) DO(ts_sec) DO(ts_nsec) DO(vlan_id) \
+    DO(is_valid) DO(ip_version) DO(protocol) DO(ip_ttl) DO(ip_len) DO(ip_src) DO(ip_dst) DO(ip6_addr) \
+    DO(sport) DO(dport) DO(seq) DO(ack_seq) DO(tcp_off) DO(tcp_flags) \
+    DO(payload_off) DO(payload_size) \
+    DO(tunnel) DO(outer_ip_version) DO(outer_protocol) DO(outer_ip_src) DO(outer_ip_dst) \
+    DO(outer_ip6_addr) DO(outer_sport) DO(outer_dport) \
+    DO(match_count) DO(match_ids) DO(payload_digest) DO(app)
+
+/* Bytes of arena memory a batch of capacity packets takes, every column
+ * being rounded up to a cache line */
+size_t packet_batch_size(uint32_t capacity){
+    const struct packet_batch *b = NULL;
+    size_t size = (sizeof(struct packet_batch) + 63) & ~(size_t)63;
+#define COLUMN_SIZE(col) size += (capacity * sizeof(*(b->col)) + 63) & ~(size_t)63;
+    FOR_EACH_BATCH_COLUMN(COLUMN_SIZE)
+#undef COLUMN_SIZE
+    return size;
 }
 
-char* parse_tcp_packet(uint8_t *eth, u_short iphdr_len,
-         struct packet_info *pi, int c_port){
-    /*
-     * Reference docs: https://datatracker.ietf.org/doc/html/rfc793 
-     */
-    sniffer_debug("Extracting TCP packet.. "); 
-    struct tcphdr *tcph = (struct tcphdr *)(eth + ETH_HLEN + iphdr_len);
-    int tcphdr_len = (unsigned int)tcph->doff * 4;
-    if(tcphdr_len < 20){  // Invalid TCP Header. Min. size of tcp header = 5 words = 20 bytes
-        return NULL;
-    }
-    pi->sport = ntohs(tcph->source);
-    pi->dport = ntohs(tcph->dest);
-    if(c_port != 0){
-        if((pi->sport != c_port) && (pi->dport != c_port )){
-            /* c_port holds the desired port's traffic which is to 
-             * be captured. When both the source port and 
-             * destination port of packet is not of interest,
-             * that packet can be discarded */
-            pi->is_valid = 0;
-            return NULL;
-        }
-    }
-    pi->seq = ntohs(tcph->seq);
-    pi->ack_seq = ntohs(tcph->ack_seq);
-    pi->doff = tcph->doff;
-    pi->res1 = tcph->res1;
-    pi->res2 = tcph->res2;
-    pi->urg = tcph->urg;
-    pi->ack = tcph->ack;
-    pi->psh = tcph->psh;
-    pi->syn = tcph->syn;
-    pi->rst = tcph->rst;
-    pi->fin = tcph->fin;
-    
-    char *payload = (char *)(eth + SIZE_ETHERNET + iphdr_len + tcphdr_len);
-    sniffer_debug("Extracted tcp\n");
-    return payload;
-}
-
-
-char* parse_udp_packet(uint8_t *eth, u_short iphdr_len,
-        struct packet_info *pi, int c_port){
-    /*
-     * Reference docs: https://datatracker.ietf.org/doc/html/rfc768
-     */
-    sniffer_debug("Extracting UDP packet..  ");
-    struct udphdr *udph = (struct udphdr *)(eth + ETH_HLEN + iphdr_len);
-    pi->sport = ntohs(udph->source);
-    pi->dport = ntohs(udph->dest);
-    if(c_port != 0){
-        if((pi->sport != c_port) && (pi->dport != c_port )){
-            /* c_port holds the desired port's traffic which is to 
-             * be captured. When both the source port and 
-             * destination port of packet is not of interest,
-             * that packet can be discarded */
-            pi->is_valid = 0;
-            return NULL;
-        }
-    }
-    char *payload = (char *)(eth + SIZE_ETHERNET + iphdr_len + UDP_HEADER_LEN);
-    sniffer_debug("Extracted\n"); 
-    return payload;
-}
-
-int parse_packet(uint8_t *eth, struct packet_info *pi, int c_port){
-    /*
-     * Reference docs: https://datatracker.ietf.org/doc/html/rfc791
-     */
-    sniffer_debug("Extracting IP packet.. ");
-    pi->is_valid = 0;
-    struct iphdr *iph = (struct iphdr *)(eth + ETH_HLEN);
-        /* We determine IP protocol. IPv4 and IPv6 has different header structures */
-        if(iph->version == 4){
-            u_short iphdr_len = iph->ihl * 4; // ip->iphl contains the header len in words. 1 word = 4 octet.
-            if(iphdr_len < IP_HEADER_LEN) {
-                pi->is_valid = 0;
+/* Carves an empty batch for up to capacity packets out of the arena */
+struct packet_batch *packet_batch_alloc(struct arena *a, uint32_t capacity, int if_id){
+    struct packet_batch *b = (struct packet_batch *)arena_alloc(a, sizeof(struct packet_batch));
+    b->count = 0;
+    b->if_id = if_id;
+#define COLUMN_ALLOC(col) b->col = arena_alloc(a, capacity * sizeof(*(b->col)));
+    FOR_EACH_BATCH_COLUMN(COLUMN_ALLOC)
+#undef COLUMN_ALLOC
+    return b;
+}
+
+/* Copies row i of src to row j of dst */
+static void packet_batch_copy_row(struct packet_batch *dst, uint32_t j,
+        const struct packet_batch *src, uint32_t i){
+#define COLUMN_COPY(col) dst->col[j] = src->col[i];
+    FOR_EACH_BATCH_COLUMN(COLUMN_COPY)
+#undef COLUMN_COPY
+}
+
+static inline uint16_t load_be16(const uint8_t *p){
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohs(v);
+}
+
+static inline uint32_t load_be32(const uint8_t *p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+#define GRE_HEADER_LEN 4
+#define VXLAN_HEADER_LEN 8
+#define GENEVE_HEADER_LEN 8
+
+/* VLAN tags and MPLS labels walked looking for the IP header, frames
+ * with more are dropped */
+#define L2_MAX_TAGS 8
+
+static inline int is_tagged(uint32_t ethertype){
+    return ethertype == ETH_P_8021Q || ethertype == ETH_P_8021AD || ethertype == ETH_P_QINQ1 ||
+        ethertype == ETH_P_MPLS_UC || ethertype == ETH_P_MPLS_MC;
+}
+
+/* Walks the stacked VLAN tags and MPLS labels of the frame at eth, which
+ * is caplen bytes long, and returns the ethertype of what follows them,
+ * 0 if that is not IP. Sets the offset of the IP header and, unless it
+ * is set already (the kernel stripped a tag), the outermost VLAN id */
+static uint32_t parse_l2_tags(uint16_t *vlan_id, const uint8_t *eth,
+        uint32_t caplen, uint32_t *l3_off){
+    uint32_t off = ETH_HLEN - 2; // The ethertype
+    for(int n = 0; n <= L2_MAX_TAGS; n++){
+        if(off + 2 > caplen){
+            return 0;
+        }
+        uint32_t ethertype = load_be16(eth + off);
+        if(ethertype == ETH_P_8021Q || ethertype == ETH_P_8021AD || ethertype == ETH_P_QINQ1){
+            if(off + 6 > caplen){
                 return 0;
             }
-            pi->ip_version = 4;
-            pi->protocol = iph->protocol; // TCP or UDP
-            pi->ip_src.s_addr = iph->saddr;
-            pi->ip_dst.s_addr = iph->daddr;
-            pi->ip_ttl = iph->ttl;
-            pi->ip_len = ntohs(iph->tot_len);
-//            pi->identification = ntohs(iph->id);
-            sniffer_debug("Extracted IP info\n");
-            char *payload;
-            switch(pi->protocol){
-                case IPPROTO_TCP:
-                    payload = parse_tcp_packet(eth, iphdr_len, pi, c_port);
-                    break;
-                case IPPROTO_UDP:
-                    payload = parse_udp_packet(eth, iphdr_len, pi, c_port);
-                    break;
-                default:
-                    pi->is_valid = 0;
+            if(*vlan_id == 0){
+                *vlan_id = load_be16(eth + off + 2) & 0x0fff;
+            }
+            off += 4;
+        } else if(ethertype == ETH_P_MPLS_UC || ethertype == ETH_P_MPLS_MC){
+            /* Labels down to the one with the bottom of stack bit, a
+             * deeper stack is dropped as too many VLAN tags are */
+            off += 2;
+            int bottom = 0;
+            for(; n <= L2_MAX_TAGS && !bottom; n++){
+                if(off + 4 > caplen){
                     return 0;
+                }
+                bottom = (load_be32(eth + off) & 0x100) != 0;
+                off += 4;
+            }
+            if(!bottom){
+                return 0;
+            }
+            /* MPLS does not say what it carries, the first nibble tells
+             * IP apart from pseudowires */
+            if(off >= caplen){
+                return 0;
             }
-            if(!payload)
-               return 0; 
-            int payload_size = strlen(payload);
-            if(payload_size > 3){
-                strcpy((char *)pi->payload_hash, "");
-                sha512(payload, pi->payload_hash);
-                pi->is_valid = 1;
-                pi->payload_size = payload_size; 
-                ascii_hex_dump(payload, payload_size,
-                        pi->payload_ascii); 
+            *l3_off = off;
+            switch(eth[off] >> 4){
+            case 4:
+                return ETH_P_IP;
+            case 6:
+                return ETH_P_IPV6;
+            default:
+                return 0;
             }
+        } else {
+            *l3_off = off + 2;
+            return ethertype;
+        }
+    }
+    return 0;
+}
 
-        } else {  // Not collecting IPv6
-            pi->is_valid = 0;
+/* Walks IPv6 extension headers, from the one of type next at off of p,
+ * of which avail bytes were captured, up to the L4 header. Sets its
+ * protocol and its offset in p. A fragment header ends the walk too,
+ * what follows it being reassembled first: frag_off is then set to its
+ * offset, else to 0. Returns 0 when there is no header that can be
+ * found: a truncated header, no next header or too many extension
+ * headers */
+static int ipv6_walk(const uint8_t *p, uint32_t avail, uint32_t next, uint32_t off,
+        uint32_t *protocol, uint32_t *l4_off, uint32_t *frag_off){
+    *frag_off = 0;
+    for(int n = 0; n <= IPV6_MAX_EXT_HEADERS; n++){
+        *protocol = next;
+        *l4_off = off;
+        switch(next){
+        case IPPROTO_HOPOPTS:
+        case IPPROTO_ROUTING:
+        case IPPROTO_DSTOPTS:
+            if(off + 8 > avail){
+                return 0;
+            }
+            next = p[off];
+            off += (p[off + 1] + 1) * 8; // Length in 8 octet units, not counting the first 8
+            break;
+        case IPPROTO_FRAGMENT:
+            if(off + 8 > avail){
+                return 0;
+            }
+            *protocol = p[off];
+            *l4_off = off + 8;
+            *frag_off = off;
+            return 1;
+        default:
+            return 1;
         }
-    sniffer_debug("Extracted IP packet\n");
+    }
     return 0;
 }
+
+/* The IPv6 part of parse_packet_batch(), for packet i whose IPv6 header
+ * is at l3. Returns 0 when the packet cannot be parsed, the outputs
+ * being 0 when there was no header to walk */
+static int parse_ipv6_header(struct packet_batch *b, uint32_t i, const uint8_t *l3,
+        uint32_t avail, uint32_t *protocol, uint32_t *l4_off, uint32_t *frag_off){
+    *protocol = *l4_off = *frag_off = 0;
+    int ok = avail >= IPV6_HEADER_LEN;
+    if(!ok){
+        l3 = zero_header;
+    }
+    b->ip_version[i] = l3[0] >> 4;
+    b->ip_ttl[i] = l3[7];
+    b->ip_len[i] = load_be16(l3 + 4);
+    b->ip_src[i] = b->ip_dst[i] = 0;
+    b->ip6_addr[i] = l3 + 8;
+    ok &= (l3[0] >> 4) == 6;
+    ok = ok && ipv6_walk(l3, avail, l3[6], IPV6_HEADER_LEN, protocol, l4_off, frag_off);
+    b->protocol[i] = *protocol;
+    return ok;
+}
+
+/* Parses the IP header of packet i, at l3_off in its frame, ethertype
+ * telling the version. Sets the L4 protocol, the offset of the L4 header
+ * and that of the end of the IP packet, and returns 0 when the packet
+ * cannot be parsed. For a fragment, frag_off is set to the offset of the
+ * header with its fragment fields and the L4 header is the start of the
+ * fragment data, else frag_off is 0 */
+static inline int parse_ip_header(struct packet_batch *b, uint32_t i, const uint8_t *eth,
+        uint32_t caplen, uint32_t ethertype, uint32_t l3_off,
+        uint32_t *protocol, uint32_t *l4_off, uint32_t *l3_end, uint32_t *frag_off){
+    if(__builtin_expect(ethertype == ETH_P_IPV6, 0)){
+        /* IPv6 header and extension headers, they need a loop */
+        int ok = parse_ipv6_header(b, i, eth + l3_off, caplen - l3_off, protocol, l4_off, frag_off);
+        *l4_off += l3_off;
+        *frag_off += (*frag_off != 0) ? l3_off : 0;
+        *l3_end = l3_off + IPV6_HEADER_LEN + b->ip_len[i];
+        return ok;
+    }
+
+    /* IPv4 header, without branches */
+    const uint8_t *l3 = (caplen >= l3_off + IP_HEADER_LEN) ? eth + l3_off : zero_header;
+    uint32_t version = l3[0] >> 4;
+    uint32_t iphdr_len = (l3[0] & 0x0f) * 4; // ihl contains the header len in words. 1 word = 4 octet.
+    uint32_t ip_len = load_be16(l3 + 2);
+    *protocol = l3[9];
+    b->ip_version[i] = version;
+    b->protocol[i] = *protocol;
+    b->ip_ttl[i] = l3[8];
+    b->ip_len[i] = ip_len;
+    memcpy(&(b->ip_src[i]), l3 + 12, sizeof(uint32_t));
+    memcpy(&(b->ip_dst[i]), l3 + 16, sizeof(uint32_t));
+    *l4_off = l3_off + iphdr_len;
+    *l3_end = l3_off + ip_len;
+    *frag_off = (load_be16(l3 + 6) & 0x3fff) ? l3_off : 0; // More fragments flag or an offset
+    return (ethertype == ETH_P_IP) & (version == 4) & (iphdr_len >= IP_HEADER_LEN);
+}
+
+/* Hands packet i, a fragment whose fragment fields are in the header at
+ * frag_off of its frame, to the thread's reassembly. When it completes
+ * its datagram, the packet becomes the datagram: its frame is the
+ * reassembled IP payload, which the parser goes on with. Returns 0
+ * until then. Without reassembly, first fragments are parsed as they
+ * are and the others dropped, having no L4 header */
+static __attribute__((noinline)) int reassemble(struct packet_batch *b, uint32_t i,
+        struct ip_reassembly *ra, const uint8_t **eth, uint32_t *caplen, uint32_t frag_off,
+        uint32_t *protocol, uint32_t *l4_off, uint32_t *l3_end){
+    const uint8_t *hdr = *eth + frag_off;
+    int ipv6 = (b->ip_version[i] == 6);
+    struct ip_fragment frag;
+    memset(&(frag.key), 0, sizeof(frag.key));
+    uint32_t l3_off;
+    if(ipv6){
+        uint32_t fields = load_be16(hdr + 2);
+        frag.offset = fields & 0xfff8;
+        frag.more = fields & 1;
+        frag.key.id = load_be32(hdr + 4);
+        memcpy(frag.key.addr, b->ip6_addr[i], 32);
+        l3_off = b->ip6_addr[i] - 8 - *eth;
+    } else {
+        uint32_t fields = load_be16(hdr + 6);
+        frag.offset = (fields & 0x1fff) * 8;
+        frag.more = (fields & 0x2000) != 0;
+        frag.key.id = load_be16(hdr + 4);
+        frag.key.protocol = *protocol;
+        memcpy(frag.key.addr, &(b->ip_src[i]), 4);
+        memcpy(frag.key.addr + 16, &(b->ip_dst[i]), 4);
+        l3_off = frag_off;
+    }
+
+    if(ra == NULL){
+        if(frag.offset != 0){
+            return 0;
+        }
+        return !ipv6 || (ipv6_walk(*eth, *caplen, *protocol, *l4_off, protocol, l4_off, &frag_off) &&
+                frag_off == 0);
+    }
+
+    /* Only fragments captured whole can be put together */
+    if(*l3_end > *caplen || *l3_end < *l4_off){
+        return 0;
+    }
+    /* What is in front of the fragment data counts towards the IP length */
+    uint32_t hdr_len = *l4_off - l3_off - (ipv6 ? IPV6_HEADER_LEN : 0);
+    frag.key.version = b->ip_version[i];
+    frag.key.vlan_id = b->vlan_id[i];
+    frag.key.if_id = b->if_id;
+    frag.data = *eth + *l4_off;
+    frag.len = *l3_end - *l4_off;
+    frag.max_len = IP_REASSEMBLY_MAX_DATAGRAM - hdr_len;
+    frag.protocol = *protocol;
+    frag.ts_ns = b->ts_sec[i] * 1000000000ULL + b->ts_nsec[i];
+
+    uint32_t len;
+    uint8_t datagram_protocol;
+    const uint8_t *datagram = ip_reassembly_add(ra, &frag, &len, &datagram_protocol);
+    if(datagram == NULL){
+        return 0;
+    }
+    b->frame[i] = *eth = datagram;
+    b->caplen[i] = *caplen = len;
+    b->ip_len[i] = hdr_len + len;
+    *protocol = datagram_protocol;
+    *l4_off = 0;
+    *l3_end = len;
+    int ok = !ipv6 || (ipv6_walk(datagram, len, datagram_protocol, 0, protocol, l4_off, &frag_off) &&
+            frag_off == 0);
+    b->protocol[i] = *protocol;
+    return ok;
+}
+
+/* Finds the packet carried by the one whose L4 header, of protocol, is
+ * at l4_off of the frame at eth. Returns the kind of tunnel, or
+ * TUNNEL_NONE if it is none, and sets the ethertype and offset of the
+ * inner IP header */
+static int tunnel_inner(const uint8_t *eth, uint32_t caplen, uint32_t protocol,
+        uint32_t l4_off, uint32_t *ethertype, uint32_t *inner_off){
+    const uint8_t *l4 = eth + l4_off;
+    uint32_t proto, off;
+    int tunnel;
+    if(protocol == IPPROTO_IPIP || protocol == IPPROTO_IPV6){
+        tunnel = TUNNEL_IPIP;
+        proto = (protocol == IPPROTO_IPIP) ? ETH_P_IP : ETH_P_IPV6;
+        off = l4_off;
+    } else if(protocol == IPPROTO_GRE){
+        /* https://datatracker.ietf.org/doc/html/rfc2890, version 0 and
+         * no routing present */
+        if(l4_off + GRE_HEADER_LEN > caplen){
+            return TUNNEL_NONE;
+        }
+        uint32_t flags = load_be16(l4);
+        if(flags & 0x4007){
+            return TUNNEL_NONE;
+        }
+        tunnel = TUNNEL_GRE;
+        proto = load_be16(l4 + 2);
+        off = l4_off + GRE_HEADER_LEN + ((flags & 0x8000) ? 4 : 0) // Checksum
+            + ((flags & 0x2000) ? 4 : 0) + ((flags & 0x1000) ? 4 : 0); // Key, sequence number
+    } else if(protocol == IPPROTO_UDP){
+        if(l4_off + UDP_HEADER_LEN + GENEVE_HEADER_LEN > caplen){
+            return TUNNEL_NONE;
+        }
+        uint32_t dport = load_be16(l4 + 2);
+        const uint8_t *tun = l4 + UDP_HEADER_LEN;
+        if(dport == VXLAN_PORT && (tun[0] & 0x08)){
+            /* https://datatracker.ietf.org/doc/html/rfc7348, with a valid VNI */
+            tunnel = TUNNEL_VXLAN;
+            proto = ETH_P_TEB;
+            off = l4_off + UDP_HEADER_LEN + VXLAN_HEADER_LEN;
+        } else if(dport == GENEVE_PORT && (tun[0] >> 6) == 0){
+            /* https://datatracker.ietf.org/doc/html/rfc8926, version 0 */
+            tunnel = TUNNEL_GENEVE;
+            proto = load_be16(tun + 2);
+            off = l4_off + UDP_HEADER_LEN + GENEVE_HEADER_LEN + (tun[0] & 0x3f) * 4;
+        } else {
+            return TUNNEL_NONE;
+        }
+    } else {
+        return TUNNEL_NONE;
+    }
+
+    if(proto == ETH_P_TEB){
+        /* An Ethernet frame, possibly tagged. Inner VLANs are not recorded */
+        if(off + ETH_HLEN > caplen){
+            return TUNNEL_NONE;
+        }
+        uint16_t inner_vlan = 0;
+        uint32_t l3_off = ETH_HLEN;
+        proto = load_be16(eth + off + 12);
+        if(is_tagged(proto)){
+            proto = parse_l2_tags(&inner_vlan, eth + off, caplen - off, &l3_off);
+        }
+        off += l3_off;
+    }
+    if((proto != ETH_P_IP && proto != ETH_P_IPV6) || off > caplen){
+        return TUNNEL_NONE;
+    }
+    *ethertype = proto;
+    *inner_off = off;
+    return tunnel;
+}
+
+/* Follows up to max_depth tunnels from the IP packet parsed last into
+ * the columns of packet i and parses the innermost IP header in its
+ * place. The headers of the outermost packet are kept in the outer
+ * columns. Returns what parse_ip_header() does for the innermost
+ * packet. Only offsets into the frame are kept, nothing is copied,
+ * unless an inner packet is a fragment: it is reassembled like outer
+ * ones are */
+static __attribute__((noinline)) int decapsulate(struct packet_batch *b, uint32_t i,
+        struct ip_reassembly *ra, const uint8_t **eth, uint32_t *caplen, int max_depth,
+        uint32_t *protocol, uint32_t *l4_off, uint32_t *l3_end){
+    int ok = 1;
+    for(int depth = 0; depth < max_depth && ok; depth++){
+        uint32_t ethertype, inner_off, frag_off;
+        int tunnel = tunnel_inner(*eth, *caplen, *protocol, *l4_off, &ethertype, &inner_off);
+        if(tunnel == TUNNEL_NONE){
+            break;
+        }
+        if(depth == 0){
+            int udp = (*protocol == IPPROTO_UDP);
+            b->tunnel[i] = tunnel;
+            b->outer_ip_version[i] = b->ip_version[i];
+            b->outer_protocol[i] = *protocol;
+            b->outer_ip_src[i] = b->ip_src[i];
+            b->outer_ip_dst[i] = b->ip_dst[i];
+            b->outer_ip6_addr[i] = b->ip6_addr[i];
+            b->outer_sport[i] = udp ? load_be16(*eth + *l4_off) : 0;
+            b->outer_dport[i] = udp ? load_be16(*eth + *l4_off + 2) : 0;
+        }
+        ok = parse_ip_header(b, i, *eth, *caplen, ethertype, inner_off, protocol, l4_off, l3_end,
+                &frag_off);
+        if(frag_off != 0 && ok){
+            ok = reassemble(b, i, ra, eth, caplen, frag_off, protocol, l4_off, l3_end);
+        }
+    }
+    return ok;
+}
+
+static const char *tunnel_names[] = { "none", "ipip", "gre", "vxlan", "geneve" };
+
+const char *tunnel_name(int tunnel){
+    return tunnel_names[tunnel];
+}
+
+/* Fills the header columns of the b->count packets whose frame, caplen
+ * and len are set, and marks the ones that pass the filters as valid.
+ * Every packet goes through the same steps: a header that is missing
+ * or too short is read as zeros and fails a check, rather than being
+ * branched around. Nothing is copied, payloads are located by
+ * payload_off and payload_size, except for fragmented datagrams: ra,
+ * the thread's reassembly or NULL, keeps fragments until the one that
+ * completes a datagram, which then stands for the whole datagram */
+void parse_packet_batch(struct packet_batch *b, const struct capture_filter *cf,
+        struct ip_reassembly *ra){
+    /*
+     * Reference docs: https://datatracker.ietf.org/doc/html/rfc791
+     * https://datatracker.ietf.org/doc/html/rfc793
+     * https://datatracker.ietf.org/doc/html/rfc768
+     * https://datatracker.ietf.org/doc/html/rfc8200
+     */
+    sniffer_debug("Extracting a batch of %u packets.. ", b->count);
+    int max_depth = cf->decap_depth;
+    for(uint32_t i = 0; i < b->count; i++){
+        if(i + PARSE_PREFETCH_AHEAD < b->count){
+            /* The headers may straddle two cache lines */
+            __builtin_prefetch(b->frame[i + PARSE_PREFETCH_AHEAD]);
+            __builtin_prefetch(b->frame[i + PARSE_PREFETCH_AHEAD] + 64);
+        }
+        const uint8_t *eth = b->frame[i];
+        uint32_t caplen = b->caplen[i];
+        uint32_t ethertype = load_be16((caplen >= ETH_HLEN ? eth : zero_header) + 12);
+        uint32_t l3_off = ETH_HLEN;
+        uint32_t protocol, l4_off, l3_end, frag_off;
+        int ok;
+
+        if(__builtin_expect(is_tagged(ethertype), 0)){
+            ethertype = parse_l2_tags(&(b->vlan_id[i]), eth, caplen, &l3_off);
+        }
+        ok = parse_ip_header(b, i, eth, caplen, ethertype, l3_off, &protocol, &l4_off, &l3_end,
+                &frag_off);
+        if(__builtin_expect(frag_off != 0, 0) && ok){
+            ok = reassemble(b, i, ra, &eth, &caplen, frag_off, &protocol, &l4_off, &l3_end);
+        }
+        b->tunnel[i] = TUNNEL_NONE;
+        if(__builtin_expect(max_depth > 0, 0) && ok){
+            ok = decapsulate(b, i, ra, &eth, &caplen, max_depth, &protocol, &l4_off, &l3_end);
+        }
+
+        /* TCP or UDP header */
+        int is_tcp = (protocol == IPPROTO_TCP);
+        ok &= is_tcp | (protocol == IPPROTO_UDP);
+        ok &= caplen >= l4_off + (is_tcp ? TCP_HEADER_LEN : UDP_HEADER_LEN);
+        const uint8_t *l4 = ok ? eth + l4_off : zero_header;
+        b->sport[i] = load_be16(l4);
+        b->dport[i] = load_be16(l4 + 2);
+        /* A UDP header is shorter than the TCP fields */
+        const uint8_t *tcp = (ok & is_tcp) ? l4 : zero_header;
+        b->seq[i] = load_be32(tcp + 4);
+        b->ack_seq[i] = load_be32(tcp + 8);
+        b->tcp_off[i] = tcp[12];
+        b->tcp_flags[i] = tcp[13];
+        uint32_t l4hdr_len = is_tcp ? (tcp[12] >> 4) * 4u : UDP_HEADER_LEN;
+        /* Min. size of tcp header = 5 words = 20 bytes */
+        ok &= !is_tcp | (l4hdr_len >= TCP_HEADER_LEN);
+
+        /* The payload ends where the IP total length says, which leaves
+         * out Ethernet padding, or where the capture ends */
+        uint32_t payload_off = l4_off + l4hdr_len;
+        ok &= payload_off <= caplen;
+        uint32_t payload_size = ok ? caplen - payload_off : 0;
+        if(l3_end >= payload_off && l3_end - payload_off < payload_size){
+            payload_size = l3_end - payload_off;
+        }
+        b->payload_off[i] = payload_off;
+        b->payload_size[i] = payload_size;
+
+        /* The kernel filter normally dropped what is not of interest
+         * already, replayed packets are only checked here */
+        ok &= (cf->protocol == 0) | ((int)protocol == cf->protocol);
+        ok &= (payload_size >= (uint32_t)cf->min_payload) | (is_tcp & cf->tcp_streams);
+        b->is_valid[i] = ok;
+        b->match_count[i] = 0;
+        b->payload_digest[i] = NULL;
+        b->app[i] = NULL;
+    }
+
+    /* When both the source port and destination port of packet is not
+     * of interest, that packet can be discarded */
+    if(cf->have_ports){
+        for(uint32_t i = 0; i < b->count; i++){
+            b->is_valid[i] &= capture_filter_port_match(cf, b->sport[i], b->dport[i]);
+        }
+    }
+    if(cf->have_vlans){
+        for(uint32_t i = 0; i < b->count; i++){
+            b->is_valid[i] &= capture_filter_vlan_match(cf, b->vlan_id[i]);
+        }
+    }
+    if(ra != NULL && b->count > 0){
+        uint32_t last = b->count - 1;
+        ip_reassembly_expire(ra, b->ts_sec[last] * 1000000000ULL + b->ts_nsec[last]);
+    }
+    sniffer_debug("Extracted\n");
+}
+
+/* Where the messages of reassemble_streams() go */
+struct stream_output {
+    const struct packet_batch *b;
+    uint32_t row;               /* Of the segment being added */
+    struct packet_batch *m;     /* NULL until the first message */
+    uint32_t capacity;
+    struct arena *a;
+    uint32_t min_payload;
+};
+
+/* Appends a message to the message batch, as a row with the headers of
+ * the segment that completed it */
+static void stream_message(void *ctx, const uint8_t *data, uint32_t len, uint32_t seq){
+    struct stream_output *out = (struct stream_output *)ctx;
+    if(out->m == NULL || out->m->count == out->capacity){
+        uint32_t capacity = (out->m != NULL) ? 2 * out->capacity : out->b->count;
+        struct packet_batch *m = packet_batch_alloc(out->a, capacity, out->b->if_id);
+        for(uint32_t j = 0; out->m != NULL && j < out->m->count; j++){
+            packet_batch_copy_row(m, j, out->m, j);
+        }
+        m->count = (out->m != NULL) ? out->m->count : 0;
+        out->m = m;
+        out->capacity = capacity;
+    }
+    struct packet_batch *m = out->m;
+    uint32_t j = m->count++;
+    packet_batch_copy_row(m, j, out->b, out->row);
+    m->frame[j] = data;
+    m->caplen[j] = m->len[j] = len;
+    m->seq[j] = seq;
+    m->payload_off[j] = 0;
+    m->payload_size[j] = len;
+    m->is_valid[j] = len >= out->min_payload;
+}
+
+/* Feeds the TCP segments of b, parsed already, to their streams. The
+ * segments are then no longer logged, the messages of the streams are,
+ * as the rows of a batch of their own allocated from a. Returns that
+ * batch, NULL when no message is complete */
+struct packet_batch *reassemble_streams(struct packet_batch *b, struct tcp_reassembly *tr,
+        const struct capture_filter *cf, struct arena *a){
+    struct stream_output out = {b, 0, NULL, 0, a, cf->min_payload};
+    for(uint32_t i = 0; i < b->count; i++){
+        if(!b->is_valid[i] || b->protocol[i] != IPPROTO_TCP){
+            continue;
+        }
+        b->is_valid[i] = 0;
+        struct tcp_segment seg;
+        memset(&(seg.key), 0, sizeof(seg.key));
+        if(b->ip_version[i] == 6){
+            memcpy(seg.key.addr, b->ip6_addr[i], 32);
+        } else {
+            memcpy(seg.key.addr, &(b->ip_src[i]), 4);
+            memcpy(seg.key.addr + 16, &(b->ip_dst[i]), 4);
+        }
+        seg.key.sport = b->sport[i];
+        seg.key.dport = b->dport[i];
+        seg.key.vlan_id = b->vlan_id[i];
+        seg.key.if_id = b->if_id;
+        seg.key.version = b->ip_version[i];
+        seg.data = b->frame[i] + b->payload_off[i];
+        seg.len = b->payload_size[i];
+        seg.seq = b->seq[i];
+        seg.flags = b->tcp_flags[i];
+        seg.ts_ns = b->ts_sec[i] * 1000000000ULL + b->ts_nsec[i];
+        out.row = i;
+        tcp_reassembly_add(tr, &seg, stream_message, &out);
+    }
+    if(b->count > 0){
+        uint32_t last = b->count - 1;
+        tcp_reassembly_expire(tr, b->ts_sec[last] * 1000000000ULL + b->ts_nsec[last]);
+    }
+    return out.m;
+}
+
+/* Searches the payloads of the valid packets of b for the patterns of
+ * ps, in the ring or wherever they are, and tags the packets with the
+ * ids of those found. The ids go to a */
+void match_packet_batch(struct packet_batch *b, const struct pattern_set *ps, struct arena *a){
+    uint32_t ids[PATTERN_MAX_MATCHES];
+    for(uint32_t i = 0; i < b->count; i++){
+        if(!b->is_valid[i]){
+            continue;
+        }
+        uint32_t n = pattern_match(ps, b->frame[i] + b->payload_off[i], b->payload_size[i],
+                ids, PATTERN_MAX_MATCHES);
+        b->match_count[i] = n;
+        if(n > 0){
+            uint32_t *copy = (uint32_t *)arena_alloc(a, n * sizeof(uint32_t));
+            memcpy(copy, ids, n * sizeof(uint32_t));
+            b->match_ids[i] = copy;
+        }
+    }
+}
+
+/* Runs the dissectors of protos, a bit set of enum app_proto, on the
+ * payloads of the valid packets of b. The fields of those they
+ * recognize go to a and point into the payloads */
+void dissect_packet_batch(struct packet_batch *b, uint32_t protos, struct arena *a){
+    struct app_fields af;
+    for(uint32_t i = 0; i < b->count; i++){
+        if(!b->is_valid[i]){
+            continue;
+        }
+        if(dissect_payload(b->frame[i] + b->payload_off[i], b->payload_size[i], b->protocol[i],
+                    b->sport[i], b->dport[i], protos, &af) != APP_NONE){
+            struct app_fields *copy = (struct app_fields *)arena_alloc(a, sizeof(struct app_fields));
+            memcpy(copy, &af, sizeof(struct app_fields));
+            b->app[i] = copy;
+        }
+    }
+}
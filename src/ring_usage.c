@@ -0,0 +1,62 @@
+/*
+ * ring_usage.c
+ *
+ * Lock-free ring occupancy histograms. Each capture thread owns one and
+ * the stats thread collects it at every stats interval by switching the
+ * thread over to the other half of the histogram.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "include/ring_usage.h"
+#include "include/cpu_affinity.h"
+#include "include/utils.h"
+
+#define CACHE_LINE 64
+
+/* Creates a histogram in memory local to the calling thread's NUMA
+ * node, so it should be called while running on the owner's CPU */
+struct ring_usage *ring_usage_create(uint32_t num_bins){
+    size_t header = (sizeof(struct ring_usage) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    size_t half = (num_bins * sizeof(double) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    size_t size = header + 2 * half;
+
+    /* The mapping is page aligned and zeroed */
+    uint8_t *mem = (uint8_t *)cpu_local_alloc(size);
+    if(mem == NULL){
+        return NULL;
+    }
+    struct ring_usage *ru = (struct ring_usage *)mem;
+    ru->num_bins = num_bins;
+    ru->alloc_size = size;
+    ru->bins[0] = (double *)(mem + header);
+    ru->bins[1] = (double *)(mem + header + half);
+    return ru;
+}
+
+void ring_usage_free(struct ring_usage *ru){
+    if(ru != NULL){
+        cpu_local_free(ru, ru->alloc_size);
+    }
+}
+
+/* Copies the histogram since the previous call into out (num_bins
+ * entries) and clears it. Called by the stats thread only */
+void ring_usage_collect(struct ring_usage *ru, double *out){
+    uint32_t old = ru->epoch;
+    __atomic_store_n(&(ru->epoch), old + 1, __ATOMIC_SEQ_CST);
+
+    /* The capture thread may have read the old epoch just before the
+     * flip. Its update finishes with seq even again, and any later
+     * update goes to the new half */
+    while(__atomic_load_n(&(ru->seq), __ATOMIC_SEQ_CST) & 1){
+        cpu_relax();
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    double *bins = ru->bins[old & 1];
+    memcpy(out, bins, ru->num_bins * sizeof(double));
+    memset(bins, 0, ru->num_bins * sizeof(double));
+}
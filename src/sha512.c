@@ -13,17 +13,27 @@
 
 #include "include/sha512.h"
 
-int sha512(const char *data, unsigned char *digest){
-    unsigned char byte_digest[SHA512_DIGEST_LENGTH];
-
+/* Computes the digest of len bytes at data */
+void sha512_bytes(const uint8_t *data, size_t len, struct payload_digest *d){
     SHA512_CTX sha512;
     SHA512_Init(&sha512);
-    SHA512_Update(&sha512, data, strlen(data));
-    SHA512_Final(byte_digest, &sha512);
+    SHA512_Update(&sha512, data, len);
+    SHA512_Final(d->bytes, &sha512);
+}
 
+/* Writes d as hex, SHA512_HEX_LENGTH characters with the terminating NUL */
+void sha512_hex(const struct payload_digest *d, char *digest){
     int i = 0; 
     for(i=0; i<SHA512_DIGEST_LENGTH; i++){
-        sprintf((char*)digest + i*2, "%02x", byte_digest[i]);
+        sprintf(digest + i*2, "%02x", d->bytes[i]);
     }
+}
+
+/* Writes the hex digest of len bytes at data, SHA512_HEX_LENGTH
+ * characters with the terminating NUL */
+int sha512(const uint8_t *data, size_t len, char *digest){
+    struct payload_digest d;
+    sha512_bytes(data, len, &d);
+    sha512_hex(&d, digest);
     return 1;
 }
@@ -25,6 +25,10 @@ Example Usage: \n\
         ./sniffer -c eno1 \n\
     For using 2 threads: \n\
         ./sniffer -T 2 \n\
+    For capturing on several interfaces, each with its own threads and \n\
+    buffer fraction (name[:threads[:fraction]], defaults from -T and -b). \n\
+    Packets are logged with the position of their interface as if_id: \n\
+        ./sniffer -c eth0:4:0.05,eth1:2 \n\
     For capturing upto 10 seconds: \n\
         ./sniffer -t 10 \n\
 	For choosing buffer fraction: \n\
@@ -35,6 +39,85 @@ Example Usage: \n\
         Mode can be 0, 1 or 2. 0 generates only log files \n\
         1 builds bloom filter. 2 applies the built bloom filter \n\
         ./sniffer -m 0 \n\
+    For reading packets from a pcap/pcapng file or directory of files: \n\
+        ./sniffer -r capture.pcap \n\
+    For replaying at the speed of the original packet timestamps: \n\
+        ./sniffer -r capture.pcap -R \n\
+    For pinning threads to CPUs 2 to 5, or to CPUs close to the interface: \n\
+        ./sniffer -T 4 -a 2-5 \n\
+        ./sniffer -T 4 -a auto \n\
+    For choosing how packets are spread across threads (hash, cpu, qm, \n\
+    lb, rnd, rollover, vlan or ebpf:<pinned program>, plus rollover/defrag \n\
+    flags): \n\
+        ./sniffer -T 4 -F hash,defrag \n\
+    For spinning up to 200 microseconds on empty blocks before sleeping \n\
+    in poll(), optionally with kernel socket busy polling: \n\
+        ./sniffer -B 200 \n\
+        ./sniffer -B 200 -S \n\
+    For decoupling capture from processing with 2 capture threads \n\
+    feeding 4 processing workers (pipeline mode): \n\
+        ./sniffer -T 2 -P 4 \n\
+    For capturing only some ports, one L4 protocol, payloads of at least \n\
+    16 bytes or traffic matching a pcap-filter expression (applied by the \n\
+    kernel before packets reach the ring): \n\
+        ./sniffer -p 53,80,8000-8080 -o udp -l 16 \n\
+        ./sniffer -E \"net 10.0.0.0/8\" \n\
+    For capturing only VLANs 100 and 200 to 299 (the outermost tag): \n\
+        ./sniffer -V 100,200-299 \n\
+    For following up to 2 levels of GRE, VXLAN, GENEVE and IP in IP \n\
+    tunnels, so that the innermost packet is filtered and hashed: \n\
+        ./sniffer -u 2 \n\
+    For reassembling fragmented datagrams in up to 16 MB per thread (4 by \n\
+    default, 0 to not reassemble), keeping the first copy of overlapping \n\
+    bytes (drop the datagram, the default, first or last) and giving up \n\
+    on a datagram after 60 seconds without a fragment (30 by default): \n\
+        ./sniffer -g 16,first,60s \n\
+    For hashing and logging TCP payloads as the messages of their stream \n\
+    rather than segment by segment: messages end with a PSH segment or \n\
+    every 4096 bytes of the stream, in 256 MB of stream memory per thread \n\
+    (64 by default) with up to 1024 KB per stream (256 by default) and \n\
+    streams given up after 30 seconds without a segment (60 by default): \n\
+        ./sniffer -s psh \n\
+        ./sniffer -s 4096,256,1024k,30s \n\
+    For a record of every flow (5-tuple) in flow_log files, with its \n\
+    packets, bytes, TCP flags and duplicates, tracking up to 65536 flows \n\
+    per thread and ending flows after 30 seconds without a packet (15 by \n\
+    default) or after 600 seconds in any case (300 by default): \n\
+        ./sniffer -k 65536 \n\
+        ./sniffer -k 65536,30s,600s \n\
+    For sending the flow records to an IPFIX collector over UDP instead \n\
+    (port 4739 by default, 65536 flows per thread unless -k is given): \n\
+        ./sniffer -I 127.0.0.1:2055 \n\
+        ./sniffer -I [::1] -k 262144,30s \n\
+    For tagging records with the ids of the patterns found in their \n\
+    payload, one pattern per line of the file (\\xHH for any byte), its \n\
+    id being the line number or given as <id><TAB><pattern>: \n\
+        ./sniffer -W patterns.txt \n\
+    For HTTP method, host and URI, DNS name, type and rcode, and TLS \n\
+    server name, ALPN and JA3 fingerprint fields in the records, here \n\
+    without the payload dump: \n\
+        ./sniffer -y all -D 0 \n\
+        ./sniffer -y dns,tls \n\
+    For capturing with AF_XDP sockets instead of TPACKET_V3 rings, one \n\
+    thread per receive queue, in generic (skb), native (drv) or native \n\
+    zero copy (zc) XDP mode: \n\
+        ./sniffer -c eth0 -T 4 -x drv \n\
+    For printing stats (with -v 1) every half second instead of every \n\
+    3 seconds: \n\
+        ./sniffer -v 1 -i 0.5 \n\
+    For serving metrics to Prometheus over HTTP (GET /json for JSON), on \n\
+    a Unix socket, or in a JSON file rewritten every stats interval: \n\
+        ./sniffer -M 9100 \n\
+        ./sniffer -M unix:/run/sniffer.sock -J /var/run/sniffer_stats.json \n\
+    For latency percentiles of each processing stage (parse, hash, bloom, \n\
+    extract, write, log lock) at every stats interval, per thread with -v 1: \n\
+        ./sniffer -L -v 1 \n\
+    For sizing the rings and the block timeout from the measured packet \n\
+    rate and size, re-tuning them when the rate changes sharply: \n\
+        ./sniffer -A -v 1 \n\
+    For logging at most the first 256 payload bytes of every packet \n\
+    (4096 by default, up to 65535, 0 for no payload_ascii): \n\
+        ./sniffer -D 256 \n\
     For help: \n\
         ./sniffer --help \n\
 ";
@@ -60,9 +143,34 @@ int main(int argc, char *argv[]){
             {"verbosity", no_argument, 0, 'v'},
             {"port_number", no_argument, 0, 'p'},
             {"n", no_argument, 0, 'n'},
-            {"error_rate", no_argument, 0, 'e'}
+            {"error_rate", no_argument, 0, 'e'},
+            {"read_file", required_argument, 0, 'r'},
+            {"replay_pace", no_argument, 0, 'R'},
+            {"cpu_list", required_argument, 0, 'a'},
+            {"fanout", required_argument, 0, 'F'},
+            {"busy_poll", required_argument, 0, 'B'},
+            {"sock_busy_poll", no_argument, 0, 'S'},
+            {"workers", required_argument, 0, 'P'},
+            {"protocol", required_argument, 0, 'o'},
+            {"min_payload", required_argument, 0, 'l'},
+            {"filter", required_argument, 0, 'E'},
+            {"xdp", required_argument, 0, 'x'},
+            {"stats_interval", required_argument, 0, 'i'},
+            {"metrics", required_argument, 0, 'M'},
+            {"stats_file", required_argument, 0, 'J'},
+            {"latency", no_argument, 0, 'L'},
+            {"ring_autotune", no_argument, 0, 'A'},
+            {"payload_dump", required_argument, 0, 'D'},
+            {"vlan", required_argument, 0, 'V'},
+            {"decap", required_argument, 0, 'u'},
+            {"reassembly", required_argument, 0, 'g'},
+            {"tcp_streams", required_argument, 0, 's'},
+            {"flows", required_argument, 0, 'k'},
+            {"ipfix", required_argument, 0, 'I'},
+            {"patterns", required_argument, 0, 'W'},
+            {"dissect", required_argument, 0, 'y'}
         };
-        c = getopt_long(argc, argv, "c:d:T:t:m:b:h:v:p:n:e:",
+        c = getopt_long(argc, argv, "c:d:T:t:m:b:h:v:p:n:e:r:Ra:F:B:SP:o:l:E:x:i:M:J:LAD:V:u:g:s:k:I:W:y:",
                 long_options, &option_index);
 
         if(c == -1)  /* end of options */
@@ -93,7 +201,7 @@ int main(int argc, char *argv[]){
                 cfg.mode = strtol(optarg, NULL, 10);
                 break;
             case 'p':
-                cfg.c_port = strtol(optarg, NULL, 10);
+                cfg.ports = optarg;
                 break;
             case 'h':
                 printf("%s\n", sniffer_help);
@@ -105,6 +213,82 @@ int main(int argc, char *argv[]){
             case 'n':
                 cfg.n_elements = strtol(optarg, NULL, 10);
                 break;
+            case 'r':
+                cfg.replay_path = optarg;
+                sniffer_debug("Replaying capture files from %s\n", cfg.replay_path);
+                break;
+            case 'R':
+                cfg.replay_pace = 1;
+                break;
+            case 'a':
+                cfg.cpu_list = optarg;
+                break;
+            case 'F':
+                cfg.fanout_mode = optarg;
+                break;
+            case 'B':
+                cfg.busy_poll_us = strtol(optarg, NULL, 10);
+                break;
+            case 'S':
+                cfg.sock_busy_poll = 1;
+                break;
+            case 'P':
+                cfg.num_workers = strtol(optarg, NULL, 10);
+                break;
+            case 'o':
+                cfg.protocol = optarg;
+                break;
+            case 'l':
+                cfg.min_payload = strtol(optarg, NULL, 10);
+                break;
+            case 'E':
+                cfg.filter_expression = optarg;
+                break;
+            case 'x':
+                cfg.xdp_mode = optarg;
+                break;
+            case 'i':
+                cfg.stats_interval = strtof(optarg, NULL);
+                break;
+            case 'M':
+                cfg.metrics_endpoint = optarg;
+                break;
+            case 'J':
+                cfg.stats_file = optarg;
+                break;
+            case 'L':
+                cfg.latency = 1;
+                break;
+            case 'A':
+                cfg.ring_autotune = 1;
+                break;
+            case 'D':
+                cfg.ascii_max = strtol(optarg, NULL, 10);
+                break;
+            case 'V':
+                cfg.vlans = optarg;
+                break;
+            case 'u':
+                cfg.decap_depth = strtol(optarg, NULL, 10);
+                break;
+            case 'g':
+                cfg.reassembly = optarg;
+                break;
+            case 's':
+                cfg.tcp_streams = optarg;
+                break;
+            case 'k':
+                cfg.flows = optarg;
+                break;
+            case 'I':
+                cfg.ipfix = optarg;
+                break;
+            case 'W':
+                cfg.patterns = optarg;
+                break;
+            case 'y':
+                cfg.dissect = optarg;
+                break;
             default:
                 printf("%s\n", sniffer_help);
                 exit(0);
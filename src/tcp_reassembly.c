@@ -0,0 +1,668 @@
+/*
+ * tcp_reassembly.c
+ *
+ * Reassembly of TCP streams, so that payloads are hashed and logged as
+ * the messages of the application rather than as segments, which are
+ * cut differently depending on the MSS and the path. Each direction of
+ * a connection is a stream of its own, cut into messages either every
+ * window bytes of the stream or after every segment with PSH set.
+ * Every processing thread has its own table, allocated once. Stream
+ * data goes to fixed size pages of a pool and no stream buffers more
+ * than the flow limit, so a thread never holds more than its budget
+ * whatever the traffic. Data received past a hole waits for the hole
+ * to be filled; when that would take the stream past its limit, or
+ * there are too many holes, the first hole is skipped instead. When
+ * the pool or the table runs out, the streams that were idle the
+ * longest are evicted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/tcp.h>
+
+#include "include/tcp_reassembly.h"
+#include "include/arena.h"
+#include "include/cpu_affinity.h"
+
+#define STREAM_PAGE_SIZE 2048
+#define STREAM_MAX_RANGES 16    /* Disjoint pieces received past a hole */
+#define STREAM_MAX_PSH 8        /* Message ends not emitted yet */
+#define STREAM_MIN_ENTRIES 16
+#define STREAM_NIL UINT32_MAX
+
+/* Sequence numbers wrap, a comes before b when it is less than 2^31
+ * behind it (RFC 1982) */
+static inline int seq_lt(uint32_t a, uint32_t b){
+    return (int32_t)(a - b) < 0;
+}
+
+/* Bytes start to end - 1 of a stream, in sequence numbers */
+struct seq_range {
+    uint32_t start, end;
+};
+
+struct tcp_stream {
+    struct tcp_stream_key key;
+    uint32_t bucket;
+    uint32_t hnext;             /* Next entry of the hash bucket */
+    uint32_t prev, next;        /* In the LRU list. Free entries are chained by next */
+    uint64_t last_ns;           /* Capture time of the last segment */
+    uint64_t start_off;         /* Of start from the first byte of the stream, windows align on it */
+    uint32_t start;             /* First byte not emitted yet */
+    uint32_t expected;          /* Next byte in order, start to expected - 1 are buffered */
+    uint32_t isn;               /* Of the SYN, when has_syn */
+    uint32_t fin;               /* Of the FIN, when has_fin. End of the stream once closed */
+    uint32_t head, tail;        /* Pages from start on, chained by page_next */
+    uint32_t head_off;          /* Of start in the head page */
+    uint32_t num_pages;
+    uint8_t has_syn, has_fin;
+    uint8_t closed;             /* By a FIN or RST, kept to ignore the retransmissions */
+    uint8_t num_ranges, num_psh;
+    struct seq_range ranges[STREAM_MAX_RANGES]; /* Received past expected, sorted and merged */
+    uint32_t psh[STREAM_MAX_PSH]; /* Ends of the segments with PSH set past start */
+};
+
+struct tcp_reassembly {
+    struct tcp_reassembly_config rc;
+    uint64_t timeout_ns;
+    uint64_t seed;              /* Of the hash, so that buckets can not be aimed at */
+    uint8_t *base;              /* Everything below lives in this mapping */
+    size_t size;
+    struct tcp_stream *entries;
+    uint32_t num_entries;
+    uint32_t free_entry;
+    uint32_t *buckets;
+    uint32_t bucket_mask;
+    uint8_t *pages;
+    uint32_t *page_next;        /* Next page of a stream, or of the free pages */
+    uint32_t num_pages;
+    uint32_t free_page;
+    uint32_t num_free_pages;
+    uint32_t lru_head, lru_tail; /* Streams in the order of their last segment */
+    struct arena *out;          /* Messages are copied here */
+    struct tcp_reassembly_stats stats;
+};
+
+static void count(uint64_t *counter){
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+static size_t round_up(size_t size){
+    return (size + 63) & ~(size_t)63;
+}
+
+/* Parses a stream reassembly spec of the form
+ * <bytes>|psh[,<MB>][,<KB>k][,<seconds>s], for example "psh" or
+ * "4096,256,1024k": messages of 4096 bytes, 256 MB of stream data per
+ * thread and up to 1024 KB per stream. A NULL spec turns reassembly off */
+int tcp_reassembly_config_parse(const char *spec, struct tcp_reassembly_config *rc){
+    rc->window = 0;
+    rc->memory = 0;
+    rc->flow_limit = TCP_REASSEMBLY_DEFAULT_FLOW_KB << 10;
+    rc->timeout = TCP_REASSEMBLY_DEFAULT_TIMEOUT;
+    if(spec == NULL){
+        return 0;
+    }
+    rc->memory = (size_t)TCP_REASSEMBLY_DEFAULT_MB << 20;
+
+    char buffer[128];
+    strncpy(buffer, spec, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
+    char *saveptr, *end;
+    char *token = strtok_r(buffer, ",", &saveptr);
+    if(token == NULL){
+        fprintf(stderr, "error: invalid stream window in %s\n", spec);
+        return -1;
+    }
+    if(strcmp(token, "psh") != 0){
+        long window = strtol(token, &end, 10);
+        if(*end != '\0' || window <= 0 || window > (64L << 20)){
+            fprintf(stderr, "error: invalid stream window in %s\n", spec);
+            return -1;
+        }
+        rc->window = window;
+    }
+
+    while((token = strtok_r(NULL, ",", &saveptr)) != NULL){
+        long value = strtol(token, &end, 10);
+        if(end == token || value <= 0){
+            fprintf(stderr, "error: unknown stream reassembly option %s\n", token);
+            return -1;
+        } else if(*end == '\0' && value <= 65536){
+            rc->memory = (size_t)value << 20;
+        } else if(strcmp(end, "k") == 0 && value >= TCP_REASSEMBLY_MIN_FLOW_KB && value <= 65536){
+            rc->flow_limit = value << 10;
+        } else if(strcmp(end, "s") == 0 && value <= 3600){
+            rc->timeout = value;
+        } else {
+            fprintf(stderr, "error: unknown stream reassembly option %s\n", token);
+            return -1;
+        }
+    }
+    if(rc->window > rc->flow_limit){
+        fprintf(stderr, "error: stream window of %u bytes is longer than the flow limit of %u KB\n",
+                rc->window, rc->flow_limit >> 10);
+        return -1;
+    }
+    if(rc->flow_limit > rc->memory){
+        fprintf(stderr, "error: stream flow limit of %u KB is more than the stream memory\n",
+                rc->flow_limit >> 10);
+        return -1;
+    }
+    return 0;
+}
+
+/* Creates the table of a thread, with rc->memory bytes of pages. It
+ * should be called on the CPU of the thread that will use it. Messages
+ * are allocated from out */
+struct tcp_reassembly *tcp_reassembly_create(const struct tcp_reassembly_config *rc, struct arena *out){
+    struct tcp_reassembly *tr = (struct tcp_reassembly *)calloc(1, sizeof(struct tcp_reassembly));
+    if(tr == NULL){
+        return NULL;
+    }
+    tr->rc = *rc;
+    tr->timeout_ns = rc->timeout * 1000000000ULL;
+    tr->out = out;
+
+    /* A stream of the flow limit always fits, and most streams hold a
+     * page or less between messages */
+    tr->num_pages = rc->memory / STREAM_PAGE_SIZE;
+    if(tr->num_pages < rc->flow_limit / STREAM_PAGE_SIZE + 1){
+        tr->num_pages = rc->flow_limit / STREAM_PAGE_SIZE + 1;
+    }
+    tr->num_entries = tr->num_pages;
+    if(tr->num_entries < STREAM_MIN_ENTRIES){
+        tr->num_entries = STREAM_MIN_ENTRIES;
+    }
+    uint32_t num_buckets = 1;
+    while(num_buckets < 2 * tr->num_entries){
+        num_buckets <<= 1;
+    }
+    tr->bucket_mask = num_buckets - 1;
+
+    size_t entries_size = round_up(tr->num_entries * sizeof(struct tcp_stream));
+    size_t buckets_size = round_up(num_buckets * sizeof(uint32_t));
+    size_t next_size = round_up(tr->num_pages * sizeof(uint32_t));
+    tr->size = entries_size + buckets_size + next_size + (size_t)tr->num_pages * STREAM_PAGE_SIZE;
+    tr->base = (uint8_t *)cpu_local_alloc(tr->size);
+    if(tr->base == NULL){
+        free(tr);
+        return NULL;
+    }
+    tr->entries = (struct tcp_stream *)tr->base;
+    tr->buckets = (uint32_t *)(tr->base + entries_size);
+    tr->page_next = (uint32_t *)(tr->base + entries_size + buckets_size);
+    tr->pages = tr->base + entries_size + buckets_size + next_size;
+
+    memset(tr->buckets, 0xff, num_buckets * sizeof(uint32_t));
+    for(uint32_t i = 0; i < tr->num_entries; i++){
+        tr->entries[i].next = (i + 1 < tr->num_entries) ? i + 1 : STREAM_NIL;
+    }
+    tr->free_entry = 0;
+    for(uint32_t i = 0; i < tr->num_pages; i++){
+        tr->page_next[i] = (i + 1 < tr->num_pages) ? i + 1 : STREAM_NIL;
+    }
+    tr->free_page = 0;
+    tr->num_free_pages = tr->num_pages;
+    tr->lru_head = tr->lru_tail = STREAM_NIL;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    tr->seed = ((uint64_t)ts.tv_sec << 32) ^ ts.tv_nsec ^ (uint64_t)(uintptr_t)tr;
+    return tr;
+}
+
+void tcp_reassembly_free(struct tcp_reassembly *tr){
+    if(tr == NULL){
+        return;
+    }
+    cpu_local_free(tr->base, tr->size);
+    free(tr);
+}
+
+static uint32_t stream_hash(const struct tcp_reassembly *tr, const struct tcp_stream_key *key){
+    uint64_t h = tr->seed;
+    for(size_t off = 0; off < sizeof(struct tcp_stream_key); off += sizeof(uint64_t)){
+        uint64_t w;
+        memcpy(&w, (const uint8_t *)key + off, sizeof(w));
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    return (uint32_t)h & tr->bucket_mask;
+}
+
+static uint8_t *page_data(const struct tcp_reassembly *tr, uint32_t page){
+    return tr->pages + (size_t)page * STREAM_PAGE_SIZE;
+}
+
+static void lru_remove(struct tcp_reassembly *tr, uint32_t idx){
+    struct tcp_stream *s = &(tr->entries[idx]);
+    if(s->prev != STREAM_NIL){
+        tr->entries[s->prev].next = s->next;
+    } else {
+        tr->lru_head = s->next;
+    }
+    if(s->next != STREAM_NIL){
+        tr->entries[s->next].prev = s->prev;
+    } else {
+        tr->lru_tail = s->prev;
+    }
+}
+
+static void lru_append(struct tcp_reassembly *tr, uint32_t idx){
+    struct tcp_stream *s = &(tr->entries[idx]);
+    s->prev = tr->lru_tail;
+    s->next = STREAM_NIL;
+    if(tr->lru_tail != STREAM_NIL){
+        tr->entries[tr->lru_tail].next = idx;
+    } else {
+        tr->lru_head = idx;
+    }
+    tr->lru_tail = idx;
+}
+
+static uint32_t entry_find(const struct tcp_reassembly *tr, const struct tcp_stream_key *key, uint32_t bucket){
+    for(uint32_t idx = tr->buckets[bucket]; idx != STREAM_NIL; idx = tr->entries[idx].hnext){
+        if(memcmp(&(tr->entries[idx].key), key, sizeof(struct tcp_stream_key)) == 0){
+            return idx;
+        }
+    }
+    return STREAM_NIL;
+}
+
+/* Gives all the pages of s back to the pool */
+static void stream_free_pages(struct tcp_reassembly *tr, struct tcp_stream *s){
+    if(s->head != STREAM_NIL){
+        tr->page_next[s->tail] = tr->free_page;
+        tr->free_page = s->head;
+        tr->num_free_pages += s->num_pages;
+    }
+    s->head = s->tail = STREAM_NIL;
+    s->head_off = 0;
+    s->num_pages = 0;
+}
+
+/* Forgets stream idx, its pages go back to the pool */
+static void entry_release(struct tcp_reassembly *tr, uint32_t idx){
+    struct tcp_stream *s = &(tr->entries[idx]);
+    uint32_t *link = &(tr->buckets[s->bucket]);
+    while(*link != idx){
+        link = &(tr->entries[*link].hnext);
+    }
+    *link = s->hnext;
+    lru_remove(tr, idx);
+    stream_free_pages(tr, s);
+    s->next = tr->free_entry;
+    tr->free_entry = idx;
+}
+
+/* A new stream whose first byte to come is seq */
+static uint32_t entry_new(struct tcp_reassembly *tr, const struct tcp_stream_key *key,
+        uint32_t bucket, uint32_t seq){
+    if(tr->free_entry == STREAM_NIL){
+        if(!tr->entries[tr->lru_head].closed){
+            count(&(tr->stats.evicted));
+        }
+        entry_release(tr, tr->lru_head);
+    }
+    uint32_t idx = tr->free_entry;
+    struct tcp_stream *s = &(tr->entries[idx]);
+    tr->free_entry = s->next;
+    memcpy(&(s->key), key, sizeof(struct tcp_stream_key));
+    s->bucket = bucket;
+    s->hnext = tr->buckets[bucket];
+    tr->buckets[bucket] = idx;
+    s->start_off = 0;
+    s->start = s->expected = seq;
+    s->head = s->tail = STREAM_NIL;
+    s->head_off = 0;
+    s->num_pages = 0;
+    s->has_syn = s->has_fin = s->closed = 0;
+    s->num_ranges = s->num_psh = 0;
+    lru_append(tr, idx);
+    count(&(tr->stats.streams));
+    return idx;
+}
+
+/* Makes the pages of stream idx reach end bytes past the start of its
+ * head page, evicting the streams idle the longest when the pool runs
+ * dry. Returns 0 if that is not enough */
+static int stream_reserve(struct tcp_reassembly *tr, uint32_t idx, uint32_t end){
+    struct tcp_stream *s = &(tr->entries[idx]);
+    while(s->num_pages * STREAM_PAGE_SIZE < end){
+        while(tr->num_free_pages == 0){
+            uint32_t victim = tr->lru_head;
+            if(victim == idx){
+                victim = tr->entries[idx].next;
+            }
+            if(victim == STREAM_NIL){
+                return 0;
+            }
+            if(!tr->entries[victim].closed){
+                count(&(tr->stats.evicted));
+            }
+            entry_release(tr, victim);
+        }
+        uint32_t page = tr->free_page;
+        tr->free_page = tr->page_next[page];
+        tr->num_free_pages--;
+        tr->page_next[page] = STREAM_NIL;
+        if(s->tail != STREAM_NIL){
+            tr->page_next[s->tail] = page;
+        } else {
+            s->head = page;
+        }
+        s->tail = page;
+        s->num_pages++;
+    }
+    return 1;
+}
+
+/* Copies len bytes at offset off of the pages of s from buf to the
+ * pages, or from the pages to buf */
+static void stream_copy(const struct tcp_reassembly *tr, const struct tcp_stream *s,
+        uint32_t off, uint8_t *buf, uint32_t len, int to_pages){
+    uint32_t page = s->head;
+    for(uint32_t p = off / STREAM_PAGE_SIZE; p > 0; p--){
+        page = tr->page_next[page];
+    }
+    off %= STREAM_PAGE_SIZE;
+    while(len > 0){
+        uint32_t n = (STREAM_PAGE_SIZE - off < len) ? STREAM_PAGE_SIZE - off : len;
+        if(to_pages){
+            memcpy(page_data(tr, page) + off, buf, n);
+        } else {
+            memcpy(buf, page_data(tr, page) + off, n);
+        }
+        page = tr->page_next[page];
+        off = 0;
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Moves the start of s n bytes on, the pages left behind go back to
+ * the pool. The bytes need not have been received */
+static void stream_consume(struct tcp_reassembly *tr, struct tcp_stream *s, uint32_t n){
+    uint64_t off = (uint64_t)s->head_off + n;
+    while(off >= STREAM_PAGE_SIZE && s->head != STREAM_NIL){
+        uint32_t page = s->head;
+        s->head = tr->page_next[page];
+        tr->page_next[page] = tr->free_page;
+        tr->free_page = page;
+        tr->num_free_pages++;
+        s->num_pages--;
+        off -= STREAM_PAGE_SIZE;
+    }
+    if(s->head == STREAM_NIL){
+        s->tail = STREAM_NIL;
+        off = 0;
+    }
+    s->head_off = off;
+    s->start += n;
+    s->start_off += n;
+
+    /* Message ends left behind */
+    uint32_t kept = 0;
+    for(uint32_t p = 0; p < s->num_psh; p++){
+        if(seq_lt(s->start, s->psh[p])){
+            s->psh[kept++] = s->psh[p];
+        }
+    }
+    s->num_psh = kept;
+}
+
+/* Emits the first len bytes of s, which must be in order, as a message */
+static void stream_emit(struct tcp_reassembly *tr, struct tcp_stream *s, uint32_t len,
+        tcp_message_fn emit, void *ctx){
+    uint8_t *message = (uint8_t *)arena_alloc(tr->out, len);
+    stream_copy(tr, s, s->head_off, message, len, 0);
+    uint32_t seq = s->start;
+    stream_consume(tr, s, len);
+    count(&(tr->stats.messages));
+    emit(ctx, message, len, seq);
+}
+
+/* Emits the messages complete in the bytes received in order: whole
+ * windows, or up to the ends of PSH segments. Messages are cut at the
+ * flow limit */
+static void stream_messages(struct tcp_reassembly *tr, struct tcp_stream *s,
+        tcp_message_fn emit, void *ctx){
+    uint32_t window = tr->rc.window;
+    uint32_t pending;
+    while((pending = s->expected - s->start) > 0){
+        uint32_t len = 0;
+        if(window > 0){
+            uint32_t left = window - s->start_off % window;
+            len = (pending >= left) ? left : 0;
+        } else {
+            for(uint32_t p = 0; p < s->num_psh; p++){
+                uint32_t psh_len = s->psh[p] - s->start;
+                if(psh_len <= pending && (len == 0 || psh_len < len)){
+                    len = psh_len;
+                }
+            }
+        }
+        if(len == 0 && pending >= tr->rc.flow_limit){
+            len = tr->rc.flow_limit;
+        }
+        if(len == 0){
+            return;
+        }
+        stream_emit(tr, s, len, emit, ctx);
+    }
+}
+
+/* Emits whatever was received in order, complete message or not */
+static void stream_flush(struct tcp_reassembly *tr, struct tcp_stream *s,
+        tcp_message_fn emit, void *ctx){
+    stream_messages(tr, s, emit, ctx);
+    if(s->expected != s->start){
+        stream_emit(tr, s, s->expected - s->start, emit, ctx);
+    }
+}
+
+/* Emits what is left of s and ends it at end, or where it got to if
+ * that is further */
+static void stream_close(struct tcp_reassembly *tr, struct tcp_stream *s, uint32_t end,
+        tcp_message_fn emit, void *ctx){
+    stream_flush(tr, s, emit, ctx);
+    stream_free_pages(tr, s);
+    s->num_ranges = s->num_psh = 0;
+    s->fin = seq_lt(end, s->expected) ? s->expected : end;
+    s->closed = 1;
+}
+
+/* Moves expected past the ranges that it reached */
+static void stream_absorb(struct tcp_stream *s){
+    uint32_t r = 0;
+    while(r < s->num_ranges && !seq_lt(s->expected, s->ranges[r].start)){
+        if(seq_lt(s->expected, s->ranges[r].end)){
+            s->expected = s->ranges[r].end;
+        }
+        r++;
+    }
+    memmove(&(s->ranges[0]), &(s->ranges[r]), (s->num_ranges - r) * sizeof(struct seq_range));
+    s->num_ranges -= r;
+}
+
+/* Adds start to end - 1 to the ranges received past expected, merging
+ * it with the ranges it touches. There must be room for one more */
+static void range_add(struct tcp_stream *s, uint32_t start, uint32_t end){
+    uint32_t n = s->num_ranges, i = 0, j;
+    while(i < n && seq_lt(s->ranges[i].end, start)){
+        i++;
+    }
+    for(j = i; j < n && !seq_lt(end, s->ranges[j].start); j++){
+        ;
+    }
+    if(j > i){
+        start = seq_lt(s->ranges[i].start, start) ? s->ranges[i].start : start;
+        end = seq_lt(end, s->ranges[j - 1].end) ? s->ranges[j - 1].end : end;
+    }
+    /* Ranges i to j - 1 become one */
+    memmove(&(s->ranges[i + 1]), &(s->ranges[j]), (n - j) * sizeof(struct seq_range));
+    s->ranges[i].start = start;
+    s->ranges[i].end = end;
+    s->num_ranges = n - (j - i) + 1;
+}
+
+/* Gives up on the first hole of s, the one in front of its first range
+ * or of seq. What is in order is emitted first, even as a partial
+ * message */
+static void stream_skip_hole(struct tcp_reassembly *tr, struct tcp_stream *s, uint32_t seq,
+        tcp_message_fn emit, void *ctx){
+    if(s->expected != s->start){
+        stream_flush(tr, s, emit, ctx);
+        return;
+    }
+    uint32_t to = (s->num_ranges > 0 && seq_lt(s->ranges[0].start, seq)) ? s->ranges[0].start : seq;
+    stream_consume(tr, s, to - s->start);
+    s->expected = to;
+    stream_absorb(s);
+    count(&(tr->stats.gaps));
+}
+
+/* Buffers the len bytes of data at seq in stream idx. Bytes received in
+ * order already are kept as they were. Returns 0 if the pool has no
+ * room for them */
+static int stream_insert(struct tcp_reassembly *tr, uint32_t idx, uint32_t seq,
+        const uint8_t *data, uint32_t len, tcp_message_fn emit, void *ctx){
+    struct tcp_stream *s = &(tr->entries[idx]);
+    uint32_t end = seq + len;
+    if(!seq_lt(s->expected, end)){
+        return 1;
+    }
+    if(seq_lt(seq, s->expected)){
+        data += s->expected - seq;
+        seq = s->expected;
+    }
+    if(end - seq > tr->rc.flow_limit){
+        /* Only from offloads that merge segments past 64 KB */
+        data += (end - seq) - tr->rc.flow_limit;
+        seq = end - tr->rc.flow_limit;
+    }
+
+    /* Holes that would take the stream past the flow limit, or that are
+     * too many, are not waited for. Lost segments never come, when the
+     * capture dropped them */
+    while(end - s->start > tr->rc.flow_limit ||
+            (s->num_ranges == STREAM_MAX_RANGES && seq != s->expected)){
+        stream_skip_hole(tr, s, seq, emit, ctx);
+    }
+
+    if(!stream_reserve(tr, idx, s->head_off + (end - s->start))){
+        return 0;
+    }
+    stream_copy(tr, s, s->head_off + (seq - s->start), (uint8_t *)data, end - seq, 1);
+    if(seq == s->expected){
+        s->expected = end;
+        stream_absorb(s);
+    } else {
+        range_add(s, seq, end);
+    }
+    return 1;
+}
+
+/* Adds a segment to its stream, calling emit for every message it
+ * completes. Streams start with a SYN or, picked up midway, with the
+ * first segment carrying data, and end with a FIN or RST, which emit
+ * what is left. Closed streams stay until the timeout or until they
+ * are evicted, so that retransmissions do not open them again */
+void tcp_reassembly_add(struct tcp_reassembly *tr, const struct tcp_segment *seg,
+        tcp_message_fn emit, void *ctx){
+    int syn = (seg->flags & TH_SYN) != 0;
+    uint32_t seq = seg->seq + syn;
+    if(seg->len > 0){
+        count(&(tr->stats.segments));
+    }
+
+    uint32_t bucket = stream_hash(tr, &(seg->key));
+    uint32_t idx = entry_find(tr, &(seg->key), bucket);
+    if(idx != STREAM_NIL && tr->entries[idx].last_ns + tr->timeout_ns <= seg->ts_ns){
+        /* Not swept yet */
+        if(!tr->entries[idx].closed){
+            count(&(tr->stats.expired));
+        }
+        entry_release(tr, idx);
+        idx = STREAM_NIL;
+    }
+    if(syn && idx != STREAM_NIL &&
+            !(tr->entries[idx].has_syn && tr->entries[idx].isn == seg->seq)){
+        /* A new connection on the same ports */
+        entry_release(tr, idx);
+        idx = STREAM_NIL;
+    }
+    if(idx != STREAM_NIL && tr->entries[idx].closed){
+        if(!seq_lt(tr->entries[idx].fin, seq + seg->len)){
+            return;
+        }
+        /* Data past the end, the ports were reused */
+        entry_release(tr, idx);
+        idx = STREAM_NIL;
+    }
+    if(idx == STREAM_NIL){
+        if(!syn && (seg->len == 0 || (seg->flags & TH_RST))){
+            return;
+        }
+        idx = entry_new(tr, &(seg->key), bucket, seq);
+        tr->entries[idx].has_syn = syn;
+        tr->entries[idx].isn = seg->seq;
+    }
+    struct tcp_stream *s = &(tr->entries[idx]);
+    s->last_ns = seg->ts_ns;
+    lru_remove(tr, idx);
+    lru_append(tr, idx);
+
+    if(seg->flags & TH_RST){
+        stream_close(tr, s, seq, emit, ctx);
+        return;
+    }
+    if(seg->flags & TH_FIN){
+        s->has_fin = 1;
+        s->fin = seq + seg->len;
+    }
+    if(seg->len > 0){
+        if(!stream_insert(tr, idx, seq, seg->data, seg->len, emit, ctx)){
+            count(&(tr->stats.dropped));
+        } else if((seg->flags & TH_PUSH) && s->num_psh < STREAM_MAX_PSH &&
+                seq_lt(s->start, seq + seg->len)){
+            s->psh[s->num_psh++] = seq + seg->len;
+        }
+    }
+    if(s->has_fin && !seq_lt(s->expected, s->fin)){
+        stream_close(tr, s, s->fin, emit, ctx);
+        return;
+    }
+    stream_messages(tr, s, emit, ctx);
+}
+
+/* Drops the streams that got no segment for the timeout, with what they
+ * buffered. The LRU list is in the order of the last segment, so only
+ * its head needs looking at */
+void tcp_reassembly_expire(struct tcp_reassembly *tr, uint64_t now_ns){
+    uint32_t idx;
+    while((idx = tr->lru_head) != STREAM_NIL &&
+            tr->entries[idx].last_ns + tr->timeout_ns <= now_ns){
+        if(!tr->entries[idx].closed){
+            count(&(tr->stats.expired));
+        }
+        entry_release(tr, idx);
+    }
+}
+
+/* Adds the counters of tr, which may be NULL, to sum */
+void tcp_reassembly_stats_add(const struct tcp_reassembly *tr, struct tcp_reassembly_stats *sum){
+    if(tr == NULL){
+        return;
+    }
+    sum->segments += __atomic_load_n(&(tr->stats.segments), __ATOMIC_RELAXED);
+    sum->messages += __atomic_load_n(&(tr->stats.messages), __ATOMIC_RELAXED);
+    sum->streams += __atomic_load_n(&(tr->stats.streams), __ATOMIC_RELAXED);
+    sum->gaps += __atomic_load_n(&(tr->stats.gaps), __ATOMIC_RELAXED);
+    sum->expired += __atomic_load_n(&(tr->stats.expired), __ATOMIC_RELAXED);
+    sum->evicted += __atomic_load_n(&(tr->stats.evicted), __ATOMIC_RELAXED);
+    sum->dropped += __atomic_load_n(&(tr->stats.dropped), __ATOMIC_RELAXED);
+}
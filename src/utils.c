@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
 
 #define MAX_READABLE_SUFFIX 9
 
@@ -27,3 +29,11 @@ void get_readable_number_float(double power,
     *str_output = readable_number_suffix[index];
 
 }
+
+/* Monotonic time in nanoseconds. clock_gettime() is served by the vDSO
+ * so this is cheap enough for the capture loop */
+uint64_t monotonic_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -0,0 +1,132 @@
+/*
+ * ascii_bench.c
+ *
+ * Checks the payload dump kernels of src/ascii_dump.c against the
+ * sprintf() based ascii_hex_dump() they replaced and times them.
+ *
+ * make ascii_bench && ./ascii_bench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../src/include/ascii_dump.h"
+
+#define MAX_PAYLOAD 4096
+
+/* The former ascii_hex_dump() of pkt_processing.c */
+static void ascii_hex_dump_sprintf(const char *payload, int payload_size,
+         unsigned char *ascii_dump){
+    unsigned char byte;
+    int i;
+    for(i=0; i<payload_size; i++){
+        byte = payload[i];
+        if((byte > 31) && (byte < 123) //Byte in printable character range
+                && (byte != 34) && (byte != 92))
+            sprintf((char*)ascii_dump+i, "%c", byte);
+        else
+            sprintf((char*)ascii_dump+i, ".");
+        if(i == 4096) //Records only the first 512 bytes
+            break;
+    }
+}
+
+static uint32_t dump_sprintf(const uint8_t *in, uint32_t len, char *out){
+    ascii_hex_dump_sprintf((const char *)in, len, (unsigned char *)out);
+    out[len] = '\0';
+    return len;
+}
+
+struct kernel {
+    const char *name;
+    ascii_dump_fn fn;
+    int supported;
+};
+
+static double now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[]){
+    long iterations = (argc > 1) ? strtol(argv[1], NULL, 10) : 200000;
+    struct kernel kernels[] = {
+        { "sprintf", dump_sprintf, 1 },
+        { "scalar", ascii_dump_scalar, 1 },
+#if defined(__x86_64__) || defined(__i386__)
+        { "sse2", ascii_dump_sse2, __builtin_cpu_supports("sse2") },
+        { "avx2", ascii_dump_avx2, __builtin_cpu_supports("avx2") },
+        { "avx512", ascii_dump_avx512, __builtin_cpu_supports("avx512bw") },
+#endif
+    };
+    int num_kernels = sizeof(kernels) / sizeof(kernels[0]);
+
+    /* Text with some binary, like most payloads */
+    uint8_t *payload = (uint8_t *)malloc(MAX_PAYLOAD);
+    char *expected = (char *)malloc(MAX_PAYLOAD + 2);
+    char *out = (char *)malloc(MAX_PAYLOAD + 2);
+    if(!payload || !expected || !out){
+        perror("could not allocate memory");
+        exit(255);
+    }
+    srand(1);
+    for(int i = 0; i < MAX_PAYLOAD; i++){
+        payload[i] = (rand() % 4 == 0) ? rand() % 256 : ' ' + rand() % 95;
+    }
+
+    /* Every length up to a few vectors, then the benchmarked ones */
+    int failures = 0;
+    for(uint32_t len = 0; len <= MAX_PAYLOAD; len += (len < 256) ? 1 : 61){
+        dump_sprintf(payload, len, expected);
+        for(int k = 1; k < num_kernels; k++){
+            if(!kernels[k].supported){
+                continue;
+            }
+            memset(out, 0x7f, MAX_PAYLOAD + 2);
+            uint32_t n = kernels[k].fn(payload, len, out);
+            if(n != len || memcmp(out, expected, len + 1) != 0 || out[len + 1] != 0x7f){
+                fprintf(stderr, "%s differs at length %u\n", kernels[k].name, len);
+                failures++;
+            }
+        }
+    }
+    if(failures > 0){
+        return 1;
+    }
+    printf("All kernels match the sprintf version\n");
+
+    uint32_t lengths[] = { 64, 512, 1500, 4096 };
+    printf("%-8s", "length");
+    for(int k = 0; k < num_kernels; k++){
+        printf("%14s", kernels[k].name);
+    }
+    printf("\n");
+    for(unsigned int l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++){
+        printf("%-8u", lengths[l]);
+        for(int k = 0; k < num_kernels; k++){
+            if(!kernels[k].supported){
+                printf("%14s", "-");
+                continue;
+            }
+            /* sprintf is slow enough to need far fewer rounds */
+            long rounds = (k == 0) ? iterations / 20 + 1 : iterations;
+            double start = now_ns();
+            for(long i = 0; i < rounds; i++){
+                kernels[k].fn(payload + (i & 7), lengths[l] - 8, out);
+                __asm__ volatile("" : : "r"(out) : "memory");
+            }
+            double ns = (now_ns() - start) / rounds;
+            printf("%11.1f ns", ns);
+        }
+        printf("\n");
+    }
+
+    free(payload);
+    free(expected);
+    free(out);
+    return 0;
+}
@@ -0,0 +1,243 @@
+/*
+ * tcp_reassembly_test.c
+ *
+ * Feeds made up segments to the stream reassembly of
+ * src/tcp_reassembly.c and checks the messages it emits: PSH and window
+ * cuts, segments out of order, sequence numbers that wrap and holes
+ * that are skipped.
+ *
+ * make tcp_reassembly_test && ./tcp_reassembly_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <netinet/tcp.h>
+
+#include "../src/include/tcp_reassembly.h"
+#include "../src/include/arena.h"
+
+#define STREAM_BYTES (256 * 1024)
+#define MAX_MESSAGES 256
+
+struct message {
+    uint32_t seq;
+    uint32_t len;
+    int intact;             /* Holds the bytes of the stream at seq */
+};
+
+struct run {
+    uint32_t isn;
+    struct message messages[MAX_MESSAGES];
+    int count;
+};
+
+/* Byte off of the stream, after the SYN */
+static uint8_t stream_byte(uint32_t off){
+    return (uint8_t)((off * 7) % 251);
+}
+
+static uint8_t stream_data[STREAM_BYTES];
+
+static void on_message(void *ctx, const uint8_t *data, uint32_t len, uint32_t seq){
+    struct run *r = (struct run *)ctx;
+    if(r->count == MAX_MESSAGES){
+        return;
+    }
+    uint32_t off = seq - (r->isn + 1);
+    struct message *m = &(r->messages[r->count++]);
+    m->seq = seq;
+    m->len = len;
+    m->intact = (off + len <= STREAM_BYTES) && memcmp(data, stream_data + off, len) == 0;
+}
+
+struct test {
+    const char *name;
+    struct tcp_reassembly *tr;
+    struct arena *out;
+    struct run run;
+    struct tcp_segment seg;
+};
+
+static void test_start(struct test *t, const char *name, uint32_t window, uint32_t isn){
+    struct tcp_reassembly_config rc = { window, 1 << 20, 64 << 10, 60 };
+    memset(t, 0, sizeof(*t));
+    t->name = name;
+    t->out = arena_create(1 << 20);
+    t->tr = tcp_reassembly_create(&rc, t->out);
+    if(t->out == NULL || t->tr == NULL){
+        perror("could not create the stream table");
+        exit(255);
+    }
+    t->run.isn = isn;
+    t->seg.key.addr[0] = 10;
+    t->seg.key.addr[16] = 10;
+    t->seg.key.sport = 40000;
+    t->seg.key.dport = 80;
+    t->seg.key.version = 4;
+
+    t->seg.seq = isn;
+    t->seg.flags = TH_SYN;
+    tcp_reassembly_add(t->tr, &(t->seg), on_message, &(t->run));
+}
+
+/* Sends bytes off to off + len - 1 of the stream */
+static void send_bytes(struct test *t, uint32_t off, uint32_t len, uint8_t flags){
+    t->seg.data = stream_data + off;
+    t->seg.len = len;
+    t->seg.seq = t->run.isn + 1 + off;
+    t->seg.flags = flags | TH_ACK;
+    t->seg.ts_ns += 1000;
+    tcp_reassembly_add(t->tr, &(t->seg), on_message, &(t->run));
+}
+
+/* Stream offset and length of a message */
+struct expected {
+    uint32_t off, len;
+};
+
+/* Checks that the messages emitted so far are the n given ones, with
+ * the bytes of the stream */
+static int expect(struct test *t, const struct expected *want, int n){
+    int ok = (t->run.count == n);
+    for(int i = 0; ok && i < n; i++){
+        struct message *m = &(t->run.messages[i]);
+        ok = (m->seq == t->run.isn + 1 + want[i].off) && (m->len == want[i].len) && m->intact;
+    }
+    if(!ok){
+        fprintf(stderr, "%s: expected %d messages, got %d:\n", t->name, n, t->run.count);
+        for(int i = 0; i < t->run.count; i++){
+            fprintf(stderr, "    offset %u, %u bytes%s\n", t->run.messages[i].seq - (t->run.isn + 1),
+                    t->run.messages[i].len, t->run.messages[i].intact ? "" : ", wrong bytes");
+        }
+    }
+    return ok;
+}
+
+static uint64_t gaps(const struct test *t){
+    struct tcp_reassembly_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    tcp_reassembly_stats_add(t->tr, &stats);
+    return stats.gaps;
+}
+
+static void test_end(struct test *t){
+    tcp_reassembly_free(t->tr);
+    arena_free(t->out);
+}
+
+/* Messages end with the segments that have PSH set, the rest of the
+ * stream goes out with the FIN */
+static int test_psh(void){
+    struct test t;
+    test_start(&t, "psh", 0, 1000);
+    send_bytes(&t, 0, 500, 0);
+    send_bytes(&t, 500, 300, TH_PUSH);
+    send_bytes(&t, 800, 100, TH_PUSH);
+    send_bytes(&t, 900, 200, 0);
+    send_bytes(&t, 1100, 0, TH_FIN);
+    struct expected want[] = { { 0, 800 }, { 800, 100 }, { 900, 200 } };
+    int ok = expect(&t, want, 3);
+    test_end(&t);
+    return ok;
+}
+
+/* Messages of window bytes however the segments are cut */
+static int test_window(void){
+    struct test t;
+    test_start(&t, "window", 1000, 5000);
+    send_bytes(&t, 0, 700, TH_PUSH);
+    send_bytes(&t, 700, 700, 0);
+    send_bytes(&t, 1400, 1100, TH_PUSH);
+    struct expected want[] = { { 0, 1000 }, { 1000, 1000 }, { 2000, 500 } };
+    int ok = expect(&t, want, 2);
+    send_bytes(&t, 2500, 0, TH_FIN);
+    ok = ok && expect(&t, want, 3);
+    test_end(&t);
+    return ok;
+}
+
+/* A stream whose sequence numbers wrap past 2^32 in a segment, in a
+ * message and in a hole */
+static int test_wrap(void){
+    struct test t;
+    test_start(&t, "wrap", 1000, 0xfffffc00);
+    send_bytes(&t, 0, 600, 0);
+    send_bytes(&t, 1200, 600, 0);   /* Past the hole, after the wrap */
+    send_bytes(&t, 600, 600, 0);    /* Fills the hole across the wrap */
+    send_bytes(&t, 1800, 0, TH_FIN);
+    struct expected want[] = { { 0, 1000 }, { 1000, 800 } };
+    int ok = expect(&t, want, 2) && gaps(&t) == 0;
+    test_end(&t);
+    return ok;
+}
+
+/* Segments out of order are held as ranges that merge as they touch,
+ * and go out once the bytes in front of them arrive */
+static int test_merge(void){
+    struct test t;
+    test_start(&t, "merge", 0, 77);
+    send_bytes(&t, 3000, 1000, 0);
+    send_bytes(&t, 5000, 1000, TH_PUSH);
+    send_bytes(&t, 1000, 1000, 0);
+    send_bytes(&t, 2000, 1000, 0);  /* Joins the first two ranges */
+    send_bytes(&t, 4500, 1000, 0);  /* Overlaps the last one */
+    send_bytes(&t, 3500, 1000, 0);  /* Joins them all */
+    struct expected want[] = { { 0, 6000 } };
+    int ok = expect(&t, want, 0);
+    send_bytes(&t, 0, 1000, 0);
+    ok = ok && expect(&t, want, 1) && gaps(&t) == 0;
+    test_end(&t);
+    return ok;
+}
+
+/* A hole that would take the stream past its 64 KB flow limit is
+ * skipped. What was in order before it goes out first, as a message of
+ * its own */
+static int test_hole(void){
+    struct test t;
+    test_start(&t, "hole", 0, 123456);
+    send_bytes(&t, 0, 1000, 0);
+    for(uint32_t off = 2000; off < 65000; off += 1000){
+        send_bytes(&t, off, 1000, 0);
+    }
+    struct expected want[] = { { 0, 1000 }, { 2000, 65000 } };
+    int ok = expect(&t, want, 0);
+    send_bytes(&t, 65000, 1000, 0);  /* Reaches the limit from the start */
+    ok = ok && expect(&t, want, 1) && gaps(&t) == 0;
+    send_bytes(&t, 66000, 1000, 0);  /* And from the end of the first message */
+    ok = ok && expect(&t, want, 1) && gaps(&t) == 1;
+    send_bytes(&t, 67000, 0, TH_FIN);
+    ok = ok && expect(&t, want, 2);
+    test_end(&t);
+    return ok;
+}
+
+int main(void){
+    for(uint32_t i = 0; i < STREAM_BYTES; i++){
+        stream_data[i] = stream_byte(i);
+    }
+
+    struct {
+        const char *name;
+        int (*fn)(void);
+    } tests[] = {
+        { "psh", test_psh },
+        { "window", test_window },
+        { "wrap", test_wrap },
+        { "merge", test_merge },
+        { "hole", test_hole },
+    };
+    int failures = 0;
+    for(unsigned int i = 0; i < sizeof(tests) / sizeof(tests[0]); i++){
+        int ok = tests[i].fn();
+        printf("%-8s %s\n", tests[i].name, ok ? "ok" : "FAILED");
+        failures += !ok;
+    }
+    if(failures > 0){
+        return 1;
+    }
+    printf("All stream reassembly tests passed\n");
+    return 0;
+}